@@ -0,0 +1,61 @@
+#ifndef DEVICE_INDEX_H
+#define DEVICE_INDEX_H
+
+#include <stdbool.h>
+
+/* Devices shown in the client, keyed by id, plus a sorted prefix index on
+ * lowercased id and type for filter-as-you-type. Slots stay put while a
+ * device exists, so the view can keep a slot per row and update just that
+ * row when the device's state changes. */
+typedef struct {
+    char id[64];
+    char type[32];
+    char ip[32];
+    char state[16];
+    int power;
+    bool used;
+    unsigned seen;
+    unsigned match;
+    void *row;
+    int next;
+} DevEntry;
+
+typedef struct {
+    char key[64];
+    int slot;
+} DevKey;
+
+typedef struct {
+    DevEntry *e;
+    int cap;
+    int count;
+    int *buckets;
+    int nbuckets;
+    DevKey *keys;
+    int nkeys;
+    bool keys_dirty;
+    unsigned scan_gen;
+    unsigned filter_gen;
+    bool filtering;
+} DevIndex;
+
+DevIndex* devidx_new(void);
+void devidx_free(DevIndex *idx);
+
+/* A scan is begin, one upsert per listed device, then sweep, which drops
+ * devices the scan did not list after calling gone() for each. */
+void devidx_begin_scan(DevIndex *idx);
+int devidx_upsert(DevIndex *idx, const char *id, const char *type,
+                  const char *ip, bool *created);
+void devidx_sweep(DevIndex *idx, void (*gone)(DevEntry *e, void *arg), void *arg);
+void devidx_clear(DevIndex *idx, void (*gone)(DevEntry *e, void *arg), void *arg);
+
+int devidx_find(DevIndex *idx, const char *id);
+DevEntry* devidx_get(DevIndex *idx, int slot);
+
+/* Marks devices whose id or type starts with prefix (case-insensitive);
+ * an empty prefix matches everything. Returns the number of matches. */
+int devidx_filter(DevIndex *idx, const char *prefix);
+bool devidx_visible(DevIndex *idx, int slot);
+
+#endif
@@ -2,6 +2,7 @@
 #define MESSAGE_BUILDER_H
 #include <json-c/json.h>
 #include <stdbool.h>
+#include "messages.h"
 typedef struct { 
 	struct json_object *root; 
 } MessageBuilder;
@@ -14,12 +15,19 @@ MessageBuilder* msg_builder_create(
 void msg_builder_add_string(MessageBuilder *mb, const char *key, const char *value);
 void msg_builder_add_int(MessageBuilder *mb, const char *key, int value);
 void msg_builder_add_bool(MessageBuilder *mb, const char *key, bool value);
+/* Replaces "data" with a payload from one of the <name>_encode() functions. */
+void msg_builder_set_data(MessageBuilder *mb, struct json_object *data);
+/* Asks every hop to stamp the request and its reply; net_send_receive()
+ * fills in client_send and reads the stamps back. */
+void msg_builder_trace(MessageBuilder *mb);
 char* msg_builder_build(MessageBuilder *mb);
 void msg_builder_free(MessageBuilder *mb);
-typedef struct { bool success; char error_msg[256]; struct json_object *data; } ResponseParser;
+/* success unless data has a status other than "success" or "queued";
+ * error_msg is then its message, or the status. queued: the device is
+ * offline and gets the request when it reconnects; its reply then comes
+ * as a notify. Read data with <name>_decode(). */
+typedef struct { bool success; bool queued; char error_msg[256]; struct json_object *data; } ResponseParser;
 ResponseParser* response_parse(const char *json_str);
 bool response_is_success(ResponseParser *rp);
-const char* response_get_string(ResponseParser *rp, const char *key);
-int response_get_int(ResponseParser *rp, const char *key);
 void response_free(ResponseParser *rp);
 #endif
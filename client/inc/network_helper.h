@@ -1,17 +1,90 @@
 #ifndef NETWORK_HELPER_H
 #define NETWORK_HELPER_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "message_builder.h"
 
+#define NET_CACHE_TTL_MS 1000
+#define NET_CACHE_SLOTS 8
+#define NET_KEY_MAX 512
+
+struct ssl_st;
+struct ssl_ctx_st;
+struct ssl_session_st;
+struct z_stream_s;
+
+/* Where the time went on the last traced request, in microseconds; -1
+ * for a part a hop did not stamp. total is what the client waited between
+ * writing the request and reading the reply. */
+typedef struct {
+    char id[17];
+    long total_us;
+    long network_us;
+    long server_us;
+    long device_link_us;
+    long device_us;
+} NetTrace;
+
+/* Reply to an idempotent request, reused until it expires. */
+typedef struct {
+    char key[NET_KEY_MAX];
+    char *line;
+    int64_t expires_ns;
+} NetCacheEntry;
+
+struct NetFlight;
+
+/* Gets each "notify" line the context reads, with io held: it must not
+ * send a request itself. */
+typedef void (*net_notify_fn)(const char *line, void *arg);
+
 typedef struct {
     int sock;
     char client_id[32];
+    struct ssl_ctx_st *ssl_ctx;
+    struct ssl_st *ssl;
+    struct ssl_session_st *session;
+    char *rbuf;
+    size_t rlen;
+    struct z_stream_s *inflater;
+    NetTrace trace;
+    /* mtx guards the cache and the in-flight list; io_mtx is held for a
+     * whole round trip, since replies come back in request order. */
+    pthread_mutex_t mtx;
+    pthread_mutex_t io_mtx;
+    pthread_cond_t flight_cv;
+    struct NetFlight *flights;
+    NetCacheEntry cache[NET_CACHE_SLOTS];
+    int cache_ttl_ms;
+    unsigned long cache_gen;
+    unsigned long cache_hits;
+    unsigned long coalesced;
+    net_notify_fn on_notify;
+    void *notify_arg;
 } NetContext;
 
 NetContext* net_context_create(const char *client_id);
+int net_enable_tls(NetContext *ctx, const char *ca_file);
 int net_connect(NetContext *ctx, const char *server_ip, int port);
+/* Call once login returns "compress": "deflate"; "Z:" frames from then on
+ * are inflated before net_send_receive() returns them. */
+int net_enable_inflate(NetContext *ctx);
+/* Safe to call from several threads. list_devices, status, home_status
+ * and query_devices replies are cached for the context's TTL, and a caller
+ * asking for one already on the wire waits for that reply instead of
+ * sending its own. Any other request, a "notify" from the server and a
+ * reconnect all empty the cache. */
 char* net_send_receive(NetContext *ctx, MessageBuilder *mb);
+/* Notifies are only read while a request waits or here: this reads the
+ * ones already on the socket without blocking, unless a round trip is on
+ * the wire (which reads them itself). */
+void net_set_notify_handler(NetContext *ctx, net_notify_fn fn, void *arg);
+void net_poll_notify(NetContext *ctx);
+/* 0 turns the cache off; coalescing stays on. */
+void net_set_cache_ttl(NetContext *ctx, int ttl_ms);
+void net_cache_clear(NetContext *ctx);
 void net_context_free(NetContext *ctx);
 
 #endif 
-
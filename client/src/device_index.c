@@ -0,0 +1,199 @@
+#include "device_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+static unsigned hash_id(const char *id) {
+    unsigned h = 2166136261u;
+    while (*id) h = (h ^ (unsigned char)*id++) * 16777619u;
+    return h;
+}
+
+static void lower_copy(char *dst, const char *src, size_t n) {
+    size_t i = 0;
+    for (; src[i] && i < n - 1; i++) dst[i] = (char)tolower((unsigned char)src[i]);
+    dst[i] = '\0';
+}
+
+DevIndex* devidx_new(void) {
+    DevIndex *idx = calloc(1, sizeof(DevIndex));
+    if (!idx) return NULL;
+    idx->nbuckets = 256;
+    idx->buckets = malloc(idx->nbuckets * sizeof(int));
+    if (!idx->buckets) {
+        free(idx);
+        return NULL;
+    }
+    memset(idx->buckets, -1, idx->nbuckets * sizeof(int));
+    return idx;
+}
+
+void devidx_free(DevIndex *idx) {
+    if (!idx) return;
+    free(idx->e);
+    free(idx->buckets);
+    free(idx->keys);
+    free(idx);
+}
+
+static void rehash(DevIndex *idx, int nbuckets) {
+    int *b = malloc(nbuckets * sizeof(int));
+    if (!b) return;
+    free(idx->buckets);
+    idx->buckets = b;
+    idx->nbuckets = nbuckets;
+    memset(b, -1, nbuckets * sizeof(int));
+    for (int i = 0; i < idx->cap; i++) {
+        if (!idx->e[i].used) continue;
+        unsigned h = hash_id(idx->e[i].id) % (unsigned)nbuckets;
+        idx->e[i].next = b[h];
+        b[h] = i;
+    }
+}
+
+int devidx_find(DevIndex *idx, const char *id) {
+    for (int i = idx->buckets[hash_id(id) % (unsigned)idx->nbuckets]; i >= 0; i = idx->e[i].next) {
+        if (strcmp(idx->e[i].id, id) == 0) return i;
+    }
+    return -1;
+}
+
+DevEntry* devidx_get(DevIndex *idx, int slot) {
+    if (slot < 0 || slot >= idx->cap || !idx->e[slot].used) return NULL;
+    return &idx->e[slot];
+}
+
+static int alloc_slot(DevIndex *idx) {
+    for (int i = idx->count; i < idx->cap; i++) {
+        if (!idx->e[i].used) return i;
+    }
+    for (int i = 0; i < idx->count && i < idx->cap; i++) {
+        if (!idx->e[i].used) return i;
+    }
+
+    int cap = idx->cap ? idx->cap * 2 : 64;
+    DevEntry *e = realloc(idx->e, cap * sizeof(DevEntry));
+    if (!e) return -1;
+    memset(e + idx->cap, 0, (cap - idx->cap) * sizeof(DevEntry));
+    int slot = idx->cap;
+    idx->e = e;
+    idx->cap = cap;
+    return slot;
+}
+
+void devidx_begin_scan(DevIndex *idx) {
+    idx->scan_gen++;
+}
+
+int devidx_upsert(DevIndex *idx, const char *id, const char *type,
+                  const char *ip, bool *created) {
+    int slot = devidx_find(idx, id);
+    if (created) *created = slot < 0;
+
+    if (slot < 0) {
+        slot = alloc_slot(idx);
+        if (slot < 0) return -1;
+        DevEntry *e = &idx->e[slot];
+        memset(e, 0, sizeof(*e));
+        snprintf(e->id, sizeof(e->id), "%s", id);
+        snprintf(e->state, sizeof(e->state), "unknown");
+        e->used = true;
+        unsigned h = hash_id(e->id) % (unsigned)idx->nbuckets;
+        e->next = idx->buckets[h];
+        idx->buckets[h] = slot;
+        idx->count++;
+        idx->keys_dirty = true;
+        if (idx->count > idx->nbuckets) rehash(idx, idx->nbuckets * 2);
+    }
+
+    DevEntry *e = &idx->e[slot];
+    if (type && strcmp(e->type, type) != 0) {
+        snprintf(e->type, sizeof(e->type), "%s", type);
+        idx->keys_dirty = true;
+    }
+    if (ip) snprintf(e->ip, sizeof(e->ip), "%s", ip);
+    e->seen = idx->scan_gen;
+    return slot;
+}
+
+static void drop_where(DevIndex *idx, bool all, void (*gone)(DevEntry *e, void *arg), void *arg) {
+    int dropped = 0;
+    for (int i = 0; i < idx->cap; i++) {
+        DevEntry *e = &idx->e[i];
+        if (!e->used || (!all && e->seen == idx->scan_gen)) continue;
+        if (gone) gone(e, arg);
+        e->used = false;
+        idx->count--;
+        dropped++;
+    }
+    if (dropped) {
+        rehash(idx, idx->nbuckets);
+        idx->keys_dirty = true;
+    }
+}
+
+void devidx_sweep(DevIndex *idx, void (*gone)(DevEntry *e, void *arg), void *arg) {
+    drop_where(idx, false, gone, arg);
+}
+
+void devidx_clear(DevIndex *idx, void (*gone)(DevEntry *e, void *arg), void *arg) {
+    drop_where(idx, true, gone, arg);
+}
+
+static int key_cmp(const void *a, const void *b) {
+    return strcmp(((const DevKey*)a)->key, ((const DevKey*)b)->key);
+}
+
+/* Two keys per device, id and type, sorted so a prefix is one range. */
+static void build_keys(DevIndex *idx) {
+    DevKey *k = realloc(idx->keys, (size_t)(idx->count * 2 + 1) * sizeof(DevKey));
+    if (!k) return;
+    idx->keys = k;
+    idx->nkeys = 0;
+    for (int i = 0; i < idx->cap; i++) {
+        if (!idx->e[i].used) continue;
+        lower_copy(k[idx->nkeys].key, idx->e[i].id, sizeof(k->key));
+        k[idx->nkeys++].slot = i;
+        if (idx->e[i].type[0]) {
+            lower_copy(k[idx->nkeys].key, idx->e[i].type, sizeof(k->key));
+            k[idx->nkeys++].slot = i;
+        }
+    }
+    qsort(k, idx->nkeys, sizeof(DevKey), key_cmp);
+    idx->keys_dirty = false;
+}
+
+int devidx_filter(DevIndex *idx, const char *prefix) {
+    idx->filter_gen++;
+    idx->filtering = prefix && prefix[0];
+    if (!idx->filtering) return idx->count;
+    if (idx->keys_dirty) build_keys(idx);
+
+    char p[64];
+    lower_copy(p, prefix, sizeof(p));
+    size_t plen = strlen(p);
+
+    int lo = 0, hi = idx->nkeys;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(idx->keys[mid].key, p) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    int matches = 0;
+    for (int i = lo; i < idx->nkeys && strncmp(idx->keys[i].key, p, plen) == 0; i++) {
+        DevEntry *e = &idx->e[idx->keys[i].slot];
+        if (e->match != idx->filter_gen) {
+            e->match = idx->filter_gen;
+            matches++;
+        }
+    }
+    return matches;
+}
+
+bool devidx_visible(DevIndex *idx, int slot) {
+    DevEntry *e = devidx_get(idx, slot);
+    if (!e) return false;
+    return !idx->filtering || e->match == idx->filter_gen;
+}
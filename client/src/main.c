@@ -2,12 +2,28 @@
 
 #include <gtk/gtk.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "message_builder.h"
 #include "network_helper.h"
+#include "device_index.h"
 
 #define SERVER_PORT 6666
+/* Above this many new rows a scan detaches the model while filling it. */
+#define BULK_INSERT 200
+/* How often notifies already on the socket are applied between requests. */
+#define NOTIFY_POLL_MS 500
+
+enum {
+    COL_SLOT,
+    COL_ID,
+    COL_TYPE,
+    COL_IP,
+    COL_STATE,
+    COL_POWER,
+    N_COLS
+};
 
 typedef struct {
     GtkWidget *window;
@@ -15,12 +31,18 @@ typedef struct {
     GtkWidget *pass_entry;
     GtkWidget *status_label;
     GtkWidget *device_list;
-    GtkWidget *device_combo;
+    GtkWidget *search_entry;
+    GtkWidget *device_view;
+    GtkListStore *device_store;
+    GtkTreeModel *device_filter;
+    DevIndex *devs;
     GtkWidget *control_label;
+    GtkWidget *latency_label;
     GtkWidget *old_pass_entry;
     GtkWidget *new_pass_entry;
     NetContext *net;
     gboolean logged_in;
+    char token[256];
 } AppData;
 
 void show_error(GtkWidget *parent, const char *msg) {
@@ -68,21 +90,10 @@ ResponseParser* send_request(AppData *app, MessageBuilder *mb, const char *prefi
         return NULL;
     }
     
-    const char *status = response_get_string(rp, "status");
-    if (status && strcmp(status, "error") == 0) {
-        const char *msg = response_get_string(rp, "message");
-        char e[256];
-        snprintf(e, sizeof(e), "%s: %s", prefix, 
-                 msg ? msg : "Unknown error");
-        show_error(app->window, e);
-        response_free(rp);
-        return NULL;
-    }
-    
     if (!response_is_success(rp)) {
         char e[256];
         snprintf(e, sizeof(e), "%s: %.200s", prefix, 
-                 rp->error_msg ? rp->error_msg : "Failed");
+                 rp->error_msg[0] ? rp->error_msg : "Failed");
         show_error(app->window, e);
         response_free(rp);
         return NULL;
@@ -91,12 +102,82 @@ ResponseParser* send_request(AppData *app, MessageBuilder *mb, const char *prefi
     return rp;
 }
 
+static void row_gone(DevEntry *e, void *arg) {
+    AppData *app = arg;
+    gtk_list_store_remove(app->device_store, e->row);
+    g_free(e->row);
+    e->row = NULL;
+}
+
+static gboolean row_visible(GtkTreeModel *model, GtkTreeIter *iter, gpointer d) {
+    AppData *app = d;
+    int slot = -1;
+    gtk_tree_model_get(model, iter, COL_SLOT, &slot, -1);
+    return devidx_visible(app->devs, slot);
+}
+
+static void update_count_label(AppData *app, int shown) {
+    char txt[64];
+    if (app->devs->count == 0) {
+        snprintf(txt, sizeof(txt), "No devices found");
+    } else if (shown < app->devs->count) {
+        snprintf(txt, sizeof(txt), "Showing %d of %d device(s)", shown, app->devs->count);
+    } else {
+        snprintf(txt, sizeof(txt), "Found %d device(s)", app->devs->count);
+    }
+    gtk_label_set_text(GTK_LABEL(app->device_list), txt);
+}
+
+static void apply_filter(AppData *app) {
+    const char *q = gtk_entry_get_text(GTK_ENTRY(app->search_entry));
+    int shown = devidx_filter(app->devs, q);
+    gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(app->device_filter));
+    update_count_label(app, shown);
+}
+
+void on_search_changed(GtkWidget *w, gpointer d) {
+    (void)w;
+    apply_filter(d);
+}
+
+/* Live columns change in place; the row keeps its position and selection. */
+static void update_device_state(AppData *app, const char *id, const char *state, int power) {
+    DevEntry *e = devidx_get(app->devs, devidx_find(app->devs, id));
+    if (!e) return;
+    snprintf(e->state, sizeof(e->state), "%s", state);
+    e->power = power;
+    gtk_list_store_set(app->device_store, e->row, COL_STATE, e->state, COL_POWER, power, -1);
+}
+
+/* device_event "state" from the server; up/down show on the next scan. */
+static void on_notify(const char *line, void *arg) {
+    AppData *app = arg;
+    struct json_object *root = json_tokener_parse(line), *action, *data;
+    DeviceEvent ev;
+    if (root && json_object_object_get_ex(root, "action", &action) &&
+        strcmp(json_object_get_string(action), "device_event") == 0 &&
+        json_object_object_get_ex(root, "data", &data) &&
+        device_event_decode(data, &ev, NULL, 0) == 0 &&
+        strcmp(ev.event, "state") == 0 && ev.has_state) {
+        DevEntry *e = devidx_get(app->devs, devidx_find(app->devs, ev.device));
+        if (e) update_device_state(app, ev.device, ev.state, ev.has_power ? (int)ev.power : e->power);
+    }
+    json_object_put(root);
+}
+
+static gboolean poll_notify(gpointer d) {
+    AppData *app = d;
+    if (app->logged_in) net_poll_notify(app->net);
+    return TRUE;
+}
+
 void set_logged_in(AppData *app, gboolean v) {
     app->logged_in = v;
-    gtk_widget_set_sensitive(app->device_combo, v);
+    gtk_widget_set_sensitive(app->device_view, v);
+    gtk_widget_set_sensitive(app->search_entry, v);
     
     if (!v) {
-        gtk_combo_box_text_remove_all(GTK_COMBO_BOX_TEXT(app->device_combo));
+        devidx_clear(app->devs, row_gone, app);
         gtk_label_set_text(GTK_LABEL(app->device_list), "No devices");
         gtk_label_set_text(GTK_LABEL(app->control_label), "State: unknown");
     }
@@ -109,7 +190,7 @@ void on_connect_clicked(GtkWidget *w, gpointer d) {
     const char *ip = gtk_entry_get_text(GTK_ENTRY(app->server_entry));
     const char *pw = gtk_entry_get_text(GTK_ENTRY(app->pass_entry));
 
-    if (!strlen(ip) || !strlen(pw)) {
+    if (!strlen(ip) || (!strlen(pw) && !app->token[0])) {
         show_error(app->window, "Enter server IP and password");
         return;
     }
@@ -122,21 +203,35 @@ void on_connect_clicked(GtkWidget *w, gpointer d) {
         return;
     }
 
+    LoginReq req = {.has_compress = true};
+    if (strlen(pw) >= sizeof(req.password) || strlen(app->token) >= sizeof(req.token)) {
+        show_error(app->window, "Password too long");
+        return;
+    }
+    if (strlen(pw)) {
+        snprintf(req.password, sizeof(req.password), "%s", pw);
+        req.has_password = true;
+    } else {
+        snprintf(req.token, sizeof(req.token), "%s", app->token);
+        req.has_token = true;
+    }
+    snprintf(req.compress, sizeof(req.compress), "deflate");
+
     MessageBuilder *mb = msg_builder_create("request", "gtk_client", "server", "login");
-    msg_builder_add_string(mb, "username", "admin");
-    msg_builder_add_string(mb, "password", pw);
+    msg_builder_set_data(mb, login_req_encode(&req));
 
     ResponseParser *rp = send_request(app, mb, "Login failed");
     msg_builder_free(mb);
 
     if (!rp) {
         gtk_label_set_text(GTK_LABEL(app->status_label), "Login failed");
+        app->token[0] = '\0';
         set_logged_in(app, FALSE);
         return;
     }
 
-    const char *status = response_get_string(rp, "status");
-    if (!status || strcmp(status, "success") != 0) {
+    LoginResp lr;
+    if (login_resp_decode(rp->data, &lr, NULL, 0) < 0 || strcmp(lr.status, "success") != 0) {
         gtk_label_set_text(GTK_LABEL(app->status_label), "Auth failed");
         show_error(app->window, "Wrong password");
         set_logged_in(app, FALSE);
@@ -144,6 +239,14 @@ void on_connect_clicked(GtkWidget *w, gpointer d) {
         return;
     }
 
+    if (strcmp(lr.compress, "deflate") == 0) {
+        net_enable_inflate(app->net);
+    }
+
+    if (lr.has_token) {
+        snprintf(app->token, sizeof(app->token), "%s", lr.token);
+    }
+
     gtk_label_set_text(GTK_LABEL(app->status_label), "Connected");
     set_logged_in(app, TRUE);
     response_free(rp);
@@ -163,74 +266,120 @@ void on_scan_clicked(GtkWidget *w, gpointer d) {
     msg_builder_free(mb);
     if (!rp) return;
 
-    gtk_combo_box_text_remove_all(GTK_COMBO_BOX_TEXT(app->device_combo));
-
-    struct json_object *devs;
-    if (json_object_object_get_ex(rp->data, "devices", &devs)) {
+    /* Merge into the existing rows: known devices are updated where they
+     * are, new ones appended and missing ones removed. */
+    ListDevicesResp lr;
+    if (list_devices_resp_decode(rp->data, &lr, NULL, 0) == 0 && lr.has_devices &&
+        json_object_is_type(lr.devices, json_type_array)) {
+        struct json_object *devs = lr.devices;
         size_t n = json_object_array_length(devs);
-        char txt[64];
-        
-        if (n == 0) {
-            snprintf(txt, sizeof(txt), "No devices found");
-        } else {
-            snprintf(txt, sizeof(txt), "Found %zu device(s)", n);
-        }
-        gtk_label_set_text(GTK_LABEL(app->device_list), txt);
-        
+        gboolean bulk = n > BULK_INSERT && (size_t)app->devs->count + BULK_INSERT < n;
+        if (bulk) gtk_tree_view_set_model(GTK_TREE_VIEW(app->device_view), NULL);
+
+        devidx_begin_scan(app->devs);
         for (size_t i = 0; i < n; i++) {
-            struct json_object *d = json_object_array_get_idx(devs, i);
-            struct json_object *id, *type;
-            if (json_object_object_get_ex(d, "id", &id) &&
-                json_object_object_get_ex(d, "type", &type)) {
-                char item[128];
-                snprintf(item, sizeof(item), "%s (%s)",
-                         json_object_get_string(id),
-                         json_object_get_string(type));
-                gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(app->device_combo), item);
+            DeviceInfo dev;
+            if (device_info_decode(json_object_array_get_idx(devs, i), &dev, NULL, 0) < 0 ||
+                !dev.has_type) continue;
+
+            bool created;
+            int slot = devidx_upsert(app->devs, dev.id, dev.type, dev.ip, &created);
+            DevEntry *e = devidx_get(app->devs, slot);
+            if (!e) continue;
+            if (dev.has_state) snprintf(e->state, sizeof(e->state), "%s", dev.state);
+            if (dev.has_power) e->power = (int)dev.power;
+
+            if (created) {
+                GtkTreeIter it;
+                gtk_list_store_insert_with_values(app->device_store, &it, -1,
+                    COL_SLOT, slot, COL_ID, e->id, COL_TYPE, e->type, COL_IP, e->ip,
+                    COL_STATE, e->state, COL_POWER, e->power, -1);
+                e->row = g_new(GtkTreeIter, 1);
+                *(GtkTreeIter*)e->row = it;
+            } else {
+                gtk_list_store_set(app->device_store, e->row,
+                    COL_TYPE, e->type, COL_IP, e->ip,
+                    COL_STATE, e->state, COL_POWER, e->power, -1);
             }
         }
-        if (n > 0) gtk_combo_box_set_active(GTK_COMBO_BOX(app->device_combo), 0);
+        devidx_sweep(app->devs, row_gone, app);
+
+        if (bulk) gtk_tree_view_set_model(GTK_TREE_VIEW(app->device_view), app->device_filter);
+        apply_filter(app);
     }
     response_free(rp);
 }
 
+static void add_part(char *buf, size_t n, const char *name, long us) {
+    size_t len = strlen(buf);
+    if (us < 0) snprintf(buf + len, n - len, " | %s ?", name);
+    else snprintf(buf + len, n - len, " | %s %.1f", name, us / 1000.0);
+}
+
+/* The client part is everything between the click and the label update
+ * that the request itself did not spend on the wire or in other hosts. */
+static void show_latency(AppData *app, gint64 clicked_us) {
+    const NetTrace *t = &app->net->trace;
+    long total = (long)(g_get_monotonic_time() - clicked_us);
+    char txt[256];
+    snprintf(txt, sizeof(txt), "RTT %.1f ms", total / 1000.0);
+    add_part(txt, sizeof(txt), "client", total - t->total_us);
+    add_part(txt, sizeof(txt), "network", t->network_us);
+    add_part(txt, sizeof(txt), "server", t->server_us);
+    add_part(txt, sizeof(txt), "device link", t->device_link_us);
+    add_part(txt, sizeof(txt), "device", t->device_us);
+    gtk_label_set_text(GTK_LABEL(app->latency_label), txt);
+}
+
 void on_control_clicked(GtkWidget *w, gpointer d) {
     AppData *app = d;
+    gint64 clicked = g_get_monotonic_time();
 
     if (!app->logged_in) {
         show_error(app->window, "Login first");
         return;
     }
 
-    gchar *sel = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(app->device_combo));
-    if (!sel) {
+    GtkTreeModel *model;
+    GtkTreeIter iter;
+    GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(app->device_view));
+    if (!gtk_tree_selection_get_selected(selection, &model, &iter)) {
         show_error(app->window, "Select a device");
         return;
     }
 
     char did[64];
-    sscanf(sel, "%63s", did);
+    gchar *sel;
+    gtk_tree_model_get(model, &iter, COL_ID, &sel, -1);
+    snprintf(did, sizeof(did), "%s", sel);
     g_free(sel);
 
     gboolean on = strcmp(gtk_button_get_label(GTK_BUTTON(w)), "Turn ON") == 0;
 
+    ControlReq req = {.state = on, .has_device_type = true, .has_state = true};
+    snprintf(req.device_type, sizeof(req.device_type), "light");
+
     MessageBuilder *mb = msg_builder_create("request", "gtk_client", did, "control");
-    msg_builder_add_string(mb, "device_type", "light");
-    msg_builder_add_bool(mb, "state", on);
+    msg_builder_set_data(mb, control_req_encode(&req));
+    msg_builder_trace(mb);
 
     ResponseParser *rp = send_request(app, mb, "Control failed");
     msg_builder_free(mb);
     if (!rp) return;
 
-    const char *st = response_get_string(rp, "state");
-    int pwr = response_get_int(rp, "power");
-
-    if (st) {
+    DeviceStatus ds;
+    if (rp->queued) {
         char txt[128];
-        snprintf(txt, sizeof(txt), "State: %s | Power: %dW", st, pwr);
+        snprintf(txt, sizeof(txt), "Queued: %s is offline", did);
         gtk_label_set_text(GTK_LABEL(app->control_label), txt);
+    } else if (device_status_decode(rp->data, &ds, NULL, 0) == 0 && ds.has_state) {
+        char txt[128];
+        snprintf(txt, sizeof(txt), "State: %s | Power: %dW", ds.state, ds.power);
+        gtk_label_set_text(GTK_LABEL(app->control_label), txt);
+        update_device_state(app, did, ds.state, ds.power);
     }
     response_free(rp);
+    show_latency(app, clicked);
 }
 
 void on_change_password_clicked(GtkWidget *w, gpointer d) {
@@ -255,9 +404,16 @@ void on_change_password_clicked(GtkWidget *w, gpointer d) {
         return;
     }
 
+    ChangePasswordReq req;
+    if (strlen(oldpw) >= sizeof(req.old_password) || strlen(newpw) >= sizeof(req.new_password)) {
+        show_error(app->window, "Password too long");
+        return;
+    }
+    snprintf(req.old_password, sizeof(req.old_password), "%s", oldpw);
+    snprintf(req.new_password, sizeof(req.new_password), "%s", newpw);
+
     MessageBuilder *mb = msg_builder_create("request", "gtk_client", "server", "change_password");
-    msg_builder_add_string(mb, "old_password", oldpw);
-    msg_builder_add_string(mb, "new_password", newpw);
+    msg_builder_set_data(mb, change_password_req_encode(&req));
 
     ResponseParser *rp = send_request(app, mb, "Change password failed");
     msg_builder_free(mb);
@@ -268,6 +424,7 @@ void on_change_password_clicked(GtkWidget *w, gpointer d) {
     gtk_entry_set_text(GTK_ENTRY(app->old_pass_entry), "");
     gtk_entry_set_text(GTK_ENTRY(app->new_pass_entry), "");
     gtk_entry_set_text(GTK_ENTRY(app->pass_entry), "");
+    app->token[0] = '\0';
     
     set_logged_in(app, FALSE);
     gtk_label_set_text(GTK_LABEL(app->status_label), "Disconnected");
@@ -281,6 +438,8 @@ void on_destroy(GtkWidget *w, gpointer d) {
     if (app->net) {
         net_context_free(app->net);
     }
+    devidx_clear(app->devs, row_gone, app);
+    devidx_free(app->devs);
     gtk_main_quit();
 }
 
@@ -289,11 +448,20 @@ int main(int argc, char *argv[]) {
 
     AppData app = {0};
     app.net = net_context_create("gtk_client");
+    app.devs = devidx_new();
+    net_set_notify_handler(app.net, on_notify, &app);
+    g_timeout_add(NOTIFY_POLL_MS, poll_notify, &app);
+
+    const char *ca = getenv("SMARTHOME_TLS_CA");
+    if (ca && net_enable_tls(app.net, ca) < 0) {
+        fprintf(stderr, "Cannot load TLS CA %s\n", ca);
+        return 1;
+    }
     app.logged_in = FALSE;
 
     app.window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(app.window), "Smart Home");
-    gtk_window_set_default_size(GTK_WINDOW(app.window), 420, 360);
+    gtk_window_set_default_size(GTK_WINDOW(app.window), 520, 520);
     gtk_container_set_border_width(GTK_CONTAINER(app.window), 10);
     g_signal_connect(app.window, "destroy", G_CALLBACK(on_destroy), &app);
 
@@ -340,9 +508,40 @@ int main(int argc, char *argv[]) {
     app.device_list = gtk_label_new("No devices");
     gtk_box_pack_start(GTK_BOX(vb), app.device_list, FALSE, FALSE, 0);
 
-    app.device_combo = gtk_combo_box_text_new();
-    gtk_widget_set_sensitive(app.device_combo, FALSE);
-    gtk_box_pack_start(GTK_BOX(vb), app.device_combo, FALSE, FALSE, 0);
+    app.search_entry = gtk_search_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(app.search_entry), "Filter by id or type");
+    gtk_widget_set_sensitive(app.search_entry, FALSE);
+    g_signal_connect(app.search_entry, "search-changed", G_CALLBACK(on_search_changed), &app);
+    gtk_box_pack_start(GTK_BOX(vb), app.search_entry, FALSE, FALSE, 0);
+
+    app.device_store = gtk_list_store_new(N_COLS, G_TYPE_INT, G_TYPE_STRING, G_TYPE_STRING,
+                                          G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT);
+    app.device_filter = gtk_tree_model_filter_new(GTK_TREE_MODEL(app.device_store), NULL);
+    gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER(app.device_filter),
+                                           row_visible, &app, NULL);
+
+    /* Fixed-height rows let the view lay out only what is on screen. */
+    app.device_view = gtk_tree_view_new_with_model(app.device_filter);
+    static const struct { const char *title; int col; int width; } cols[] = {
+        {"Device", COL_ID, 180}, {"Type", COL_TYPE, 80}, {"IP", COL_IP, 110},
+        {"State", COL_STATE, 70}, {"Power (W)", COL_POWER, 70},
+    };
+    for (size_t i = 0; i < sizeof(cols) / sizeof(cols[0]); i++) {
+        GtkTreeViewColumn *col = gtk_tree_view_column_new_with_attributes(
+            cols[i].title, gtk_cell_renderer_text_new(), "text", cols[i].col, NULL);
+        gtk_tree_view_column_set_sizing(col, GTK_TREE_VIEW_COLUMN_FIXED);
+        gtk_tree_view_column_set_fixed_width(col, cols[i].width);
+        gtk_tree_view_column_set_resizable(col, TRUE);
+        gtk_tree_view_append_column(GTK_TREE_VIEW(app.device_view), col);
+    }
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(app.device_view), TRUE);
+    gtk_widget_set_sensitive(app.device_view, FALSE);
+
+    GtkWidget *scroll = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(scroll), app.device_view);
+    gtk_box_pack_start(GTK_BOX(vb), scroll, TRUE, TRUE, 0);
 
     GtkWidget *h2 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
     gtk_box_pack_start(GTK_BOX(vb), h2, FALSE, FALSE, 0);
@@ -358,6 +557,9 @@ int main(int argc, char *argv[]) {
     app.control_label = gtk_label_new("State: unknown");
     gtk_box_pack_start(GTK_BOX(vb), app.control_label, FALSE, FALSE, 0);
 
+    app.latency_label = gtk_label_new("");
+    gtk_box_pack_start(GTK_BOX(vb), app.latency_label, FALSE, FALSE, 0);
+
     gtk_widget_show_all(app.window);
     gtk_main();
     return 0;
@@ -2,7 +2,9 @@
 #include "message_builder.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <time.h>
+#include <openssl/rand.h>
 MessageBuilder* msg_builder_create(const char *type, const char *from, const char *to, const char *action) {
     MessageBuilder *mb = malloc(sizeof(MessageBuilder));
     if (!mb) return NULL;
@@ -34,6 +36,20 @@ void msg_builder_add_bool(MessageBuilder *mb, const char *key, bool value) {
     if (json_object_object_get_ex(mb->root, "data", &data))
         json_object_object_add(data, key, json_object_new_boolean(value));
 }
+void msg_builder_trace(MessageBuilder *mb) {
+    if (!mb || !mb->root) return;
+    unsigned char r[8];
+    if (RAND_bytes(r, sizeof(r)) != 1) return;
+    char id[17];
+    for (int i = 0; i < 8; i++) snprintf(id + 2 * i, 3, "%02x", r[i]);
+    struct json_object *t = json_object_new_object();
+    json_object_object_add(t, "id", json_object_new_string(id));
+    json_object_object_add(mb->root, "trace", t);
+}
+void msg_builder_set_data(MessageBuilder *mb, struct json_object *data) {
+    if (!mb || !mb->root || !data) return;
+    json_object_object_add(mb->root, "data", data);
+}
 char* msg_builder_build(MessageBuilder *mb) {
     if (!mb || !mb->root) return NULL;
     return strdup(json_object_to_json_string(mb->root));
@@ -51,30 +67,20 @@ ResponseParser* response_parse(const char *json_str) {
     struct json_object *root = json_tokener_parse(json_str);
     if (!root) { strcpy(rp->error_msg, "Invalid JSON"); return rp; }
     struct json_object *data;
-    if (json_object_object_get_ex(root, "data", &data)) {
+    StatusResp st;
+    if (!json_object_object_get_ex(root, "data", &data)) {
+        strcpy(rp->error_msg, "No data field");
+    } else if (status_resp_decode(data, &st, rp->error_msg, sizeof(rp->error_msg)) == 0) {
         rp->data = json_object_get(data);
-        struct json_object *status;
-        if (json_object_object_get_ex(data, "status", &status)) {
-            if (strcmp(json_object_get_string(status), "success") == 0) rp->success = true;
-            else { rp->success = false; strncpy(rp->error_msg, json_object_get_string(status), 255); }
-        } else rp->success = true;
-    } else { rp->success = false; strcpy(rp->error_msg, "No data field"); }
+        rp->queued = st.has_status && strcmp(st.status, "queued") == 0;
+        rp->success = !st.has_status || strcmp(st.status, "success") == 0 || rp->queued;
+        if (!rp->success) snprintf(rp->error_msg, sizeof(rp->error_msg), "%s",
+                                   st.has_message ? st.message : st.status);
+    }
     json_object_put(root);
     return rp;
 }
 bool response_is_success(ResponseParser *rp) { return rp && rp->success; }
-const char* response_get_string(ResponseParser *rp, const char *key) {
-    if (!rp || !rp->data) return NULL;
-    struct json_object *field;
-    if (json_object_object_get_ex(rp->data, key, &field)) return json_object_get_string(field);
-    return NULL;
-}
-int response_get_int(ResponseParser *rp, const char *key) {
-    if (!rp || !rp->data) return 0;
-    struct json_object *field;
-    if (json_object_object_get_ex(rp->data, key, &field)) return json_object_get_int(field);
-    return 0;
-}
 void response_free(ResponseParser *rp) {
     if (rp) {
         if (rp->data) json_object_put(rp->data);
@@ -1,47 +1,476 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include "network_helper.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <zlib.h>
+#define NET_READ_CHUNK 4096
+#define NET_ZPREFIX "Z:"
+#define NET_UNIX_FMT "/tmp/smarthome-%u/%d.sock"
+/* A cacheable request on the wire; callers asking the same thing wait for
+ * its reply. The last one to let go frees it. */
+struct NetFlight {
+    char key[NET_KEY_MAX];
+    char *line;
+    bool done;
+    int refs;
+    struct NetFlight *next;
+};
+static const char *net_cacheable[] = {"list_devices", "status", "home_status", "query_devices", NULL};
 NetContext* net_context_create(const char *client_id) {
     NetContext *ctx = calloc(1, sizeof(NetContext));
     if (!ctx) return NULL;
     ctx->sock = -1;
+    ctx->cache_ttl_ms = NET_CACHE_TTL_MS;
     strncpy(ctx->client_id, client_id ? client_id : "client", 31);
+    pthread_mutex_init(&ctx->mtx, NULL);
+    pthread_mutex_init(&ctx->io_mtx, NULL);
+    pthread_cond_init(&ctx->flight_cv, NULL);
     return ctx;
 }
+/* Called with ctx->mtx held. */
+static void net_cache_drop(NetContext *ctx) {
+    for (int i = 0; i < NET_CACHE_SLOTS; i++) {
+        free(ctx->cache[i].line);
+        ctx->cache[i].line = NULL;
+    }
+    ctx->cache_gen++;
+}
+void net_cache_clear(NetContext *ctx) {
+    if (!ctx) return;
+    pthread_mutex_lock(&ctx->mtx);
+    net_cache_drop(ctx);
+    pthread_mutex_unlock(&ctx->mtx);
+}
+void net_set_cache_ttl(NetContext *ctx, int ttl_ms) {
+    if (!ctx) return;
+    pthread_mutex_lock(&ctx->mtx);
+    ctx->cache_ttl_ms = ttl_ms > 0 ? ttl_ms : 0;
+    net_cache_drop(ctx);
+    pthread_mutex_unlock(&ctx->mtx);
+}
+/* TLS 1.3 tickets arrive after the handshake; keep the newest one so the
+ * next net_connect() resumes instead of doing a full handshake. */
+static int on_new_session(SSL *ssl, SSL_SESSION *sess) {
+    NetContext *ctx = SSL_get_app_data(ssl);
+    if (!ctx) return 0;
+    if (ctx->session) SSL_SESSION_free(ctx->session);
+    ctx->session = sess;
+    return 1;
+}
+int net_enable_tls(NetContext *ctx, const char *ca_file) {
+    if (!ctx || ctx->ssl_ctx) return -1;
+    SSL_CTX *sc = SSL_CTX_new(TLS_client_method());
+    if (!sc) return -1;
+    SSL_CTX_set_min_proto_version(sc, TLS1_2_VERSION);
+    SSL_CTX_set_verify(sc, SSL_VERIFY_PEER, NULL);
+    if (SSL_CTX_load_verify_locations(sc, ca_file, NULL) != 1) { SSL_CTX_free(sc); return -1; }
+    SSL_CTX_set_session_cache_mode(sc, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(sc, on_new_session);
+    SSL_CTX_set_options(sc, SSL_OP_ENABLE_KTLS);
+    ctx->ssl_ctx = sc;
+    return 0;
+}
+static void net_close(NetContext *ctx) {
+    if (ctx->ssl) { SSL_shutdown(ctx->ssl); SSL_free(ctx->ssl); ctx->ssl = NULL; }
+    if (ctx->sock >= 0) { close(ctx->sock); ctx->sock = -1; }
+    if (ctx->inflater) { inflateEnd(ctx->inflater); free(ctx->inflater); ctx->inflater = NULL; }
+    ctx->rlen = 0;
+}
+int net_enable_inflate(NetContext *ctx) {
+    if (!ctx || ctx->inflater) return -1;
+    z_stream *zs = calloc(1, sizeof(z_stream));
+    if (!zs) return -1;
+    if (inflateInit2(zs, -15) != Z_OK) { free(zs); return -1; }
+    ctx->inflater = zs;
+    return 0;
+}
+/* A server on this host also listens on a Unix socket named after our uid
+ * and its port (SMARTHOME_UNIX overrides the path, "" turns this off).
+ * Local connections skip TCP and TLS, so the peer must run as us or root;
+ * -1 means use TCP instead. */
+static int net_connect_unix(NetContext *ctx, const char *server_ip, int port) {
+    if (strcmp(server_ip, "localhost") != 0 && strncmp(server_ip, "127.", 4) != 0) return -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    const char *path = getenv("SMARTHOME_UNIX");
+    if (path) {
+        if (!path[0] || strlen(path) >= sizeof(addr.sun_path)) return -1;
+        strcpy(addr.sun_path, path);
+    } else {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), NET_UNIX_FMT, (unsigned)getuid(), port);
+    }
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) { close(s); return -1; }
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+        (cred.uid != getuid() && cred.uid != 0)) {
+        close(s);
+        return -1;
+    }
+    ctx->sock = s;
+    return 0;
+}
 int net_connect(NetContext *ctx, const char *server_ip, int port) {
     if (!ctx) return -1;
-    if (ctx->sock >= 0) close(ctx->sock);
+    net_cache_clear(ctx);
+    net_close(ctx);
+    /* With TLS on the password must never cross a plain socket. */
+    if (!ctx->ssl_ctx && net_connect_unix(ctx, server_ip, port) == 0) return 0;
     ctx->sock = socket(AF_INET, SOCK_STREAM, 0);
     if (ctx->sock < 0) return -1;
     struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
     addr.sin_addr.s_addr = inet_addr(server_ip);
     if (connect(ctx->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         close(ctx->sock); ctx->sock = -1; return -1;
     }
+    if (!ctx->ssl_ctx) return 0;
+    ctx->ssl = SSL_new(ctx->ssl_ctx);
+    if (!ctx->ssl) { net_close(ctx); return -1; }
+    SSL_set_app_data(ctx->ssl, ctx);
+    SSL_set_fd(ctx->ssl, ctx->sock);
+    SSL_set1_host(ctx->ssl, server_ip);
+    if (ctx->session) SSL_set_session(ctx->ssl, ctx->session);
+    if (SSL_connect(ctx->ssl) != 1) {
+        ERR_clear_error();
+        if (ctx->session) { SSL_SESSION_free(ctx->session); ctx->session = NULL; }
+        net_close(ctx);
+        return -1;
+    }
     return 0;
 }
-char* net_send_receive(NetContext *ctx, MessageBuilder *mb) {
-    if (!ctx || ctx->sock < 0 || !mb) return NULL;
+static int net_write_all(NetContext *ctx, const char *buf, size_t len) {
+    while (len > 0) {
+        int n = ctx->ssl ? SSL_write(ctx->ssl, buf, (int)len) : (int)send(ctx->sock, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        buf += n; len -= (size_t)n;
+    }
+    return 0;
+}
+static int net_read(NetContext *ctx, char *buf, size_t len) {
+    if (ctx->ssl) return SSL_read(ctx->ssl, buf, (int)len);
+    return (int)recv(ctx->sock, buf, len, 0);
+}
+static int b64_val(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+/* Inflate a "Z:" frame through the connection's stream. The result may
+ * hold several lines (the server batches queued frames), so it goes back
+ * in front of rbuf and is read like any other input. */
+static int net_inflate_line(NetContext *ctx, const char *b64, size_t n) {
+    unsigned char *raw = malloc(n / 4 * 3 + 3);
+    if (!raw) return -1;
+    size_t rn = 0; uint32_t acc = 0; int bits = 0;
+    for (size_t i = 0; i < n && b64[i] != '='; i++) {
+        int v = b64_val(b64[i]);
+        if (v < 0) { free(raw); return -1; }
+        acc = (acc << 6) | (uint32_t)v; bits += 6;
+        if (bits >= 8) { bits -= 8; raw[rn++] = (unsigned char)(acc >> bits); }
+    }
+    size_t cap = rn * 4 + 256, out = 0;
+    char *text = malloc(cap);
+    if (!text) { free(raw); return -1; }
+    z_stream *zs = ctx->inflater;
+    zs->next_in = raw; zs->avail_in = (uInt)rn;
+    int rc;
+    do {
+        if (cap - out < 256) {
+            char *t = realloc(text, cap * 2);
+            if (!t) { free(raw); free(text); return -1; }
+            text = t; cap *= 2;
+        }
+        zs->next_out = (unsigned char*)text + out; zs->avail_out = (uInt)(cap - out - 1);
+        rc = inflate(zs, Z_SYNC_FLUSH);
+        out = cap - 1 - zs->avail_out;
+    } while ((rc == Z_OK || rc == Z_BUF_ERROR) && (zs->avail_in > 0 || zs->avail_out == 0));
+    free(raw);
+    if (rc != Z_OK && rc != Z_BUF_ERROR) { free(text); return -1; }
+    text[out++] = '\n';
+    char *nb = realloc(ctx->rbuf, ctx->rlen + out);
+    if (!nb) { free(text); return -1; }
+    ctx->rbuf = nb;
+    memmove(ctx->rbuf + out, ctx->rbuf, ctx->rlen);
+    memcpy(ctx->rbuf, text, out);
+    ctx->rlen += out;
+    free(text);
+    return 0;
+}
+/* Responses are newline-delimited; bytes after the first line stay in rbuf
+ * for the next call. */
+static char* net_read_line(NetContext *ctx) {
+    size_t zp = strlen(NET_ZPREFIX);
+    for (;;) {
+        char *nl = ctx->rbuf ? memchr(ctx->rbuf, '\n', ctx->rlen) : NULL;
+        if (nl && ctx->inflater && (size_t)(nl - ctx->rbuf) >= zp &&
+            memcmp(ctx->rbuf, NET_ZPREFIX, zp) == 0) {
+            size_t n = (size_t)(nl - ctx->rbuf);
+            char *frame = malloc(n - zp);
+            if (!frame) return NULL;
+            memcpy(frame, ctx->rbuf + zp, n - zp);
+            ctx->rlen -= n + 1;
+            memmove(ctx->rbuf, nl + 1, ctx->rlen);
+            int rc = net_inflate_line(ctx, frame, n - zp);
+            free(frame);
+            if (rc < 0) return NULL;
+            continue;
+        }
+        if (nl) {
+            size_t n = (size_t)(nl - ctx->rbuf);
+            char *line = malloc(n + 1);
+            if (!line) return NULL;
+            memcpy(line, ctx->rbuf, n); line[n] = '\0';
+            ctx->rlen -= n + 1;
+            memmove(ctx->rbuf, nl + 1, ctx->rlen);
+            return line;
+        }
+        char *nb = realloc(ctx->rbuf, ctx->rlen + NET_READ_CHUNK);
+        if (!nb) return NULL;
+        ctx->rbuf = nb;
+        int n = net_read(ctx, ctx->rbuf + ctx->rlen, NET_READ_CHUNK);
+        if (n <= 0) return NULL;
+        ctx->rlen += (size_t)n;
+    }
+}
+static int64_t net_mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static int64_t stamp(struct json_object *t, const char *key) {
+    struct json_object *v;
+    return json_object_object_get_ex(t, key, &v) ? json_object_get_int64(v) : 0;
+}
+/* Each difference is taken between stamps from one host's clock. */
+static void net_trace_reply(NetContext *ctx, const char *line, int64_t sent, int64_t got) {
+    NetTrace *tr = &ctx->trace;
+    tr->total_us = (long)((got - sent) / 1000);
+    tr->network_us = tr->server_us = tr->device_link_us = tr->device_us = -1;
+    struct json_object *root = json_tokener_parse(line), *t;
+    if (!root) return;
+    if (json_object_object_get_ex(root, "trace", &t)) {
+        int64_t sr = stamp(t, "server_recv"), sro = stamp(t, "server_route");
+        int64_t dr = stamp(t, "device_recv"), dp = stamp(t, "device_reply");
+        int64_t rr = stamp(t, "reply_recv"), rro = stamp(t, "reply_route");
+        int64_t dev = dr && dp ? dp - dr : 0;
+        if (dr && dp) tr->device_us = (long)(dev / 1000);
+        if (sr && sro && rr && rro) {
+            tr->server_us = (long)((sro - sr + rro - rr) / 1000);
+            tr->network_us = (long)((got - sent - (rro - sr)) / 1000);
+        }
+        if (sro && rr) tr->device_link_us = (long)((rr - sro - dev) / 1000);
+    }
+    json_object_put(root);
+}
+static bool net_is_notify(const char *line) {
+    struct json_object *root = json_tokener_parse(line), *type;
+    bool notify = root && json_object_object_get_ex(root, "type", &type) &&
+                  strcmp(json_object_get_string(type), "notify") == 0;
+    json_object_put(root);
+    return notify;
+}
+/* Called with ctx->io_mtx held. A notify read while waiting is not the
+ * reply; it means server state moved, so it only empties the cache. */
+static char* net_round_trip(NetContext *ctx, MessageBuilder *mb, struct json_object *t) {
+    int64_t sent = 0;
+    if (t) {
+        sent = net_mono_ns();
+        json_object_object_add(t, "client_send", json_object_new_int64(sent));
+    }
     char *msg_str = msg_builder_build(mb);
     if (!msg_str) return NULL;
-    send(ctx->sock, msg_str, strlen(msg_str), 0);
-    send(ctx->sock, "\n", 1, 0);
-    free(msg_str);
-    char buffer[4096] = {0};
-    int n = recv(ctx->sock, buffer, 4095, 0);
-    if (n <= 0) return NULL;
-    return strdup(buffer);
+    size_t n = strlen(msg_str);
+    char *frame = realloc(msg_str, n + 1);
+    if (!frame) { free(msg_str); return NULL; }
+    frame[n] = '\n';
+    int rc = net_write_all(ctx, frame, n + 1);
+    free(frame);
+    if (rc < 0) return NULL;
+    char *line;
+    while ((line = net_read_line(ctx)) && net_is_notify(line)) {
+        if (ctx->on_notify) ctx->on_notify(line, ctx->notify_arg);
+        free(line);
+        net_cache_clear(ctx);
+    }
+    if (line && t) net_trace_reply(ctx, line, sent, net_mono_ns());
+    return line;
+}
+/* Called with ctx->io_mtx held. Lines that came while no request was
+ * waiting can only be notifies (device up/down/state), so anything
+ * cached before them is stale. */
+static void net_drain_idle(NetContext *ctx) {
+    for (;;) {
+        bool ready = (ctx->rbuf && memchr(ctx->rbuf, '\n', ctx->rlen)) ||
+                     (ctx->ssl && SSL_pending(ctx->ssl) > 0);
+        if (!ready) {
+            struct pollfd p = {.fd = ctx->sock, .events = POLLIN};
+            if (poll(&p, 1, 0) <= 0) return;
+        }
+        char *line = net_read_line(ctx);
+        if (!line) return;
+        if (ctx->on_notify && net_is_notify(line)) ctx->on_notify(line, ctx->notify_arg);
+        free(line);
+        net_cache_clear(ctx);
+    }
+}
+void net_set_notify_handler(NetContext *ctx, net_notify_fn fn, void *arg) {
+    if (!ctx) return;
+    pthread_mutex_lock(&ctx->io_mtx);
+    ctx->on_notify = fn;
+    ctx->notify_arg = arg;
+    pthread_mutex_unlock(&ctx->io_mtx);
+}
+void net_poll_notify(NetContext *ctx) {
+    if (!ctx || pthread_mutex_trylock(&ctx->io_mtx) != 0) return;
+    if (ctx->sock >= 0) net_drain_idle(ctx);
+    pthread_mutex_unlock(&ctx->io_mtx);
+}
+static bool net_is_cacheable(const char *action) {
+    for (int i = 0; net_cacheable[i]; i++) {
+        if (strcmp(net_cacheable[i], action) == 0) return true;
+    }
+    return false;
+}
+/* Same target, action and payload; the timestamp is left out. */
+static bool net_cache_key(MessageBuilder *mb, char *key, size_t len) {
+    struct json_object *to, *action, *data;
+    if (!json_object_object_get_ex(mb->root, "action", &action) ||
+        !net_is_cacheable(json_object_get_string(action))) return false;
+    const char *ts = json_object_object_get_ex(mb->root, "to", &to) ? json_object_get_string(to) : "";
+    const char *ds = json_object_object_get_ex(mb->root, "data", &data)
+                         ? json_object_to_json_string_ext(data, JSON_C_TO_STRING_PLAIN) : "";
+    int n = snprintf(key, len, "%s|%s|%s", ts, json_object_get_string(action), ds);
+    return n > 0 && (size_t)n < len;
+}
+/* Called with ctx->mtx held. */
+static char* net_cache_get(NetContext *ctx, const char *key) {
+    int64_t now = net_mono_ns();
+    for (int i = 0; i < NET_CACHE_SLOTS; i++) {
+        NetCacheEntry *e = &ctx->cache[i];
+        if (e->line && e->expires_ns > now && strcmp(e->key, key) == 0) return strdup(e->line);
+    }
+    return NULL;
+}
+/* Called with ctx->mtx held. Reuses the same key's slot, else a free one,
+ * else the one closest to expiring. */
+static void net_cache_put(NetContext *ctx, const char *key, const char *line) {
+    NetCacheEntry *slot = NULL;
+    for (int i = 0; i < NET_CACHE_SLOTS; i++) {
+        NetCacheEntry *e = &ctx->cache[i];
+        if (e->line && strcmp(e->key, key) == 0) { slot = e; break; }
+        if (!slot || (slot->line && (!e->line || e->expires_ns < slot->expires_ns))) slot = e;
+    }
+    char *copy = strdup(line);
+    if (!copy) return;
+    free(slot->line);
+    slot->line = copy;
+    snprintf(slot->key, sizeof(slot->key), "%s", key);
+    slot->expires_ns = net_mono_ns() + (int64_t)ctx->cache_ttl_ms * 1000000;
+}
+static void net_flight_put(struct NetFlight *f) {
+    if (--f->refs > 0) return;
+    free(f->line);
+    free(f);
+}
+/* Called with ctx->mtx held. */
+static void net_flight_finish(NetContext *ctx, struct NetFlight *f, const char *line) {
+    for (struct NetFlight **pp = &ctx->flights; *pp; pp = &(*pp)->next) {
+        if (*pp == f) { *pp = f->next; break; }
+    }
+    if (f->refs > 1 && line) f->line = strdup(line);
+    f->done = true;
+    pthread_cond_broadcast(&ctx->flight_cv);
+    net_flight_put(f);
+}
+char* net_send_receive(NetContext *ctx, MessageBuilder *mb) {
+    if (!ctx || ctx->sock < 0 || !mb) return NULL;
+    struct json_object *t = NULL, *id;
+    if (json_object_object_get_ex(mb->root, "trace", &t)) {
+        if (json_object_object_get_ex(t, "id", &id)) {
+            snprintf(ctx->trace.id, sizeof(ctx->trace.id), "%s", json_object_get_string(id));
+        }
+    }
+    char key[NET_KEY_MAX];
+    bool cacheable = !t && net_cache_key(mb, key, sizeof(key));
+    struct NetFlight *f = NULL;
+    /* Busy means a round trip is on the wire and reads them itself. */
+    if (cacheable && pthread_mutex_trylock(&ctx->io_mtx) == 0) {
+        if (ctx->sock >= 0) net_drain_idle(ctx);
+        pthread_mutex_unlock(&ctx->io_mtx);
+    }
+    pthread_mutex_lock(&ctx->mtx);
+    if (cacheable) {
+        char *hit = ctx->cache_ttl_ms ? net_cache_get(ctx, key) : NULL;
+        if (hit) { ctx->cache_hits++; pthread_mutex_unlock(&ctx->mtx); return hit; }
+        for (f = ctx->flights; f && strcmp(f->key, key) != 0; f = f->next) {}
+        if (f) {
+            f->refs++;
+            ctx->coalesced++;
+            while (!f->done) pthread_cond_wait(&ctx->flight_cv, &ctx->mtx);
+            char *line = f->line ? strdup(f->line) : NULL;
+            net_flight_put(f);
+            pthread_mutex_unlock(&ctx->mtx);
+            return line;
+        }
+        f = calloc(1, sizeof(*f));
+        if (f) {
+            snprintf(f->key, sizeof(f->key), "%s", key);
+            f->refs = 1;
+            f->next = ctx->flights;
+            ctx->flights = f;
+        }
+    }
+    unsigned long gen = ctx->cache_gen;
+    pthread_mutex_unlock(&ctx->mtx);
+
+    char *line = NULL;
+    pthread_mutex_lock(&ctx->io_mtx);
+    if (ctx->sock >= 0) line = net_round_trip(ctx, mb, t);
+    pthread_mutex_unlock(&ctx->io_mtx);
+
+    pthread_mutex_lock(&ctx->mtx);
+    if (!cacheable) {
+        /* Anything else may change what the cached requests would return. */
+        net_cache_drop(ctx);
+    } else if (line && ctx->cache_ttl_ms && gen == ctx->cache_gen) {
+        ResponseParser *rp = response_parse(line);
+        if (rp && response_is_success(rp) && !rp->queued) net_cache_put(ctx, key, line);
+        response_free(rp);
+    }
+    if (f) net_flight_finish(ctx, f, line);
+    pthread_mutex_unlock(&ctx->mtx);
+    return line;
 }
 void net_context_free(NetContext *ctx) {
     if (ctx) {
-        if (ctx->sock >= 0) close(ctx->sock);
+        net_close(ctx);
+        if (ctx->session) SSL_SESSION_free(ctx->session);
+        if (ctx->ssl_ctx) SSL_CTX_free(ctx->ssl_ctx);
+        free(ctx->rbuf);
+        net_cache_drop(ctx);
+        pthread_cond_destroy(&ctx->flight_cv);
+        pthread_mutex_destroy(&ctx->io_mtx);
+        pthread_mutex_destroy(&ctx->mtx);
         free(ctx);
     }
 }
@@ -0,0 +1,128 @@
+#define _POSIX_C_SOURCE 200809L
+#include "network_helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <getopt.h>
+#include <openssl/ssl.h>
+
+/* Connection setup and request cost through NetContext: -c connect+login
+ * cycles (resuming the TLS session unless -f), then -r list_devices round
+ * trips on the last connection. Always TCP, and the reply cache is off. */
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char* request(NetContext *ctx, const char *action, const char *password) {
+    MessageBuilder *mb = msg_builder_create("request", "bench", "server", action);
+    if (!mb) return NULL;
+    if (password) msg_builder_add_string(mb, "password", password);
+    char *r = net_send_receive(ctx, mb);
+    msg_builder_free(mb);
+    return r;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -H, --host ADDR      server address (default 127.0.0.1)\n"
+        "  -p, --port PORT      server port (default 6666)\n"
+        "  -a, --ca FILE        use TLS, trusting this CA\n"
+        "  -f, --full           full handshake every time (no resumption)\n"
+        "  -c, --connects N     connect+login cycles (default 300)\n"
+        "  -r, --requests N     requests on one connection (default 20000)\n"
+        "  -P, --password PW    login password (default admin)\n",
+        prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    const char *ca = NULL;
+    const char *password = "admin";
+    int port = 6666;
+    int connects = 300;
+    int requests = 20000;
+    bool full = false;
+
+    static const struct option opts[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"ca", required_argument, NULL, 'a'},
+        {"full", no_argument, NULL, 'f'},
+        {"connects", required_argument, NULL, 'c'},
+        {"requests", required_argument, NULL, 'r'},
+        {"password", required_argument, NULL, 'P'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:a:fc:r:P:h", opts, NULL)) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'a': ca = optarg; break;
+            case 'f': full = true; break;
+            case 'c': connects = atoi(optarg); break;
+            case 'r': requests = atoi(optarg); break;
+            case 'P': password = optarg; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc || connects < 1 || requests < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    setenv("SMARTHOME_UNIX", "", 1);
+    NetContext *ctx = net_context_create("bench");
+    if (!ctx) return 1;
+    net_set_cache_ttl(ctx, 0);
+    if (ca && net_enable_tls(ctx, ca) < 0) {
+        fprintf(stderr, "Cannot load CA %s\n", ca);
+        return 1;
+    }
+
+    int resumed = 0;
+    double start = now_s();
+    for (int i = 0; i < connects; i++) {
+        if (full && ctx->session) {
+            SSL_SESSION_free(ctx->session);
+            ctx->session = NULL;
+        }
+        if (net_connect(ctx, host, port) < 0) {
+            fprintf(stderr, "Connect %d failed\n", i);
+            return 1;
+        }
+        if (ctx->ssl && SSL_session_reused(ctx->ssl)) resumed++;
+        char *r = request(ctx, "login", password);
+        if (!r) {
+            fprintf(stderr, "No login reply on connect %d\n", i);
+            return 1;
+        }
+        free(r);
+    }
+    double elapsed = now_s() - start;
+    printf("%s: %d connect+login in %.2fs (%.0f/s, %d resumed)\n",
+           !ca ? "plaintext" : full ? "TLS full" : "TLS resumed",
+           connects, elapsed, connects / elapsed, resumed);
+
+    start = now_s();
+    for (int i = 0; i < requests; i++) {
+        char *r = request(ctx, "list_devices", NULL);
+        if (!r) {
+            fprintf(stderr, "No reply to request %d\n", i);
+            return 1;
+        }
+        free(r);
+    }
+    elapsed = now_s() - start;
+    if (requests > 0) printf("%d requests in %.2fs (%.0f req/s)\n", requests, elapsed, requests / elapsed);
+    net_context_free(ctx);
+    return 0;
+}
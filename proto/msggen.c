@@ -0,0 +1,262 @@
+/* Generates <out>.h and <out>.c from a message schema:
+ *
+ *   action <name> <high|normal|bulk>
+ *   message <Name>
+ *       <type> <field> [required]
+ *   end
+ *
+ * Types are string(N) (N bytes with the NUL), int, int64, double, bool
+ * and json. Actions become the Action enum in schema order; each message
+ * becomes a struct with a has_ flag per field, its WireMsg table and
+ * <name>_decode / <name>_encode wrappers. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+#define MAX_ACTIONS 64
+#define MAX_MSGS 64
+#define MAX_FIELDS 32
+#define NAME_LEN 64
+
+typedef struct {
+    char name[NAME_LEN];
+    char type[16];
+    int size;
+    bool required;
+} Field;
+
+typedef struct {
+    char name[NAME_LEN];
+    char lower[NAME_LEN * 2];
+    Field fields[MAX_FIELDS];
+    int nfields;
+} Msg;
+
+typedef struct {
+    char name[NAME_LEN];
+    int lane;
+} Act;
+
+static Act acts[MAX_ACTIONS];
+static int nacts;
+static Msg msgs[MAX_MSGS];
+static int nmsgs;
+static const char *schema;
+static int lineno;
+
+static void die(const char *why) {
+    fprintf(stderr, "%s:%d: %s\n", schema, lineno, why);
+    exit(1);
+}
+
+/* LoginReq -> login_req */
+static void snake(const char *in, char *out, size_t n) {
+    size_t o = 0;
+    for (size_t i = 0; in[i] && o + 2 < n; i++) {
+        if (isupper((unsigned char)in[i]) && i > 0) out[o++] = '_';
+        out[o++] = (char)tolower((unsigned char)in[i]);
+    }
+    out[o] = '\0';
+}
+
+static void upper(const char *in, char *out, size_t n) {
+    size_t o = 0;
+    for (; in[o] && o + 1 < n; o++) out[o] = (char)toupper((unsigned char)in[o]);
+    out[o] = '\0';
+}
+
+static const char* c_type(const Field *f) {
+    if (strcmp(f->type, "string") == 0) return "char";
+    if (strcmp(f->type, "int") == 0) return "int";
+    if (strcmp(f->type, "int64") == 0) return "int64_t";
+    if (strcmp(f->type, "double") == 0) return "double";
+    if (strcmp(f->type, "bool") == 0) return "bool";
+    return "struct json_object*";
+}
+
+static const char* wire_type(const Field *f) {
+    if (strcmp(f->type, "string") == 0) return "WIRE_STRING";
+    if (strcmp(f->type, "int") == 0) return "WIRE_INT";
+    if (strcmp(f->type, "int64") == 0) return "WIRE_INT64";
+    if (strcmp(f->type, "double") == 0) return "WIRE_DOUBLE";
+    if (strcmp(f->type, "bool") == 0) return "WIRE_BOOL";
+    return "WIRE_JSON";
+}
+
+static void parse_field(Msg *m, char *type, char *name, char *flag) {
+    if (m->nfields == MAX_FIELDS) die("too many fields");
+    Field *f = &m->fields[m->nfields++];
+    if (!name || strlen(name) >= NAME_LEN) die("bad field name");
+    strcpy(f->name, name);
+    f->required = flag && strcmp(flag, "required") == 0;
+    if (flag && !f->required) die("expected 'required'");
+
+    int size;
+    if (sscanf(type, "string(%d)", &size) == 1) {
+        if (size < 2) die("string size must be at least 2");
+        strcpy(f->type, "string");
+        f->size = size;
+    } else if (!strcmp(type, "int") || !strcmp(type, "int64") || !strcmp(type, "double") ||
+               !strcmp(type, "bool") || !strcmp(type, "json")) {
+        strcpy(f->type, type);
+    } else {
+        die("unknown type");
+    }
+    for (int i = 0; i < m->nfields - 1; i++) {
+        if (strcmp(m->fields[i].name, f->name) == 0) die("duplicate field");
+    }
+}
+
+static void parse(FILE *in) {
+    char line[256];
+    Msg *cur = NULL;
+    while (fgets(line, sizeof(line), in)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *a = strtok(line, " \t\r\n");
+        if (!a) continue;
+        char *b = strtok(NULL, " \t\r\n");
+        char *c = strtok(NULL, " \t\r\n");
+        if (strtok(NULL, " \t\r\n")) die("trailing words");
+
+        if (cur) {
+            if (strcmp(a, "end") == 0) cur = NULL;
+            else parse_field(cur, a, b, c);
+        } else if (strcmp(a, "action") == 0) {
+            static const char *lanes[] = {"high", "normal", "bulk"};
+            if (!b || !c || strlen(b) >= NAME_LEN) die("action <name> <high|normal|bulk>");
+            if (nacts == MAX_ACTIONS) die("too many actions");
+            Act *x = &acts[nacts++];
+            strcpy(x->name, b);
+            x->lane = -1;
+            for (int i = 0; i < 3; i++) if (strcmp(c, lanes[i]) == 0) x->lane = i;
+            if (x->lane < 0) die("action class must be high, normal or bulk");
+        } else if (strcmp(a, "message") == 0) {
+            if (!b || c || strlen(b) >= NAME_LEN) die("message <Name>");
+            if (nmsgs == MAX_MSGS) die("too many messages");
+            cur = &msgs[nmsgs++];
+            strcpy(cur->name, b);
+            snake(b, cur->lower, sizeof(cur->lower));
+        } else {
+            die("expected action or message");
+        }
+    }
+    if (cur) die("message without end");
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(((const Field*)a)->name, ((const Field*)b)->name);
+}
+
+static void emit_header(FILE *h, const char *base) {
+    char guard[NAME_LEN * 2];
+    upper(base, guard, sizeof(guard));
+    fprintf(h, "/* Generated by msggen from %s. Do not edit. */\n", schema);
+    fprintf(h, "#ifndef %s_H\n#define %s_H\n\n#include \"wire.h\"\n\n", guard, guard);
+
+    fprintf(h, "typedef enum {\n");
+    for (int i = 0; i < nacts; i++) {
+        char up[NAME_LEN];
+        upper(acts[i].name, up, sizeof(up));
+        fprintf(h, "    ACT_%s,\n", up);
+    }
+    fprintf(h, "    ACT_COUNT\n} Action;\n\n");
+    fprintf(h, "/* Wire name and outbound lane of each action. */\n");
+    fprintf(h, "extern const WireAction wire_actions[ACT_COUNT];\n");
+
+    for (int i = 0; i < nmsgs; i++) {
+        Msg *m = &msgs[i];
+        fprintf(h, "\ntypedef struct {\n");
+        for (int j = 0; j < m->nfields; j++) {
+            Field *f = &m->fields[j];
+            if (f->size) fprintf(h, "    char %s[%d];\n", f->name, f->size);
+            else fprintf(h, "    %s %s;\n", c_type(f), f->name);
+        }
+        for (int j = 0; j < m->nfields; j++) {
+            fprintf(h, "    bool has_%s;\n", m->fields[j].name);
+        }
+        if (m->nfields == 0) fprintf(h, "    char unused;\n");
+        fprintf(h, "} %s;\n\n", m->name);
+        fprintf(h, "extern const WireMsg %s_msg;\n", m->lower);
+        fprintf(h, "int %s_decode(struct json_object *obj, %s *out, char *err, size_t errlen);\n",
+                m->lower, m->name);
+        fprintf(h, "struct json_object* %s_encode(const %s *in);\n", m->lower, m->name);
+    }
+    fprintf(h, "\n#endif\n");
+}
+
+static void emit_source(FILE *c, const char *base) {
+    fprintf(c, "/* Generated by msggen from %s. Do not edit. */\n", schema);
+    fprintf(c, "#include \"%s.h\"\n#include <stddef.h>\n\n", base);
+
+    fprintf(c, "const WireAction wire_actions[ACT_COUNT] = {\n");
+    for (int i = 0; i < nacts; i++) {
+        fprintf(c, "    {\"%s\", %d},\n", acts[i].name, acts[i].lane);
+    }
+    fprintf(c, "};\n");
+
+    for (int i = 0; i < nmsgs; i++) {
+        Msg *m = &msgs[i];
+        Field sorted[MAX_FIELDS];
+        memcpy(sorted, m->fields, sizeof(Field) * (size_t)m->nfields);
+        qsort(sorted, (size_t)m->nfields, sizeof(Field), by_name);
+
+        if (m->nfields) {
+            fprintf(c, "\nstatic const WireField %s_fields[] = {\n", m->lower);
+            for (int j = 0; j < m->nfields; j++) {
+                Field *f = &sorted[j];
+                fprintf(c, "    {\"%s\", %s, %s, offsetof(%s, %s), sizeof(((%s*)0)->%s), "
+                           "offsetof(%s, has_%s)},\n",
+                        f->name, wire_type(f), f->required ? "true" : "false",
+                        m->name, f->name, m->name, f->name, m->name, f->name);
+            }
+            fprintf(c, "};\n");
+        }
+        fprintf(c, "\nconst WireMsg %s_msg = {\"%s\", sizeof(%s), %d, %s%s};\n",
+                m->lower, m->name, m->name, m->nfields,
+                m->nfields ? m->lower : "NULL", m->nfields ? "_fields" : "");
+        fprintf(c, "\nint %s_decode(struct json_object *obj, %s *out, char *err, size_t errlen) {\n"
+                   "    return wire_decode(&%s_msg, obj, out, err, errlen);\n}\n",
+                m->lower, m->name, m->lower);
+        fprintf(c, "\nstruct json_object* %s_encode(const %s *in) {\n"
+                   "    return wire_encode(&%s_msg, in);\n}\n",
+                m->lower, m->name, m->lower);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <schema> <out>  (writes <out>.h and <out>.c)\n", argv[0]);
+        return 2;
+    }
+    schema = argv[1];
+    FILE *in = fopen(schema, "r");
+    if (!in) {
+        perror(schema);
+        return 1;
+    }
+    parse(in);
+    fclose(in);
+
+    const char *out = argv[2];
+    const char *base = strrchr(out, '/') ? strrchr(out, '/') + 1 : out;
+    char path[512];
+    snprintf(path, sizeof(path), "%s.h", out);
+    FILE *h = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s.c", out);
+    FILE *c = fopen(path, "w");
+    if (!h || !c) {
+        perror(out);
+        return 1;
+    }
+    emit_header(h, base);
+    emit_source(c, base);
+    if (fclose(h) != 0 || fclose(c) != 0) {
+        perror(out);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include "wire.h"
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+static void fail(char *err, size_t n, const char *field, const char *why) {
+    if (err && n) snprintf(err, n, "%s: %s", field, why);
+}
+
+static const WireField* find_field(const WireMsg *m, const char *key) {
+    int lo = 0, hi = m->nfields - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(key, m->fields[mid].name);
+        if (c == 0) return &m->fields[mid];
+        if (c < 0) hi = mid - 1;
+        else lo = mid + 1;
+    }
+    return NULL;
+}
+
+static bool is_number(struct json_object *v) {
+    return json_object_is_type(v, json_type_int) || json_object_is_type(v, json_type_double);
+}
+
+static int set_field(const WireField *f, struct json_object *v, char *base,
+                     char *err, size_t n) {
+    void *p = base + f->off;
+    switch (f->type) {
+        case WIRE_STRING: {
+            if (!json_object_is_type(v, json_type_string)) {
+                fail(err, n, f->name, "expected string");
+                return -1;
+            }
+            size_t len = (size_t)json_object_get_string_len(v);
+            if (len >= f->size) {
+                fail(err, n, f->name, "too long");
+                return -1;
+            }
+            memcpy(p, json_object_get_string(v), len + 1);
+            return 0;
+        }
+        case WIRE_INT: {
+            if (!is_number(v)) break;
+            int64_t x = json_object_get_int64(v);
+            if (x < INT_MIN || x > INT_MAX) {
+                fail(err, n, f->name, "out of range");
+                return -1;
+            }
+            *(int*)p = (int)x;
+            return 0;
+        }
+        case WIRE_INT64:
+            if (!is_number(v)) break;
+            *(int64_t*)p = json_object_get_int64(v);
+            return 0;
+        case WIRE_DOUBLE:
+            if (!is_number(v)) break;
+            *(double*)p = json_object_get_double(v);
+            return 0;
+        case WIRE_BOOL:
+            if (!json_object_is_type(v, json_type_boolean)) {
+                fail(err, n, f->name, "expected bool");
+                return -1;
+            }
+            *(bool*)p = json_object_get_boolean(v);
+            return 0;
+        case WIRE_JSON:
+            *(struct json_object**)p = v;
+            return 0;
+    }
+    fail(err, n, f->name, "expected number");
+    return -1;
+}
+
+int wire_decode(const WireMsg *m, struct json_object *obj, void *out, char *err, size_t errlen) {
+    char *base = out;
+    memset(out, 0, m->size);
+    if (obj && !json_object_is_type(obj, json_type_object)) {
+        fail(err, errlen, "data", "expected object");
+        return -1;
+    }
+
+    if (obj) {
+        json_object_object_foreach(obj, key, val) {
+            if (!val) continue;
+            const WireField *f = find_field(m, key);
+            if (!f) continue;
+            if (set_field(f, val, base, err, errlen) < 0) return -1;
+            *(bool*)(base + f->has_off) = true;
+        }
+    }
+
+    for (int i = 0; i < m->nfields; i++) {
+        const WireField *f = &m->fields[i];
+        if (f->required && !*(bool*)(base + f->has_off)) {
+            fail(err, errlen, f->name, "missing");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct json_object* wire_encode(const WireMsg *m, const void *in) {
+    const char *base = in;
+    struct json_object *obj = json_object_new_object();
+    if (!obj) return NULL;
+
+    for (int i = 0; i < m->nfields; i++) {
+        const WireField *f = &m->fields[i];
+        if (!f->required && !*(const bool*)(base + f->has_off)) continue;
+        const void *p = base + f->off;
+        struct json_object *v = NULL;
+        switch (f->type) {
+            case WIRE_STRING: v = json_object_new_string(p); break;
+            case WIRE_INT: v = json_object_new_int(*(const int*)p); break;
+            case WIRE_INT64: v = json_object_new_int64(*(const int64_t*)p); break;
+            case WIRE_DOUBLE: v = json_object_new_double(*(const double*)p); break;
+            case WIRE_BOOL: v = json_object_new_boolean(*(const bool*)p); break;
+            case WIRE_JSON: v = json_object_get(*(struct json_object* const*)p); break;
+        }
+        json_object_object_add(obj, f->name, v);
+    }
+    return obj;
+}
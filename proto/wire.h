@@ -0,0 +1,54 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <json-c/json.h>
+
+/* Runtime for the payload structs msggen generates from messages.schema.
+ * Each struct has a table of its fields (JSON name, type, offset, size and
+ * the offset of its has_ flag), sorted by name; decoding walks the JSON
+ * object once and stores each known key straight into the struct, so a
+ * handler reads plain fields instead of looking each one up. */
+typedef enum {
+    WIRE_STRING,
+    WIRE_INT,
+    WIRE_INT64,
+    WIRE_DOUBLE,
+    WIRE_BOOL,
+    WIRE_JSON
+} WireType;
+
+typedef struct {
+    const char *name;
+    WireType type;
+    bool required;
+    size_t off;
+    size_t size;
+    size_t has_off;
+} WireField;
+
+typedef struct {
+    const char *name;
+    size_t size;
+    int nfields;
+    const WireField *fields;
+} WireMsg;
+
+typedef struct {
+    const char *name;
+    int lane;
+} WireAction;
+
+/* Fills out from obj (NULL reads as {}). Unknown keys and nulls are
+ * skipped; a wrong type, an over-long string or a missing required field
+ * fails with -1 and a reason in err. Numbers are accepted for any numeric
+ * field. json fields borrow from obj and live as long as it does. */
+int wire_decode(const WireMsg *m, struct json_object *obj, void *out, char *err, size_t errlen);
+
+/* Required fields always, optional ones whose has_ flag is set. json
+ * fields are added with a new ref; the caller keeps its own. */
+struct json_object* wire_encode(const WireMsg *m, const void *in);
+
+#endif
@@ -0,0 +1,367 @@
+/* Generated by msggen from ../proto/messages.schema. Do not edit. */
+#include "messages.h"
+#include <stddef.h>
+
+const WireAction wire_actions[ACT_COUNT] = {
+    {"register", 0},
+    {"login", 0},
+    {"control", 0},
+    {"status", 1},
+    {"heartbeat", 2},
+    {"list_devices", 2},
+    {"change_password", 0},
+    {"cluster_hello", 0},
+    {"cluster_gossip", 2},
+    {"assign_room", 0},
+    {"home_status", 2},
+    {"ota", 1},
+    {"ota_chunk", 2},
+    {"trace", 2},
+    {"stats", 2},
+    {"query_devices", 1},
+    {"device_event", 2},
+};
+
+static const WireField status_resp_fields[] = {
+    {"message", WIRE_STRING, false, offsetof(StatusResp, message), sizeof(((StatusResp*)0)->message), offsetof(StatusResp, has_message)},
+    {"retry_after_ms", WIRE_INT, false, offsetof(StatusResp, retry_after_ms), sizeof(((StatusResp*)0)->retry_after_ms), offsetof(StatusResp, has_retry_after_ms)},
+    {"status", WIRE_STRING, false, offsetof(StatusResp, status), sizeof(((StatusResp*)0)->status), offsetof(StatusResp, has_status)},
+};
+
+const WireMsg status_resp_msg = {"StatusResp", sizeof(StatusResp), 3, status_resp_fields};
+
+int status_resp_decode(struct json_object *obj, StatusResp *out, char *err, size_t errlen) {
+    return wire_decode(&status_resp_msg, obj, out, err, errlen);
+}
+
+struct json_object* status_resp_encode(const StatusResp *in) {
+    return wire_encode(&status_resp_msg, in);
+}
+
+static const WireField register_req_fields[] = {
+    {"compress", WIRE_STRING, false, offsetof(RegisterReq, compress), sizeof(((RegisterReq*)0)->compress), offsetof(RegisterReq, has_compress)},
+    {"device_type", WIRE_STRING, false, offsetof(RegisterReq, device_type), sizeof(((RegisterReq*)0)->device_type), offsetof(RegisterReq, has_device_type)},
+    {"home", WIRE_STRING, false, offsetof(RegisterReq, home), sizeof(((RegisterReq*)0)->home), offsetof(RegisterReq, has_home)},
+    {"room", WIRE_STRING, false, offsetof(RegisterReq, room), sizeof(((RegisterReq*)0)->room), offsetof(RegisterReq, has_room)},
+};
+
+const WireMsg register_req_msg = {"RegisterReq", sizeof(RegisterReq), 4, register_req_fields};
+
+int register_req_decode(struct json_object *obj, RegisterReq *out, char *err, size_t errlen) {
+    return wire_decode(&register_req_msg, obj, out, err, errlen);
+}
+
+struct json_object* register_req_encode(const RegisterReq *in) {
+    return wire_encode(&register_req_msg, in);
+}
+
+static const WireField register_resp_fields[] = {
+    {"compress", WIRE_STRING, false, offsetof(RegisterResp, compress), sizeof(((RegisterResp*)0)->compress), offsetof(RegisterResp, has_compress)},
+    {"device_id", WIRE_STRING, false, offsetof(RegisterResp, device_id), sizeof(((RegisterResp*)0)->device_id), offsetof(RegisterResp, has_device_id)},
+    {"status", WIRE_STRING, true, offsetof(RegisterResp, status), sizeof(((RegisterResp*)0)->status), offsetof(RegisterResp, has_status)},
+    {"udp_key", WIRE_STRING, false, offsetof(RegisterResp, udp_key), sizeof(((RegisterResp*)0)->udp_key), offsetof(RegisterResp, has_udp_key)},
+    {"udp_port", WIRE_INT, false, offsetof(RegisterResp, udp_port), sizeof(((RegisterResp*)0)->udp_port), offsetof(RegisterResp, has_udp_port)},
+};
+
+const WireMsg register_resp_msg = {"RegisterResp", sizeof(RegisterResp), 5, register_resp_fields};
+
+int register_resp_decode(struct json_object *obj, RegisterResp *out, char *err, size_t errlen) {
+    return wire_decode(&register_resp_msg, obj, out, err, errlen);
+}
+
+struct json_object* register_resp_encode(const RegisterResp *in) {
+    return wire_encode(&register_resp_msg, in);
+}
+
+static const WireField login_req_fields[] = {
+    {"compress", WIRE_STRING, false, offsetof(LoginReq, compress), sizeof(((LoginReq*)0)->compress), offsetof(LoginReq, has_compress)},
+    {"password", WIRE_STRING, false, offsetof(LoginReq, password), sizeof(((LoginReq*)0)->password), offsetof(LoginReq, has_password)},
+    {"token", WIRE_STRING, false, offsetof(LoginReq, token), sizeof(((LoginReq*)0)->token), offsetof(LoginReq, has_token)},
+};
+
+const WireMsg login_req_msg = {"LoginReq", sizeof(LoginReq), 3, login_req_fields};
+
+int login_req_decode(struct json_object *obj, LoginReq *out, char *err, size_t errlen) {
+    return wire_decode(&login_req_msg, obj, out, err, errlen);
+}
+
+struct json_object* login_req_encode(const LoginReq *in) {
+    return wire_encode(&login_req_msg, in);
+}
+
+static const WireField login_resp_fields[] = {
+    {"compress", WIRE_STRING, false, offsetof(LoginResp, compress), sizeof(((LoginResp*)0)->compress), offsetof(LoginResp, has_compress)},
+    {"expires_in", WIRE_INT, false, offsetof(LoginResp, expires_in), sizeof(((LoginResp*)0)->expires_in), offsetof(LoginResp, has_expires_in)},
+    {"status", WIRE_STRING, true, offsetof(LoginResp, status), sizeof(((LoginResp*)0)->status), offsetof(LoginResp, has_status)},
+    {"token", WIRE_STRING, false, offsetof(LoginResp, token), sizeof(((LoginResp*)0)->token), offsetof(LoginResp, has_token)},
+};
+
+const WireMsg login_resp_msg = {"LoginResp", sizeof(LoginResp), 4, login_resp_fields};
+
+int login_resp_decode(struct json_object *obj, LoginResp *out, char *err, size_t errlen) {
+    return wire_decode(&login_resp_msg, obj, out, err, errlen);
+}
+
+struct json_object* login_resp_encode(const LoginResp *in) {
+    return wire_encode(&login_resp_msg, in);
+}
+
+static const WireField change_password_req_fields[] = {
+    {"new_password", WIRE_STRING, true, offsetof(ChangePasswordReq, new_password), sizeof(((ChangePasswordReq*)0)->new_password), offsetof(ChangePasswordReq, has_new_password)},
+    {"old_password", WIRE_STRING, true, offsetof(ChangePasswordReq, old_password), sizeof(((ChangePasswordReq*)0)->old_password), offsetof(ChangePasswordReq, has_old_password)},
+};
+
+const WireMsg change_password_req_msg = {"ChangePasswordReq", sizeof(ChangePasswordReq), 2, change_password_req_fields};
+
+int change_password_req_decode(struct json_object *obj, ChangePasswordReq *out, char *err, size_t errlen) {
+    return wire_decode(&change_password_req_msg, obj, out, err, errlen);
+}
+
+struct json_object* change_password_req_encode(const ChangePasswordReq *in) {
+    return wire_encode(&change_password_req_msg, in);
+}
+
+static const WireField cluster_hello_req_fields[] = {
+    {"key", WIRE_STRING, true, offsetof(ClusterHelloReq, key), sizeof(((ClusterHelloReq*)0)->key), offsetof(ClusterHelloReq, has_key)},
+    {"node", WIRE_STRING, true, offsetof(ClusterHelloReq, node), sizeof(((ClusterHelloReq*)0)->node), offsetof(ClusterHelloReq, has_node)},
+};
+
+const WireMsg cluster_hello_req_msg = {"ClusterHelloReq", sizeof(ClusterHelloReq), 2, cluster_hello_req_fields};
+
+int cluster_hello_req_decode(struct json_object *obj, ClusterHelloReq *out, char *err, size_t errlen) {
+    return wire_decode(&cluster_hello_req_msg, obj, out, err, errlen);
+}
+
+struct json_object* cluster_hello_req_encode(const ClusterHelloReq *in) {
+    return wire_encode(&cluster_hello_req_msg, in);
+}
+
+static const WireField cluster_hello_resp_fields[] = {
+    {"node", WIRE_STRING, false, offsetof(ClusterHelloResp, node), sizeof(((ClusterHelloResp*)0)->node), offsetof(ClusterHelloResp, has_node)},
+    {"status", WIRE_STRING, true, offsetof(ClusterHelloResp, status), sizeof(((ClusterHelloResp*)0)->status), offsetof(ClusterHelloResp, has_status)},
+};
+
+const WireMsg cluster_hello_resp_msg = {"ClusterHelloResp", sizeof(ClusterHelloResp), 2, cluster_hello_resp_fields};
+
+int cluster_hello_resp_decode(struct json_object *obj, ClusterHelloResp *out, char *err, size_t errlen) {
+    return wire_decode(&cluster_hello_resp_msg, obj, out, err, errlen);
+}
+
+struct json_object* cluster_hello_resp_encode(const ClusterHelloResp *in) {
+    return wire_encode(&cluster_hello_resp_msg, in);
+}
+
+static const WireField control_req_fields[] = {
+    {"attribute", WIRE_STRING, false, offsetof(ControlReq, attribute), sizeof(((ControlReq*)0)->attribute), offsetof(ControlReq, has_attribute)},
+    {"device_type", WIRE_STRING, false, offsetof(ControlReq, device_type), sizeof(((ControlReq*)0)->device_type), offsetof(ControlReq, has_device_type)},
+    {"state", WIRE_BOOL, false, offsetof(ControlReq, state), sizeof(((ControlReq*)0)->state), offsetof(ControlReq, has_state)},
+};
+
+const WireMsg control_req_msg = {"ControlReq", sizeof(ControlReq), 3, control_req_fields};
+
+int control_req_decode(struct json_object *obj, ControlReq *out, char *err, size_t errlen) {
+    return wire_decode(&control_req_msg, obj, out, err, errlen);
+}
+
+struct json_object* control_req_encode(const ControlReq *in) {
+    return wire_encode(&control_req_msg, in);
+}
+
+static const WireField device_status_fields[] = {
+    {"device_type", WIRE_STRING, false, offsetof(DeviceStatus, device_type), sizeof(((DeviceStatus*)0)->device_type), offsetof(DeviceStatus, has_device_type)},
+    {"power", WIRE_INT, false, offsetof(DeviceStatus, power), sizeof(((DeviceStatus*)0)->power), offsetof(DeviceStatus, has_power)},
+    {"state", WIRE_STRING, false, offsetof(DeviceStatus, state), sizeof(((DeviceStatus*)0)->state), offsetof(DeviceStatus, has_state)},
+    {"status", WIRE_STRING, false, offsetof(DeviceStatus, status), sizeof(((DeviceStatus*)0)->status), offsetof(DeviceStatus, has_status)},
+    {"uptime_today", WIRE_DOUBLE, false, offsetof(DeviceStatus, uptime_today), sizeof(((DeviceStatus*)0)->uptime_today), offsetof(DeviceStatus, has_uptime_today)},
+};
+
+const WireMsg device_status_msg = {"DeviceStatus", sizeof(DeviceStatus), 5, device_status_fields};
+
+int device_status_decode(struct json_object *obj, DeviceStatus *out, char *err, size_t errlen) {
+    return wire_decode(&device_status_msg, obj, out, err, errlen);
+}
+
+struct json_object* device_status_encode(const DeviceStatus *in) {
+    return wire_encode(&device_status_msg, in);
+}
+
+static const WireField list_devices_resp_fields[] = {
+    {"devices", WIRE_JSON, false, offsetof(ListDevicesResp, devices), sizeof(((ListDevicesResp*)0)->devices), offsetof(ListDevicesResp, has_devices)},
+};
+
+const WireMsg list_devices_resp_msg = {"ListDevicesResp", sizeof(ListDevicesResp), 1, list_devices_resp_fields};
+
+int list_devices_resp_decode(struct json_object *obj, ListDevicesResp *out, char *err, size_t errlen) {
+    return wire_decode(&list_devices_resp_msg, obj, out, err, errlen);
+}
+
+struct json_object* list_devices_resp_encode(const ListDevicesResp *in) {
+    return wire_encode(&list_devices_resp_msg, in);
+}
+
+static const WireField device_info_fields[] = {
+    {"id", WIRE_STRING, true, offsetof(DeviceInfo, id), sizeof(((DeviceInfo*)0)->id), offsetof(DeviceInfo, has_id)},
+    {"ip", WIRE_STRING, false, offsetof(DeviceInfo, ip), sizeof(((DeviceInfo*)0)->ip), offsetof(DeviceInfo, has_ip)},
+    {"last_seen", WIRE_INT64, false, offsetof(DeviceInfo, last_seen), sizeof(((DeviceInfo*)0)->last_seen), offsetof(DeviceInfo, has_last_seen)},
+    {"node", WIRE_STRING, false, offsetof(DeviceInfo, node), sizeof(((DeviceInfo*)0)->node), offsetof(DeviceInfo, has_node)},
+    {"power", WIRE_DOUBLE, false, offsetof(DeviceInfo, power), sizeof(((DeviceInfo*)0)->power), offsetof(DeviceInfo, has_power)},
+    {"state", WIRE_STRING, false, offsetof(DeviceInfo, state), sizeof(((DeviceInfo*)0)->state), offsetof(DeviceInfo, has_state)},
+    {"type", WIRE_STRING, false, offsetof(DeviceInfo, type), sizeof(((DeviceInfo*)0)->type), offsetof(DeviceInfo, has_type)},
+};
+
+const WireMsg device_info_msg = {"DeviceInfo", sizeof(DeviceInfo), 7, device_info_fields};
+
+int device_info_decode(struct json_object *obj, DeviceInfo *out, char *err, size_t errlen) {
+    return wire_decode(&device_info_msg, obj, out, err, errlen);
+}
+
+struct json_object* device_info_encode(const DeviceInfo *in) {
+    return wire_encode(&device_info_msg, in);
+}
+
+static const WireField query_devices_req_fields[] = {
+    {"limit", WIRE_INT, false, offsetof(QueryDevicesReq, limit), sizeof(((QueryDevicesReq*)0)->limit), offsetof(QueryDevicesReq, has_limit)},
+    {"online", WIRE_BOOL, false, offsetof(QueryDevicesReq, online), sizeof(((QueryDevicesReq*)0)->online), offsetof(QueryDevicesReq, has_online)},
+    {"power_max", WIRE_DOUBLE, false, offsetof(QueryDevicesReq, power_max), sizeof(((QueryDevicesReq*)0)->power_max), offsetof(QueryDevicesReq, has_power_max)},
+    {"power_min", WIRE_DOUBLE, false, offsetof(QueryDevicesReq, power_min), sizeof(((QueryDevicesReq*)0)->power_min), offsetof(QueryDevicesReq, has_power_min)},
+    {"state", WIRE_STRING, false, offsetof(QueryDevicesReq, state), sizeof(((QueryDevicesReq*)0)->state), offsetof(QueryDevicesReq, has_state)},
+    {"type", WIRE_STRING, false, offsetof(QueryDevicesReq, type), sizeof(((QueryDevicesReq*)0)->type), offsetof(QueryDevicesReq, has_type)},
+};
+
+const WireMsg query_devices_req_msg = {"QueryDevicesReq", sizeof(QueryDevicesReq), 6, query_devices_req_fields};
+
+int query_devices_req_decode(struct json_object *obj, QueryDevicesReq *out, char *err, size_t errlen) {
+    return wire_decode(&query_devices_req_msg, obj, out, err, errlen);
+}
+
+struct json_object* query_devices_req_encode(const QueryDevicesReq *in) {
+    return wire_encode(&query_devices_req_msg, in);
+}
+
+static const WireField device_event_fields[] = {
+    {"device", WIRE_STRING, true, offsetof(DeviceEvent, device), sizeof(((DeviceEvent*)0)->device), offsetof(DeviceEvent, has_device)},
+    {"device_type", WIRE_STRING, false, offsetof(DeviceEvent, device_type), sizeof(((DeviceEvent*)0)->device_type), offsetof(DeviceEvent, has_device_type)},
+    {"event", WIRE_STRING, true, offsetof(DeviceEvent, event), sizeof(((DeviceEvent*)0)->event), offsetof(DeviceEvent, has_event)},
+    {"power", WIRE_DOUBLE, false, offsetof(DeviceEvent, power), sizeof(((DeviceEvent*)0)->power), offsetof(DeviceEvent, has_power)},
+    {"state", WIRE_STRING, false, offsetof(DeviceEvent, state), sizeof(((DeviceEvent*)0)->state), offsetof(DeviceEvent, has_state)},
+};
+
+const WireMsg device_event_msg = {"DeviceEvent", sizeof(DeviceEvent), 5, device_event_fields};
+
+int device_event_decode(struct json_object *obj, DeviceEvent *out, char *err, size_t errlen) {
+    return wire_decode(&device_event_msg, obj, out, err, errlen);
+}
+
+struct json_object* device_event_encode(const DeviceEvent *in) {
+    return wire_encode(&device_event_msg, in);
+}
+
+static const WireField assign_room_req_fields[] = {
+    {"device", WIRE_STRING, true, offsetof(AssignRoomReq, device), sizeof(((AssignRoomReq*)0)->device), offsetof(AssignRoomReq, has_device)},
+    {"home", WIRE_STRING, false, offsetof(AssignRoomReq, home), sizeof(((AssignRoomReq*)0)->home), offsetof(AssignRoomReq, has_home)},
+    {"room", WIRE_STRING, true, offsetof(AssignRoomReq, room), sizeof(((AssignRoomReq*)0)->room), offsetof(AssignRoomReq, has_room)},
+};
+
+const WireMsg assign_room_req_msg = {"AssignRoomReq", sizeof(AssignRoomReq), 3, assign_room_req_fields};
+
+int assign_room_req_decode(struct json_object *obj, AssignRoomReq *out, char *err, size_t errlen) {
+    return wire_decode(&assign_room_req_msg, obj, out, err, errlen);
+}
+
+struct json_object* assign_room_req_encode(const AssignRoomReq *in) {
+    return wire_encode(&assign_room_req_msg, in);
+}
+
+static const WireField home_status_req_fields[] = {
+    {"home", WIRE_STRING, false, offsetof(HomeStatusReq, home), sizeof(((HomeStatusReq*)0)->home), offsetof(HomeStatusReq, has_home)},
+    {"room", WIRE_STRING, false, offsetof(HomeStatusReq, room), sizeof(((HomeStatusReq*)0)->room), offsetof(HomeStatusReq, has_room)},
+};
+
+const WireMsg home_status_req_msg = {"HomeStatusReq", sizeof(HomeStatusReq), 2, home_status_req_fields};
+
+int home_status_req_decode(struct json_object *obj, HomeStatusReq *out, char *err, size_t errlen) {
+    return wire_decode(&home_status_req_msg, obj, out, err, errlen);
+}
+
+struct json_object* home_status_req_encode(const HomeStatusReq *in) {
+    return wire_encode(&home_status_req_msg, in);
+}
+
+static const WireField ota_req_fields[] = {
+    {"devices", WIRE_JSON, false, offsetof(OtaReq, devices), sizeof(((OtaReq*)0)->devices), offsetof(OtaReq, has_devices)},
+    {"image", WIRE_STRING, false, offsetof(OtaReq, image), sizeof(((OtaReq*)0)->image), offsetof(OtaReq, has_image)},
+};
+
+const WireMsg ota_req_msg = {"OtaReq", sizeof(OtaReq), 2, ota_req_fields};
+
+int ota_req_decode(struct json_object *obj, OtaReq *out, char *err, size_t errlen) {
+    return wire_decode(&ota_req_msg, obj, out, err, errlen);
+}
+
+struct json_object* ota_req_encode(const OtaReq *in) {
+    return wire_encode(&ota_req_msg, in);
+}
+
+static const WireField ota_offer_fields[] = {
+    {"chunk", WIRE_INT, true, offsetof(OtaOffer, chunk), sizeof(((OtaOffer*)0)->chunk), offsetof(OtaOffer, has_chunk)},
+    {"image", WIRE_STRING, true, offsetof(OtaOffer, image), sizeof(((OtaOffer*)0)->image), offsetof(OtaOffer, has_image)},
+    {"sha256", WIRE_STRING, true, offsetof(OtaOffer, sha256), sizeof(((OtaOffer*)0)->sha256), offsetof(OtaOffer, has_sha256)},
+    {"size", WIRE_INT64, true, offsetof(OtaOffer, size), sizeof(((OtaOffer*)0)->size), offsetof(OtaOffer, has_size)},
+};
+
+const WireMsg ota_offer_msg = {"OtaOffer", sizeof(OtaOffer), 4, ota_offer_fields};
+
+int ota_offer_decode(struct json_object *obj, OtaOffer *out, char *err, size_t errlen) {
+    return wire_decode(&ota_offer_msg, obj, out, err, errlen);
+}
+
+struct json_object* ota_offer_encode(const OtaOffer *in) {
+    return wire_encode(&ota_offer_msg, in);
+}
+
+static const WireField ota_ack_fields[] = {
+    {"error", WIRE_STRING, false, offsetof(OtaAck, error), sizeof(((OtaAck*)0)->error), offsetof(OtaAck, has_error)},
+    {"offset", WIRE_INT64, false, offsetof(OtaAck, offset), sizeof(((OtaAck*)0)->offset), offsetof(OtaAck, has_offset)},
+    {"status", WIRE_STRING, false, offsetof(OtaAck, status), sizeof(((OtaAck*)0)->status), offsetof(OtaAck, has_status)},
+    {"window", WIRE_INT, false, offsetof(OtaAck, window), sizeof(((OtaAck*)0)->window), offsetof(OtaAck, has_window)},
+};
+
+const WireMsg ota_ack_msg = {"OtaAck", sizeof(OtaAck), 4, ota_ack_fields};
+
+int ota_ack_decode(struct json_object *obj, OtaAck *out, char *err, size_t errlen) {
+    return wire_decode(&ota_ack_msg, obj, out, err, errlen);
+}
+
+struct json_object* ota_ack_encode(const OtaAck *in) {
+    return wire_encode(&ota_ack_msg, in);
+}
+
+static const WireField ota_chunk_fields[] = {
+    {"image", WIRE_STRING, true, offsetof(OtaChunk, image), sizeof(((OtaChunk*)0)->image), offsetof(OtaChunk, has_image)},
+    {"len", WIRE_INT64, true, offsetof(OtaChunk, len), sizeof(((OtaChunk*)0)->len), offsetof(OtaChunk, has_len)},
+    {"offset", WIRE_INT64, true, offsetof(OtaChunk, offset), sizeof(((OtaChunk*)0)->offset), offsetof(OtaChunk, has_offset)},
+};
+
+const WireMsg ota_chunk_msg = {"OtaChunk", sizeof(OtaChunk), 3, ota_chunk_fields};
+
+int ota_chunk_decode(struct json_object *obj, OtaChunk *out, char *err, size_t errlen) {
+    return wire_decode(&ota_chunk_msg, obj, out, err, errlen);
+}
+
+struct json_object* ota_chunk_encode(const OtaChunk *in) {
+    return wire_encode(&ota_chunk_msg, in);
+}
+
+static const WireField trace_req_fields[] = {
+    {"limit", WIRE_INT, false, offsetof(TraceReq, limit), sizeof(((TraceReq*)0)->limit), offsetof(TraceReq, has_limit)},
+};
+
+const WireMsg trace_req_msg = {"TraceReq", sizeof(TraceReq), 1, trace_req_fields};
+
+int trace_req_decode(struct json_object *obj, TraceReq *out, char *err, size_t errlen) {
+    return wire_decode(&trace_req_msg, obj, out, err, errlen);
+}
+
+struct json_object* trace_req_encode(const TraceReq *in) {
+    return wire_encode(&trace_req_msg, in);
+}
@@ -0,0 +1,320 @@
+/* Generated by msggen from ../proto/messages.schema. Do not edit. */
+#ifndef MESSAGES_H
+#define MESSAGES_H
+
+#include "wire.h"
+
+typedef enum {
+    ACT_REGISTER,
+    ACT_LOGIN,
+    ACT_CONTROL,
+    ACT_STATUS,
+    ACT_HEARTBEAT,
+    ACT_LIST_DEVICES,
+    ACT_CHANGE_PASSWORD,
+    ACT_CLUSTER_HELLO,
+    ACT_CLUSTER_GOSSIP,
+    ACT_ASSIGN_ROOM,
+    ACT_HOME_STATUS,
+    ACT_OTA,
+    ACT_OTA_CHUNK,
+    ACT_TRACE,
+    ACT_STATS,
+    ACT_QUERY_DEVICES,
+    ACT_DEVICE_EVENT,
+    ACT_COUNT
+} Action;
+
+/* Wire name and outbound lane of each action. */
+extern const WireAction wire_actions[ACT_COUNT];
+
+typedef struct {
+    char status[32];
+    char message[128];
+    int retry_after_ms;
+    bool has_status;
+    bool has_message;
+    bool has_retry_after_ms;
+} StatusResp;
+
+extern const WireMsg status_resp_msg;
+int status_resp_decode(struct json_object *obj, StatusResp *out, char *err, size_t errlen);
+struct json_object* status_resp_encode(const StatusResp *in);
+
+typedef struct {
+    char device_type[32];
+    char home[32];
+    char room[32];
+    char compress[16];
+    bool has_device_type;
+    bool has_home;
+    bool has_room;
+    bool has_compress;
+} RegisterReq;
+
+extern const WireMsg register_req_msg;
+int register_req_decode(struct json_object *obj, RegisterReq *out, char *err, size_t errlen);
+struct json_object* register_req_encode(const RegisterReq *in);
+
+typedef struct {
+    char status[32];
+    char device_id[32];
+    int udp_port;
+    char udp_key[33];
+    char compress[16];
+    bool has_status;
+    bool has_device_id;
+    bool has_udp_port;
+    bool has_udp_key;
+    bool has_compress;
+} RegisterResp;
+
+extern const WireMsg register_resp_msg;
+int register_resp_decode(struct json_object *obj, RegisterResp *out, char *err, size_t errlen);
+struct json_object* register_resp_encode(const RegisterResp *in);
+
+typedef struct {
+    char password[32];
+    char token[192];
+    char compress[16];
+    bool has_password;
+    bool has_token;
+    bool has_compress;
+} LoginReq;
+
+extern const WireMsg login_req_msg;
+int login_req_decode(struct json_object *obj, LoginReq *out, char *err, size_t errlen);
+struct json_object* login_req_encode(const LoginReq *in);
+
+typedef struct {
+    char status[32];
+    char token[192];
+    int expires_in;
+    char compress[16];
+    bool has_status;
+    bool has_token;
+    bool has_expires_in;
+    bool has_compress;
+} LoginResp;
+
+extern const WireMsg login_resp_msg;
+int login_resp_decode(struct json_object *obj, LoginResp *out, char *err, size_t errlen);
+struct json_object* login_resp_encode(const LoginResp *in);
+
+typedef struct {
+    char old_password[32];
+    char new_password[32];
+    bool has_old_password;
+    bool has_new_password;
+} ChangePasswordReq;
+
+extern const WireMsg change_password_req_msg;
+int change_password_req_decode(struct json_object *obj, ChangePasswordReq *out, char *err, size_t errlen);
+struct json_object* change_password_req_encode(const ChangePasswordReq *in);
+
+typedef struct {
+    char node[32];
+    char key[64];
+    bool has_node;
+    bool has_key;
+} ClusterHelloReq;
+
+extern const WireMsg cluster_hello_req_msg;
+int cluster_hello_req_decode(struct json_object *obj, ClusterHelloReq *out, char *err, size_t errlen);
+struct json_object* cluster_hello_req_encode(const ClusterHelloReq *in);
+
+typedef struct {
+    char status[32];
+    char node[32];
+    bool has_status;
+    bool has_node;
+} ClusterHelloResp;
+
+extern const WireMsg cluster_hello_resp_msg;
+int cluster_hello_resp_decode(struct json_object *obj, ClusterHelloResp *out, char *err, size_t errlen);
+struct json_object* cluster_hello_resp_encode(const ClusterHelloResp *in);
+
+typedef struct {
+    char device_type[16];
+    bool state;
+    char attribute[32];
+    bool has_device_type;
+    bool has_state;
+    bool has_attribute;
+} ControlReq;
+
+extern const WireMsg control_req_msg;
+int control_req_decode(struct json_object *obj, ControlReq *out, char *err, size_t errlen);
+struct json_object* control_req_encode(const ControlReq *in);
+
+typedef struct {
+    char status[32];
+    char device_type[16];
+    char state[16];
+    int power;
+    double uptime_today;
+    bool has_status;
+    bool has_device_type;
+    bool has_state;
+    bool has_power;
+    bool has_uptime_today;
+} DeviceStatus;
+
+extern const WireMsg device_status_msg;
+int device_status_decode(struct json_object *obj, DeviceStatus *out, char *err, size_t errlen);
+struct json_object* device_status_encode(const DeviceStatus *in);
+
+typedef struct {
+    struct json_object* devices;
+    bool has_devices;
+} ListDevicesResp;
+
+extern const WireMsg list_devices_resp_msg;
+int list_devices_resp_decode(struct json_object *obj, ListDevicesResp *out, char *err, size_t errlen);
+struct json_object* list_devices_resp_encode(const ListDevicesResp *in);
+
+typedef struct {
+    char id[32];
+    char type[32];
+    char ip[32];
+    char node[32];
+    int64_t last_seen;
+    char state[16];
+    double power;
+    bool has_id;
+    bool has_type;
+    bool has_ip;
+    bool has_node;
+    bool has_last_seen;
+    bool has_state;
+    bool has_power;
+} DeviceInfo;
+
+extern const WireMsg device_info_msg;
+int device_info_decode(struct json_object *obj, DeviceInfo *out, char *err, size_t errlen);
+struct json_object* device_info_encode(const DeviceInfo *in);
+
+typedef struct {
+    char type[32];
+    char state[16];
+    bool online;
+    double power_min;
+    double power_max;
+    int limit;
+    bool has_type;
+    bool has_state;
+    bool has_online;
+    bool has_power_min;
+    bool has_power_max;
+    bool has_limit;
+} QueryDevicesReq;
+
+extern const WireMsg query_devices_req_msg;
+int query_devices_req_decode(struct json_object *obj, QueryDevicesReq *out, char *err, size_t errlen);
+struct json_object* query_devices_req_encode(const QueryDevicesReq *in);
+
+typedef struct {
+    char device[32];
+    char event[16];
+    char device_type[32];
+    char state[16];
+    double power;
+    bool has_device;
+    bool has_event;
+    bool has_device_type;
+    bool has_state;
+    bool has_power;
+} DeviceEvent;
+
+extern const WireMsg device_event_msg;
+int device_event_decode(struct json_object *obj, DeviceEvent *out, char *err, size_t errlen);
+struct json_object* device_event_encode(const DeviceEvent *in);
+
+typedef struct {
+    char device[32];
+    char home[32];
+    char room[32];
+    bool has_device;
+    bool has_home;
+    bool has_room;
+} AssignRoomReq;
+
+extern const WireMsg assign_room_req_msg;
+int assign_room_req_decode(struct json_object *obj, AssignRoomReq *out, char *err, size_t errlen);
+struct json_object* assign_room_req_encode(const AssignRoomReq *in);
+
+typedef struct {
+    char home[32];
+    char room[32];
+    bool has_home;
+    bool has_room;
+} HomeStatusReq;
+
+extern const WireMsg home_status_req_msg;
+int home_status_req_decode(struct json_object *obj, HomeStatusReq *out, char *err, size_t errlen);
+struct json_object* home_status_req_encode(const HomeStatusReq *in);
+
+typedef struct {
+    char image[64];
+    struct json_object* devices;
+    bool has_image;
+    bool has_devices;
+} OtaReq;
+
+extern const WireMsg ota_req_msg;
+int ota_req_decode(struct json_object *obj, OtaReq *out, char *err, size_t errlen);
+struct json_object* ota_req_encode(const OtaReq *in);
+
+typedef struct {
+    char image[64];
+    int64_t size;
+    char sha256[65];
+    int chunk;
+    bool has_image;
+    bool has_size;
+    bool has_sha256;
+    bool has_chunk;
+} OtaOffer;
+
+extern const WireMsg ota_offer_msg;
+int ota_offer_decode(struct json_object *obj, OtaOffer *out, char *err, size_t errlen);
+struct json_object* ota_offer_encode(const OtaOffer *in);
+
+typedef struct {
+    char status[32];
+    char error[128];
+    int64_t offset;
+    int window;
+    bool has_status;
+    bool has_error;
+    bool has_offset;
+    bool has_window;
+} OtaAck;
+
+extern const WireMsg ota_ack_msg;
+int ota_ack_decode(struct json_object *obj, OtaAck *out, char *err, size_t errlen);
+struct json_object* ota_ack_encode(const OtaAck *in);
+
+typedef struct {
+    char image[64];
+    int64_t offset;
+    int64_t len;
+    bool has_image;
+    bool has_offset;
+    bool has_len;
+} OtaChunk;
+
+extern const WireMsg ota_chunk_msg;
+int ota_chunk_decode(struct json_object *obj, OtaChunk *out, char *err, size_t errlen);
+struct json_object* ota_chunk_encode(const OtaChunk *in);
+
+typedef struct {
+    int limit;
+    bool has_limit;
+} TraceReq;
+
+extern const WireMsg trace_req_msg;
+int trace_req_decode(struct json_object *obj, TraceReq *out, char *err, size_t errlen);
+struct json_object* trace_req_encode(const TraceReq *in);
+
+#endif
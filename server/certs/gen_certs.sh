@@ -0,0 +1,24 @@
+#!/bin/sh
+# Self-signed local CA + server certificate for testing the TLS listener.
+# Usage: ./gen_certs.sh [server-ip-or-name]   (default 127.0.0.1)
+set -e
+cd "$(dirname "$0")"
+
+NAME=${1:-127.0.0.1}
+case "$NAME" in
+    *[!0-9.]*) SAN="DNS:$NAME" ;;
+    *)         SAN="IP:$NAME" ;;
+esac
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes \
+    -keyout ca.key -out ca.pem -days 3650 -subj "/CN=homeserver local CA"
+
+openssl req -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes \
+    -keyout server.key -out server.csr -subj "/CN=$NAME"
+
+printf "subjectAltName=%s,DNS:localhost\n" "$SAN" > server.ext
+openssl x509 -req -in server.csr -CA ca.pem -CAkey ca.key -CAcreateserial \
+    -out server.pem -days 825 -extfile server.ext
+
+rm -f server.csr server.ext ca.srl
+echo "CA: certs/ca.pem  cert: certs/server.pem  key: certs/server.key"
@@ -0,0 +1,20 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#define ADMIT_RATE 2000
+#define ADMIT_BURST 2000
+#define ADMIT_BUCKETS 4096
+/* How long past its slot a deferred registrant's token stays reserved. */
+#define ADMIT_RESERVE_SEC 10
+
+/* Token bucket in front of device registration. When a reconnect storm
+ * drains it, each refused registrant gets its own later slot with a token
+ * already set aside, so the retries arrive spread out instead of as a
+ * second storm and are let in when they do. */
+void admit_init(double rate, double burst);
+
+/* 0 if id may register now, otherwise how many ms to wait. Asking again
+ * before the slot gives the time left, not a new slot. */
+unsigned admit_register(const char *id);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AUTH_TOKEN_LEN 192
+#define AUTH_TOKEN_TTL (24 * 3600)
+
+int auth_init(void);
+int auth_issue(const char *client_id, const char *scope, uint32_t ttl,
+               char *out, size_t out_len);
+bool auth_verify(const char *token, char *client_id, size_t id_len,
+                 char *scope, size_t scope_len);
+/* -1 if no new key could be made; the old one then stays. */
+int auth_rotate_key(void);
+unsigned auth_generation(void);
+
+/* Signing key and generation, handed to a replacement process so tokens
+ * issued here stay valid. Import only before serving. */
+#define AUTH_KEY_BYTES 32
+void auth_export(unsigned char key_out[AUTH_KEY_BYTES], unsigned *gen);
+void auth_import(const unsigned char key_in[AUTH_KEY_BYTES], unsigned gen);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "SHCAP\x01\0\0"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_HDR_LEN 16
+#define CAPTURE_REC_LEN 16
+#define CAPTURE_BUF (1024 * 1024)
+
+/* Record of every inbound frame, for replaying real traffic later. All
+ * integers are little-endian.
+ *
+ *   header: magic[8] | start u64 (wall clock, us)
+ *   record: conn u32 | t u64 (us since start) | len u32 | frame[len]
+ *
+ * conn numbers connections in accept order. A record with len 0 means the
+ * connection closed. Frames are copied into a memory buffer and a
+ * background thread writes full buffers out, so the connection threads
+ * never wait on the disk unless it falls a whole buffer behind. */
+int capture_open(const char *path);
+void capture_close(void);
+void capture_frame(uint32_t conn, const char *frame, size_t len);
+void capture_end(uint32_t conn);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "protocol.h"
+
+#define CLUSTER_MAX_PEERS 16
+#define CLUSTER_LINKS 2
+#define CLUSTER_SYNC_SEC 5
+
+typedef struct {
+    char host[64];
+    int port;
+} PeerAddr;
+
+typedef struct {
+    const char *node;
+    const char *key;
+    PeerAddr peers[CLUSTER_MAX_PEERS];
+    int npeers;
+} ClusterConfig;
+
+typedef void (*cluster_emit_fn)(const char *id, const char *type, void *arg);
+
+int cluster_init(const ClusterConfig *cfg);
+void cluster_stop(void);
+bool cluster_enabled(void);
+const char* cluster_node(void);
+
+bool cluster_accept_peer(const char *node, const char *key);
+void cluster_peer_up(const char *node);
+void cluster_peer_down(const char *node);
+void cluster_apply_gossip(struct json_object *data);
+void cluster_announce(const char *id, const char *type, bool up);
+int cluster_forward(const char *to, const char *js, int lane);
+void cluster_foreach_remote(void (*fn)(const char *id, const char *type,
+                                       const char *node, void *arg), void *arg);
+
+#endif
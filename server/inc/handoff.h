@@ -0,0 +1,23 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <json-c/json.h>
+
+#define HANDOFF_FMT "/tmp/smarthome-%d.handoff"
+#define HANDOFF_MAX_MSG (1024 * 1024)
+
+/* Channel between a running server and its replacement. Every message is
+ * one JSON record, optionally carrying one descriptor (SCM_RIGHTS) on a
+ * SOCK_SEQPACKET socket, so records never split or merge. Only a process
+ * of the same user may connect. */
+int handoff_listen(const char *path);
+int handoff_accept(int lsock);
+int handoff_connect(const char *path);
+
+int handoff_send(int ch, struct json_object *rec, int fd);
+
+/* Next record, with *fd set to the descriptor it carried or -1. NULL on
+ * EOF or error. */
+struct json_object* handoff_recv(int ch, int *fd);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef HOME_H
+#define HOME_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <json-c/json.h>
+
+#define HOME_DEFAULT "home"
+#define ROOM_DEFAULT "unassigned"
+#define HOME_QUERY_LIMIT 100
+#define HOME_QUERY_MAX 1000
+
+/* Home -> room -> device tree. Every room and home keeps running totals
+ * (devices, online, power) that are adjusted on each change, so a status
+ * query reads them instead of walking the devices. */
+void home_device_up(const char *id, const char *type, const char *home, const char *room);
+void home_device_down(const char *id);
+/* Drops an offline device altogether; an online one is left alone. */
+void home_forget(const char *id);
+void home_set_power(const char *id, double watts);
+/* Last reported state ("on", "off", ...), kept while the device is away.
+ * true when it differs from the one before. */
+bool home_set_state(const char *id, const char *state);
+/* Last time anything was heard from the device, over TCP or UDP. */
+void home_touch(const char *id);
+time_t home_last_seen(const char *id);
+/* Last reported state and power; -1 if the device is unknown. */
+int home_device_state(const char *id, char *state, size_t len, double *watts);
+int home_assign(const char *id, const char *home, const char *room);
+/* Where the device sits now; -1 if it was never placed. */
+int home_locate(const char *id, char *home, size_t home_len, char *room, size_t room_len);
+
+/* Totals for one home and each of its rooms, or just one room when room
+ * is given. NULL if the home or room does not exist. */
+struct json_object* home_status(const char *home, const char *room);
+
+/* NULL strings and online < 0 match anything; power is inclusive. */
+typedef struct {
+    const char *type;
+    const char *state;
+    int online;
+    double power_min;
+    double power_max;
+    int limit;
+} HomeQuery;
+
+/* Devices on this node matching q, at most q->limit of them, from the
+ * index kept up to date by the calls above; *count is the number that
+ * match in all. */
+struct json_object* home_query(const HomeQuery *q, int *count);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef LINEBUF_H
+#define LINEBUF_H
+
+#include <stddef.h>
+
+/* Accumulates stream bytes and hands out complete '\n'-terminated lines.
+ * A returned line stays valid until the next linebuf_append(). */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t off;
+    size_t cap;
+    size_t max;
+} LineBuf;
+
+int linebuf_init(LineBuf *lb, size_t max);
+int linebuf_append(LineBuf *lb, const char *data, size_t n);
+char* linebuf_next(LineBuf *lb, size_t *line_len);
+void linebuf_free(LineBuf *lb);
+
+#endif
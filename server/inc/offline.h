@@ -0,0 +1,45 @@
+#ifndef OFFLINE_H
+#define OFFLINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define OFFLINE_TTL 600
+#define OFFLINE_MAX_PER_DEV 32
+#define OFFLINE_LATE_SEC 30
+
+/* Requests for registered devices that are offline wait here until the
+ * device registers again or their TTL runs out. Entries with the same
+ * key replace each other, so the queue holds desired state rather than
+ * every toggle that happened while the device was away. */
+void offline_init(unsigned ttl_sec);
+unsigned offline_ttl(void);
+
+/* 1 replaced an older entry (its sender copied to superseded),
+ * 0 queued, -1 the device's queue is full. */
+int offline_put(const char *dev, const char *key, const char *from,
+                const char *js, char *superseded, size_t superseded_len);
+
+/* Removes the device's unexpired entries and returns them as one buffer of
+ * '\n'-separated frames for the caller to free, or NULL if there are none. */
+char* offline_take(const char *dev, int *count);
+
+/* Every unexpired entry, in delivery order per device, for a process
+ * upgrade; the new process puts them back with offline_restore(). */
+typedef void (*offline_visit_fn)(const char *dev, const char *key, const char *from,
+                                 time_t expires, const char *js, void *arg);
+void offline_foreach(offline_visit_fn fn, void *arg);
+int offline_restore(const char *dev, const char *key, const char *from, time_t expires,
+                    const char *js);
+
+/* Senders of parked requests were already answered "queued", so the
+ * device's reply to a delivered one is late. True (once per delivered
+ * request, oldest first, for OFFLINE_LATE_SEC) if a reply from dev to
+ * "to" is such a reply. */
+bool offline_late_reply(const char *dev, const char *to);
+typedef void (*offline_late_fn)(const char *dev, const char *to, time_t expires, void *arg);
+void offline_foreach_late(offline_late_fn fn, void *arg);
+void offline_restore_late(const char *dev, const char *to, time_t expires);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef OTA_H
+#define OTA_H
+
+#include <stdbool.h>
+#include <json-c/json.h>
+#include "outq.h"
+
+#define OTA_CHUNK 4096
+#define OTA_WINDOW 4
+#define OTA_MAX_WINDOW 64
+#define OTA_BUCKETS 1024
+
+/* Firmware rollout from --firmware-dir. The server offers an image to a
+ * device ("ota" request: image, size, sha256, chunk); the device answers
+ * with the offset it already holds and how many chunks it can take
+ * unacknowledged ("ota" response: offset, window). Each chunk is an
+ * "ota_chunk" notify line (image, offset, len) followed by len raw bytes.
+ * Every acknowledgement opens the window again, and a device that comes
+ * back after a drop is re-offered the image and resumes from its offset.
+ * Devices on the same image share one open file, and chunks go out with
+ * sendfile(), so a rollout costs a few counters per device, not a copy of
+ * the image. */
+int ota_init(const char *dir);
+bool ota_enabled(void);
+
+/* Starts (or restarts) a rollout of image to dev; q is NULL if the device
+ * is offline, in which case the offer goes out when it registers. */
+int ota_offer(const char *dev, OutQ *q, const char *image);
+void ota_device_up(const char *dev, OutQ *q);
+void ota_reply(const char *dev, OutQ *q, struct json_object *data);
+
+/* Progress of every rollout: device, image, offset, size, state. */
+struct json_object* ota_status(void);
+
+#endif
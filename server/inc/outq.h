@@ -0,0 +1,112 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "tls.h"
+#include "zframe.h"
+
+#define OUTQ_KEY_LEN 48
+#define OUTQ_ACK_TIMEOUT_MS 2000
+#define OUTQ_LANES 3
+/* Bytes a queue may hold before bulk frames are shed and, if that is not
+ * enough, the consumer is disconnected. */
+#define OUTQ_MAX_BYTES (4 * 1024 * 1024)
+
+typedef struct OutItem {
+    struct OutItem *next;
+    char *buf;
+    size_t len;
+    char key[OUTQ_KEY_LEN];
+    char from[32];
+    bool gated;
+    bool deflate;
+    int lane;
+    /* Raw file range that follows buf on the wire; release(arg) runs when
+     * the item is freed, sent or not. */
+    int file_fd;
+    off_t file_off;
+    size_t file_len;
+    void (*release)(void *arg);
+    void *release_arg;
+    /* Bytes of buf, then of the file range, already written. */
+    size_t sent;
+} OutItem;
+
+/* Per-connection outbound queue. Every write to a socket goes through here,
+ * so senders on different threads never interleave frames. The queue owns
+ * the socket (and its TLS state) and closes it on the last unref. Gated items are
+ * requests to a device: only one is in flight until the device answers, and
+ * pending ones with the same key are replaced by the newest. Items wait in
+ * one of OUTQ_LANES FIFO lanes; lane 0 is always drained first, so a
+ * command is never stuck behind a backlog of bulk frames. Writes never
+ * block: what a full socket does not take stays in cur, and a flusher
+ * thread sends the rest once the socket drains. */
+typedef struct OutQ {
+    int sock;
+    TlsConn *tls;
+    int refs;
+    pthread_mutex_t mtx;
+    OutItem *head[OUTQ_LANES];
+    OutItem *tail[OUTQ_LANES];
+    int pending;
+    size_t bytes;
+    OutItem *cur;
+    bool flushing;
+    bool awaiting;
+    bool closed;
+    bool dirty;
+    bool timed;
+    bool watched;
+    uint64_t await_until;
+    uint64_t coalesced;
+    uint64_t shed;
+    ZFrame *z;
+    void (*wake)(struct OutQ *q);
+    void *loop;
+    /* Pool jobs queued or running for this connection; see offload(). */
+    atomic_int jobs;
+} OutQ;
+
+OutQ* outq_new(int sock);
+OutQ* outq_ref(OutQ *q);
+void outq_unref(OutQ *q);
+int outq_push(OutQ *q, const char *js, int lane, const char *key, bool gated,
+              const char *from, char *superseded, size_t superseded_len);
+/* Header line js, then len bytes of fd from off, back to back with no
+ * other frame between them. Plain connections use sendfile(), so the
+ * bytes go from the page cache to the socket without a user-space copy;
+ * the event loop and non-kTLS TLS read them into a buffer instead. Never
+ * deflated. On -1 the caller still owns arg. */
+int outq_push_file(OutQ *q, const char *js, int lane, int fd, off_t off, size_t len,
+                   void (*release)(void *arg), void *arg);
+void outq_ack(OutQ *q);
+void outq_kick(OutQ *q);
+/* ms until the request awaiting its ack times out while frames wait
+ * behind it, 0 if that is due now, -1 if nothing is held up (or another
+ * thread is flushing and will see it). Without q->wake the flusher thread
+ * kicks such a queue when it is due; the event loop arms its own. */
+int outq_ack_wait(OutQ *q);
+void outq_close(OutQ *q);
+
+/* Closes the queue without touching the socket, waits out a write already
+ * in progress and passes each frame still queued (newline included) to
+ * fn, lane by lane, oldest first; a frame the socket only took part of
+ * comes first, as its unsent rest. For handing the connection to another process. */
+typedef void (*outq_item_fn)(const OutItem *it, void *arg);
+void outq_detach(OutQ *q, outq_item_fn fn, void *arg);
+
+/* Items pushed from now on are deflated when they go out (see zframe.h);
+ * anything already queued is still sent plain. */
+int outq_enable_deflate(OutQ *q);
+
+/* Event-loop side: with q->wake set, pushes do not write to the socket;
+ * they call wake() once and the loop drains the queue with take/done. */
+OutItem* outq_take(OutQ *q);
+void outq_done(OutQ *q, OutItem *it, bool ok);
+
+#endif
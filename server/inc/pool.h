@@ -0,0 +1,26 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+
+#define POOL_MAX_WORKERS 64
+#define POOL_LANES 3
+
+/* Work-stealing pool for handlers too heavy to run on an I/O thread. Each
+ * worker owns a deque: it takes its newest job first and, when empty,
+ * steals the oldest job from another worker. Submissions from outside the
+ * pool are spread round-robin. Every worker keeps one deque per lane and
+ * looks through lane 0 everywhere, stealing included, before lane 1. */
+typedef void (*pool_fn)(void *arg);
+
+/* workers < 0 means one per online CPU; 0 leaves the pool off. */
+int pool_init(int workers);
+bool pool_enabled(void);
+
+/* -1 when the pool is off or stopping; the caller then runs fn itself. */
+int pool_submit(pool_fn fn, void *arg, int lane);
+
+/* Runs what is already queued, then joins the workers. */
+void pool_stop(void);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <json-c/json.h>
+#include "messages.h"
 
 typedef enum {
     MSG_REQUEST,
@@ -10,15 +11,37 @@ typedef enum {
     MSG_NOTIFY
 } MsgType;
 
+/* Delivery class. PRIO_DEFAULT means the action's own class; a sender
+ * can override it with a top-level "priority": "high"/"normal"/"bulk". */
 typedef enum {
-    ACT_REGISTER,
-    ACT_LOGIN,
-    ACT_CONTROL,
-    ACT_STATUS,
-    ACT_HEARTBEAT,
-    ACT_LIST_DEVICES,
-    ACT_CHANGE_PASSWORD
-} Action;
+    PRIO_DEFAULT,
+    PRIO_HIGH,
+    PRIO_NORMAL,
+    PRIO_BULK
+} Prio;
+
+/* Hops of a traced request and its reply, each a CLOCK_MONOTONIC reading
+ * in ns on the host that stamped it. Only differences between stamps from
+ * the same host mean anything. */
+typedef enum {
+    TS_CLIENT_SEND,
+    TS_SERVER_RECV,
+    TS_SERVER_ROUTE,
+    TS_DEVICE_RECV,
+    TS_DEVICE_REPLY,
+    TS_REPLY_RECV,
+    TS_REPLY_ROUTE,
+    TS_COUNT
+} TraceStamp;
+
+#define TRACE_ID_LEN 17
+
+/* Optional "trace": {"id": ..., "<stamp>": ns, ...}; id[0] == 0 when the
+ * message carries none. */
+typedef struct {
+    char id[TRACE_ID_LEN];
+    uint64_t ns[TS_COUNT];
+} TraceCtx;
 
 typedef struct {
     MsgType type;
@@ -26,6 +49,8 @@ typedef struct {
     char to[32];
     Action action;
     uint64_t timestamp;
+    Prio prio;
+    TraceCtx trace;
     void *data;
 } Message;
 
@@ -34,5 +59,11 @@ char* create_msg(Message *m);
 void free_msg(Message *m);
 const char* type_str(MsgType t);
 const char* action_str(Action a);
+const char* stamp_str(TraceStamp s);
+
+/* Outbound lane, 0 (interactive) to 2 (bulk): the action's class from
+ * messages.schema, or the message's own override. */
+int action_lane(Action a);
+int msg_lane(const Message *m);
 
 #endif
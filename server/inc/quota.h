@@ -0,0 +1,36 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+#include <stdbool.h>
+#include <json-c/json.h>
+
+#define QUOTA_RATE 50
+#define QUOTA_CLASSES 3
+#define QUOTA_SLOTS 1024
+#define QUOTA_PROBE 16
+#define QUOTA_NOTICE_MS 1000
+#define QUOTA_TOP 10
+/* Stats name of the bucket shared by identities that found no slot. */
+#define QUOTA_SHARED_ID "*"
+
+/* Per-identity token buckets, one per action class (high, normal, bulk;
+ * see the schema). An identity is a logged-in id, so every connection
+ * under that id shares its buckets, or "#<address>" before login. rate is messages per second in each
+ * class, 0 turns quotas off and < 0 means QUOTA_RATE; burst < 1 means
+ * twice the rate. */
+void quota_init(double rate, double burst);
+bool quota_enabled(void);
+
+/* 0 if id may send one more message of class cls now, otherwise how many
+ * ms until it may. *notify is set on the first refusal per class in each
+ * QUOTA_NOTICE_MS, so a flood logs one line per window, not one per
+ * refused message. */
+unsigned quota_take(const char *id, int cls, bool *notify);
+
+/* Time throttled connections spent held back. */
+void quota_count_pause(unsigned ms);
+
+/* Settings, throttled counts per class and the most throttled identities. */
+struct json_object* quota_stats(void);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdbool.h>
+#include "server.h"
+
+/* Initial index size; the table doubles as entries are added. */
+#define REG_BUCKETS 32
+#define REG_MAX_READERS 256
+#define REG_SHARDS 64
+/* reg_expire does its sweep at most this often. */
+#define REG_SWEEP_SEC 10
+
+/* Device/client registry. Readers walk an immutable snapshot inside an
+ * epoch-protected section and never take a lock; writers copy the current
+ * snapshot of the id's shard, publish the new one and free the old after
+ * every reader that might still see it has left. Each entry holds a ref on
+ * its OutQ, so a queue found by a reader outlives the lookup. */
+typedef void (*reg_visit_fn)(const Conn *c, void *arg);
+
+int reg_init(void);
+/* -1 when out of memory: the id is then not routable. */
+int reg_upsert(const Conn *c);
+/* Takes id offline if its entry still holds q; a client's entry is
+ * removed. True if it did either. */
+bool reg_drop(const char *id, OutQ *q);
+/* Forgets devices offline for ttl_sec or more, passing each to fn (may be
+ * NULL) first; returns how many. Does nothing if the last sweep was less
+ * than REG_SWEEP_SEC ago. */
+int reg_expire(unsigned ttl_sec, reg_visit_fn fn, void *arg);
+OutQ* reg_lookup(const char *id, bool *is_dev);
+bool reg_is_device(const char *id);
+/* The UDP nonce of a known device's registration, 0 if it has none. */
+uint64_t reg_udp_nonce(const char *id);
+void reg_foreach(reg_visit_fn fn, void *arg);
+/* Devices that registered once and are not connected now. */
+void reg_foreach_offline(reg_visit_fn fn, void *arg);
+
+#endif
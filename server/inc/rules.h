@@ -0,0 +1,22 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <json-c/json.h>
+
+#define RULES_SENDER "rules"
+
+/* Automation rules loaded from a JSON file:
+ *   {"rules": [{"name": "porch",
+ *               "when": {"device": "ESP32_a", "attribute": "state", "equals": "on"},
+ *               "window": {"from": "18:00", "to": "06:00"},
+ *               "then": [{"device": "ESP32_b", "data": {"state": false}}]}]}
+ * "when" takes one of equals/above/below. A rule fires when its condition
+ * becomes true, not on every report while it stays true. */
+typedef void (*rule_emit_fn)(const char *rule, const char *device,
+                             struct json_object *data, void *arg);
+
+int rules_load(const char *path);
+void rules_eval(const char *device, struct json_object *data,
+                rule_emit_fn emit, void *arg);
+
+#endif
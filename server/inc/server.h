@@ -3,12 +3,24 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "outq.h"
+#include "tls.h"
+#include "cluster.h"
+#include "linebuf.h"
+#include <netinet/in.h>
 
 #define PORT 6666
-#define MAX_CONN 10
 #define BUF_SIZE 4096
+#define MAX_FRAME (64 * 1024)
+#define SRV_BACKLOG 32768
+#define CONN_STACK_SIZE (256 * 1024)
+#define SRV_NOTSENT_LOWAT (16 * 1024)
+/* uid, port: a directory only the server's user can enter. */
+#define SRV_UNIX_FMT "/tmp/smarthome-%u/%d.sock"
+#define SRV_MAX_JOBS 4
 
-typedef struct {
+typedef struct Conn {
     int sock;
     char id[32];
     char ip[32];
@@ -16,13 +28,64 @@ typedef struct {
     pthread_t tid;
     bool online;
     bool is_dev;
+    bool is_peer;
+    bool local;
     bool logged_in;
+    unsigned auth_gen;
+    char scope[16];
     char device_type[32];
+    uint32_t serial;
+    /* Mixed into the UDP key; new on every registration. */
+    uint64_t udp_nonce;
+    TlsConn *tls;
+    OutQ *q;
+    /* Threads backend only: every connection thread, for a process upgrade. */
+    struct Conn *live_prev;
+    struct Conn *live_next;
+    bool parked;
+    /* Taken over from the previous process, still plain, with the bytes
+     * it had read past the last complete frame. */
+    bool adopted;
+    char *resume;
+    size_t resume_len;
+    /* Over quota: lines are held back until this CLOCK_MONOTONIC ms. */
+    uint64_t hold_until;
 } Conn;
 
-int srv_init(void);
-void srv_start(void);
+typedef struct {
+    int port;
+    const char *tls_cert;
+    const char *tls_key;
+    const char *io_backend;
+    int backlog;
+    double register_rate;
+    double register_burst;
+    double msg_rate;
+    double msg_burst;
+    unsigned offline_ttl;
+    const char *rules_file;
+    int udp_port;
+    const char *capture_file;
+    int workers;
+    const char *unix_path;
+    bool takeover;
+    const char *firmware_dir;
+    ClusterConfig cluster;
+} SrvConfig;
+
+int srv_init(const SrvConfig *cfg);
+int srv_start(void);
 void srv_stop(void);
+void srv_foreach_local(cluster_emit_fn fn, void *arg);
+
+struct json_object;
+void srv_device_report(const char *id, struct json_object *data);
+
+/* Connection lifecycle shared by the I/O backends. */
+Conn* srv_conn_open(int sock, const struct sockaddr_in *addr);
+/* Lines held back by a quota hold stay in lb; feed n = 0 when it ends. */
+int srv_conn_feed(Conn *c, LineBuf *lb, const char *data, size_t n);
+void srv_conn_close(Conn *c);
 
 #endif
 
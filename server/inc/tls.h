@@ -0,0 +1,26 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct TlsConn TlsConn;
+
+int tls_server_init(const char *cert_file, const char *key_file);
+bool tls_enabled(void);
+void tls_server_cleanup(void);
+
+TlsConn* tls_accept(int sock);
+ssize_t tls_read(TlsConn *t, void *buf, size_t len);
+/* Non-blocking: bytes written, 0 when the socket is full (*events is what
+ * to poll for; retry with the same buf), -1 on error. */
+ssize_t tls_write_some(TlsConn *t, const void *buf, size_t len, short *events);
+/* The same for len bytes of fd from off, which the kernel encrypts
+ * straight from the page cache; kTLS only. */
+ssize_t tls_sendfile_some(TlsConn *t, int fd, off_t off, size_t len, short *events);
+bool tls_ktls_send(TlsConn *t);
+bool tls_resumed(TlsConn *t);
+void tls_free(TlsConn *t);
+
+#endif
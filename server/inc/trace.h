@@ -0,0 +1,24 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <json-c/json.h>
+#include "protocol.h"
+
+#define TRACE_RING 1024
+
+/* Latency tracing for requests that carry a trace context. The server
+ * stamps when it reads each leg and when it routes it on; the first server
+ * on a leg stamps it and cluster peers leave it alone, so both stamps of a
+ * leg come from the same clock. A reply routed here completes the span,
+ * which is kept in a ring of the last TRACE_RING until someone asks for
+ * them with the "trace" action. */
+uint64_t trace_now(void);
+void trace_recv(Message *m, uint64_t now);
+void trace_route(Message *m);
+
+/* The newest limit spans, oldest first, with the per-hop times that can
+ * be worked out from their stamps. */
+struct json_object* trace_export(int limit);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UDP_BATCH 64
+#define UDP_MAX_DGRAM 512
+#define UDP_KEY_LEN 16
+#define UDP_MAC_LEN 16
+#define UDP_SECRET_LEN 32
+
+/* Optional datagram channel for device heartbeats and telemetry, so the
+ * TCP stream only carries control. Layout (multi-byte fields big-endian):
+ *
+ *   'S' 'H' | ver=1 | kind (1 heartbeat, 2 telemetry) | seq u32 |
+ *   id_len u8 | id | [count u8 | count x (key_len u8 | key | tag | value)] |
+ *   mac[16]
+ *
+ * tag 'n' is an i32 in thousandths, 'b' a u8 boolean, 's' a u8 length and
+ * bytes. mac is HMAC-SHA256 over everything before it, truncated, keyed
+ * with the per-device key handed out in the register response. Every
+ * registration gets a fresh key, so seq starts over from 1 with it and
+ * must increase after that, which stops replays. */
+int udp_start(int port);
+void udp_stop(void);
+int udp_port(void);
+
+/* For a process upgrade: stop reading and hand back the socket, and
+ * resume on one passed in with the secret the device keys came from.
+ * The last seq seen per key goes across too, restored before adopting. */
+typedef void (*udp_seq_fn)(const char *id, uint64_t nonce, uint32_t seq, void *arg);
+int udp_detach(void);
+void udp_secret(unsigned char out[UDP_SECRET_LEN]);
+void udp_foreach_seq(udp_seq_fn fn, void *arg);
+void udp_restore_seq(const char *id, uint64_t nonce, uint32_t seq);
+int udp_adopt(int fd, const unsigned char key[UDP_SECRET_LEN]);
+
+/* A new registration's nonce, 0 when UDP is off (no key is handed out). */
+uint64_t udp_nonce(void);
+/* Hex key for device id under nonce, for the register response. */
+int udp_device_key(const char *id, uint64_t nonce, char *hex, size_t len);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef URING_H
+#define URING_H
+
+#define URING_ENTRIES 4096
+#define URING_BUFS 4096
+#define URING_BUF_SIZE 2048
+
+/* -1 when the kernel lacks io_uring, provided buffer rings or multishot
+ * recv (6.0+); the caller stays on threads. */
+int uring_init(void);
+/* Runs the loop after uring_init; returns -1 only if io_uring_enter fails. */
+int uring_run(int listen_sock, int unix_sock);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef ZFRAME_H
+#define ZFRAME_H
+
+#include <stddef.h>
+
+#define ZFRAME_MIN 512
+#define ZFRAME_PREFIX "Z:"
+
+/* Outbound deflate for connections that asked for it at login/register.
+ * One raw-deflate stream lives for the whole connection and every frame
+ * ends in a sync flush, so later frames reuse the history of earlier ones
+ * (repeated list_devices shrink to a few bytes). A compressed frame is
+ * "Z:" + base64(deflate bytes) + "\n"; the receiver must inflate the Z:
+ * frames in order through one stream. Frames under ZFRAME_MIN stay plain. */
+typedef struct ZFrame ZFrame;
+
+ZFrame* zframe_new(void);
+void zframe_free(ZFrame *z);
+
+/* frame is a '\n'-terminated line. Returns a new malloc'd line, or NULL to
+ * send the original unchanged. */
+char* zframe_encode(ZFrame *z, const char *frame, size_t len, size_t *out_len);
+
+#endif
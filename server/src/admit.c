@@ -0,0 +1,104 @@
+#include "admit.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+/* A deferred registrant's slot. Its token was taken when the slot was
+ * handed out, so coming back on time costs nothing. Slots only grow, so
+ * the list is oldest first and stale ones come off the head. */
+typedef struct Resv {
+    char id[32];
+    double slot;
+    struct Resv *prev, *next;
+    struct Resv *chain;
+} Resv;
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static double rate = ADMIT_RATE;
+static double burst = ADMIT_BURST;
+static double tokens = ADMIT_BURST;
+static double last;
+static Resv *buckets[ADMIT_BUCKETS];
+static Resv *oldest, *newest;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned hash_id(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h % ADMIT_BUCKETS;
+}
+
+static Resv** find(const char *id) {
+    Resv **pp = &buckets[hash_id(id)];
+    while (*pp && strcmp((*pp)->id, id) != 0) pp = &(*pp)->chain;
+    return pp;
+}
+
+static void unlink_resv(Resv *r) {
+    Resv **pp = find(r->id);
+    *pp = r->chain;
+    if (r->prev) r->prev->next = r->next;
+    else oldest = r->next;
+    if (r->next) r->next->prev = r->prev;
+    else newest = r->prev;
+    free(r);
+}
+
+static void expire(double now) {
+    while (oldest && oldest->slot + ADMIT_RESERVE_SEC < now) unlink_resv(oldest);
+}
+
+void admit_init(double r, double b) {
+    pthread_mutex_lock(&mtx);
+    rate = r > 0 ? r : ADMIT_RATE;
+    burst = b >= 1 ? b : rate;
+    tokens = burst;
+    last = now_sec();
+    while (oldest) unlink_resv(oldest);
+    pthread_mutex_unlock(&mtx);
+}
+
+unsigned admit_register(const char *id) {
+    pthread_mutex_lock(&mtx);
+    double now = now_sec();
+    tokens += (now - last) * rate;
+    if (tokens > burst) tokens = burst;
+    last = now;
+    expire(now);
+
+    unsigned wait_ms = 0;
+    Resv *r = *find(id);
+    if (r) {
+        if (r->slot <= now) unlink_resv(r);
+        else wait_ms = (unsigned)((r->slot - now) * 1000) + 1;
+    } else if (tokens >= 1) {
+        tokens -= 1;
+    } else {
+        /* Take the token now and let the bucket go into debt: the slot
+         * is when the refill has paid it back, one interval after the
+         * slot handed out before. */
+        tokens -= 1;
+        double slot = now - tokens / rate;
+        wait_ms = (unsigned)((slot - now) * 1000) + 1;
+        r = calloc(1, sizeof(Resv));
+        if (r) {
+            snprintf(r->id, sizeof(r->id), "%s", id);
+            r->slot = slot;
+            Resv **pp = find(id);
+            *pp = r;
+            r->prev = newest;
+            if (newest) newest->next = r;
+            else oldest = r;
+            newest = r;
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+    return wait_ms;
+}
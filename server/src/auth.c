@@ -0,0 +1,190 @@
+#include "auth.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+/* Token: "<b64url(id|scope|exp)>.<b64url(hmac-sha256)>". Everything needed
+ * to check it is in the token itself, so verification is one HMAC and a
+ * constant-time compare with no table lookup. */
+
+#define KEY_WORDS 4
+#define MAC_LEN 32
+#define PAYLOAD_MAX 96
+
+_Static_assert(KEY_WORDS * 8 == AUTH_KEY_BYTES, "key size");
+
+static _Atomic uint64_t key[KEY_WORDS];
+static atomic_uint key_seq;
+static pthread_mutex_t key_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static const char b64url[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static size_t b64_encode(const unsigned char *in, size_t n, char *out) {
+    size_t o = 0;
+    for (size_t i = 0; i < n; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16;
+        if (i + 1 < n) v |= (uint32_t)in[i + 1] << 8;
+        if (i + 2 < n) v |= in[i + 2];
+        out[o++] = b64url[(v >> 18) & 63];
+        out[o++] = b64url[(v >> 12) & 63];
+        if (i + 1 < n) out[o++] = b64url[(v >> 6) & 63];
+        if (i + 2 < n) out[o++] = b64url[v & 63];
+    }
+    out[o] = '\0';
+    return o;
+}
+
+static int b64_val(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '-') return 62;
+    if (c == '_') return 63;
+    return -1;
+}
+
+static int b64_decode(const char *in, size_t n, unsigned char *out, size_t cap) {
+    size_t o = 0;
+    uint32_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < n; i++) {
+        int v = b64_val(in[i]);
+        if (v < 0) return -1;
+        acc = (acc << 6) | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (o >= cap) return -1;
+            out[o++] = (unsigned char)(acc >> bits);
+        }
+    }
+    return (int)o;
+}
+
+/* -1 without touching the current key when there is no randomness. */
+static int set_key(void) {
+    uint64_t k[KEY_WORDS];
+    if (RAND_bytes((unsigned char*)k, sizeof(k)) != 1) return -1;
+
+    pthread_mutex_lock(&key_mtx);
+    atomic_fetch_add_explicit(&key_seq, 1, memory_order_acq_rel);
+    for (int i = 0; i < KEY_WORDS; i++) {
+        atomic_store_explicit(&key[i], k[i], memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&key_seq, 1, memory_order_release);
+    pthread_mutex_unlock(&key_mtx);
+    return 0;
+}
+
+/* Seqlock read: verifiers never block each other or the rotation. */
+static unsigned load_key(uint64_t k[KEY_WORDS]) {
+    unsigned s1, s2;
+    do {
+        s1 = atomic_load_explicit(&key_seq, memory_order_acquire);
+        for (int i = 0; i < KEY_WORDS; i++) {
+            k[i] = atomic_load_explicit(&key[i], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        s2 = atomic_load_explicit(&key_seq, memory_order_relaxed);
+    } while ((s1 & 1) || s1 != s2);
+    return s1 / 2;
+}
+
+static void sign(const unsigned char *msg, size_t n, unsigned char mac[MAC_LEN]) {
+    uint64_t k[KEY_WORDS];
+    load_key(k);
+    unsigned int len = MAC_LEN;
+    HMAC(EVP_sha256(), k, sizeof(k), msg, n, mac, &len);
+}
+
+int auth_init(void) {
+    return set_key();
+}
+
+int auth_issue(const char *client_id, const char *scope, uint32_t ttl,
+               char *out, size_t out_len) {
+    if (strchr(client_id, '|') || strchr(scope, '|')) return -1;
+
+    char payload[PAYLOAD_MAX];
+    unsigned long long exp = (unsigned long long)time(NULL) + ttl;
+    int n = snprintf(payload, sizeof(payload), "%s|%s|%llu", client_id, scope, exp);
+    if (n < 0 || (size_t)n >= sizeof(payload)) return -1;
+
+    unsigned char mac[MAC_LEN];
+    sign((const unsigned char*)payload, (size_t)n, mac);
+
+    char p64[PAYLOAD_MAX * 4 / 3 + 4];
+    char m64[MAC_LEN * 4 / 3 + 4];
+    b64_encode((const unsigned char*)payload, (size_t)n, p64);
+    b64_encode(mac, MAC_LEN, m64);
+
+    n = snprintf(out, out_len, "%s.%s", p64, m64);
+    return (n < 0 || (size_t)n >= out_len) ? -1 : 0;
+}
+
+bool auth_verify(const char *token, char *client_id, size_t id_len,
+                 char *scope, size_t scope_len) {
+    if (!token) return false;
+    const char *dot = strchr(token, '.');
+    if (!dot) return false;
+
+    unsigned char payload[PAYLOAD_MAX];
+    unsigned char mac[MAC_LEN];
+    int pn = b64_decode(token, (size_t)(dot - token), payload, sizeof(payload) - 1);
+    int mn = b64_decode(dot + 1, strlen(dot + 1), mac, sizeof(mac));
+    if (pn <= 0 || mn != MAC_LEN) return false;
+
+    unsigned char expect[MAC_LEN];
+    sign(payload, (size_t)pn, expect);
+    if (CRYPTO_memcmp(mac, expect, MAC_LEN) != 0) return false;
+
+    payload[pn] = '\0';
+    char *id = (char*)payload;
+    char *sc = strchr(id, '|');
+    if (!sc) return false;
+    *sc++ = '\0';
+    char *ex = strchr(sc, '|');
+    if (!ex) return false;
+    *ex++ = '\0';
+
+    unsigned long long exp = strtoull(ex, NULL, 10);
+    if (exp < (unsigned long long)time(NULL)) return false;
+
+    if (client_id) snprintf(client_id, id_len, "%s", id);
+    if (scope) snprintf(scope, scope_len, "%s", sc);
+    return true;
+}
+
+int auth_rotate_key(void) {
+    return set_key();
+}
+
+unsigned auth_generation(void) {
+    return atomic_load_explicit(&key_seq, memory_order_acquire) / 2;
+}
+
+void auth_export(unsigned char key_out[AUTH_KEY_BYTES], unsigned *gen) {
+    uint64_t k[KEY_WORDS];
+    *gen = load_key(k);
+    memcpy(key_out, k, sizeof(k));
+}
+
+void auth_import(const unsigned char key_in[AUTH_KEY_BYTES], unsigned gen) {
+    uint64_t k[KEY_WORDS];
+    memcpy(k, key_in, sizeof(k));
+
+    pthread_mutex_lock(&key_mtx);
+    for (int i = 0; i < KEY_WORDS; i++) {
+        atomic_store_explicit(&key[i], k[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&key_seq, gen * 2, memory_order_release);
+    pthread_mutex_unlock(&key_mtx);
+}
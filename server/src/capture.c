@@ -0,0 +1,146 @@
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static pthread_t tid;
+static FILE *out;
+static bool running;
+static bool writing;
+static unsigned char *fill;
+static unsigned char *spare;
+static size_t fill_len;
+static uint64_t start_us;
+
+static uint64_t mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void put_le(unsigned char *p, uint64_t v, int n) {
+    for (int i = 0; i < n; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+/* Swaps the buffers under mtx and writes the full one without it. */
+static void* writer_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&mtx);
+    for (;;) {
+        while (running && fill_len == 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&wake, &mtx, &ts);
+        }
+        if (fill_len == 0) break;
+
+        unsigned char *buf = fill;
+        size_t len = fill_len;
+        fill = spare;
+        fill_len = 0;
+        writing = true;
+        pthread_cond_broadcast(&drained);
+        pthread_mutex_unlock(&mtx);
+
+        if (fwrite(buf, 1, len, out) != len) perror("capture write");
+        fflush(out);
+
+        pthread_mutex_lock(&mtx);
+        spare = buf;
+        writing = false;
+        pthread_cond_broadcast(&drained);
+    }
+    pthread_mutex_unlock(&mtx);
+    return NULL;
+}
+
+/* Frames hold passwords and tokens: the file is the owner's alone, also
+ * when it already existed with a wider mode. */
+int capture_open(const char *path) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd < 0 || fchmod(fd, 0600) < 0 || !(out = fdopen(fd, "wb"))) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    fill = malloc(CAPTURE_BUF);
+    spare = malloc(CAPTURE_BUF);
+    if (!fill || !spare) {
+        free(fill);
+        free(spare);
+        fclose(out);
+        out = NULL;
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned char hdr[CAPTURE_HDR_LEN];
+    memcpy(hdr, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    put_le(hdr + 8, (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000, 8);
+    fwrite(hdr, 1, sizeof(hdr), out);
+    start_us = mono_us();
+
+    running = true;
+    if (pthread_create(&tid, NULL, writer_thread, NULL) != 0) {
+        perror("pthread_create");
+        running = false;
+        fclose(out);
+        out = NULL;
+        return -1;
+    }
+    printf("Capturing inbound frames to %s\n", path);
+    return 0;
+}
+
+static void append(uint32_t conn, const char *frame, size_t len) {
+    if (!out || CAPTURE_REC_LEN + len > CAPTURE_BUF) return;
+    uint64_t t = mono_us() - start_us;
+
+    pthread_mutex_lock(&mtx);
+    while (running && fill_len + CAPTURE_REC_LEN + len > CAPTURE_BUF) {
+        /* The writer still has the spare; wait for it to come back. */
+        pthread_cond_signal(&wake);
+        pthread_cond_wait(&drained, &mtx);
+    }
+    if (running) {
+        unsigned char *p = fill + fill_len;
+        put_le(p, conn, 4);
+        put_le(p + 4, t, 8);
+        put_le(p + 12, len, 4);
+        memcpy(p + CAPTURE_REC_LEN, frame, len);
+        fill_len += CAPTURE_REC_LEN + len;
+        if (fill_len > CAPTURE_BUF / 2 && !writing) pthread_cond_signal(&wake);
+    }
+    pthread_mutex_unlock(&mtx);
+}
+
+void capture_frame(uint32_t conn, const char *frame, size_t len) {
+    if (len > 0) append(conn, frame, len);
+}
+
+void capture_end(uint32_t conn) {
+    append(conn, NULL, 0);
+}
+
+void capture_close(void) {
+    if (!out) return;
+    pthread_mutex_lock(&mtx);
+    running = false;
+    pthread_cond_broadcast(&wake);
+    pthread_cond_broadcast(&drained);
+    pthread_mutex_unlock(&mtx);
+    pthread_join(tid, NULL);
+    fclose(out);
+    out = NULL;
+}
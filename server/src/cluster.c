@@ -0,0 +1,538 @@
+#include "cluster.h"
+#include "server.h"
+#include "outq.h"
+#include "linebuf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <json-c/json.h>
+#include <openssl/crypto.h>
+
+/* Each node owns its local connections and tells its peers which ids it
+ * holds: a delta on every register/disconnect, plus a full sync every
+ * CLUSTER_SYNC_SEC to repair anything lost. route_msg() asks the
+ * directory for ids that are not local and forwards the frame over a
+ * pooled link to the owning node. Frames received from a peer are only
+ * ever delivered locally, so nothing loops. */
+
+#define DIR_BUCKETS 4096
+#define SYNC_CHUNK 256
+#define LINK_MAX_FRAME (64 * 1024)
+
+typedef struct DirEntry {
+    struct DirEntry *next;
+    char id[32];
+    char type[32];
+    int node;
+    unsigned stamp;
+} DirEntry;
+
+typedef struct {
+    char name[32];
+    int inbound;
+    unsigned sync;
+} NodeInfo;
+
+typedef struct {
+    PeerAddr addr;
+    char name[32];
+    pthread_mutex_t mtx;
+    OutQ *links[CLUSTER_LINKS];
+    int socks[CLUSTER_LINKS];
+} Peer;
+
+typedef struct {
+    Peer *peer;
+    int slot;
+} LinkArg;
+
+static bool enabled = false;
+static atomic_bool running;
+static char self[32];
+static char cluster_key[64];
+
+static Peer peers[CLUSTER_MAX_PEERS];
+static int npeers = 0;
+static LinkArg link_args[CLUSTER_MAX_PEERS][CLUSTER_LINKS];
+
+static DirEntry *dir[DIR_BUCKETS];
+static NodeInfo nodes[CLUSTER_MAX_PEERS * 2];
+static int nnodes = 0;
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static atomic_uint sync_seq;
+
+static unsigned hash_id(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+}
+
+/* Called with dir_lock held for writing. */
+static int node_index(const char *name) {
+    for (int i = 0; i < nnodes; i++) {
+        if (strcmp(nodes[i].name, name) == 0) return i;
+    }
+    if (nnodes >= (int)(sizeof(nodes) / sizeof(nodes[0]))) return -1;
+    snprintf(nodes[nnodes].name, sizeof(nodes[nnodes].name), "%s", name);
+    return nnodes++;
+}
+
+static DirEntry** dir_slot(const char *id) {
+    DirEntry **pp = &dir[hash_id(id) % DIR_BUCKETS];
+    while (*pp && strcmp((*pp)->id, id) != 0) pp = &(*pp)->next;
+    return pp;
+}
+
+static void dir_set(const char *id, const char *type, int node, unsigned stamp) {
+    DirEntry **pp = dir_slot(id);
+    DirEntry *e = *pp;
+    if (!e) {
+        e = calloc(1, sizeof(DirEntry));
+        if (!e) return;
+        snprintf(e->id, sizeof(e->id), "%s", id);
+        *pp = e;
+    }
+    snprintf(e->type, sizeof(e->type), "%s", type ? type : "");
+    e->node = node;
+    e->stamp = stamp;
+}
+
+static void dir_del(const char *id, int node) {
+    DirEntry **pp = dir_slot(id);
+    DirEntry *e = *pp;
+    if (e && e->node == node) {
+        *pp = e->next;
+        free(e);
+    }
+}
+
+/* Drops entries of `node`; with keep_stamp set, only those not refreshed
+ * by the sync round that just finished. */
+static void dir_purge(int node, bool keep_stamp, unsigned stamp) {
+    for (int b = 0; b < DIR_BUCKETS; b++) {
+        DirEntry **pp = &dir[b];
+        while (*pp) {
+            DirEntry *e = *pp;
+            if (e->node == node && (!keep_stamp || e->stamp != stamp)) {
+                *pp = e->next;
+                free(e);
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+}
+
+static Peer* peer_by_name(const char *name) {
+    for (int i = 0; i < npeers; i++) {
+        pthread_mutex_lock(&peers[i].mtx);
+        bool match = strcmp(peers[i].name, name) == 0;
+        pthread_mutex_unlock(&peers[i].mtx);
+        if (match) return &peers[i];
+    }
+    return NULL;
+}
+
+static OutQ* peer_link(Peer *p, unsigned h) {
+    OutQ *q = NULL;
+    pthread_mutex_lock(&p->mtx);
+    for (int i = 0; i < CLUSTER_LINKS && !q; i++) {
+        OutQ *l = p->links[(h + (unsigned)i) % CLUSTER_LINKS];
+        if (l) q = outq_ref(l);
+    }
+    pthread_mutex_unlock(&p->mtx);
+    return q;
+}
+
+static char* gossip_msg(struct json_object *d) {
+    Message m = {0};
+    m.type = MSG_NOTIFY;
+    snprintf(m.from, sizeof(m.from), "%s", self);
+    snprintf(m.to, sizeof(m.to), "cluster");
+    m.action = ACT_CLUSTER_GOSSIP;
+    m.timestamp = time(NULL);
+    m.data = d;
+    return create_msg(&m);
+}
+
+static void push_js(OutQ *q, const char *js, int lane) {
+    if (q && js) outq_push(q, js, lane, NULL, false, NULL, NULL, 0);
+}
+
+typedef struct {
+    OutQ *q;
+    unsigned seq;
+    struct json_object *up;
+} SyncCtx;
+
+static void sync_flush(SyncCtx *s, bool last) {
+    struct json_object *d = json_object_new_object();
+    json_object_object_add(d, "node", json_object_new_string(self));
+    json_object_object_add(d, "sync", json_object_new_int64(s->seq));
+    json_object_object_add(d, "last", json_object_new_boolean(last));
+    json_object_object_add(d, "up", s->up);
+    s->up = json_object_new_array();
+
+    char *js = gossip_msg(d);
+    push_js(s->q, js, action_lane(ACT_CLUSTER_GOSSIP));
+    free(js);
+    json_object_put(d);
+}
+
+static void sync_emit(const char *id, const char *type, void *arg) {
+    SyncCtx *s = arg;
+    struct json_object *e = json_object_new_array();
+    json_object_array_add(e, json_object_new_string(id));
+    json_object_array_add(e, json_object_new_string(type));
+    json_object_array_add(s->up, e);
+    if (json_object_array_length(s->up) >= SYNC_CHUNK) sync_flush(s, false);
+}
+
+static void send_full_sync(OutQ *q) {
+    SyncCtx s = {.q = q, .seq = atomic_fetch_add(&sync_seq, 1) + 1,
+                 .up = json_object_new_array()};
+    srv_foreach_local(sync_emit, &s);
+    sync_flush(&s, true);
+    json_object_put(s.up);
+}
+
+static int dial(const PeerAddr *a) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", a->port);
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    if (getaddrinfo(a->host, port, &hints, &res) != 0) return -1;
+
+    int s = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s < 0) continue;
+        if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(res);
+
+    if (s >= 0) {
+        int one = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return s;
+}
+
+static bool read_hello(int s, LineBuf *lb, char *name, size_t name_len) {
+    char buf[4096];
+    char *line;
+    while ((line = linebuf_next(lb, NULL)) == NULL) {
+        ssize_t n = recv(s, buf, sizeof(buf), 0);
+        if (n <= 0 || linebuf_append(lb, buf, (size_t)n) < 0) return false;
+    }
+
+    Message *m = parse_msg(line);
+    if (!m) return false;
+
+    bool ok = false;
+    struct json_object *st, *node;
+    if (m->action == ACT_CLUSTER_HELLO &&
+        json_object_object_get_ex(m->data, "status", &st) &&
+        strcmp(json_object_get_string(st), "success") == 0 &&
+        json_object_object_get_ex(m->data, "node", &node)) {
+        snprintf(name, name_len, "%s", json_object_get_string(node));
+        ok = true;
+    }
+    free_msg(m);
+    return ok;
+}
+
+static void* link_thread(void *arg) {
+    LinkArg *la = arg;
+    Peer *p = la->peer;
+    int delay = 200;
+
+    while (atomic_load(&running)) {
+        int s = dial(&p->addr);
+        if (s < 0) {
+            sleep_ms(delay);
+            if (delay < 5000) delay *= 2;
+            continue;
+        }
+
+        OutQ *q = outq_new(s);
+        if (!q) {
+            close(s);
+            sleep_ms(delay);
+            continue;
+        }
+
+        struct json_object *d = json_object_new_object();
+        json_object_object_add(d, "node", json_object_new_string(self));
+        json_object_object_add(d, "key", json_object_new_string(cluster_key));
+        Message hello = {.type = MSG_REQUEST, .action = ACT_CLUSTER_HELLO,
+                         .timestamp = (uint64_t)time(NULL), .data = d};
+        snprintf(hello.from, sizeof(hello.from), "%s", self);
+        snprintf(hello.to, sizeof(hello.to), "cluster");
+        char *js = create_msg(&hello);
+        push_js(q, js, msg_lane(&hello));
+        free(js);
+        json_object_put(d);
+
+        LineBuf lb;
+        char name[32];
+        if (linebuf_init(&lb, LINK_MAX_FRAME) < 0 ||
+            !read_hello(s, &lb, name, sizeof(name))) {
+            printf("[CLUSTER] Handshake with %s:%d failed\n", p->addr.host, p->addr.port);
+            linebuf_free(&lb);
+            outq_unref(q);
+            sleep_ms(delay);
+            if (delay < 5000) delay *= 2;
+            continue;
+        }
+        delay = 200;
+
+        pthread_mutex_lock(&p->mtx);
+        snprintf(p->name, sizeof(p->name), "%s", name);
+        p->links[la->slot] = outq_ref(q);
+        p->socks[la->slot] = s;
+        pthread_mutex_unlock(&p->mtx);
+        printf("[CLUSTER] Link %d to %s (%s:%d) up\n", la->slot, name,
+               p->addr.host, p->addr.port);
+
+        if (la->slot == 0) send_full_sync(q);
+
+        /* Links are one-way; the peer writes nothing after the hello. */
+        char buf[4096];
+        while (atomic_load(&running) && recv(s, buf, sizeof(buf), 0) > 0) {}
+
+        pthread_mutex_lock(&p->mtx);
+        p->links[la->slot] = NULL;
+        p->socks[la->slot] = -1;
+        pthread_mutex_unlock(&p->mtx);
+        printf("[CLUSTER] Link %d to %s down\n", la->slot, name);
+
+        outq_close(q);
+        outq_unref(q);
+        outq_unref(q);
+        linebuf_free(&lb);
+    }
+    return NULL;
+}
+
+static void* sync_thread(void *arg) {
+    (void)arg;
+    while (atomic_load(&running)) {
+        sleep_ms(CLUSTER_SYNC_SEC * 1000);
+        for (int i = 0; i < npeers; i++) {
+            OutQ *q = peer_link(&peers[i], 0);
+            if (q) {
+                send_full_sync(q);
+                outq_unref(q);
+            }
+        }
+    }
+    return NULL;
+}
+
+int cluster_init(const ClusterConfig *cfg) {
+    if (cfg->npeers == 0) return 0;
+    if (!cfg->key || !cfg->key[0]) {
+        fprintf(stderr, "[CLUSTER] --peer needs a non-empty --cluster-key\n");
+        return -1;
+    }
+
+    snprintf(self, sizeof(self), "%s", cfg->node);
+    snprintf(cluster_key, sizeof(cluster_key), "%s", cfg->key ? cfg->key : "");
+    atomic_store(&running, true);
+    enabled = true;
+
+    npeers = cfg->npeers;
+    for (int i = 0; i < npeers; i++) {
+        peers[i].addr = cfg->peers[i];
+        pthread_mutex_init(&peers[i].mtx, NULL);
+        for (int l = 0; l < CLUSTER_LINKS; l++) {
+            peers[i].socks[l] = -1;
+            link_args[i][l] = (LinkArg){.peer = &peers[i], .slot = l};
+
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, link_thread, &link_args[i][l]) != 0) {
+                perror("pthread_create");
+                return -1;
+            }
+            pthread_detach(tid);
+        }
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, sync_thread, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(tid);
+
+    printf("Cluster node %s, %d peer(s)\n", self, npeers);
+    return 0;
+}
+
+void cluster_stop(void) {
+    if (!enabled) return;
+    atomic_store(&running, false);
+    for (int i = 0; i < npeers; i++) {
+        pthread_mutex_lock(&peers[i].mtx);
+        for (int l = 0; l < CLUSTER_LINKS; l++) {
+            if (peers[i].socks[l] >= 0) shutdown(peers[i].socks[l], SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&peers[i].mtx);
+    }
+}
+
+bool cluster_enabled(void) {
+    return enabled;
+}
+
+const char* cluster_node(void) {
+    return self;
+}
+
+bool cluster_accept_peer(const char *node, const char *key) {
+    if (!enabled || !node || !key || strcmp(node, self) == 0) return false;
+    size_t n = strlen(cluster_key);
+    return n > 0 && strlen(key) == n && CRYPTO_memcmp(key, cluster_key, n) == 0;
+}
+
+void cluster_peer_up(const char *node) {
+    pthread_rwlock_wrlock(&dir_lock);
+    int idx = node_index(node);
+    if (idx >= 0) nodes[idx].inbound++;
+    pthread_rwlock_unlock(&dir_lock);
+}
+
+void cluster_peer_down(const char *node) {
+    pthread_rwlock_wrlock(&dir_lock);
+    int idx = node_index(node);
+    if (idx >= 0 && --nodes[idx].inbound <= 0) {
+        nodes[idx].inbound = 0;
+        dir_purge(idx, false, 0);
+        printf("[CLUSTER] Node %s gone, directory entries dropped\n", node);
+    }
+    pthread_rwlock_unlock(&dir_lock);
+}
+
+void cluster_apply_gossip(struct json_object *data) {
+    struct json_object *node_obj, *v;
+    if (!json_object_object_get_ex(data, "node", &node_obj)) return;
+    const char *node = json_object_get_string(node_obj);
+    if (strcmp(node, self) == 0) return;
+
+    pthread_rwlock_wrlock(&dir_lock);
+    int idx = node_index(node);
+    if (idx < 0) {
+        pthread_rwlock_unlock(&dir_lock);
+        return;
+    }
+
+    if (json_object_object_get_ex(data, "sync", &v)) {
+        nodes[idx].sync = (unsigned)json_object_get_int64(v);
+    }
+    unsigned stamp = nodes[idx].sync;
+
+    if (json_object_object_get_ex(data, "up", &v)) {
+        size_t n = json_object_array_length(v);
+        for (size_t i = 0; i < n; i++) {
+            struct json_object *e = json_object_array_get_idx(v, i);
+            struct json_object *id = json_object_array_get_idx(e, 0);
+            struct json_object *type = json_object_array_get_idx(e, 1);
+            if (id) dir_set(json_object_get_string(id),
+                            type ? json_object_get_string(type) : "", idx, stamp);
+        }
+    }
+    if (json_object_object_get_ex(data, "down", &v)) {
+        size_t n = json_object_array_length(v);
+        for (size_t i = 0; i < n; i++) {
+            dir_del(json_object_get_string(json_object_array_get_idx(v, i)), idx);
+        }
+    }
+    if (json_object_object_get_ex(data, "last", &v) && json_object_get_boolean(v)) {
+        dir_purge(idx, true, stamp);
+    }
+    pthread_rwlock_unlock(&dir_lock);
+}
+
+void cluster_announce(const char *id, const char *type, bool up) {
+    if (!enabled) return;
+
+    struct json_object *d = json_object_new_object();
+    json_object_object_add(d, "node", json_object_new_string(self));
+    struct json_object *arr = json_object_new_array();
+    if (up) {
+        struct json_object *e = json_object_new_array();
+        json_object_array_add(e, json_object_new_string(id));
+        json_object_array_add(e, json_object_new_string(type ? type : ""));
+        json_object_array_add(arr, e);
+        json_object_object_add(d, "up", arr);
+    } else {
+        json_object_array_add(arr, json_object_new_string(id));
+        json_object_object_add(d, "down", arr);
+    }
+
+    char *js = gossip_msg(d);
+    for (int i = 0; i < npeers; i++) {
+        OutQ *q = peer_link(&peers[i], 0);
+        if (q) {
+            push_js(q, js, action_lane(ACT_CLUSTER_GOSSIP));
+            outq_unref(q);
+        }
+    }
+    free(js);
+    json_object_put(d);
+}
+
+int cluster_forward(const char *to, const char *js, int lane) {
+    if (!enabled) return -1;
+
+    char node[32] = "";
+    pthread_rwlock_rdlock(&dir_lock);
+    DirEntry *e = *dir_slot(to);
+    if (e) snprintf(node, sizeof(node), "%s", nodes[e->node].name);
+    pthread_rwlock_unlock(&dir_lock);
+    if (!node[0]) return -1;
+
+    Peer *p = peer_by_name(node);
+    if (!p) return -1;
+
+    /* Same destination, same link: keeps per-device ordering. */
+    OutQ *q = peer_link(p, hash_id(to));
+    if (!q) return -1;
+    int rc = outq_push(q, js, lane, NULL, false, NULL, NULL, 0);
+    outq_unref(q);
+    return rc < 0 ? -1 : 0;
+}
+
+void cluster_foreach_remote(void (*fn)(const char *id, const char *type,
+                                       const char *node, void *arg), void *arg) {
+    if (!enabled) return;
+    pthread_rwlock_rdlock(&dir_lock);
+    for (int b = 0; b < DIR_BUCKETS; b++) {
+        for (DirEntry *e = dir[b]; e; e = e->next) {
+            fn(e->id, e->type, nodes[e->node].name, arg);
+        }
+    }
+    pthread_rwlock_unlock(&dir_lock);
+}
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static int make_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return -1;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static void size_buffers(int s) {
+    int sz = HANDOFF_MAX_MSG * 2;
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (make_addr(path, &addr) < 0) return -1;
+
+    int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s < 0) {
+        perror("handoff socket");
+        return -1;
+    }
+    unlink(path);
+    mode_t old = umask(077);
+    int rc = bind(s, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old);
+    if (rc < 0 || listen(s, 1) < 0) {
+        perror(path);
+        close(s);
+        return -1;
+    }
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+    return s;
+}
+
+int handoff_accept(int lsock) {
+    int ch = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+    if (ch < 0) return -1;
+
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(ch, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid()) {
+        fprintf(stderr, "[UPGRADE] Refused handoff to uid %d\n", (int)cred.uid);
+        close(ch);
+        return -1;
+    }
+    size_buffers(ch);
+    return ch;
+}
+
+int handoff_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (make_addr(path, &addr) < 0) return -1;
+
+    int ch = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (ch < 0) return -1;
+    size_buffers(ch);
+    if (connect(ch, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(ch);
+        return -1;
+    }
+    return ch;
+}
+
+int handoff_send(int ch, struct json_object *rec, int fd) {
+    size_t len;
+    const char *js = json_object_to_json_string_length(rec, JSON_C_TO_STRING_PLAIN, &len);
+    if (!js || len > HANDOFF_MAX_MSG) return -1;
+
+    struct iovec iov = {.iov_base = (void*)js, .iov_len = len};
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (fd >= 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(ch, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+struct json_object* handoff_recv(int ch, int *fd) {
+    *fd = -1;
+    char *buf = malloc(HANDOFF_MAX_MSG + 1);
+    if (!buf) return NULL;
+
+    struct iovec iov = {.iov_base = buf, .iov_len = HANDOFF_MAX_MSG};
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf)};
+
+    ssize_t n;
+    do {
+        n = recvmsg(ch, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); n > 0 && c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(c), sizeof(int));
+        }
+    }
+    if (n <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (*fd >= 0) close(*fd);
+        *fd = -1;
+        free(buf);
+        return NULL;
+    }
+
+    buf[n] = '\0';
+    struct json_object *rec = json_tokener_parse(buf);
+    free(buf);
+    if (!rec && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+    return rec;
+}
@@ -0,0 +1,468 @@
+#include "home.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#define HOME_BUCKETS 64
+#define ROOM_BUCKETS 256
+#define DEV_BUCKETS 1024
+#define GROUP_BUCKETS 64
+/* Power bins: [-inf, 1) W, then POWER_SUB bins per power of two. */
+#define POWER_SUB 8
+#define POWER_BINS 129
+
+typedef struct {
+    int devices;
+    int online;
+    double power;
+} Agg;
+
+typedef struct Home {
+    struct Home *next;
+    char name[32];
+    Agg agg;
+    struct Room *rooms;
+} Home;
+
+typedef struct Room {
+    struct Room *next;
+    struct Room *sibling;
+    Home *home;
+    char name[32];
+    Agg agg;
+} Room;
+
+typedef struct DevNode {
+    struct DevNode *next;
+    char id[32];
+    char type[32];
+    char state[16];
+    Room *room;
+    bool online;
+    double power;
+    time_t last_seen;
+    struct Group *group;
+    int bin;
+    struct DevNode *bin_prev;
+    struct DevNode *bin_next;
+} DevNode;
+
+/* Query index: every device sits in the group for its (type, state,
+ * online) and, inside it, in the bin for its power. A query only visits
+ * matching groups, takes whole bins inside its power range by count and
+ * checks devices one by one only in the bins its bounds cut through.
+ * Types and states are whatever devices report, so a group is freed once
+ * its last device leaves. */
+typedef struct Group {
+    struct Group *next;
+    struct Group *all_next;
+    struct Group *all_prev;
+    char type[32];
+    char state[16];
+    bool online;
+    int members;
+    int count[POWER_BINS];
+    DevNode *bins[POWER_BINS];
+} Group;
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static Home *homes[HOME_BUCKETS];
+static Room *rooms[ROOM_BUCKETS];
+static DevNode **devs;
+static size_t dev_buckets;
+static size_t ndevs;
+static Group *groups[GROUP_BUCKETS];
+static Group *all_groups;
+
+static unsigned hash_str(unsigned h, const char *s) {
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static Home* get_home(const char *name, bool create) {
+    unsigned b = hash_str(2166136261u, name) % HOME_BUCKETS;
+    for (Home *h = homes[b]; h; h = h->next) {
+        if (strcmp(h->name, name) == 0) return h;
+    }
+    if (!create) return NULL;
+
+    Home *h = calloc(1, sizeof(Home));
+    if (!h) return NULL;
+    snprintf(h->name, sizeof(h->name), "%s", name);
+    h->next = homes[b];
+    homes[b] = h;
+    return h;
+}
+
+static Room* get_room(const char *home, const char *name, bool create) {
+    unsigned b = hash_str(hash_str(2166136261u, home) ^ '/', name) % ROOM_BUCKETS;
+    for (Room *r = rooms[b]; r; r = r->next) {
+        if (strcmp(r->name, name) == 0 && strcmp(r->home->name, home) == 0) return r;
+    }
+    if (!create) return NULL;
+
+    Home *h = get_home(home, true);
+    Room *r = h ? calloc(1, sizeof(Room)) : NULL;
+    if (!r) return NULL;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->home = h;
+    r->next = rooms[b];
+    rooms[b] = r;
+    r->sibling = h->rooms;
+    h->rooms = r;
+    return r;
+}
+
+/* Doubles the device table once it averages one device per bucket. */
+static void grow_devs(void) {
+    size_t n = dev_buckets ? dev_buckets * 2 : DEV_BUCKETS;
+    DevNode **t = calloc(n, sizeof(DevNode*));
+    if (!t) return;
+    for (size_t i = 0; i < dev_buckets; i++) {
+        DevNode *d = devs[i];
+        while (d) {
+            DevNode *next = d->next;
+            unsigned b = hash_str(2166136261u, d->id) % n;
+            d->next = t[b];
+            t[b] = d;
+            d = next;
+        }
+    }
+    free(devs);
+    devs = t;
+    dev_buckets = n;
+}
+
+static DevNode* get_dev(const char *id, bool create) {
+    if (dev_buckets) {
+        unsigned b = hash_str(2166136261u, id) % dev_buckets;
+        for (DevNode *d = devs[b]; d; d = d->next) {
+            if (strcmp(d->id, id) == 0) return d;
+        }
+    }
+    if (!create) return NULL;
+
+    if (ndevs >= dev_buckets) grow_devs();
+    if (!dev_buckets) return NULL;
+    DevNode *d = calloc(1, sizeof(DevNode));
+    if (!d) return NULL;
+    snprintf(d->id, sizeof(d->id), "%s", id);
+    unsigned b = hash_str(2166136261u, id) % dev_buckets;
+    d->next = devs[b];
+    devs[b] = d;
+    ndevs++;
+    return d;
+}
+
+static int power_bin(double w) {
+    if (!(w >= 1)) return 0;
+    int e;
+    double m = frexp(w, &e);
+    int b = 1 + (e - 1) * POWER_SUB + (int)((m - 0.5) * 2 * POWER_SUB);
+    return b < POWER_BINS ? b : POWER_BINS - 1;
+}
+
+/* Lowest power in bin b; bin b holds [bin_low(b), bin_low(b + 1)). */
+static double bin_low(int b) {
+    if (b <= 0) return -INFINITY;
+    if (b >= POWER_BINS) return INFINITY;
+    int e = (b - 1) / POWER_SUB + 1;
+    int sub = (b - 1) % POWER_SUB;
+    return ldexp(0.5 + sub / (2.0 * POWER_SUB), e);
+}
+
+static unsigned group_bucket(const char *type, const char *state, bool online) {
+    return (hash_str(hash_str(2166136261u, type) ^ '/', state) ^ online) % GROUP_BUCKETS;
+}
+
+static Group* get_group(const char *type, const char *state, bool online) {
+    unsigned b = group_bucket(type, state, online);
+    for (Group *g = groups[b]; g; g = g->next) {
+        if (g->online == online && strcmp(g->type, type) == 0 && strcmp(g->state, state) == 0) {
+            return g;
+        }
+    }
+
+    Group *g = calloc(1, sizeof(Group));
+    if (!g) return NULL;
+    snprintf(g->type, sizeof(g->type), "%s", type);
+    snprintf(g->state, sizeof(g->state), "%s", state);
+    g->online = online;
+    g->next = groups[b];
+    groups[b] = g;
+    g->all_next = all_groups;
+    if (all_groups) all_groups->all_prev = g;
+    all_groups = g;
+    return g;
+}
+
+static void put_group(Group *g) {
+    if (--g->members > 0) return;
+    Group **pp = &groups[group_bucket(g->type, g->state, g->online)];
+    while (*pp != g) pp = &(*pp)->next;
+    *pp = g->next;
+    if (g->all_prev) g->all_prev->all_next = g->all_next;
+    else all_groups = g->all_next;
+    if (g->all_next) g->all_next->all_prev = g->all_prev;
+    free(g);
+}
+
+static void index_out(DevNode *d) {
+    Group *g = d->group;
+    if (!g) return;
+    if (d->bin_prev) d->bin_prev->bin_next = d->bin_next;
+    else g->bins[d->bin] = d->bin_next;
+    if (d->bin_next) d->bin_next->bin_prev = d->bin_prev;
+    g->count[d->bin]--;
+    d->group = NULL;
+    d->bin_prev = d->bin_next = NULL;
+    put_group(g);
+}
+
+static void index_in(DevNode *d) {
+    Group *g = get_group(d->type, d->state, d->online);
+    if (!g) return;
+    d->group = g;
+    d->bin = power_bin(d->power);
+    d->bin_prev = NULL;
+    d->bin_next = g->bins[d->bin];
+    if (d->bin_next) d->bin_next->bin_prev = d;
+    g->bins[d->bin] = d;
+    g->count[d->bin]++;
+    g->members++;
+}
+
+/* Apply a device's contribution (sign +1 or -1) to its room and home. */
+static void account(DevNode *d, int sign) {
+    if (!d->room) return;
+    Agg *levels[2] = {&d->room->agg, &d->room->home->agg};
+    for (int i = 0; i < 2; i++) {
+        levels[i]->devices += sign;
+        if (d->online) {
+            levels[i]->online += sign;
+            levels[i]->power += sign * d->power;
+        }
+    }
+}
+
+static void move_dev(DevNode *d, const char *home, const char *room) {
+    Room *r = get_room(home, room, true);
+    if (!r || r == d->room) return;
+    account(d, -1);
+    d->room = r;
+    account(d, +1);
+}
+
+void home_device_up(const char *id, const char *type, const char *home, const char *room) {
+    pthread_mutex_lock(&mtx);
+    DevNode *d = get_dev(id, true);
+    if (d) {
+        index_out(d);
+        if (type && type[0]) snprintf(d->type, sizeof(d->type), "%s", type);
+        if (home || room || !d->room) {
+            move_dev(d, home ? home : (d->room ? d->room->home->name : HOME_DEFAULT),
+                     room ? room : ROOM_DEFAULT);
+        }
+        if (!d->online) {
+            account(d, -1);
+            d->online = true;
+            d->power = 0;
+            account(d, +1);
+        }
+        d->last_seen = time(NULL);
+        index_in(d);
+    }
+    pthread_mutex_unlock(&mtx);
+}
+
+void home_device_down(const char *id) {
+    pthread_mutex_lock(&mtx);
+    DevNode *d = get_dev(id, false);
+    if (d && d->online) {
+        index_out(d);
+        account(d, -1);
+        d->online = false;
+        d->power = 0;
+        account(d, +1);
+        index_in(d);
+    }
+    pthread_mutex_unlock(&mtx);
+}
+
+void home_forget(const char *id) {
+    pthread_mutex_lock(&mtx);
+    DevNode *d = get_dev(id, false);
+    if (d && !d->online) {
+        index_out(d);
+        account(d, -1);
+        DevNode **pp = &devs[hash_str(2166136261u, id) % dev_buckets];
+        while (*pp != d) pp = &(*pp)->next;
+        *pp = d->next;
+        ndevs--;
+        free(d);
+    }
+    pthread_mutex_unlock(&mtx);
+}
+
+void home_set_power(const char *id, double watts) {
+    pthread_mutex_lock(&mtx);
+    DevNode *d = get_dev(id, false);
+    if (d && d->online && d->room) {
+        double delta = watts - d->power;
+        d->power = watts;
+        d->room->agg.power += delta;
+        d->room->home->agg.power += delta;
+        if (power_bin(watts) != d->bin) {
+            index_out(d);
+            index_in(d);
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+}
+
+bool home_set_state(const char *id, const char *state) {
+    pthread_mutex_lock(&mtx);
+    DevNode *d = get_dev(id, false);
+    bool changed = d && strncmp(d->state, state, sizeof(d->state) - 1) != 0;
+    if (changed) {
+        index_out(d);
+        snprintf(d->state, sizeof(d->state), "%s", state);
+        index_in(d);
+    }
+    pthread_mutex_unlock(&mtx);
+    return changed;
+}
+
+void home_touch(const char *id) {
+    pthread_mutex_lock(&mtx);
+    DevNode *d = get_dev(id, false);
+    if (d) d->last_seen = time(NULL);
+    pthread_mutex_unlock(&mtx);
+}
+
+time_t home_last_seen(const char *id) {
+    pthread_mutex_lock(&mtx);
+    DevNode *d = get_dev(id, false);
+    time_t t = d ? d->last_seen : 0;
+    pthread_mutex_unlock(&mtx);
+    return t;
+}
+
+int home_device_state(const char *id, char *state, size_t len, double *watts) {
+    pthread_mutex_lock(&mtx);
+    DevNode *d = get_dev(id, false);
+    if (d) {
+        snprintf(state, len, "%s", d->state);
+        *watts = d->power;
+    }
+    pthread_mutex_unlock(&mtx);
+    return d ? 0 : -1;
+}
+
+int home_assign(const char *id, const char *home, const char *room) {
+    pthread_mutex_lock(&mtx);
+    DevNode *d = get_dev(id, false);
+    if (d) move_dev(d, home, room);
+    pthread_mutex_unlock(&mtx);
+    return d ? 0 : -1;
+}
+
+int home_locate(const char *id, char *home, size_t home_len, char *room, size_t room_len) {
+    pthread_mutex_lock(&mtx);
+    DevNode *d = get_dev(id, false);
+    bool found = d && d->room;
+    if (found) {
+        snprintf(home, home_len, "%s", d->room->home->name);
+        snprintf(room, room_len, "%s", d->room->name);
+    }
+    pthread_mutex_unlock(&mtx);
+    return found ? 0 : -1;
+}
+
+static struct json_object* agg_json(const char *key, const char *name, const Agg *a) {
+    struct json_object *o = json_object_new_object();
+    json_object_object_add(o, key, json_object_new_string(name));
+    json_object_object_add(o, "devices", json_object_new_int(a->devices));
+    json_object_object_add(o, "online", json_object_new_int(a->online));
+    json_object_object_add(o, "power", json_object_new_double(a->power));
+    return o;
+}
+
+struct json_object* home_status(const char *home, const char *room) {
+    struct json_object *out = NULL;
+    pthread_mutex_lock(&mtx);
+    if (room) {
+        Room *r = get_room(home, room, false);
+        if (r) out = agg_json("room", r->name, &r->agg);
+    } else {
+        Home *h = get_home(home, false);
+        if (h) {
+            out = agg_json("home", h->name, &h->agg);
+            struct json_object *list = json_object_new_array();
+            for (Room *r = h->rooms; r; r = r->sibling) {
+                json_object_array_add(list, agg_json("room", r->name, &r->agg));
+            }
+            json_object_object_add(out, "rooms", list);
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+    return out;
+}
+
+static void add_match(struct json_object *list, const DevNode *d) {
+    struct json_object *o = json_object_new_object();
+    json_object_object_add(o, "id", json_object_new_string(d->id));
+    json_object_object_add(o, "type", json_object_new_string(d->type));
+    json_object_object_add(o, "online", json_object_new_boolean(d->online));
+    json_object_object_add(o, "state", json_object_new_string(d->state));
+    json_object_object_add(o, "power", json_object_new_double(d->power));
+    if (d->room) {
+        json_object_object_add(o, "home", json_object_new_string(d->room->home->name));
+        json_object_object_add(o, "room", json_object_new_string(d->room->name));
+    }
+    json_object_object_add(o, "last_seen", json_object_new_int64((int64_t)d->last_seen));
+    json_object_array_add(list, o);
+}
+
+struct json_object* home_query(const HomeQuery *q, int *count) {
+    struct json_object *list = json_object_new_array();
+    int n = 0, listed = 0;
+
+    pthread_mutex_lock(&mtx);
+    for (const Group *g = all_groups; g; g = g->all_next) {
+        if (q->type && strcmp(g->type, q->type) != 0) continue;
+        if (q->state && strcmp(g->state, q->state) != 0) continue;
+        if (q->online >= 0 && g->online != (q->online > 0)) continue;
+
+        for (int b = 0; b < POWER_BINS; b++) {
+            if (!g->count[b]) continue;
+            double lo = bin_low(b), hi = bin_low(b + 1);
+            if (hi <= q->power_min || lo > q->power_max) continue;
+
+            if (lo >= q->power_min && hi <= q->power_max) {
+                n += g->count[b];
+                for (const DevNode *d = g->bins[b]; d && listed < q->limit; d = d->bin_next) {
+                    add_match(list, d);
+                    listed++;
+                }
+                continue;
+            }
+            for (const DevNode *d = g->bins[b]; d; d = d->bin_next) {
+                if (d->power < q->power_min || d->power > q->power_max) continue;
+                n++;
+                if (listed < q->limit) {
+                    add_match(list, d);
+                    listed++;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+
+    *count = n;
+    return list;
+}
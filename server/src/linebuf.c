@@ -0,0 +1,51 @@
+#include "linebuf.h"
+#include <stdlib.h>
+#include <string.h>
+
+int linebuf_init(LineBuf *lb, size_t max) {
+    memset(lb, 0, sizeof(*lb));
+    lb->max = max;
+    lb->cap = max < 4096 ? max : 4096;
+    lb->buf = malloc(lb->cap + 1);
+    return lb->buf ? 0 : -1;
+}
+
+int linebuf_append(LineBuf *lb, const char *data, size_t n) {
+    if (lb->off > 0) {
+        memmove(lb->buf, lb->buf + lb->off, lb->len - lb->off);
+        lb->len -= lb->off;
+        lb->off = 0;
+    }
+    if (lb->len + n > lb->max) return -1;
+
+    if (lb->len + n > lb->cap) {
+        size_t cap = lb->cap * 2;
+        while (cap < lb->len + n) cap *= 2;
+        if (cap > lb->max) cap = lb->max;
+        char *nb = realloc(lb->buf, cap + 1);
+        if (!nb) return -1;
+        lb->buf = nb;
+        lb->cap = cap;
+    }
+    memcpy(lb->buf + lb->len, data, n);
+    lb->len += n;
+    return 0;
+}
+
+char* linebuf_next(LineBuf *lb, size_t *line_len) {
+    char *start = lb->buf + lb->off;
+    char *nl = memchr(start, '\n', lb->len - lb->off);
+    if (!nl) return NULL;
+
+    *nl = '\0';
+    size_t n = (size_t)(nl - start);
+    if (n > 0 && start[n - 1] == '\r') start[--n] = '\0';
+    lb->off += (size_t)(nl - start) + 1;
+    if (line_len) *line_len = n;
+    return start;
+}
+
+void linebuf_free(LineBuf *lb) {
+    free(lb->buf);
+    memset(lb, 0, sizeof(*lb));
+}
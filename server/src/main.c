@@ -1,7 +1,13 @@
 #include "server.h"
+#include "admit.h"
+#include "offline.h"
+#include "quota.h"
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <unistd.h>
 
 void sig_handler(int sig) {
     (void)sig;
@@ -10,17 +16,144 @@ void sig_handler(int sig) {
     exit(0);
 }
 
-int main(void) {
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -p, --port PORT        listen port (default %d)\n"
+        "      --tls-cert FILE    serve TLS with this certificate chain\n"
+        "      --tls-key FILE     private key for --tls-cert\n"
+        "      --io BACKEND       threads (default) or uring; falls back to threads\n"
+        "      --backlog N        listen backlog (default %d)\n"
+        "      --register-rate R  device registrations admitted per second (default %d)\n"
+        "      --register-burst B registrations admitted at once before pacing (default %d)\n"
+        "      --msg-rate R       messages per second per identity and action class\n"
+        "                         (default %d, 0 = no quotas)\n"
+        "      --msg-burst B      messages per class sent at once before throttling\n"
+        "                         (default twice --msg-rate)\n"
+        "      --offline-ttl SEC  keep requests for offline devices this long (default %d)\n"
+        "      --rules FILE       load automation rules from a JSON file\n"
+        "      --udp-port PORT    accept device heartbeats/telemetry over UDP (default off)\n"
+        "      --capture FILE     record every inbound frame for build/replay\n"
+        "      --workers N        threads for heavy requests (default one per CPU, 0 = inline)\n"
+        "      --unix PATH        also listen on this Unix socket (default /tmp/smarthome-UID/PORT.sock, \"\" = off)\n"
+        "      --node NAME        cluster node name (default node-PORT)\n"
+        "      --peer HOST:PORT   cluster peer, repeat for each other node\n"
+        "      --cluster-key KEY  shared secret peers present in their hello\n"
+        "      --firmware-dir DIR serve OTA images from this directory (default off)\n"
+        "      --takeover         take the listeners and live connections over from\n"
+        "                         the server running on this port, which then exits\n",
+        prog, PORT, SRV_BACKLOG, ADMIT_RATE, ADMIT_BURST, QUOTA_RATE, OFFLINE_TTL);
+}
+
+static int parse_peer(const char *s, PeerAddr *p) {
+    const char *colon = strrchr(s, ':');
+    if (!colon || colon == s || (size_t)(colon - s) >= sizeof(p->host)) return -1;
+    memcpy(p->host, s, (size_t)(colon - s));
+    p->host[colon - s] = '\0';
+    p->port = atoi(colon + 1);
+    return p->port > 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    SrvConfig cfg = {.port = PORT, .workers = -1, .msg_rate = -1};
+    char node[32];
+
+    static const struct option opts[] = {
+        {"port", required_argument, NULL, 'p'},
+        {"tls-cert", required_argument, NULL, 'c'},
+        {"tls-key", required_argument, NULL, 'k'},
+        {"io", required_argument, NULL, 'i'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"register-rate", required_argument, NULL, 'r'},
+        {"register-burst", required_argument, NULL, 'B'},
+        {"msg-rate", required_argument, NULL, 'm'},
+        {"msg-burst", required_argument, NULL, 'M'},
+        {"offline-ttl", required_argument, NULL, 'T'},
+        {"rules", required_argument, NULL, 'R'},
+        {"udp-port", required_argument, NULL, 'u'},
+        {"capture", required_argument, NULL, 'C'},
+        {"workers", required_argument, NULL, 'w'},
+        {"unix", required_argument, NULL, 'U'},
+        {"takeover", no_argument, NULL, 'X'},
+        {"firmware-dir", required_argument, NULL, 'F'},
+        {"node", required_argument, NULL, 'n'},
+        {"peer", required_argument, NULL, 'P'},
+        {"cluster-key", required_argument, NULL, 'K'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:h", opts, NULL)) != -1) {
+        switch (opt) {
+            case 'p': cfg.port = atoi(optarg); break;
+            case 'c': cfg.tls_cert = optarg; break;
+            case 'k': cfg.tls_key = optarg; break;
+            case 'i': cfg.io_backend = optarg; break;
+            case 'b': cfg.backlog = atoi(optarg); break;
+            case 'r': cfg.register_rate = atof(optarg); break;
+            case 'B': cfg.register_burst = atof(optarg); break;
+            case 'm': cfg.msg_rate = atof(optarg); break;
+            case 'M': cfg.msg_burst = atof(optarg); break;
+            case 'T': cfg.offline_ttl = (unsigned)atoi(optarg); break;
+            case 'R': cfg.rules_file = optarg; break;
+            case 'u': cfg.udp_port = atoi(optarg); break;
+            case 'C': cfg.capture_file = optarg; break;
+            case 'w': cfg.workers = atoi(optarg); break;
+            case 'U': cfg.unix_path = optarg; break;
+            case 'X': cfg.takeover = true; break;
+            case 'F': cfg.firmware_dir = optarg; break;
+            case 'n': cfg.cluster.node = optarg; break;
+            case 'K': cfg.cluster.key = optarg; break;
+            case 'P':
+                if (cfg.cluster.npeers >= CLUSTER_MAX_PEERS ||
+                    parse_peer(optarg, &cfg.cluster.peers[cfg.cluster.npeers]) < 0) {
+                    fprintf(stderr, "Bad or too many --peer: %s\n", optarg);
+                    return 1;
+                }
+                cfg.cluster.npeers++;
+                break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!cfg.tls_cert != !cfg.tls_key) {
+        fprintf(stderr, "--tls-cert and --tls-key must be given together\n");
+        return 1;
+    }
+
+    if (cfg.cluster.npeers > 0 && (!cfg.cluster.key || !cfg.cluster.key[0])) {
+        fprintf(stderr, "--peer requires a non-empty --cluster-key\n");
+        return 1;
+    }
+
+    /* Peer links are plain TCP and a TLS listener would drop them. */
+    if (cfg.cluster.npeers > 0 && cfg.tls_cert) {
+        fprintf(stderr, "--peer cannot be used with --tls-cert: cluster links are plain TCP\n");
+        return 1;
+    }
+
+    char unix_path[108];
+    if (!cfg.unix_path) {
+        snprintf(unix_path, sizeof(unix_path), SRV_UNIX_FMT, (unsigned)getuid(), cfg.port);
+        cfg.unix_path = unix_path;
+    }
+
+    if (!cfg.cluster.node) {
+        snprintf(node, sizeof(node), "node-%d", cfg.port);
+        cfg.cluster.node = node;
+    }
+
     printf("C11 + GTK PROJECT\n\n");
     
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
+    signal(SIGPIPE, SIG_IGN);
     
-    if (srv_init() < 0) {
+    if (srv_init(&cfg) < 0) {
         fprintf(stderr, "Init failed\n");
         return 1;
     }
     
-    srv_start();
-    return 0;
+    return srv_start() < 0 ? 1 : 0;
 }
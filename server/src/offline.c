@@ -0,0 +1,235 @@
+#include "offline.h"
+#include "outq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct Parked {
+    struct Parked *next;
+    char key[OUTQ_KEY_LEN];
+    char from[32];
+    time_t expires;
+    size_t len;
+    char js[];
+} Parked;
+
+typedef struct DevQueue {
+    struct DevQueue *next;
+    char id[32];
+    Parked *head;
+    int count;
+} DevQueue;
+
+typedef struct Late {
+    struct Late *next;
+    char dev[32];
+    char to[32];
+    time_t expires;
+} Late;
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static DevQueue *queues;
+static Late *late;
+static unsigned ttl = OFFLINE_TTL;
+
+void offline_init(unsigned ttl_sec) {
+    if (ttl_sec > 0) ttl = ttl_sec;
+}
+
+unsigned offline_ttl(void) {
+    return ttl;
+}
+
+static DevQueue* find_queue(const char *dev, bool create) {
+    for (DevQueue *d = queues; d; d = d->next) {
+        if (strcmp(d->id, dev) == 0) return d;
+    }
+    if (!create) return NULL;
+
+    DevQueue *d = calloc(1, sizeof(DevQueue));
+    if (!d) return NULL;
+    strncpy(d->id, dev, sizeof(d->id) - 1);
+    d->next = queues;
+    queues = d;
+    return d;
+}
+
+static void drop_expired(DevQueue *d, time_t now) {
+    Parked **pp = &d->head;
+    while (*pp) {
+        Parked *p = *pp;
+        if (p->expires <= now) {
+            *pp = p->next;
+            d->count--;
+            free(p);
+        } else {
+            pp = &p->next;
+        }
+    }
+}
+
+static int put(const char *dev, const char *key, const char *from, const char *js,
+               time_t now, time_t expires, char *superseded, size_t superseded_len) {
+    if (superseded && superseded_len) superseded[0] = '\0';
+
+    size_t n = strlen(js);
+    Parked *p = malloc(sizeof(Parked) + n + 1);
+    if (!p) return -1;
+    memset(p, 0, sizeof(Parked));
+    if (key) strncpy(p->key, key, sizeof(p->key) - 1);
+    if (from) strncpy(p->from, from, sizeof(p->from) - 1);
+    p->expires = expires;
+    p->len = n;
+    memcpy(p->js, js, n + 1);
+
+    pthread_mutex_lock(&mtx);
+    DevQueue *d = find_queue(dev, true);
+    if (!d) {
+        pthread_mutex_unlock(&mtx);
+        free(p);
+        return -1;
+    }
+    drop_expired(d, now);
+
+    /* Same key: take the old entry's place so delivery order still
+     * follows when each attribute was first touched. */
+    Parked **pp = &d->head;
+    while (*pp) {
+        if (p->key[0] && strcmp((*pp)->key, p->key) == 0) {
+            Parked *old = *pp;
+            if (superseded && superseded_len) {
+                strncpy(superseded, old->from, superseded_len - 1);
+                superseded[superseded_len - 1] = '\0';
+            }
+            p->next = old->next;
+            *pp = p;
+            free(old);
+            pthread_mutex_unlock(&mtx);
+            return 1;
+        }
+        pp = &(*pp)->next;
+    }
+
+    if (d->count >= OFFLINE_MAX_PER_DEV) {
+        pthread_mutex_unlock(&mtx);
+        free(p);
+        return -1;
+    }
+    *pp = p;
+    d->count++;
+    pthread_mutex_unlock(&mtx);
+    return 0;
+}
+
+int offline_put(const char *dev, const char *key, const char *from,
+                const char *js, char *superseded, size_t superseded_len) {
+    time_t now = time(NULL);
+    return put(dev, key, from, js, now, now + (time_t)ttl, superseded, superseded_len);
+}
+
+int offline_restore(const char *dev, const char *key, const char *from, time_t expires,
+                    const char *js) {
+    time_t now = time(NULL);
+    if (expires <= now) return 0;
+    return put(dev, key, from, js, now, expires, NULL, 0) < 0 ? -1 : 0;
+}
+
+void offline_foreach(offline_visit_fn fn, void *arg) {
+    pthread_mutex_lock(&mtx);
+    time_t now = time(NULL);
+    for (DevQueue *d = queues; d; d = d->next) {
+        drop_expired(d, now);
+        for (Parked *p = d->head; p; p = p->next) fn(d->id, p->key, p->from, p->expires, p->js, arg);
+    }
+    pthread_mutex_unlock(&mtx);
+}
+
+/* Called with mtx held. */
+static void late_add(const char *dev, const char *to, time_t expires) {
+    Late *l = calloc(1, sizeof(Late));
+    if (!l) return;
+    strncpy(l->dev, dev, sizeof(l->dev) - 1);
+    strncpy(l->to, to, sizeof(l->to) - 1);
+    l->expires = expires;
+    Late **pp = &late;
+    while (*pp) pp = &(*pp)->next;
+    *pp = l;
+}
+
+void offline_foreach_late(offline_late_fn fn, void *arg) {
+    pthread_mutex_lock(&mtx);
+    for (Late *l = late; l; l = l->next) fn(l->dev, l->to, l->expires, arg);
+    pthread_mutex_unlock(&mtx);
+}
+
+void offline_restore_late(const char *dev, const char *to, time_t expires) {
+    if (expires <= time(NULL)) return;
+    pthread_mutex_lock(&mtx);
+    late_add(dev, to, expires);
+    pthread_mutex_unlock(&mtx);
+}
+
+bool offline_late_reply(const char *dev, const char *to) {
+    bool found = false;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&mtx);
+    Late **pp = &late;
+    while (*pp) {
+        Late *l = *pp;
+        bool match = !found && strcmp(l->dev, dev) == 0 && strcmp(l->to, to) == 0;
+        if (match || l->expires <= now) {
+            *pp = l->next;
+            free(l);
+            found = found || match;
+        } else {
+            pp = &l->next;
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+    return found;
+}
+
+char* offline_take(const char *dev, int *count) {
+    *count = 0;
+    pthread_mutex_lock(&mtx);
+    DevQueue **dp = &queues;
+    while (*dp && strcmp((*dp)->id, dev) != 0) dp = &(*dp)->next;
+    DevQueue *d = *dp;
+    if (!d) {
+        pthread_mutex_unlock(&mtx);
+        return NULL;
+    }
+    *dp = d->next;
+    pthread_mutex_unlock(&mtx);
+
+    time_t now = time(NULL);
+    drop_expired(d, now);
+
+    size_t total = 0;
+    for (Parked *p = d->head; p; p = p->next) total += p->len + 1;
+
+    char *out = total ? malloc(total) : NULL;
+    size_t off = 0;
+    Parked *p = d->head;
+    pthread_mutex_lock(&mtx);
+    while (p) {
+        Parked *next = p->next;
+        if (out) {
+            memcpy(out + off, p->js, p->len);
+            off += p->len;
+            out[off++] = '\n';
+            (*count)++;
+            if (p->from[0]) late_add(dev, p->from, now + OFFLINE_LATE_SEC);
+        }
+        free(p);
+        p = next;
+    }
+    pthread_mutex_unlock(&mtx);
+    free(d);
+
+    /* outq_push() adds the final newline itself. */
+    if (out) out[off - 1] = '\0';
+    return out;
+}
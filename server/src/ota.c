@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include "ota.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+typedef struct Image {
+    struct Image *next;
+    char name[64];
+    int fd;
+    size_t size;
+    ino_t ino;
+    time_t mtime;
+    char sha256[65];
+    int refs;
+} Image;
+
+typedef enum { OTA_OFFERED, OTA_SENDING, OTA_DONE, OTA_FAILED } OtaState;
+
+typedef struct Session {
+    struct Session *next;
+    char dev[32];
+    Image *img;
+    size_t acked;
+    size_t sent;
+    int window;
+    OtaState state;
+    char error[32];
+} Session;
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static char *fw_dir;
+static Image *images;
+static Session *sessions[OTA_BUCKETS];
+
+static const char *state_name[] = {"offered", "sending", "done", "failed"};
+
+int ota_init(const char *dir) {
+    if (!dir) return 0;
+    struct stat st;
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Firmware directory not found: %s\n", dir);
+        return -1;
+    }
+    fw_dir = strdup(dir);
+    printf("OTA images from %s\n", dir);
+    return fw_dir ? 0 : -1;
+}
+
+bool ota_enabled(void) {
+    return fw_dir != NULL;
+}
+
+static unsigned hash_id(const char *id) {
+    unsigned h = 2166136261u;
+    while (*id) {
+        h ^= (unsigned char)*id++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static Session* find_session(const char *dev, bool create) {
+    unsigned b = hash_id(dev) & (OTA_BUCKETS - 1);
+    for (Session *s = sessions[b]; s; s = s->next) {
+        if (strcmp(s->dev, dev) == 0) return s;
+    }
+    if (!create) return NULL;
+
+    Session *s = calloc(1, sizeof(Session));
+    if (!s) return NULL;
+    snprintf(s->dev, sizeof(s->dev), "%s", dev);
+    s->next = sessions[b];
+    sessions[b] = s;
+    return s;
+}
+
+/* Called with mtx held. */
+static void image_unref_locked(Image *img) {
+    if (--img->refs > 0) return;
+    for (Image **pp = &images; *pp; pp = &(*pp)->next) {
+        if (*pp == img) {
+            *pp = img->next;
+            break;
+        }
+    }
+    close(img->fd);
+    free(img);
+}
+
+static void image_release(void *arg) {
+    pthread_mutex_lock(&mtx);
+    image_unref_locked(arg);
+    pthread_mutex_unlock(&mtx);
+}
+
+/* The mapping only lives for the hash; sends read the page cache through
+ * the fd. */
+static int hash_image(Image *img) {
+    unsigned char md[32];
+    unsigned int n = 0;
+    if (img->size == 0) {
+        EVP_Digest("", 0, md, &n, EVP_sha256(), NULL);
+    } else {
+        void *map = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+        if (map == MAP_FAILED) return -1;
+        madvise(map, img->size, MADV_SEQUENTIAL);
+        int ok = EVP_Digest(map, img->size, md, &n, EVP_sha256(), NULL);
+        munmap(map, img->size);
+        if (!ok) return -1;
+    }
+    for (int i = 0; i < 32; i++) snprintf(img->sha256 + i * 2, 3, "%02x", md[i]);
+    return 0;
+}
+
+/* Called with mtx held. A file replaced on disk gets a new Image; devices
+ * still on the old one finish it. */
+static Image* image_get(const char *name) {
+    if (!name[0] || name[0] == '.' || strchr(name, '/') || strlen(name) >= sizeof(images->name)) {
+        return NULL;
+    }
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", fw_dir, name);
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) return NULL;
+
+    for (Image *img = images; img; img = img->next) {
+        if (strcmp(img->name, name) == 0 && img->ino == st.st_ino &&
+            img->mtime == st.st_mtime && img->size == (size_t)st.st_size) {
+            img->refs++;
+            return img;
+        }
+    }
+
+    Image *img = calloc(1, sizeof(Image));
+    if (!img) return NULL;
+    img->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (img->fd < 0 || fstat(img->fd, &st) < 0) {
+        if (img->fd >= 0) close(img->fd);
+        free(img);
+        return NULL;
+    }
+    snprintf(img->name, sizeof(img->name), "%s", name);
+    img->size = (size_t)st.st_size;
+    img->ino = st.st_ino;
+    img->mtime = st.st_mtime;
+    if (hash_image(img) < 0) {
+        close(img->fd);
+        free(img);
+        return NULL;
+    }
+    img->refs = 1;
+    img->next = images;
+    images = img;
+    printf("[OTA] Opened %s (%zu bytes, sha256 %.16s...)\n", name, img->size, img->sha256);
+    return img;
+}
+
+static char* build_msg(MsgType type, const char *to, Action action, struct json_object *d) {
+    Message m = {0};
+    m.type = type;
+    snprintf(m.from, sizeof(m.from), "server");
+    snprintf(m.to, sizeof(m.to), "%s", to);
+    m.action = action;
+    m.timestamp = time(NULL);
+    m.data = d;
+    char *js = create_msg(&m);
+    json_object_put(d);
+    return js;
+}
+
+static void send_offer(const char *dev, OutQ *q, const Image *img) {
+    OtaOffer o = {.size = (int64_t)img->size, .chunk = OTA_CHUNK};
+    snprintf(o.image, sizeof(o.image), "%s", img->name);
+    snprintf(o.sha256, sizeof(o.sha256), "%s", img->sha256);
+    char *js = build_msg(MSG_REQUEST, dev, ACT_OTA, ota_offer_encode(&o));
+    if (js) {
+        outq_push(q, js, action_lane(ACT_OTA), NULL, false, NULL, NULL, 0);
+        free(js);
+    }
+}
+
+int ota_offer(const char *dev, OutQ *q, const char *image) {
+    if (!fw_dir) return -1;
+    pthread_mutex_lock(&mtx);
+    Image *img = image_get(image);
+    Session *s = img ? find_session(dev, true) : NULL;
+    if (!s) {
+        if (img) image_unref_locked(img);
+        pthread_mutex_unlock(&mtx);
+        return -1;
+    }
+    if (s->img) image_unref_locked(s->img);
+    s->img = img;
+    s->acked = s->sent = 0;
+    s->window = OTA_WINDOW;
+    s->state = OTA_OFFERED;
+    s->error[0] = '\0';
+    img->refs++;
+    pthread_mutex_unlock(&mtx);
+
+    if (q) send_offer(dev, q, img);
+    printf("[OTA] %s -> %s%s\n", image, dev, q ? "" : " (offered when it registers)");
+    image_release(img);
+    return 0;
+}
+
+void ota_device_up(const char *dev, OutQ *q) {
+    pthread_mutex_lock(&mtx);
+    Session *s = find_session(dev, false);
+    Image *img = NULL;
+    size_t at = 0;
+    if (s && s->img && (s->state == OTA_OFFERED || s->state == OTA_SENDING)) {
+        s->state = OTA_OFFERED;
+        s->sent = at = s->acked;
+        img = s->img;
+        img->refs++;
+    }
+    pthread_mutex_unlock(&mtx);
+
+    if (img) {
+        send_offer(dev, q, img);
+        printf("[OTA] Re-offered %s to %s at %zu\n", img->name, dev, at);
+        image_release(img);
+    }
+}
+
+typedef struct {
+    off_t off;
+    size_t len;
+} Chunk;
+
+void ota_reply(const char *dev, OutQ *q, struct json_object *data) {
+    Chunk chunks[OTA_MAX_WINDOW];
+    int n = 0;
+    Image *img = NULL;
+
+    OtaAck ack;
+    char err[160];
+    if (ota_ack_decode(data, &ack, err, sizeof(err)) < 0) {
+        printf("[OTA] %s sent a bad reply: %s\n", dev, err);
+        return;
+    }
+
+    pthread_mutex_lock(&mtx);
+    Session *s = find_session(dev, false);
+    if (!s || !s->img || s->state == OTA_DONE || s->state == OTA_FAILED) {
+        pthread_mutex_unlock(&mtx);
+        return;
+    }
+
+    if (strcmp(ack.status, "error") == 0) {
+        s->state = OTA_FAILED;
+        snprintf(s->error, sizeof(s->error), "%.*s", (int)sizeof(s->error) - 1,
+                 ack.has_error ? ack.error : "device_error");
+        printf("[OTA] %s failed %s: %s\n", dev, s->img->name, s->error);
+        pthread_mutex_unlock(&mtx);
+        return;
+    }
+
+    int64_t off = ack.has_offset ? ack.offset : -1;
+    if (off < 0 || (size_t)off > s->img->size) {
+        pthread_mutex_unlock(&mtx);
+        return;
+    }
+    if (ack.has_window) {
+        int w = ack.window;
+        s->window = w < 1 ? 1 : w > OTA_MAX_WINDOW ? OTA_MAX_WINDOW : w;
+    }
+
+    /* Going backwards means the device lost data or restarted: send
+     * again from where it is. */
+    if (s->state == OTA_OFFERED || (size_t)off > s->sent || (size_t)off < s->acked) {
+        s->sent = (size_t)off;
+    }
+    s->acked = (size_t)off;
+    s->state = OTA_SENDING;
+    if (s->acked == s->img->size) {
+        s->state = OTA_DONE;
+        printf("[OTA] %s has %s (%zu bytes)\n", dev, s->img->name, s->img->size);
+        pthread_mutex_unlock(&mtx);
+        return;
+    }
+
+    size_t limit = s->acked + (size_t)s->window * OTA_CHUNK;
+    while (s->sent < s->img->size && s->sent < limit) {
+        size_t len = s->img->size - s->sent;
+        if (len > OTA_CHUNK) len = OTA_CHUNK;
+        chunks[n].off = (off_t)s->sent;
+        chunks[n].len = len;
+        n++;
+        s->sent += len;
+    }
+    img = s->img;
+    img->refs += n;
+    pthread_mutex_unlock(&mtx);
+
+    /* Pushed outside the lock: the push may write to the socket. */
+    for (int i = 0; i < n; i++) {
+        OtaChunk ch = {.offset = (int64_t)chunks[i].off, .len = (int64_t)chunks[i].len};
+        snprintf(ch.image, sizeof(ch.image), "%s", img->name);
+        char *js = build_msg(MSG_NOTIFY, dev, ACT_OTA_CHUNK, ota_chunk_encode(&ch));
+        if (!js || outq_push_file(q, js, action_lane(ACT_OTA_CHUNK), img->fd, chunks[i].off, chunks[i].len,
+                                  image_release, img) < 0) {
+            image_release(img);
+        }
+        free(js);
+    }
+}
+
+struct json_object* ota_status(void) {
+    struct json_object *arr = json_object_new_array();
+    pthread_mutex_lock(&mtx);
+    for (int b = 0; b < OTA_BUCKETS; b++) {
+        for (Session *s = sessions[b]; s; s = s->next) {
+            if (!s->img) continue;
+            struct json_object *o = json_object_new_object();
+            json_object_object_add(o, "device", json_object_new_string(s->dev));
+            json_object_object_add(o, "image", json_object_new_string(s->img->name));
+            json_object_object_add(o, "offset", json_object_new_int64((int64_t)s->acked));
+            json_object_object_add(o, "size", json_object_new_int64((int64_t)s->img->size));
+            json_object_object_add(o, "state", json_object_new_string(state_name[s->state]));
+            if (s->error[0]) json_object_object_add(o, "error", json_object_new_string(s->error));
+            json_object_array_add(arr, o);
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+    return arr;
+}
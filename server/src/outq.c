@@ -0,0 +1,611 @@
+#include "outq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Queues the flusher thread looks after, each holding a ref: ones whose
+ * frames wait behind an unacked request until at, and ones whose socket
+ * was full (events is what to poll for). Few at a time, so a list will do. */
+typedef struct Timed {
+    struct Timed *next;
+    OutQ *q;
+    uint64_t at;
+    short events;
+} Timed;
+
+static pthread_mutex_t timer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static Timed *timers;
+static int timer_pipe[2] = {-1, -1};
+static bool timer_ok;
+
+static void flush_locked(OutQ *q);
+
+static void timer_wake(void) {
+    char c = 0;
+    if (write(timer_pipe[1], &c, 1) < 0) {
+        /* Full pipe: a wakeup is already pending. */
+    }
+}
+
+/* Only ever flushes, which never blocks, so one slow socket cannot hold
+ * up the deadlines of the others. */
+static void* timer_run(void *arg) {
+    (void)arg;
+    Timed *mine = NULL;
+    struct pollfd *p = NULL;
+    size_t cap = 0;
+    for (;;) {
+        pthread_mutex_lock(&timer_mtx);
+        while (timers) {
+            Timed *t = timers;
+            timers = t->next;
+            t->next = mine;
+            mine = t;
+        }
+        pthread_mutex_unlock(&timer_mtx);
+
+        size_t n = 1;
+        for (Timed *t = mine; t; t = t->next) n++;
+        if (n > cap) {
+            struct pollfd *np = realloc(p, n * sizeof(*p));
+            if (!np) {
+                poll(NULL, 0, 10);
+                continue;
+            }
+            p = np;
+            cap = n;
+        }
+
+        uint64_t now = now_ms();
+        int timeout = -1;
+        p[0] = (struct pollfd){.fd = timer_pipe[0], .events = POLLIN};
+        size_t i = 1;
+        for (Timed *t = mine; t; t = t->next, i++) {
+            p[i] = (struct pollfd){.fd = t->events ? t->q->sock : -1, .events = t->events};
+            if (t->events) continue;
+            int ms = now >= t->at ? 0 : (int)(t->at - now);
+            if (timeout < 0 || ms < timeout) timeout = ms;
+        }
+        poll(p, n, timeout);
+        if (p[0].revents & POLLIN) {
+            char buf[64];
+            while (read(timer_pipe[0], buf, sizeof(buf)) > 0) {}
+        }
+
+        now = now_ms();
+        i = 1;
+        for (Timed **pp = &mine; *pp; i++) {
+            Timed *t = *pp;
+            OutQ *q = t->q;
+            pthread_mutex_lock(&q->mtx);
+            bool due = t->events ? p[i].revents != 0 || q->closed : now >= t->at;
+            if (!due) {
+                pthread_mutex_unlock(&q->mtx);
+                pp = &t->next;
+                continue;
+            }
+            *pp = t->next;
+            if (t->events) q->watched = false;
+            else q->timed = false;
+            flush_locked(q);
+            pthread_mutex_unlock(&q->mtx);
+            outq_unref(q);
+            free(t);
+        }
+    }
+    return NULL;
+}
+
+static void timer_start(void) {
+    if (pipe(timer_pipe) < 0) return;
+    for (int i = 0; i < 2; i++) {
+        fcntl(timer_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(timer_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    timer_ok = pthread_create(&tid, &attr, timer_run, NULL) == 0;
+    pthread_attr_destroy(&attr);
+}
+
+/* Called with q->mtx held; false if the flusher cannot take q. */
+static bool timer_add(OutQ *q, uint64_t at, short events) {
+    pthread_once(&timer_once, timer_start);
+    Timed *t = malloc(sizeof(Timed));
+    if (!timer_ok || !t) {
+        free(t);
+        return false;
+    }
+    q->refs++;
+    t->q = q;
+    t->at = at;
+    t->events = events;
+    pthread_mutex_lock(&timer_mtx);
+    t->next = timers;
+    timers = t;
+    pthread_mutex_unlock(&timer_mtx);
+    timer_wake();
+    return true;
+}
+
+/* After a flush left frames behind the gate. */
+static void timer_arm(OutQ *q) {
+    if (q->timed || !q->awaiting || q->pending == 0 || q->closed) return;
+    q->timed = timer_add(q, q->await_until, 0);
+}
+
+/* After the socket took only part of cur. */
+static void watch_sock(OutQ *q, short events) {
+    if (q->watched || q->closed) return;
+    q->watched = timer_add(q, 0, events);
+}
+
+/* Writes as much of it as the socket takes without blocking: 1 once it is
+ * all out, 0 when the socket is full (*events says what to wait for), -1
+ * on error. */
+static int send_some(OutQ *q, OutItem *it, short *events) {
+    size_t total = it->len + it->file_len;
+    while (it->sent < total) {
+        ssize_t n;
+        *events = POLLOUT;
+        if (it->sent < it->len) {
+            const char *p = it->buf + it->sent;
+            size_t left = it->len - it->sent;
+            n = q->tls ? tls_write_some(q->tls, p, left, events)
+                       : send(q->sock, p, left, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } else {
+            off_t off = it->file_off + (off_t)(it->sent - it->len);
+            size_t left = total - it->sent;
+            n = q->tls ? tls_sendfile_some(q->tls, it->file_fd, off, left, events)
+                       : sendfile(q->sock, it->file_fd, &off, left);
+            if (n == 0 && !q->tls) return -1;
+        }
+        if (n < 0) {
+            if (q->tls) return -1;
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return 0;
+        it->sent += (size_t)n;
+    }
+    return 1;
+}
+
+/* The event loop only sends from memory. */
+static int inline_file(OutItem *it) {
+    if (!it->file_len) return 0;
+    char *buf = realloc(it->buf, it->len + it->file_len);
+    if (!buf) return -1;
+    it->buf = buf;
+    size_t got = 0;
+    while (got < it->file_len) {
+        ssize_t n = pread(it->file_fd, buf + it->len + got, it->file_len - got,
+                          it->file_off + (off_t)got);
+        if (n <= 0) return -1;
+        got += (size_t)n;
+    }
+    it->len += it->file_len;
+    it->file_len = 0;
+    return 0;
+}
+
+static void free_item(OutItem *it) {
+    if (it->release) it->release(it->release_arg);
+    free(it->buf);
+    free(it);
+}
+
+OutQ* outq_new(int sock) {
+    OutQ *q = calloc(1, sizeof(OutQ));
+    if (!q) return NULL;
+    if (pthread_mutex_init(&q->mtx, NULL) != 0) {
+        free(q);
+        return NULL;
+    }
+    q->sock = sock;
+    q->refs = 1;
+    return q;
+}
+
+OutQ* outq_ref(OutQ *q) {
+    if (!q) return NULL;
+    pthread_mutex_lock(&q->mtx);
+    q->refs++;
+    pthread_mutex_unlock(&q->mtx);
+    return q;
+}
+
+/* cur belongs to whoever is flushing; they free it when they see closed. */
+static void drop_pending(OutQ *q) {
+    if (q->cur && !q->flushing) {
+        free_item(q->cur);
+        q->cur = NULL;
+    }
+    for (int l = 0; l < OUTQ_LANES; l++) {
+        OutItem *it = q->head[l];
+        while (it) {
+            OutItem *next = it->next;
+            free_item(it);
+            it = next;
+        }
+        q->head[l] = q->tail[l] = NULL;
+    }
+    q->pending = 0;
+    q->bytes = 0;
+}
+
+static int clamp_lane(int lane) {
+    return lane < 0 ? 0 : lane >= OUTQ_LANES ? OUTQ_LANES - 1 : lane;
+}
+
+static void append(OutQ *q, OutItem *it) {
+    int l = it->lane;
+    if (q->tail[l]) q->tail[l]->next = it;
+    else q->head[l] = it;
+    q->tail[l] = it;
+    q->pending++;
+    q->bytes += it->len + it->file_len;
+}
+
+/* Room for n more bytes: the oldest bulk frames go first. False if that
+ * is not enough. */
+static bool make_room(OutQ *q, size_t n) {
+    int l = OUTQ_LANES - 1;
+    while (q->bytes + n > OUTQ_MAX_BYTES && q->head[l]) {
+        OutItem *it = q->head[l];
+        q->head[l] = it->next;
+        if (!q->head[l]) q->tail[l] = NULL;
+        q->pending--;
+        q->bytes -= it->len + it->file_len;
+        q->shed++;
+        free_item(it);
+    }
+    return q->bytes + n <= OUTQ_MAX_BYTES;
+}
+
+/* A consumer that cannot keep up even with its bulk frames shed is cut
+ * off; shutting the socket down lets its reader see the end. */
+static void overflow(OutQ *q) {
+    q->closed = true;
+    drop_pending(q);
+    if (q->sock >= 0) shutdown(q->sock, SHUT_RDWR);
+}
+
+void outq_unref(OutQ *q) {
+    if (!q) return;
+    pthread_mutex_lock(&q->mtx);
+    int left = --q->refs;
+    pthread_mutex_unlock(&q->mtx);
+    if (left > 0) return;
+
+    q->flushing = false;
+    drop_pending(q);
+    zframe_free(q->z);
+    tls_free(q->tls);
+    if (q->sock >= 0) close(q->sock);
+    pthread_mutex_destroy(&q->mtx);
+    free(q);
+}
+
+/* First item that may go out now, from the most urgent lane that has one:
+ * anything ungated, or a gated request when the device is not still
+ * working on the previous one. */
+static OutItem* take_sendable(OutQ *q) {
+    if (q->awaiting && now_ms() >= q->await_until) {
+        q->awaiting = false;
+    }
+
+    for (int l = 0; l < OUTQ_LANES; l++) {
+        OutItem *prev = NULL;
+        for (OutItem *it = q->head[l]; it; prev = it, it = it->next) {
+            if (it->gated && q->awaiting) continue;
+
+            if (prev) prev->next = it->next;
+            else q->head[l] = it->next;
+            if (q->tail[l] == it) q->tail[l] = prev;
+            q->pending--;
+            q->bytes -= it->len + it->file_len;
+            it->next = NULL;
+            return it;
+        }
+    }
+    return NULL;
+}
+
+/* Only the flusher calls this, so the stream sees frames in send order. */
+static void encode_item(OutQ *q, OutItem *it) {
+    if (!it->deflate) return;
+    size_t n;
+    char *z = zframe_encode(q->z, it->buf, it->len, &n);
+    if (z) {
+        free(it->buf);
+        it->buf = z;
+        it->len = n;
+    }
+}
+
+/* Called with q->mtx held. Only one thread flushes at a time; the others
+ * just leave their item queued, which is what gives coalescing a window.
+ * Nothing here blocks: a frame the socket only takes part of stays in cur
+ * and the flusher thread finishes it when the socket drains. */
+static void flush_locked(OutQ *q) {
+    if (q->flushing) return;
+    if (q->wake) {
+        if (!q->dirty && !q->closed) {
+            q->dirty = true;
+            q->wake(q);
+        }
+        return;
+    }
+    q->flushing = true;
+
+    short events = 0;
+    while (!q->closed) {
+        OutItem *it = q->cur;
+        bool fresh = !it;
+        if (fresh) {
+            if (!(it = take_sendable(q))) break;
+            if (it->gated) {
+                q->awaiting = true;
+                q->await_until = now_ms() + OUTQ_ACK_TIMEOUT_MS;
+            }
+            q->cur = it;
+        }
+        pthread_mutex_unlock(&q->mtx);
+        int rc = 0;
+        if (fresh) {
+            encode_item(q, it);
+            /* Only kTLS sends a file range without reading it in first. */
+            if (it->file_len && q->tls && !tls_ktls_send(q->tls) && inline_file(it) < 0) rc = -1;
+        }
+        if (rc == 0) rc = send_some(q, it, &events);
+        if (rc != 0) free_item(it);
+        pthread_mutex_lock(&q->mtx);
+        if (rc == 0) break;
+        q->cur = NULL;
+        if (rc < 0) {
+            q->closed = true;
+            drop_pending(q);
+        }
+    }
+    q->flushing = false;
+    if (q->closed) return;
+    if (q->cur) watch_sock(q, events);
+    timer_arm(q);
+}
+
+int outq_push(OutQ *q, const char *js, int lane, const char *key, bool gated,
+              const char *from, char *superseded, size_t superseded_len) {
+    if (!q || !js) return -1;
+    if (superseded && superseded_len) superseded[0] = '\0';
+
+    size_t n = strlen(js);
+    pthread_mutex_lock(&q->mtx);
+    if (q->closed) {
+        pthread_mutex_unlock(&q->mtx);
+        return -1;
+    }
+
+    int rc = 0;
+    OutItem *same = NULL;
+    if (key && key[0]) {
+        for (int l = 0; l < OUTQ_LANES && !same; l++) {
+            for (OutItem *it = q->head[l]; it; it = it->next) {
+                if (strcmp(it->key, key) == 0) {
+                    same = it;
+                    break;
+                }
+            }
+        }
+    }
+
+    char *buf = malloc(n + 1);
+    if (!buf) {
+        pthread_mutex_unlock(&q->mtx);
+        return -1;
+    }
+    memcpy(buf, js, n);
+    buf[n] = '\n';
+
+    if (same) {
+        /* Latest state wins: keep the queue slot, swap the payload. */
+        if (superseded && superseded_len) {
+            strncpy(superseded, same->from, superseded_len - 1);
+            superseded[superseded_len - 1] = '\0';
+        }
+        q->bytes = q->bytes - same->len + n + 1;
+        free(same->buf);
+        same->buf = buf;
+        same->deflate = q->z != NULL;
+        same->len = n + 1;
+        strncpy(same->from, from ? from : "", sizeof(same->from) - 1);
+        same->from[sizeof(same->from) - 1] = '\0';
+        q->coalesced++;
+        rc = 1;
+    } else {
+        bool fits = make_room(q, n + 1);
+        OutItem *it = fits ? calloc(1, sizeof(OutItem)) : NULL;
+        if (!it) {
+            if (!fits && clamp_lane(lane) == OUTQ_LANES - 1) q->shed++;
+            else if (!fits) overflow(q);
+            free(buf);
+            pthread_mutex_unlock(&q->mtx);
+            return -1;
+        }
+        it->buf = buf;
+        it->len = n + 1;
+        it->gated = gated;
+        it->deflate = q->z != NULL;
+        it->lane = clamp_lane(lane);
+        if (key) {
+            strncpy(it->key, key, sizeof(it->key) - 1);
+        }
+        if (from) {
+            strncpy(it->from, from, sizeof(it->from) - 1);
+        }
+
+        append(q, it);
+    }
+
+    flush_locked(q);
+    pthread_mutex_unlock(&q->mtx);
+    return rc;
+}
+
+int outq_push_file(OutQ *q, const char *js, int lane, int fd, off_t off, size_t len,
+                   void (*release)(void *arg), void *arg) {
+    if (!q || !js) return -1;
+    size_t n = strlen(js);
+    OutItem *it = calloc(1, sizeof(OutItem));
+    char *buf = malloc(n + 1);
+    if (!it || !buf) {
+        free(it);
+        free(buf);
+        return -1;
+    }
+    memcpy(buf, js, n);
+    buf[n] = '\n';
+    it->buf = buf;
+    it->len = n + 1;
+    it->lane = clamp_lane(lane);
+    it->file_fd = fd;
+    it->file_off = off;
+    it->file_len = len;
+
+    pthread_mutex_lock(&q->mtx);
+    if (q->closed || !make_room(q, it->len + len)) {
+        if (!q->closed && it->lane == OUTQ_LANES - 1) q->shed++;
+        else if (!q->closed) overflow(q);
+        pthread_mutex_unlock(&q->mtx);
+        free_item(it);
+        return -1;
+    }
+    it->release = release;
+    it->release_arg = arg;
+    append(q, it);
+    flush_locked(q);
+    pthread_mutex_unlock(&q->mtx);
+    return 0;
+}
+
+void outq_ack(OutQ *q) {
+    if (!q) return;
+    pthread_mutex_lock(&q->mtx);
+    q->awaiting = false;
+    flush_locked(q);
+    pthread_mutex_unlock(&q->mtx);
+}
+
+void outq_kick(OutQ *q) {
+    if (!q) return;
+    pthread_mutex_lock(&q->mtx);
+    flush_locked(q);
+    pthread_mutex_unlock(&q->mtx);
+}
+
+int outq_ack_wait(OutQ *q) {
+    if (!q) return -1;
+    pthread_mutex_lock(&q->mtx);
+    int ms = -1;
+    if (q->awaiting && q->pending > 0 && !q->closed && !q->flushing) {
+        uint64_t now = now_ms();
+        ms = now >= q->await_until ? 0 : (int)(q->await_until - now);
+    }
+    pthread_mutex_unlock(&q->mtx);
+    return ms;
+}
+
+OutItem* outq_take(OutQ *q) {
+    pthread_mutex_lock(&q->mtx);
+    OutItem *it = NULL;
+    if (!q->closed && !q->flushing) {
+        it = take_sendable(q);
+    }
+    if (it) {
+        q->flushing = true;
+        if (it->gated) {
+            q->awaiting = true;
+            q->await_until = now_ms() + OUTQ_ACK_TIMEOUT_MS;
+        }
+    } else {
+        q->dirty = false;
+    }
+    pthread_mutex_unlock(&q->mtx);
+    if (it && inline_file(it) < 0) {
+        outq_done(q, it, false);
+        return NULL;
+    }
+    if (it) encode_item(q, it);
+    return it;
+}
+
+void outq_done(OutQ *q, OutItem *it, bool ok) {
+    free_item(it);
+    pthread_mutex_lock(&q->mtx);
+    q->flushing = false;
+    if (!ok) {
+        q->closed = true;
+        drop_pending(q);
+    }
+    pthread_mutex_unlock(&q->mtx);
+}
+
+void outq_close(OutQ *q) {
+    if (!q) return;
+    pthread_mutex_lock(&q->mtx);
+    q->closed = true;
+    drop_pending(q);
+    if (q->watched) timer_wake();
+    pthread_mutex_unlock(&q->mtx);
+}
+
+void outq_detach(OutQ *q, outq_item_fn fn, void *arg) {
+    if (!q) return;
+    pthread_mutex_lock(&q->mtx);
+    q->closed = true;
+    while (q->flushing) {
+        pthread_mutex_unlock(&q->mtx);
+        poll(NULL, 0, 1);
+        pthread_mutex_lock(&q->mtx);
+    }
+    OutItem *cur = q->cur;
+    if (cur && cur->sent < cur->len) {
+        OutItem rest = *cur;
+        rest.buf += cur->sent;
+        rest.len -= cur->sent;
+        fn(&rest, arg);
+    }
+    if (q->watched) timer_wake();
+    for (int l = 0; l < OUTQ_LANES; l++) {
+        for (OutItem *it = q->head[l]; it; it = it->next) fn(it, arg);
+    }
+    drop_pending(q);
+    pthread_mutex_unlock(&q->mtx);
+}
+
+int outq_enable_deflate(OutQ *q) {
+    if (!q) return -1;
+    pthread_mutex_lock(&q->mtx);
+    if (!q->z) q->z = zframe_new();
+    int rc = q->z ? 0 : -1;
+    pthread_mutex_unlock(&q->mtx);
+    return rc;
+}
@@ -0,0 +1,162 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef struct {
+    pool_fn fn;
+    void *arg;
+} Job;
+
+/* Ring of jobs. The owner pushes and pops at the tail; thieves take from
+ * the head. */
+typedef struct {
+    pthread_mutex_t mtx;
+    Job *jobs;
+    size_t cap;
+    size_t head;
+    size_t len;
+} Deque;
+
+static Deque deques[POOL_MAX_WORKERS][POOL_LANES];
+static pthread_t tids[POOL_MAX_WORKERS];
+static int nworkers;
+static atomic_bool running;
+static atomic_uint next_deque;
+static _Atomic long pending;
+static pthread_mutex_t idle_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cv = PTHREAD_COND_INITIALIZER;
+static int idle;
+static _Thread_local int my_deque = -1;
+
+static int deque_push(Deque *d, Job j) {
+    pthread_mutex_lock(&d->mtx);
+    if (d->len == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        Job *jobs = malloc(cap * sizeof(Job));
+        if (!jobs) {
+            pthread_mutex_unlock(&d->mtx);
+            return -1;
+        }
+        for (size_t i = 0; i < d->len; i++) jobs[i] = d->jobs[(d->head + i) % d->cap];
+        free(d->jobs);
+        d->jobs = jobs;
+        d->cap = cap;
+        d->head = 0;
+    }
+    d->jobs[(d->head + d->len) % d->cap] = j;
+    d->len++;
+    pthread_mutex_unlock(&d->mtx);
+    return 0;
+}
+
+static bool deque_take(Deque *d, bool newest, Job *out) {
+    pthread_mutex_lock(&d->mtx);
+    bool got = d->len > 0;
+    if (got) {
+        if (newest) {
+            *out = d->jobs[(d->head + d->len - 1) % d->cap];
+        } else {
+            *out = d->jobs[d->head];
+            d->head = (d->head + 1) % d->cap;
+        }
+        d->len--;
+    }
+    pthread_mutex_unlock(&d->mtx);
+    return got;
+}
+
+static bool find_job(int self, Job *out) {
+    for (int l = 0; l < POOL_LANES; l++) {
+        if (deque_take(&deques[self][l], true, out)) return true;
+        for (int i = 1; i < nworkers; i++) {
+            if (deque_take(&deques[(self + i) % nworkers][l], false, out)) return true;
+        }
+    }
+    return false;
+}
+
+static void* worker(void *arg) {
+    int self = (int)(long)arg;
+    my_deque = self;
+
+    for (;;) {
+        Job j;
+        if (find_job(self, &j)) {
+            atomic_fetch_sub(&pending, 1);
+            j.fn(j.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_mtx);
+        if (atomic_load(&pending) == 0) {
+            if (!atomic_load(&running)) {
+                pthread_mutex_unlock(&idle_mtx);
+                break;
+            }
+            idle++;
+            pthread_cond_wait(&idle_cv, &idle_mtx);
+            idle--;
+        }
+        pthread_mutex_unlock(&idle_mtx);
+    }
+    return NULL;
+}
+
+int pool_init(int workers) {
+    if (workers < 0) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0) return 0;
+    if (workers > POOL_MAX_WORKERS) workers = POOL_MAX_WORKERS;
+
+    atomic_store(&running, true);
+    for (int i = 0; i < workers; i++) {
+        for (int l = 0; l < POOL_LANES; l++) pthread_mutex_init(&deques[i][l].mtx, NULL);
+        if (pthread_create(&tids[i], NULL, worker, (void*)(long)i) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        nworkers++;
+    }
+    if (nworkers == 0) {
+        atomic_store(&running, false);
+        return -1;
+    }
+    printf("Worker pool: %d thread(s)\n", nworkers);
+    return 0;
+}
+
+bool pool_enabled(void) {
+    return nworkers > 0 && atomic_load(&running);
+}
+
+int pool_submit(pool_fn fn, void *arg, int lane) {
+    if (!pool_enabled()) return -1;
+
+    int d = my_deque >= 0 ? my_deque
+                          : (int)(atomic_fetch_add(&next_deque, 1) % (unsigned)nworkers);
+    atomic_fetch_add(&pending, 1);
+    if (lane < 0) lane = 0;
+    if (lane >= POOL_LANES) lane = POOL_LANES - 1;
+    if (deque_push(&deques[d][lane], (Job){fn, arg}) < 0) {
+        atomic_fetch_sub(&pending, 1);
+        return -1;
+    }
+
+    pthread_mutex_lock(&idle_mtx);
+    if (idle > 0) pthread_cond_signal(&idle_cv);
+    pthread_mutex_unlock(&idle_mtx);
+    return 0;
+}
+
+void pool_stop(void) {
+    if (nworkers == 0) return;
+    pthread_mutex_lock(&idle_mtx);
+    atomic_store(&running, false);
+    pthread_cond_broadcast(&idle_cv);
+    pthread_mutex_unlock(&idle_mtx);
+    for (int i = 0; i < nworkers; i++) pthread_join(tids[i], NULL);
+    nworkers = 0;
+}
@@ -1,5 +1,6 @@
 #include "protocol.h"
 #include <json-c/json.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -14,14 +15,19 @@ const char* type_str(MsgType t) {
 }
 
 const char* action_str(Action a) {
-    switch(a) {
-        case ACT_REGISTER: return "register";
-        case ACT_LOGIN: return "login";
-        case ACT_CONTROL: return "control";
-        case ACT_STATUS: return "status";
-        case ACT_HEARTBEAT: return "heartbeat";
-        case ACT_LIST_DEVICES: return "list_devices";
-        case ACT_CHANGE_PASSWORD: return "change_password";
+    if ((unsigned)a >= ACT_COUNT) return "unknown";
+    return wire_actions[a].name;
+}
+
+const char* stamp_str(TraceStamp s) {
+    switch (s) {
+        case TS_CLIENT_SEND: return "client_send";
+        case TS_SERVER_RECV: return "server_recv";
+        case TS_SERVER_ROUTE: return "server_route";
+        case TS_DEVICE_RECV: return "device_recv";
+        case TS_DEVICE_REPLY: return "device_reply";
+        case TS_REPLY_RECV: return "reply_recv";
+        case TS_REPLY_ROUTE: return "reply_route";
         default: return "unknown";
     }
 }
@@ -33,16 +39,63 @@ static MsgType str_to_type(const char *s) {
 }
 
 static Action str_to_action(const char *s) {
-    if (strcmp(s, "register") == 0) return ACT_REGISTER;
-    if (strcmp(s, "login") == 0) return ACT_LOGIN;
-    if (strcmp(s, "control") == 0) return ACT_CONTROL;
-    if (strcmp(s, "status") == 0) return ACT_STATUS;
-    if (strcmp(s, "heartbeat") == 0) return ACT_HEARTBEAT;
-    if (strcmp(s, "list_devices") == 0) return ACT_LIST_DEVICES;
-    if (strcmp(s, "change_password") == 0) return ACT_CHANGE_PASSWORD;
+    for (int a = 0; a < ACT_COUNT; a++) {
+        if (strcmp(s, wire_actions[a].name) == 0) return (Action)a;
+    }
     return ACT_REGISTER;
 }
 
+static Prio str_to_prio(const char *s) {
+    if (strcmp(s, "high") == 0) return PRIO_HIGH;
+    if (strcmp(s, "normal") == 0) return PRIO_NORMAL;
+    if (strcmp(s, "bulk") == 0) return PRIO_BULK;
+    return PRIO_DEFAULT;
+}
+
+static const char* prio_str(Prio p) {
+    switch (p) {
+        case PRIO_HIGH: return "high";
+        case PRIO_NORMAL: return "normal";
+        case PRIO_BULK: return "bulk";
+        default: return NULL;
+    }
+}
+
+int action_lane(Action a) {
+    if ((unsigned)a >= ACT_COUNT) return PRIO_NORMAL - PRIO_HIGH;
+    return wire_actions[a].lane;
+}
+
+int msg_lane(const Message *m) {
+    if (m->prio == PRIO_DEFAULT) return action_lane(m->action);
+    return (int)m->prio - (int)PRIO_HIGH;
+}
+
+static void parse_trace(struct json_object *obj, TraceCtx *t) {
+    struct json_object *v;
+    if (!json_object_object_get_ex(obj, "id", &v)) return;
+    const char *id = json_object_get_string(v);
+    if (!id || !id[0]) return;
+    snprintf(t->id, sizeof(t->id), "%s", id);
+    for (int i = 0; i < TS_COUNT; i++) {
+        if (json_object_object_get_ex(obj, stamp_str((TraceStamp)i), &v)) {
+            t->ns[i] = (uint64_t)json_object_get_int64(v);
+        }
+    }
+}
+
+static struct json_object* trace_obj(const TraceCtx *t) {
+    struct json_object *o = json_object_new_object();
+    json_object_object_add(o, "id", json_object_new_string(t->id));
+    for (int i = 0; i < TS_COUNT; i++) {
+        if (t->ns[i]) {
+            json_object_object_add(o, stamp_str((TraceStamp)i),
+                                   json_object_new_int64((int64_t)t->ns[i]));
+        }
+    }
+    return o;
+}
+
 Message* parse_msg(const char *json) {
     if (!json) return NULL;
     
@@ -78,6 +131,16 @@ Message* parse_msg(const char *json) {
         m->timestamp = (uint64_t)time(NULL);
     }
     
+    struct json_object *prio;
+    if (json_object_object_get_ex(root, "priority", &prio)) {
+        m->prio = str_to_prio(json_object_get_string(prio));
+    }
+    
+    struct json_object *trace;
+    if (json_object_object_get_ex(root, "trace", &trace)) {
+        parse_trace(trace, &m->trace);
+    }
+    
     struct json_object *data;
     if (json_object_object_get_ex(root, "data", &data)) {
         m->data = json_object_get(data);
@@ -97,6 +160,12 @@ char* create_msg(Message *m) {
     json_object_object_add(root, "to", json_object_new_string(m->to));
     json_object_object_add(root, "action", json_object_new_string(action_str(m->action)));
     json_object_object_add(root, "timestamp", json_object_new_int64(m->timestamp));
+    if (prio_str(m->prio)) {
+        json_object_object_add(root, "priority", json_object_new_string(prio_str(m->prio)));
+    }
+    if (m->trace.id[0]) {
+        json_object_object_add(root, "trace", trace_obj(&m->trace));
+    }
     
     if (m->data) {
         json_object_object_add(root, "data", json_object_get((struct json_object*)m->data));
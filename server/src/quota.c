@@ -0,0 +1,161 @@
+#include "quota.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+static const char *class_names[QUOTA_CLASSES] = {"high", "normal", "bulk"};
+
+typedef struct {
+    char id[48];
+    double tokens[QUOTA_CLASSES];
+    double last;
+    double noticed[QUOTA_CLASSES];
+    uint64_t throttled;
+} Slot;
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+/* The extra slot at the end is the shared bucket, see find(). */
+static Slot slots[QUOTA_SLOTS + 1];
+static double rate = QUOTA_RATE;
+static double burst = 2 * QUOTA_RATE;
+static uint64_t throttled[QUOTA_CLASSES];
+static uint64_t paused_ms;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned hash_id(const char *id) {
+    unsigned h = 2166136261u;
+    while (*id) {
+        h ^= (unsigned char)*id++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void quota_init(double r, double b) {
+    pthread_mutex_lock(&mtx);
+    rate = r < 0 ? QUOTA_RATE : r;
+    burst = b >= 1 ? b : 2 * rate;
+    memset(slots, 0, sizeof(slots));
+    Slot *shared = &slots[QUOTA_SLOTS];
+    snprintf(shared->id, sizeof(shared->id), "%s", QUOTA_SHARED_ID);
+    for (int k = 0; k < QUOTA_CLASSES; k++) shared->tokens[k] = burst;
+    shared->last = now_sec();
+    pthread_mutex_unlock(&mtx);
+    if (rate > 0) {
+        printf("[QUOTA] %.0f msg/s per identity and class, burst %.0f\n", rate, burst);
+    }
+}
+
+bool quota_enabled(void) {
+    return rate > 0;
+}
+
+/* A bucket that has had time to refill completely is as good as a new
+ * one, so its slot can go to another identity. A slot still refilling is
+ * never taken over: its owner would come back to a full burst. When the
+ * probe window has no free slot, the identity shares the last bucket with
+ * every other one that found none. */
+static Slot* find(const char *id, double now) {
+    unsigned b = hash_id(id) & (QUOTA_SLOTS - 1);
+    Slot *free_slot = NULL;
+    for (int n = 0; n < QUOTA_PROBE; n++) {
+        Slot *s = &slots[(b + (unsigned)n) & (QUOTA_SLOTS - 1)];
+        if (s->id[0] && strcmp(s->id, id) == 0) return s;
+        if (!free_slot && (!s->id[0] || (now - s->last) * rate >= burst)) free_slot = s;
+    }
+    if (!free_slot) return &slots[QUOTA_SLOTS];
+
+    Slot *s = free_slot;
+    memset(s, 0, sizeof(*s));
+    snprintf(s->id, sizeof(s->id), "%s", id);
+    for (int k = 0; k < QUOTA_CLASSES; k++) s->tokens[k] = burst;
+    s->last = now;
+    return s;
+}
+
+unsigned quota_take(const char *id, int cls, bool *notify) {
+    *notify = false;
+    if (rate <= 0) return 0;
+    if (cls < 0) cls = 0;
+    if (cls >= QUOTA_CLASSES) cls = QUOTA_CLASSES - 1;
+
+    pthread_mutex_lock(&mtx);
+    double now = now_sec();
+    Slot *s = find(id, now);
+    for (int k = 0; k < QUOTA_CLASSES; k++) {
+        s->tokens[k] += (now - s->last) * rate;
+        if (s->tokens[k] > burst) s->tokens[k] = burst;
+    }
+    s->last = now;
+
+    unsigned wait_ms = 0;
+    if (s->tokens[cls] >= 1) {
+        s->tokens[cls] -= 1;
+    } else {
+        wait_ms = (unsigned)((1 - s->tokens[cls]) / rate * 1000) + 1;
+        s->throttled++;
+        throttled[cls]++;
+        if (now - s->noticed[cls] >= QUOTA_NOTICE_MS / 1000.0) {
+            s->noticed[cls] = now;
+            *notify = true;
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+    return wait_ms;
+}
+
+void quota_count_pause(unsigned ms) {
+    pthread_mutex_lock(&mtx);
+    paused_ms += ms;
+    pthread_mutex_unlock(&mtx);
+}
+
+struct json_object* quota_stats(void) {
+    struct json_object *o = json_object_new_object();
+    struct json_object *cls = json_object_new_object();
+    struct json_object *top = json_object_new_array();
+
+    pthread_mutex_lock(&mtx);
+    json_object_object_add(o, "rate", json_object_new_double(rate));
+    json_object_object_add(o, "burst", json_object_new_double(burst));
+    for (int k = 0; k < QUOTA_CLASSES; k++) {
+        json_object_object_add(cls, class_names[k], json_object_new_int64((int64_t)throttled[k]));
+    }
+    json_object_object_add(o, "throttled", cls);
+    json_object_object_add(o, "paused_ms", json_object_new_int64((int64_t)paused_ms));
+
+    /* Selection by repeated scan: QUOTA_TOP is small. */
+    const Slot *picked[QUOTA_TOP];
+    int npicked = 0;
+    uint64_t below = UINT64_MAX;
+    while (npicked < QUOTA_TOP) {
+        const Slot *best = NULL;
+        for (int i = 0; i <= QUOTA_SLOTS; i++) {
+            const Slot *s = &slots[i];
+            if (!s->id[0] || s->throttled == 0 || s->throttled > below) continue;
+            bool seen = false;
+            for (int j = 0; j < npicked && !seen; j++) seen = picked[j] == s;
+            if (!seen && (!best || s->throttled > best->throttled)) best = s;
+        }
+        if (!best) break;
+        picked[npicked++] = best;
+        below = best->throttled;
+    }
+    for (int j = 0; j < npicked; j++) {
+        struct json_object *e = json_object_new_object();
+        json_object_object_add(e, "id", json_object_new_string(picked[j]->id));
+        json_object_object_add(e, "throttled", json_object_new_int64((int64_t)picked[j]->throttled));
+        json_object_array_add(top, e);
+    }
+    pthread_mutex_unlock(&mtx);
+
+    json_object_object_add(o, "identities", top);
+    return o;
+}
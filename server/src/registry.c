@@ -0,0 +1,393 @@
+#include "registry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+
+/* Entries are immutable once published and shared by every snapshot that
+ * contains them, so a write copies pointers rather than Conns. An entry
+ * holds the ref on its OutQ and is freed with the snapshot it was last
+ * replaced in. since is when an offline entry went offline. */
+typedef struct RegEntry {
+    Conn c;
+    time_t since;
+    struct RegEntry *next_dead;
+} RegEntry;
+
+typedef struct RegSnap {
+    int cnt;
+    int cap;
+    unsigned mask;
+    int *index;
+    RegEntry **conns;
+    RegEntry *dead;
+    uint64_t retired_at;
+    struct RegSnap *next_retired;
+} RegSnap;
+
+/* epoch is the global epoch a reader saw on entry, 0 while outside. */
+typedef struct {
+    _Alignas(64) _Atomic uint64_t epoch;
+    atomic_bool used;
+} ReaderSlot;
+
+static ReaderSlot slots[REG_MAX_READERS];
+static _Atomic uint64_t global_epoch = 1;
+/* Each shard is its own snapshot, so a write copies only the shard that
+ * holds the id. */
+static RegSnap *_Atomic current[REG_SHARDS];
+static pthread_mutex_t writer_mtx = PTHREAD_MUTEX_INITIALIZER;
+static RegSnap *retired;
+static time_t last_sweep;
+
+static _Thread_local int my_slot = -1;
+static _Thread_local int last_slot = -1;
+static _Thread_local int depth;
+
+static bool slot_try(int i) {
+    bool f = false;
+    if (atomic_load_explicit(&slots[i].used, memory_order_relaxed)) return false;
+    return atomic_compare_exchange_strong(&slots[i].used, &f, true);
+}
+
+/* A slot is held only for the outermost read section, so any number of
+ * threads can read; all slots are busy only while REG_MAX_READERS reads
+ * are in progress at once, and those end without waiting on anything. */
+static int slot_acquire(void) {
+    if (last_slot >= 0 && slot_try(last_slot)) return last_slot;
+    unsigned start = (unsigned)(uintptr_t)&depth / 64;
+    for (;;) {
+        for (int n = 0; n < REG_MAX_READERS; n++) {
+            int i = (int)((start + (unsigned)n) % REG_MAX_READERS);
+            if (slot_try(i)) return last_slot = i;
+        }
+        sched_yield();
+    }
+}
+
+/* The slot store and the snapshot load are both seq_cst, as are the
+ * writer's publish and its slot scan: either the writer sees this reader,
+ * or this reader sees the new snapshot. */
+static void read_enter(void) {
+    if (depth++ == 0) {
+        my_slot = slot_acquire();
+        atomic_store(&slots[my_slot].epoch, atomic_load(&global_epoch));
+    }
+}
+
+static void read_exit(void) {
+    if (--depth == 0) {
+        atomic_store_explicit(&slots[my_slot].epoch, 0, memory_order_release);
+        atomic_store_explicit(&slots[my_slot].used, false, memory_order_release);
+        my_slot = -1;
+    }
+}
+
+/* Oldest epoch any reader is still in; readers at or past it cannot see
+ * snapshots retired before it. */
+static uint64_t oldest_reader(void) {
+    uint64_t min = UINT64_MAX;
+    for (int i = 0; i < REG_MAX_READERS; i++) {
+        uint64_t e = atomic_load(&slots[i].epoch);
+        if (e != 0 && e < min) min = e;
+    }
+    return min;
+}
+
+static unsigned hash_id(const char *id) {
+    unsigned h = 2166136261u;
+    while (*id) {
+        h ^= (unsigned char)*id++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* The top bits pick the shard, the low bits the bucket inside it. */
+static int shard_of(const char *id) {
+    return (int)(hash_id(id) >> 26) % REG_SHARDS;
+}
+
+static int snap_find(const RegSnap *s, const char *id) {
+    unsigned b = hash_id(id) & s->mask;
+    for (unsigned n = 0; n <= s->mask; n++) {
+        int slot = s->index[b];
+        if (slot == 0) return -1;
+        if (strcmp(s->conns[slot - 1]->c.id, id) == 0) return slot - 1;
+        b = (b + 1) & s->mask;
+    }
+    return -1;
+}
+
+static void snap_index(RegSnap *s, int i) {
+    unsigned b = hash_id(s->conns[i]->c.id) & s->mask;
+    while (s->index[b] != 0) b = (b + 1) & s->mask;
+    s->index[b] = i + 1;
+}
+
+/* The index keeps at least half its buckets empty. */
+static RegSnap* snap_alloc(int cap) {
+    unsigned buckets = REG_BUCKETS;
+    while (buckets < (unsigned)cap * 2) buckets *= 2;
+    RegSnap *s = calloc(1, sizeof(RegSnap) + (size_t)cap * sizeof(RegEntry*) +
+                           buckets * sizeof(int));
+    if (!s) return NULL;
+    s->cap = cap;
+    s->mask = buckets - 1;
+    s->conns = (RegEntry**)(s + 1);
+    s->index = (int*)(s->conns + cap);
+    return s;
+}
+
+static RegEntry* entry_new(const Conn *c) {
+    RegEntry *e = malloc(sizeof(RegEntry));
+    if (!e) return NULL;
+    e->c = *c;
+    e->c.q = outq_ref(c->q);
+    e->since = 0;
+    e->next_dead = NULL;
+    return e;
+}
+
+static void snap_free(RegSnap *s) {
+    while (s->dead) {
+        RegEntry *e = s->dead;
+        s->dead = e->next_dead;
+        outq_unref(e->c.q);
+        free(e);
+    }
+    free(s);
+}
+
+static void reclaim(void) {
+    uint64_t oldest = oldest_reader();
+    RegSnap **pp = &retired;
+    while (*pp) {
+        RegSnap *s = *pp;
+        if (s->retired_at <= oldest) {
+            *pp = s->next_retired;
+            snap_free(s);
+        } else {
+            pp = &s->next_retired;
+        }
+    }
+}
+
+/* Called with writer_mtx held. The entries replaced by the write (a
+ * next_dead chain) go down with the old snapshot once no reader can reach
+ * them, so a writer never waits for readers. */
+static void publish(int shard, RegSnap *next, RegEntry *replaced) {
+    RegSnap *old = atomic_exchange(&current[shard], next);
+    while (replaced) {
+        RegEntry *e = replaced;
+        replaced = e->next_dead;
+        e->next_dead = old->dead;
+        old->dead = e;
+    }
+    old->retired_at = atomic_fetch_add(&global_epoch, 1) + 1;
+    old->next_retired = retired;
+    retired = old;
+    reclaim();
+}
+
+/* Room for one more entry; the index is rebuilt when the table grows. */
+static RegSnap* snap_clone(int shard) {
+    const RegSnap *cur = atomic_load(&current[shard]);
+    int cap = cur->cnt < cur->cap ? cur->cap : cur->cap * 2;
+    RegSnap *s = snap_alloc(cap);
+    if (!s) return NULL;
+    s->cnt = cur->cnt;
+    memcpy(s->conns, cur->conns, (size_t)cur->cnt * sizeof(RegEntry*));
+    if (cap == cur->cap) {
+        memcpy(s->index, cur->index, (cur->mask + 1) * sizeof(int));
+    } else {
+        for (int i = 0; i < s->cnt; i++) snap_index(s, i);
+    }
+    return s;
+}
+
+static bool expired(const RegEntry *e, time_t cutoff) {
+    return !e->c.online && e->since <= cutoff;
+}
+
+/* The shard without drop and without entries offline since cutoff or
+ * earlier; the index is rebuilt. */
+static RegSnap* snap_filter(int shard, const RegEntry *drop, time_t cutoff) {
+    const RegSnap *cur = atomic_load(&current[shard]);
+    RegSnap *s = snap_alloc(cur->cap);
+    if (!s) return NULL;
+    for (int i = 0; i < cur->cnt; i++) {
+        RegEntry *e = cur->conns[i];
+        if (e == drop || expired(e, cutoff)) continue;
+        s->conns[s->cnt] = e;
+        snap_index(s, s->cnt++);
+    }
+    return s;
+}
+
+int reg_init(void) {
+    for (int i = 0; i < REG_SHARDS; i++) {
+        RegSnap *s = snap_alloc(REG_BUCKETS / 2);
+        if (!s) return -1;
+        atomic_store(&current[i], s);
+    }
+    return 0;
+}
+
+int reg_upsert(const Conn *c) {
+    RegEntry *e = entry_new(c);
+    if (!e) return -1;
+    if (!c->online) e->since = time(NULL);
+    int shard = shard_of(c->id);
+    pthread_mutex_lock(&writer_mtx);
+    RegSnap *s = snap_clone(shard);
+    if (!s) {
+        pthread_mutex_unlock(&writer_mtx);
+        outq_unref(e->c.q);
+        free(e);
+        return -1;
+    }
+
+    RegEntry *replaced = NULL;
+    int i = snap_find(s, c->id);
+    if (i >= 0) {
+        replaced = s->conns[i];
+        s->conns[i] = e;
+    } else {
+        s->conns[s->cnt] = e;
+        snap_index(s, s->cnt++);
+    }
+
+    publish(shard, s, replaced);
+    pthread_mutex_unlock(&writer_mtx);
+    return 0;
+}
+
+/* A device stays known, offline, until reg_expire forgets it; a client
+ * has nothing to keep and is removed. */
+bool reg_drop(const char *id, OutQ *q) {
+    if (!q || !id[0]) return false;
+    int shard = shard_of(id);
+    pthread_mutex_lock(&writer_mtx);
+    const RegSnap *cur = atomic_load(&current[shard]);
+    int i = snap_find(cur, id);
+    if (i < 0 || cur->conns[i]->c.q != q) {
+        pthread_mutex_unlock(&writer_mtx);
+        return false;
+    }
+
+    RegSnap *s = NULL;
+    RegEntry *e = NULL;
+    if (cur->conns[i]->c.is_dev) {
+        Conn off = cur->conns[i]->c;
+        off.online = false;
+        off.q = NULL;
+        e = entry_new(&off);
+        if (e) e->since = time(NULL);
+        s = e ? snap_clone(shard) : NULL;
+    } else {
+        s = snap_filter(shard, cur->conns[i], -1);
+    }
+    if (!s) {
+        free(e);
+        pthread_mutex_unlock(&writer_mtx);
+        return false;
+    }
+
+    RegEntry *replaced = cur->conns[i];
+    if (e) s->conns[i] = e;
+    publish(shard, s, replaced);
+    pthread_mutex_unlock(&writer_mtx);
+    return true;
+}
+
+int reg_expire(unsigned ttl_sec, reg_visit_fn fn, void *arg) {
+    time_t now = time(NULL);
+    int n = 0;
+    pthread_mutex_lock(&writer_mtx);
+    if (now - last_sweep < REG_SWEEP_SEC) {
+        pthread_mutex_unlock(&writer_mtx);
+        return 0;
+    }
+    last_sweep = now;
+    time_t cutoff = now - (time_t)ttl_sec;
+    for (int shard = 0; shard < REG_SHARDS; shard++) {
+        const RegSnap *cur = atomic_load(&current[shard]);
+        int i;
+        for (i = 0; i < cur->cnt && !expired(cur->conns[i], cutoff); i++) {}
+        if (i == cur->cnt) continue;
+        RegSnap *s = snap_filter(shard, NULL, cutoff);
+        if (!s) continue;
+
+        RegEntry *gone = NULL;
+        for (; i < cur->cnt; i++) {
+            RegEntry *e = cur->conns[i];
+            if (!expired(e, cutoff)) continue;
+            if (fn) fn(&e->c, arg);
+            e->next_dead = gone;
+            gone = e;
+            n++;
+        }
+        publish(shard, s, gone);
+    }
+    pthread_mutex_unlock(&writer_mtx);
+    return n;
+}
+
+OutQ* reg_lookup(const char *id, bool *is_dev) {
+    OutQ *q = NULL;
+    read_enter();
+    const RegSnap *s = atomic_load(&current[shard_of(id)]);
+    int i = snap_find(s, id);
+    if (i >= 0 && s->conns[i]->c.online) {
+        q = outq_ref(s->conns[i]->c.q);
+        if (is_dev) *is_dev = s->conns[i]->c.is_dev;
+    }
+    read_exit();
+    return q;
+}
+
+/* Known as a device, online or not. */
+bool reg_is_device(const char *id) {
+    read_enter();
+    const RegSnap *s = atomic_load(&current[shard_of(id)]);
+    int i = snap_find(s, id);
+    bool dev = i >= 0 && s->conns[i]->c.is_dev;
+    read_exit();
+    return dev;
+}
+
+uint64_t reg_udp_nonce(const char *id) {
+    read_enter();
+    const RegSnap *s = atomic_load(&current[shard_of(id)]);
+    int i = snap_find(s, id);
+    uint64_t nonce = i >= 0 && s->conns[i]->c.is_dev ? s->conns[i]->c.udp_nonce : 0;
+    read_exit();
+    return nonce;
+}
+
+void reg_foreach(reg_visit_fn fn, void *arg) {
+    read_enter();
+    for (int shard = 0; shard < REG_SHARDS; shard++) {
+        const RegSnap *s = atomic_load(&current[shard]);
+        for (int i = 0; i < s->cnt; i++) {
+            if (s->conns[i]->c.online) fn(&s->conns[i]->c, arg);
+        }
+    }
+    read_exit();
+}
+
+void reg_foreach_offline(reg_visit_fn fn, void *arg) {
+    read_enter();
+    for (int shard = 0; shard < REG_SHARDS; shard++) {
+        const RegSnap *s = atomic_load(&current[shard]);
+        for (int i = 0; i < s->cnt; i++) {
+            if (!s->conns[i]->c.online && s->conns[i]->c.is_dev) fn(&s->conns[i]->c, arg);
+        }
+    }
+    read_exit();
+}
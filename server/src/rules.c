@@ -0,0 +1,252 @@
+#include "rules.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* Rules are compiled once into a hash index on (device, attribute), so a
+ * status report only looks at the rules that name that exact pair. The
+ * index is never modified after loading and needs no lock. */
+
+typedef enum {
+    OP_EQUALS,
+    OP_ABOVE,
+    OP_BELOW
+} RuleOp;
+
+typedef struct {
+    char device[32];
+    struct json_object *data;
+} RuleAction;
+
+typedef struct {
+    char name[48];
+    RuleOp op;
+    char sval[64];
+    double nval;
+    int win_from;
+    int win_to;
+    RuleAction *actions;
+    int nactions;
+    atomic_bool active;
+} Rule;
+
+typedef struct TrigKey {
+    struct TrigKey *next;
+    char device[32];
+    char attr[32];
+    int *rules;
+    int nrules;
+} TrigKey;
+
+static Rule *rules;
+static int nrules;
+static TrigKey **index_tab;
+static unsigned index_mask;
+
+static unsigned hash_key(const char *dev, const char *attr) {
+    unsigned h = 2166136261u;
+    for (const char *p = dev; *p; p++) h = (h ^ (unsigned char)*p) * 16777619u;
+    h = (h ^ '/') * 16777619u;
+    for (const char *p = attr; *p; p++) h = (h ^ (unsigned char)*p) * 16777619u;
+    return h;
+}
+
+static TrigKey* find_key(const char *dev, const char *attr) {
+    for (TrigKey *k = index_tab[hash_key(dev, attr) & index_mask]; k; k = k->next) {
+        if (strcmp(k->device, dev) == 0 && strcmp(k->attr, attr) == 0) return k;
+    }
+    return NULL;
+}
+
+/* Values compare as text, so "on", true and 1 each only match themselves. */
+static const char* value_str(struct json_object *v, char *buf, size_t n) {
+    switch (json_object_get_type(v)) {
+        case json_type_string: return json_object_get_string(v);
+        case json_type_boolean: return json_object_get_boolean(v) ? "true" : "false";
+        case json_type_int:
+        case json_type_double:
+            snprintf(buf, n, "%g", json_object_get_double(v));
+            return buf;
+        default: return NULL;
+    }
+}
+
+static int parse_hhmm(struct json_object *o) {
+    int h, m;
+    if (!o || sscanf(json_object_get_string(o), "%d:%d", &h, &m) != 2) return -1;
+    if (h < 0 || h > 23 || m < 0 || m > 59) return -1;
+    return h * 60 + m;
+}
+
+static int compile_rule(struct json_object *jr, Rule *r, char *dev, char *attr) {
+    struct json_object *when, *then, *o;
+    if (!json_object_object_get_ex(jr, "when", &when) ||
+        !json_object_object_get_ex(jr, "then", &then) ||
+        json_object_get_type(then) != json_type_array) return -1;
+
+    if (json_object_object_get_ex(jr, "name", &o)) {
+        snprintf(r->name, sizeof(r->name), "%s", json_object_get_string(o));
+    }
+    if (!json_object_object_get_ex(when, "device", &o)) return -1;
+    snprintf(dev, 32, "%s", json_object_get_string(o));
+    if (!json_object_object_get_ex(when, "attribute", &o)) return -1;
+    snprintf(attr, 32, "%s", json_object_get_string(o));
+
+    char buf[32];
+    if (json_object_object_get_ex(when, "equals", &o)) {
+        const char *s = value_str(o, buf, sizeof(buf));
+        if (!s) return -1;
+        r->op = OP_EQUALS;
+        snprintf(r->sval, sizeof(r->sval), "%s", s);
+    } else if (json_object_object_get_ex(when, "above", &o)) {
+        r->op = OP_ABOVE;
+        r->nval = json_object_get_double(o);
+    } else if (json_object_object_get_ex(when, "below", &o)) {
+        r->op = OP_BELOW;
+        r->nval = json_object_get_double(o);
+    } else {
+        return -1;
+    }
+
+    r->win_from = r->win_to = -1;
+    struct json_object *win;
+    if (json_object_object_get_ex(jr, "window", &win)) {
+        struct json_object *from = NULL, *to = NULL;
+        json_object_object_get_ex(win, "from", &from);
+        json_object_object_get_ex(win, "to", &to);
+        r->win_from = parse_hhmm(from);
+        r->win_to = parse_hhmm(to);
+        if (r->win_from < 0 || r->win_to < 0) return -1;
+    }
+
+    size_t n = json_object_array_length(then);
+    r->actions = calloc(n ? n : 1, sizeof(RuleAction));
+    if (!r->actions) return -1;
+    for (size_t i = 0; i < n; i++) {
+        struct json_object *ja = json_object_array_get_idx(then, i), *data;
+        if (!json_object_object_get_ex(ja, "device", &o) ||
+            !json_object_object_get_ex(ja, "data", &data)) return -1;
+        RuleAction *a = &r->actions[r->nactions++];
+        snprintf(a->device, sizeof(a->device), "%s", json_object_get_string(o));
+        a->data = json_object_get(data);
+    }
+    return 0;
+}
+
+static int index_add(const char *dev, const char *attr, int rule) {
+    TrigKey *k = find_key(dev, attr);
+    if (!k) {
+        k = calloc(1, sizeof(TrigKey));
+        if (!k) return -1;
+        snprintf(k->device, sizeof(k->device), "%s", dev);
+        snprintf(k->attr, sizeof(k->attr), "%s", attr);
+        unsigned b = hash_key(dev, attr) & index_mask;
+        k->next = index_tab[b];
+        index_tab[b] = k;
+    }
+    int *grown = realloc(k->rules, (size_t)(k->nrules + 1) * sizeof(int));
+    if (!grown) return -1;
+    k->rules = grown;
+    k->rules[k->nrules++] = rule;
+    return 0;
+}
+
+int rules_load(const char *path) {
+    struct json_object *root = json_object_from_file(path);
+    struct json_object *list;
+    if (!root || !json_object_object_get_ex(root, "rules", &list) ||
+        json_object_get_type(list) != json_type_array) {
+        fprintf(stderr, "[RULE] Cannot read rules from %s\n", path);
+        if (root) json_object_put(root);
+        return -1;
+    }
+
+    size_t n = json_object_array_length(list);
+    unsigned buckets = 64;
+    while (buckets < n * 2) buckets <<= 1;
+
+    rules = calloc(n ? n : 1, sizeof(Rule));
+    index_tab = calloc(buckets, sizeof(TrigKey*));
+    if (!rules || !index_tab) {
+        json_object_put(root);
+        return -1;
+    }
+    index_mask = buckets - 1;
+
+    for (size_t i = 0; i < n; i++) {
+        char dev[32], attr[32];
+        Rule *r = &rules[nrules];
+        snprintf(r->name, sizeof(r->name), "rule%zu", i);
+        if (compile_rule(json_object_array_get_idx(list, i), r, dev, attr) < 0 ||
+            index_add(dev, attr, nrules) < 0) {
+            fprintf(stderr, "[RULE] Skipping invalid rule %zu (%s)\n", i, r->name);
+            for (int a = 0; a < r->nactions; a++) json_object_put(r->actions[a].data);
+            free(r->actions);
+            memset(r, 0, sizeof(*r));
+            continue;
+        }
+        nrules++;
+    }
+
+    json_object_put(root);
+    printf("[RULE] Loaded %d rule(s) from %s\n", nrules, path);
+    return nrules;
+}
+
+static bool in_window(const Rule *r, int now_min) {
+    if (r->win_from < 0) return true;
+    if (r->win_from <= r->win_to) return now_min >= r->win_from && now_min < r->win_to;
+    return now_min >= r->win_from || now_min < r->win_to;
+}
+
+static bool matches(const Rule *r, struct json_object *v) {
+    char buf[32];
+    if (r->op == OP_EQUALS) {
+        const char *s = value_str(v, buf, sizeof(buf));
+        return s && strcmp(s, r->sval) == 0;
+    }
+    json_type t = json_object_get_type(v);
+    if (t != json_type_int && t != json_type_double && t != json_type_string) return false;
+    double d = json_object_get_double(v);
+    return r->op == OP_ABOVE ? d > r->nval : d < r->nval;
+}
+
+void rules_eval(const char *device, struct json_object *data,
+                rule_emit_fn emit, void *arg) {
+    if (!index_tab || !data || json_object_get_type(data) != json_type_object) return;
+
+    int now_min = -1;
+    json_object_object_foreach(data, attr, val) {
+        TrigKey *k = find_key(device, attr);
+        if (!k) continue;
+
+        for (int i = 0; i < k->nrules; i++) {
+            Rule *r = &rules[k->rules[i]];
+            if (!matches(r, val)) {
+                atomic_store(&r->active, false);
+                continue;
+            }
+            if (atomic_load(&r->active)) continue;
+
+            if (r->win_from >= 0 && now_min < 0) {
+                time_t t = time(NULL);
+                struct tm tm;
+                localtime_r(&t, &tm);
+                now_min = tm.tm_hour * 60 + tm.tm_min;
+            }
+            if (!in_window(r, now_min)) continue;
+
+            /* Only one of several concurrent reports gets to fire it. */
+            bool was = false;
+            if (!atomic_compare_exchange_strong(&r->active, &was, true)) continue;
+
+            printf("[RULE] %s fired on %s.%s\n", r->name, device, attr);
+            for (int a = 0; a < r->nactions; a++) {
+                emit(r->name, r->actions[a].device, r->actions[a].data, arg);
+            }
+        }
+    }
+}
@@ -1,52 +1,248 @@
+#define _GNU_SOURCE
 #include "server.h"
 #include "protocol.h"
+#include "auth.h"
+#include "linebuf.h"
+#include "uring.h"
+#include "registry.h"
+#include "admit.h"
+#include "offline.h"
+#include "rules.h"
+#include "home.h"
+#include "udp.h"
+#include "capture.h"
+#include "pool.h"
+#include "handoff.h"
+#include "ota.h"
+#include "trace.h"
+#include "quota.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <json-c/json.h>
 #include <time.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+_Static_assert(sizeof(((LoginResp*)0)->token) >= AUTH_TOKEN_LEN, "schema token too short");
+_Static_assert(sizeof(((RegisterResp*)0)->udp_key) >= UDP_KEY_LEN * 2 + 1, "schema udp_key too short");
 
 static int srv_sock = -1;
+static int unix_sock = -1;
+static char unix_path[108];
 static bool running = false;
+static const char *io_backend = "threads";
 static char admin_password[32] = "admin";
-
-typedef struct {
-    Conn conns[MAX_CONN];
-    int cnt;
-    pthread_mutex_t mtx;
-} ConnList;
-
-static ConnList list = {.cnt = 0, .mtx = PTHREAD_MUTEX_INITIALIZER};
+static _Atomic uint32_t conn_serial;
+static int srv_port;
+
+/* Process upgrade (see handoff.h). Connection threads park on live_cv
+ * while the new process connects, then each sends its own socket over. */
+static int handoff_sock = -1;
+static int handoff_ch = -1;
+static char handoff_path[108];
+static pthread_mutex_t handoff_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t live_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t live_cv = PTHREAD_COND_INITIALIZER;
+static Conn *live;
+static int live_count;
+static int parked_count;
+static atomic_bool handing_off;
+static bool handoff_go;
+static struct json_object *adopted;
+static int adopted_udp = -1;
+static unsigned char adopted_udp_secret[UDP_SECRET_LEN];
 
 static void* handle_conn(void *arg);
 static void handle_msg(Conn *c, const char *json);
 static void route_msg(Message *m);
-static void handle_list_devices(Conn *c);
-static void send_error_response(Conn *c, const char *action, const char *error_msg);
+static bool route_local(Message *m);
+static void deliver_parked(const char *id, OutQ *q);
+static void handle_list_devices(Conn *c, Message *m);
+static void handle_cluster_hello(Conn *c, Message *m);
+static void handle_assign_room(Conn *c, Message *m);
+static void handle_home_status(Conn *c, Message *m);
+static void handle_query_devices(Conn *c, Message *m);
+static void handle_ota(Conn *c, Message *m);
+static void handle_trace(Conn *c, Message *m);
+static void send_error_response(Conn *c, Action action, const char *error_msg);
+static void send_retry_later(Conn *c, const char *to, Action action, const char *why,
+                             unsigned wait_ms);
+static void send_server_response(Conn *c, Action action, struct json_object *d);
+static void send_route_status(const char *to, Message *m, MsgType type, const char *status);
+static int takeover(const SrvConfig *cfg);
+static void adopt_conns(pthread_attr_t *attr);
+static void handoff_out(void);
+
+/* The socket is non-blocking so the queue's writes never wait on it; a
+ * signal still breaks the wait for input (EINTR). */
+static int conn_recv(Conn *c, char *buf, size_t len) {
+    if (c->tls) return (int)tls_read(c->tls, buf, len);
+    for (;;) {
+        ssize_t n = recv(c->sock, buf, len, 0);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return (int)n;
+        struct pollfd p = {.fd = c->sock, .events = POLLIN};
+        if (poll(&p, 1, -1) < 0) return -1;
+    }
+}
+
+/* Changing the password rotates the token key, which also ends every
+ * password/token session opened under the old key. */
+static bool conn_authed(Conn *c) {
+    if (!c->logged_in) return false;
+    return c->is_dev || c->auth_gen == auth_generation();
+}
 
-int srv_init(void) {
-    if (pthread_mutex_init(&list.mtx, NULL) != 0) {
-        fprintf(stderr, "Mutex init failed\n");
+static void conn_send(Conn *c, const char *js, int lane) {
+    outq_push(c->q, js, lane, NULL, false, NULL, NULL, 0);
+}
+
+/* A handler running on the pool gets a copy of the connection, holding
+ * its own ref on the queue, so it can reply after the connection is gone. */
+typedef struct {
+    Conn c;
+    Message *m;
+    void (*fn)(Conn *c, Message *m);
+} SrvJob;
+
+static void run_job(void *arg) {
+    SrvJob *j = arg;
+    j->fn(&j->c, j->m);
+    atomic_fetch_sub(&j->c.q->jobs, 1);
+    outq_unref(j->c.q);
+    free_msg(j->m);
+    free(j);
+}
+
+/* Hands m to the pool, which frees it; false if the caller should run it
+ * inline and keep ownership. A connection that already has SRV_MAX_JOBS
+ * queued runs the next one itself, so its reads stop while it does and
+ * one sender cannot fill the pool ahead of everyone else. */
+static bool offload(Conn *c, Message *m, void (*fn)(Conn *c, Message *m)) {
+    if (!pool_enabled() || atomic_load(&c->q->jobs) >= SRV_MAX_JOBS) return false;
+    SrvJob *j = malloc(sizeof(SrvJob));
+    if (!j) return false;
+    j->c = *c;
+    j->c.q = outq_ref(c->q);
+    j->m = m;
+    j->fn = fn;
+    atomic_fetch_add(&c->q->jobs, 1);
+    if (pool_submit(run_job, j, msg_lane(m)) < 0) {
+        atomic_fetch_sub(&c->q->jobs, 1);
+        outq_unref(j->c.q);
+        free(j);
+        return false;
+    }
+    return true;
+}
+
+static int list_upsert(Conn *c) {
+    if (reg_upsert(c) < 0) {
+        printf("[REGISTRY] Cannot add %s\n", c->id);
         return -1;
     }
+    cluster_announce(c->id, c->device_type, true);
+    return 0;
+}
+
+static void forget_device(const Conn *c, void *arg) {
+    (void)arg;
+    home_forget(c->id);
+}
+
+/* The connection stays anonymous when its id could not be registered.
+ * Devices gone for longer than anything could be parked for are forgotten
+ * here, so ids that come and go do not pile up. */
+static bool list_join(Conn *c, Action action) {
+    int n = reg_expire(offline_ttl(), forget_device, NULL);
+    if (n > 0) printf("[REGISTRY] Forgot %d device(s) offline for %us\n", n, offline_ttl());
+    if (list_upsert(c) == 0) return true;
+    c->id[0] = '\0';
+    c->is_dev = false;
+    c->logged_in = false;
+    c->scope[0] = '\0';
+    send_error_response(c, action, "unavailable");
+    return false;
+}
+
+typedef struct {
+    OutQ **qs;
+    size_t n, cap;
+} Watchers;
+
+static void add_watcher(const Conn *c, void *arg) {
+    Watchers *w = arg;
+    if (!c->logged_in || c->is_dev || c->is_peer || c->auth_gen != auth_generation()) return;
+    if (w->n == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 16;
+        OutQ **qs = realloc(w->qs, cap * sizeof(*qs));
+        if (!qs) return;
+        w->qs = qs;
+        w->cap = cap;
+    }
+    w->qs[w->n++] = outq_ref(c->q);
+}
+
+/* Tells the clients logged in here that a device came up, went away or
+ * changed state, so whatever they cached about it is stale. The queues are
+ * collected first: a push may write to the socket. */
+static void notify_device_event(const char *id, const char *event, const char *type,
+                                const char *state) {
+    Watchers w = {0};
+    reg_foreach(add_watcher, &w);
+    if (w.n == 0) return;
+
+    DeviceEvent ev = {.has_device_type = type && *type, .has_state = state != NULL};
+    snprintf(ev.device, sizeof(ev.device), "%s", id);
+    snprintf(ev.event, sizeof(ev.event), "%s", event);
+    if (ev.has_device_type) snprintf(ev.device_type, sizeof(ev.device_type), "%s", type);
+    if (state) snprintf(ev.state, sizeof(ev.state), "%s", state);
+    char now[16];
+    ev.has_power = state && home_device_state(id, now, sizeof(now), &ev.power) == 0;
+
+    Message m = {0};
+    m.type = MSG_NOTIFY;
+    strncpy(m.from, "server", sizeof(m.from) - 1);
+    strncpy(m.to, "*", sizeof(m.to) - 1);
+    m.action = ACT_DEVICE_EVENT;
+    m.timestamp = time(NULL);
+    m.data = device_event_encode(&ev);
+
+    char *js = create_msg(&m);
+    for (size_t i = 0; i < w.n; i++) {
+        if (js) outq_push(w.qs[i], js, msg_lane(&m), NULL, false, NULL, NULL, 0);
+        outq_unref(w.qs[i]);
+    }
+    free(js);
+    json_object_put(m.data);
+    free(w.qs);
+}
 
-    srv_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (srv_sock < 0) {
+static int listen_tcp(int port, int backlog) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
         perror("socket");
         return -1;
     }
 
     int opt = 1;
-    if (setsockopt(srv_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         perror("setsockopt");
-        close(srv_sock);
+        close(s);
         return -1;
     }
 
@@ -54,180 +250,1075 @@ int srv_init(void) {
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(PORT);
+    addr.sin_port = htons(port);
 
-    if (bind(srv_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind");
-        close(srv_sock);
+        close(s);
         return -1;
     }
 
-    if (listen(srv_sock, MAX_CONN) < 0) {
+    if (listen(s, backlog) < 0) {
         perror("listen");
-        close(srv_sock);
+        close(s);
         return -1;
     }
 
-    printf("Server listening on port %d\n", PORT);
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+    printf("Server listening on port %d%s\n", port,
+           tls_enabled() ? " (TLS)" : "");
+    return s;
+}
+
+/* The socket's directory must be ours and closed to everyone else, or
+ * another local user could put a socket of their own in its place. */
+static int private_dir(const char *path) {
+    char dir[108];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (!slash) snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir) slash[1] = '\0';
+    else *slash = '\0';
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    struct stat st;
+    if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & 022)) {
+        fprintf(stderr, "Refusing Unix socket in %s: not a directory only this user can write\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+/* Same protocol for clients on this host, without the TCP/IP stack. The
+ * socket (0600, in a private directory) stands in for TLS, so these
+ * connections are always plain. */
+static int listen_unix(const char *path, int backlog) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if (private_dir(path) < 0) return -1;
+
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    mode_t old = umask(077);
+    int rc = bind(s, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old);
+    if (rc < 0 || listen(s, backlog) < 0) {
+        perror(path);
+        close(s);
+        return -1;
+    }
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+    snprintf(unix_path, sizeof(unix_path), "%s", path);
+    printf("Server listening on %s\n", path);
+    return s;
+}
+
+/* A reconnect storm needs one descriptor per device. */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int read_sysctl(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    int v = -1;
+    if (fscanf(f, "%d", &v) != 1) v = -1;
+    fclose(f);
+    return v;
+}
+
+int srv_init(const SrvConfig *cfg) {
+    if (cfg->io_backend) io_backend = cfg->io_backend;
+    srv_port = cfg->port;
+
+    if (auth_init() < 0) {
+        fprintf(stderr, "Auth init failed\n");
+        return -1;
+    }
+
+    if (cfg->tls_cert && tls_server_init(cfg->tls_cert, cfg->tls_key) < 0) {
+        fprintf(stderr, "TLS init failed\n");
+        return -1;
+    }
+
+    if (reg_init() < 0) {
+        fprintf(stderr, "Registry init failed\n");
+        return -1;
+    }
+
+    admit_init(cfg->register_rate, cfg->register_burst);
+    quota_init(cfg->msg_rate, cfg->msg_burst);
+    offline_init(cfg->offline_ttl);
+
+    if (cfg->rules_file && rules_load(cfg->rules_file) < 0) {
+        return -1;
+    }
+    if (ota_init(cfg->firmware_dir) < 0) {
+        return -1;
+    }
+    raise_fd_limit();
+
+    int backlog = cfg->backlog > 0 ? cfg->backlog : SRV_BACKLOG;
+    if (cfg->takeover) {
+        if (takeover(cfg) < 0) return -1;
+    } else {
+        srv_sock = listen_tcp(cfg->port, backlog);
+        if (srv_sock < 0) return -1;
+    }
+
+    if (unix_sock < 0 && cfg->unix_path && cfg->unix_path[0]) {
+        unix_sock = listen_unix(cfg->unix_path, backlog);
+        if (unix_sock < 0) {
+            close(srv_sock);
+            return -1;
+        }
+    }
+
+    int somaxconn = read_sysctl("/proc/sys/net/core/somaxconn");
+    if (somaxconn > 0 && somaxconn < backlog) {
+        printf("[LISTEN] backlog %d capped by net.core.somaxconn=%d\n", backlog, somaxconn);
+    }
+
+    if (cluster_init(&cfg->cluster) < 0) {
+        close(srv_sock);
+        return -1;
+    }
+    if (adopted_udp >= 0) {
+        if (udp_adopt(adopted_udp, adopted_udp_secret) < 0) {
+            close(srv_sock);
+            return -1;
+        }
+    } else if (cfg->udp_port > 0 && udp_start(cfg->udp_port) < 0) {
+        close(srv_sock);
+        return -1;
+    }
+    if (cfg->capture_file && capture_open(cfg->capture_file) < 0) {
+        close(srv_sock);
+        return -1;
+    }
+    if (pool_init(cfg->workers) < 0) {
+        close(srv_sock);
+        return -1;
+    }
     printf("Default password: %s\n\n", admin_password);
     return 0;
 }
 
-void srv_start(void) {
-    running = true;
-    printf("Server started\n\n");
+Conn* srv_conn_open(int csock, const struct sockaddr_in *caddr) {
+    Conn *c = malloc(sizeof(Conn));
+    if (!c) {
+        fprintf(stderr, "malloc failed for Conn\n");
+        close(csock);
+        return NULL;
+    }
+    memset(c, 0, sizeof(Conn));
+    c->sock = csock;
+    if (caddr) {
+        /* Keep the unsent backlog in the OutQ, where lanes can reorder it,
+         * rather than in the kernel where it is strictly FIFO. */
+        int lowat = SRV_NOTSENT_LOWAT;
+        setsockopt(csock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+        strncpy(c->ip, inet_ntoa(caddr->sin_addr), sizeof(c->ip) - 1);
+        c->ip[sizeof(c->ip) - 1] = '\0';
+        c->port = ntohs(caddr->sin_port);
+    } else {
+        snprintf(c->ip, sizeof(c->ip), "unix");
+        c->local = true;
+    }
+    snprintf(c->id, sizeof(c->id), "tmp_%d", csock);
+    c->serial = atomic_fetch_add(&conn_serial, 1) + 1;
+    c->online = true;
+    c->is_dev = false;
+    c->logged_in = false;
+    c->device_type[0] = '\0';
+    c->q = outq_new(csock);
+    if (!c->q) {
+        fprintf(stderr, "outq_new failed\n");
+        close(csock);
+        free(c);
+        return NULL;
+    }
 
-    while (running) {
+    printf("[CONNECT] %s:%d\n", c->ip, c->port);
+    return c;
+}
+
+/* Drain everything queued on the listen socket before sleeping again;
+ * after a power blip the backlog fills all at once. */
+static void accept_all(int lsock, bool local, pthread_attr_t *attr) {
+    for (;;) {
         struct sockaddr_in caddr;
         socklen_t len = sizeof(caddr);
 
-        int csock = accept(srv_sock, (struct sockaddr*)&caddr, &len);
+        int csock = accept4(lsock, local ? NULL : (struct sockaddr*)&caddr,
+                            local ? NULL : &len, SOCK_CLOEXEC);
         if (csock < 0) {
             if (errno == EINTR) continue;
-            perror("accept");
-            continue;
-        }
-
-        Conn *c = malloc(sizeof(Conn));
-        if (!c) {
-            fprintf(stderr, "malloc failed for Conn\n");
-            close(csock);
-            continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                perror("accept");
+                poll(NULL, 0, 100);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            break;
         }
-        memset(c, 0, sizeof(Conn));
-        c->sock = csock;
-        strncpy(c->ip, inet_ntoa(caddr.sin_addr), sizeof(c->ip) - 1);
-        c->ip[sizeof(c->ip) - 1] = '\0';
-        c->port = ntohs(caddr.sin_port);
-        snprintf(c->id, sizeof(c->id), "tmp_%d", csock);
-        c->online = true;
-        c->is_dev = false;
-        c->logged_in = false;
-        c->device_type[0] = '\0';
 
-        printf("[CONNECT] %s:%d\n", c->ip, c->port);
+        Conn *c = srv_conn_open(csock, local ? NULL : &caddr);
+        if (!c) continue;
 
-        if (pthread_create(&c->tid, NULL, handle_conn, c) != 0) {
+        if (pthread_create(&c->tid, attr, handle_conn, c) != 0) {
             perror("pthread_create");
-            close(csock);
+            outq_unref(c->q);
             free(c);
-            continue;
         }
-        pthread_detach(c->tid);
     }
 }
 
+/* ---- Process upgrade ----
+ * The new binary runs with --takeover and connects to the handoff socket.
+ * Every connection thread stops reading and parks; once all have, udp,
+ * the pool and the cluster links stop, and each thread sends its socket,
+ * login state, queued frames and any half-read frame. The listeners go
+ * last, then this process exits. TLS, deflate and peer connections cannot
+ * be carried over and are closed; they reconnect. */
+
+static void hex_encode(const unsigned char *in, size_t n, char *out) {
+    for (size_t i = 0; i < n; i++) snprintf(out + i * 2, 3, "%02x", in[i]);
+}
+
+static int hex_decode(const char *in, unsigned char *out, size_t n) {
+    if (!in || strlen(in) != n * 2) return -1;
+    for (size_t i = 0; i < n; i++) {
+        unsigned v;
+        if (sscanf(in + i * 2, "%2x", &v) != 1) return -1;
+        out[i] = (unsigned char)v;
+    }
+    return 0;
+}
+
+static void live_add(Conn *c) {
+    pthread_mutex_lock(&live_mtx);
+    c->tid = pthread_self();
+    c->live_prev = NULL;
+    c->live_next = live;
+    if (live) live->live_prev = c;
+    live = c;
+    live_count++;
+    pthread_mutex_unlock(&live_mtx);
+}
+
+static void live_remove(Conn *c) {
+    pthread_mutex_lock(&live_mtx);
+    if (c->live_prev) c->live_prev->live_next = c->live_next;
+    else live = c->live_next;
+    if (c->live_next) c->live_next->live_prev = c->live_prev;
+    live_count--;
+    pthread_cond_broadcast(&live_cv);
+    pthread_mutex_unlock(&live_mtx);
+}
+
+static void add_pending(const OutItem *it, void *arg) {
+    if (it->file_len) return;
+    struct json_object *o = json_object_new_object();
+    json_object_object_add(o, "frame", json_object_new_string_len(it->buf, (int)it->len - 1));
+    json_object_object_add(o, "key", json_object_new_string(it->key));
+    json_object_object_add(o, "gated", json_object_new_boolean(it->gated));
+    json_object_object_add(o, "lane", json_object_new_int(it->lane));
+    json_object_object_add(o, "from", json_object_new_string(it->from));
+    json_object_array_add((struct json_object*)arg, o);
+}
+
+static int conn_handover(Conn *c, LineBuf *lb) {
+    struct json_object *rec = json_object_new_object();
+    json_object_object_add(rec, "kind", json_object_new_string("conn"));
+    json_object_object_add(rec, "id", json_object_new_string(c->id));
+    json_object_object_add(rec, "ip", json_object_new_string(c->ip));
+    json_object_object_add(rec, "port", json_object_new_int(c->port));
+    json_object_object_add(rec, "local", json_object_new_boolean(c->local));
+    json_object_object_add(rec, "is_dev", json_object_new_boolean(c->is_dev));
+    json_object_object_add(rec, "logged_in", json_object_new_boolean(c->logged_in));
+    json_object_object_add(rec, "auth_gen", json_object_new_int64(c->auth_gen));
+    json_object_object_add(rec, "scope", json_object_new_string(c->scope));
+    json_object_object_add(rec, "device_type", json_object_new_string(c->device_type));
+    json_object_object_add(rec, "udp_nonce", json_object_new_int64((int64_t)c->udp_nonce));
+
+    char home[32], room[32];
+    if (c->is_dev && home_locate(c->id, home, sizeof(home), room, sizeof(room)) == 0) {
+        json_object_object_add(rec, "home", json_object_new_string(home));
+        json_object_object_add(rec, "room", json_object_new_string(room));
+    }
+    json_object_object_add(rec, "partial",
+                           json_object_new_string_len(lb->buf + lb->off, (int)(lb->len - lb->off)));
+
+    struct json_object *pending = json_object_new_array();
+    outq_detach(c->q, add_pending, pending);
+    json_object_object_add(rec, "pending", pending);
+
+    pthread_mutex_lock(&handoff_mtx);
+    int rc = handoff_send(handoff_ch, rec, c->sock);
+    pthread_mutex_unlock(&handoff_mtx);
+    json_object_put(rec);
+
+    if (rc < 0) printf("[UPGRADE] Could not hand over %s, closing it\n", c->id);
+    return rc;
+}
+
+/* 1 when the connection now belongs to the new process, 0 to go on
+ * serving (upgrade abandoned), -1 to close it. */
+static int conn_park(Conn *c, LineBuf *lb) {
+    if (c->tls || c->is_peer || c->q->z) return -1;
+
+    pthread_mutex_lock(&live_mtx);
+    c->parked = true;
+    parked_count++;
+    pthread_cond_broadcast(&live_cv);
+    while (atomic_load(&handing_off) && !handoff_go) {
+        pthread_cond_wait(&live_cv, &live_mtx);
+    }
+    bool go = handoff_go;
+    c->parked = false;
+    parked_count--;
+    pthread_mutex_unlock(&live_mtx);
+
+    if (!go) return 0;
+    return conn_handover(c, lb) == 0 ? 1 : -1;
+}
+
+static void deadline_in(struct timespec *ts, long ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static bool past(const struct timespec *ts) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > ts->tv_sec || (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+static int send_listener(int ch, const char *kind, int fd, const char *path) {
+    if (fd < 0) return 0;
+    struct json_object *rec = json_object_new_object();
+    json_object_object_add(rec, "kind", json_object_new_string(kind));
+    if (path) json_object_object_add(rec, "path", json_object_new_string(path));
+    int rc = handoff_send(ch, rec, fd);
+    json_object_put(rec);
+    return rc;
+}
+
+static int send_globals(int ch) {
+    unsigned char key[AUTH_KEY_BYTES];
+    char hex[UDP_SECRET_LEN * 2 + 1];
+    unsigned gen;
+    auth_export(key, &gen);
+    hex_encode(key, sizeof(key), hex);
+
+    struct json_object *rec = json_object_new_object();
+    json_object_object_add(rec, "kind", json_object_new_string("global"));
+    json_object_object_add(rec, "auth_key", json_object_new_string(hex));
+    json_object_object_add(rec, "auth_gen", json_object_new_int64(gen));
+    json_object_object_add(rec, "password", json_object_new_string(admin_password));
+    if (udp_port() > 0) {
+        unsigned char secret[UDP_SECRET_LEN];
+        udp_secret(secret);
+        hex_encode(secret, sizeof(secret), hex);
+        json_object_object_add(rec, "udp_secret", json_object_new_string(hex));
+    }
+    int rc = handoff_send(ch, rec, -1);
+    json_object_put(rec);
+    return rc;
+}
+
+static void send_known_device(const Conn *c, void *arg) {
+    struct json_object *rec = json_object_new_object();
+    json_object_object_add(rec, "kind", json_object_new_string("device"));
+    json_object_object_add(rec, "id", json_object_new_string(c->id));
+    json_object_object_add(rec, "device_type", json_object_new_string(c->device_type));
+    json_object_object_add(rec, "udp_nonce", json_object_new_int64((int64_t)c->udp_nonce));
+    handoff_send(*(int*)arg, rec, -1);
+    json_object_put(rec);
+}
+
+static void send_udp_seq(const char *id, uint64_t nonce, uint32_t seq, void *arg) {
+    struct json_object *rec = json_object_new_object();
+    json_object_object_add(rec, "kind", json_object_new_string("udp_seq"));
+    json_object_object_add(rec, "id", json_object_new_string(id));
+    json_object_object_add(rec, "nonce", json_object_new_int64((int64_t)nonce));
+    json_object_object_add(rec, "seq", json_object_new_int64(seq));
+    handoff_send(*(int*)arg, rec, -1);
+    json_object_put(rec);
+}
+
+static void send_parked(const char *dev, const char *key, const char *from, time_t expires,
+                        const char *js, void *arg) {
+    struct json_object *rec = json_object_new_object();
+    json_object_object_add(rec, "kind", json_object_new_string("parked"));
+    json_object_object_add(rec, "dev", json_object_new_string(dev));
+    json_object_object_add(rec, "key", json_object_new_string(key));
+    json_object_object_add(rec, "from", json_object_new_string(from));
+    json_object_object_add(rec, "expires", json_object_new_int64((int64_t)expires));
+    json_object_object_add(rec, "frame", json_object_new_string(js));
+    handoff_send(*(int*)arg, rec, -1);
+    json_object_put(rec);
+}
+
+static void send_late(const char *dev, const char *to, time_t expires, void *arg) {
+    struct json_object *rec = json_object_new_object();
+    json_object_object_add(rec, "kind", json_object_new_string("late"));
+    json_object_object_add(rec, "dev", json_object_new_string(dev));
+    json_object_object_add(rec, "to", json_object_new_string(to));
+    json_object_object_add(rec, "expires", json_object_new_int64((int64_t)expires));
+    handoff_send(*(int*)arg, rec, -1);
+    json_object_put(rec);
+}
+
+static void handoff_out(void) {
+    int ch = handoff_accept(handoff_sock);
+    if (ch < 0) return;
+    printf("[UPGRADE] New process connected\n");
+    if (send_globals(ch) < 0) {
+        close(ch);
+        return;
+    }
+
+    /* Park every connection thread; a signal breaks the ones in recv().
+     * TLS state cannot be handed over and tls_read() sleeps through the
+     * signal, so those are shut down now and their clients reconnect. */
+    struct timespec until, tick;
+    deadline_in(&until, 2000);
+    pthread_mutex_lock(&live_mtx);
+    atomic_store(&handing_off, true);
+    for (Conn *c = live; c; c = c->live_next) {
+        if (c->tls) shutdown(c->sock, SHUT_RDWR);
+    }
+    while (parked_count < live_count && !past(&until)) {
+        for (Conn *c = live; c; c = c->live_next) {
+            if (!c->parked) pthread_kill(c->tid, SIGUSR1);
+        }
+        deadline_in(&tick, 10);
+        pthread_cond_timedwait(&live_cv, &live_mtx, &tick);
+    }
+    if (parked_count < live_count) {
+        atomic_store(&handing_off, false);
+        pthread_cond_broadcast(&live_cv);
+        pthread_mutex_unlock(&live_mtx);
+        printf("[UPGRADE] %d connection(s) busy, upgrade abandoned\n", live_count - parked_count);
+        close(ch);
+        return;
+    }
+    int total = live_count;
+    pthread_mutex_unlock(&live_mtx);
+
+    /* Past this point there is no going back. Nothing may write to a
+     * queue once its frames are collected, so stop the other producers. */
+    cluster_stop();
+    int udp = udp_detach();
+    pool_stop();
+
+    handoff_ch = ch;
+    deadline_in(&until, 5000);
+    pthread_mutex_lock(&live_mtx);
+    handoff_go = true;
+    pthread_cond_broadcast(&live_cv);
+    while (live_count > 0 && !past(&until)) {
+        deadline_in(&tick, 100);
+        pthread_cond_timedwait(&live_cv, &live_mtx, &tick);
+    }
+    pthread_mutex_unlock(&live_mtx);
+
+    /* Offline devices and what waits for them, so a command parked before
+     * the upgrade still goes out when the device comes back. */
+    reg_foreach_offline(send_known_device, &ch);
+    offline_foreach(send_parked, &ch);
+    offline_foreach_late(send_late, &ch);
+    udp_foreach_seq(send_udp_seq, &ch);
+
+    send_listener(ch, "tcp", srv_sock, NULL);
+    send_listener(ch, "unix", unix_sock, unix_path);
+    send_listener(ch, "udp", udp, NULL);
+    struct json_object *done = json_object_new_object();
+    json_object_object_add(done, "kind", json_object_new_string("done"));
+    handoff_send(ch, done, -1);
+    json_object_put(done);
+    close(ch);
+
+    printf("[UPGRADE] Handed over %d connection(s), exiting\n", total);
+    capture_close();
+    exit(0);
+}
+
+static const char* rec_str(struct json_object *rec, const char *key) {
+    struct json_object *o;
+    return json_object_object_get_ex(rec, key, &o) ? json_object_get_string(o) : NULL;
+}
+
+static bool rec_bool(struct json_object *rec, const char *key) {
+    struct json_object *o;
+    return json_object_object_get_ex(rec, key, &o) && json_object_get_boolean(o);
+}
+
+static int apply_globals(struct json_object *rec) {
+    struct json_object *o;
+    unsigned char key[AUTH_KEY_BYTES];
+    if (!json_object_object_get_ex(rec, "auth_key", &o) ||
+        hex_decode(json_object_get_string(o), key, sizeof(key)) < 0) {
+        return -1;
+    }
+    unsigned gen = 0;
+    if (json_object_object_get_ex(rec, "auth_gen", &o)) gen = (unsigned)json_object_get_int64(o);
+    auth_import(key, gen);
+
+    if (json_object_object_get_ex(rec, "password", &o)) {
+        snprintf(admin_password, sizeof(admin_password), "%s", json_object_get_string(o));
+    }
+    if (json_object_object_get_ex(rec, "udp_secret", &o)) {
+        hex_decode(json_object_get_string(o), adopted_udp_secret, sizeof(adopted_udp_secret));
+    }
+    return 0;
+}
+
+/* Everything but the connections is applied here, before anything else
+ * starts; the connections wait in adopted for srv_start. */
+static int takeover(const SrvConfig *cfg) {
+    char path[108];
+    snprintf(path, sizeof(path), HANDOFF_FMT, cfg->port);
+    int ch = handoff_connect(path);
+    if (ch < 0) {
+        fprintf(stderr, "No server to take over at %s\n", path);
+        return -1;
+    }
+
+    adopted = json_object_new_array();
+    int parked = 0;
+    bool done = false;
+    int fd;
+    struct json_object *rec;
+    while (!done && (rec = handoff_recv(ch, &fd)) != NULL) {
+        struct json_object *o;
+        const char *kind = json_object_object_get_ex(rec, "kind", &o) ? json_object_get_string(o) : "";
+
+        if (strcmp(kind, "global") == 0) {
+            if (apply_globals(rec) < 0) fprintf(stderr, "[UPGRADE] Bad global record\n");
+        } else if (strcmp(kind, "conn") == 0 && fd >= 0) {
+            json_object_object_add(rec, "fd", json_object_new_int(fd));
+            json_object_array_add(adopted, json_object_get(rec));
+            fd = -1;
+        } else if (strcmp(kind, "device") == 0) {
+            Conn dev = {.sock = -1, .is_dev = true};
+            snprintf(dev.id, sizeof(dev.id), "%s", rec_str(rec, "id") ? rec_str(rec, "id") : "");
+            snprintf(dev.device_type, sizeof(dev.device_type), "%s",
+                     rec_str(rec, "device_type") ? rec_str(rec, "device_type") : "");
+            if (json_object_object_get_ex(rec, "udp_nonce", &o)) {
+                dev.udp_nonce = (uint64_t)json_object_get_int64(o);
+            }
+            if (dev.id[0]) reg_upsert(&dev);
+        } else if (strcmp(kind, "parked") == 0) {
+            time_t expires = json_object_object_get_ex(rec, "expires", &o)
+                                 ? (time_t)json_object_get_int64(o) : 0;
+            if (rec_str(rec, "dev") && rec_str(rec, "frame") &&
+                offline_restore(rec_str(rec, "dev"), rec_str(rec, "key"), rec_str(rec, "from"),
+                                expires, rec_str(rec, "frame")) == 0) {
+                parked++;
+            }
+        } else if (strcmp(kind, "late") == 0) {
+            if (rec_str(rec, "dev") && rec_str(rec, "to") &&
+                json_object_object_get_ex(rec, "expires", &o)) {
+                offline_restore_late(rec_str(rec, "dev"), rec_str(rec, "to"),
+                                     (time_t)json_object_get_int64(o));
+            }
+        } else if (strcmp(kind, "udp_seq") == 0) {
+            if (rec_str(rec, "id") && json_object_object_get_ex(rec, "nonce", &o)) {
+                uint64_t nonce = (uint64_t)json_object_get_int64(o);
+                uint32_t seq = json_object_object_get_ex(rec, "seq", &o)
+                                   ? (uint32_t)json_object_get_int64(o) : 0;
+                udp_restore_seq(rec_str(rec, "id"), nonce, seq);
+            }
+        } else if (strcmp(kind, "tcp") == 0 && fd >= 0) {
+            srv_sock = fd;
+            fd = -1;
+        } else if (strcmp(kind, "unix") == 0 && fd >= 0) {
+            if (json_object_object_get_ex(rec, "path", &o)) {
+                snprintf(unix_path, sizeof(unix_path), "%s", json_object_get_string(o));
+            }
+            unix_sock = fd;
+            fd = -1;
+        } else if (strcmp(kind, "udp") == 0 && fd >= 0) {
+            adopted_udp = fd;
+            fd = -1;
+        } else if (strcmp(kind, "done") == 0) {
+            done = true;
+        }
+        if (fd >= 0) close(fd);
+        json_object_put(rec);
+    }
+    close(ch);
+
+    if (!done || srv_sock < 0) {
+        fprintf(stderr, "[UPGRADE] Takeover incomplete\n");
+        return -1;
+    }
+    printf("[UPGRADE] Took over port %d%s%s with %d connection(s), %d parked request(s)\n",
+           cfg->port, unix_sock >= 0 ? " and " : "", unix_sock >= 0 ? unix_path : "",
+           (int)json_object_array_length(adopted), parked);
+    return 0;
+}
+
+static void adopt_conn(struct json_object *rec, pthread_attr_t *attr) {
+    struct json_object *o;
+    json_object_object_get_ex(rec, "fd", &o);
+    int fd = json_object_get_int(o);
+
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    const char *ip = rec_str(rec, "ip");
+    if (ip) inet_aton(ip, &addr.sin_addr);
+    if (json_object_object_get_ex(rec, "port", &o)) addr.sin_port = htons(json_object_get_int(o));
+
+    Conn *c = srv_conn_open(fd, rec_bool(rec, "local") ? NULL : &addr);
+    if (!c) return;
+    c->adopted = true;
+    snprintf(c->id, sizeof(c->id), "%s", rec_str(rec, "id") ? rec_str(rec, "id") : "");
+    snprintf(c->scope, sizeof(c->scope), "%s", rec_str(rec, "scope") ? rec_str(rec, "scope") : "");
+    snprintf(c->device_type, sizeof(c->device_type), "%s",
+             rec_str(rec, "device_type") ? rec_str(rec, "device_type") : "");
+    c->is_dev = rec_bool(rec, "is_dev");
+    c->logged_in = rec_bool(rec, "logged_in");
+    if (json_object_object_get_ex(rec, "auth_gen", &o)) c->auth_gen = (unsigned)json_object_get_int64(o);
+    if (json_object_object_get_ex(rec, "udp_nonce", &o)) c->udp_nonce = (uint64_t)json_object_get_int64(o);
+
+    if (json_object_object_get_ex(rec, "partial", &o) && json_object_get_string_len(o) > 0) {
+        c->resume_len = (size_t)json_object_get_string_len(o);
+        c->resume = malloc(c->resume_len);
+        if (c->resume) memcpy(c->resume, json_object_get_string(o), c->resume_len);
+        else c->resume_len = 0;
+    }
+
+    if (c->logged_in && list_upsert(c) < 0) c->logged_in = false;
+    if (c->is_dev) {
+        home_device_up(c->id, c->device_type, rec_str(rec, "home"), rec_str(rec, "room"));
+    }
+
+    struct json_object *pending;
+    if (json_object_object_get_ex(rec, "pending", &pending)) {
+        for (size_t i = 0; i < json_object_array_length(pending); i++) {
+            struct json_object *it = json_object_array_get_idx(pending, i);
+            struct json_object *lane = NULL;
+            json_object_object_get_ex(it, "lane", &lane);
+            outq_push(c->q, rec_str(it, "frame"), lane ? json_object_get_int(lane) : 0,
+                      rec_str(it, "key"), rec_bool(it, "gated"),
+                      rec_str(it, "from"), NULL, 0);
+        }
+    }
+    printf("[UPGRADE] Adopted %s\n", c->id);
+
+    if (pthread_create(&c->tid, attr, handle_conn, c) != 0) {
+        perror("pthread_create");
+        srv_conn_close(c);
+    }
+}
+
+static void adopt_conns(pthread_attr_t *attr) {
+    if (!adopted) return;
+    for (size_t i = 0; i < json_object_array_length(adopted); i++) {
+        adopt_conn(json_object_array_get_idx(adopted, i), attr);
+    }
+    json_object_put(adopted);
+    adopted = NULL;
+}
+
+static void wake_conn(int sig) {
+    (void)sig;
+}
+
+int srv_start(void) {
+    running = true;
+    printf("Server started\n\n");
+
+    /* No SA_RESTART: the signal has to break a blocked recv(). */
+    struct sigaction sa = {.sa_handler = wake_conn};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CONN_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    /* Taken-over connections stay on threads whatever the backend. */
+    adopt_conns(&attr);
+
+    if (strcmp(io_backend, "uring") == 0) {
+        if (tls_enabled()) {
+            printf("[IO] io_uring backend does not do TLS, using threads\n");
+        } else if (uring_init() == 0) {
+            pthread_attr_destroy(&attr);
+            return uring_run(srv_sock, unix_sock);
+        } else {
+            printf("[IO] io_uring unavailable, using threads\n");
+        }
+    }
+
+    snprintf(handoff_path, sizeof(handoff_path), HANDOFF_FMT, srv_port);
+    handoff_sock = handoff_listen(handoff_path);
+
+    while (running) {
+        struct pollfd p[3] = {
+            {.fd = srv_sock, .events = POLLIN},
+            {.fd = unix_sock, .events = POLLIN},
+            {.fd = handoff_sock, .events = POLLIN},
+        };
+        if (poll(p, 3, -1) < 0) continue;
+        if (p[0].revents & POLLIN) accept_all(srv_sock, false, &attr);
+        if (unix_sock >= 0 && (p[1].revents & POLLIN)) accept_all(unix_sock, true, &attr);
+        if (handoff_sock >= 0 && (p[2].revents & POLLIN)) handoff_out();
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
 static void* handle_conn(void *arg) {
     Conn *c = (Conn*)arg;
     char buf[BUF_SIZE];
 
+    if (tls_enabled() && !c->local && !c->adopted) {
+        c->tls = tls_accept(c->sock);
+        if (!c->tls) {
+            printf("[TLS] Handshake failed %s:%d\n", c->ip, c->port);
+            outq_unref(c->q);
+            free(c);
+            return NULL;
+        }
+        c->q->tls = c->tls;
+        printf("[TLS] %s:%d %s%s\n", c->ip, c->port,
+               tls_resumed(c->tls) ? "resumed" : "full handshake",
+               tls_ktls_send(c->tls) ? ", kTLS" : "");
+    }
+
+    if (!c->tls) fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) | O_NONBLOCK);
+
+    LineBuf lb;
+    if (linebuf_init(&lb, MAX_FRAME) < 0) {
+        outq_unref(c->q);
+        free(c);
+        return NULL;
+    }
+    if (c->resume) {
+        linebuf_append(&lb, c->resume, c->resume_len);
+        free(c->resume);
+        c->resume = NULL;
+    }
+    live_add(c);
+
+    bool handed = false;
     while (running) {
-        int n = recv(c->sock, buf, BUF_SIZE - 1, 0);
+        if (atomic_load(&handing_off)) {
+            int rc = conn_park(c, &lb);
+            if (rc > 0) {
+                handed = true;
+                break;
+            }
+            if (rc < 0) break;
+        }
+
+        int n = conn_recv(c, buf, BUF_SIZE);
+        if (n < 0 && errno == EINTR && !c->tls) continue;
 
         if (n <= 0) {
             printf("[DISCONNECT] %s\n", c->id);
-            c->online = false;
             break;
         }
+        if (srv_conn_feed(c, &lb, buf, (size_t)n) < 0) break;
+    }
+    linebuf_free(&lb);
+    live_remove(c);
+
+    if (handed) {
+        /* The socket is the new process's now: no shutdown, no offline. */
+        outq_unref(c->q);
+        free(c);
+        return NULL;
+    }
+    srv_conn_close(c);
+    return NULL;
+}
 
-        buf[n] = '\0';
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-        if (n < 5) {
-            continue;
-        }
+/* A connection over its quota waits out the refill before its next line
+ * is even parsed. A connection thread just sleeps, so the sender is held
+ * back by TCP flow control. The event loop cannot sleep: it leaves the
+ * lines it already read in the buffer, stops receiving and feeds them
+ * again when the hold ends. False means stop for now. */
+static bool conn_hold(Conn *c) {
+    uint64_t now = now_ms();
+    if (now >= c->hold_until) {
+        c->hold_until = 0;
+        return true;
+    }
+    if (c->q->wake) return false;
+    unsigned ms = (unsigned)(c->hold_until - now);
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+    c->hold_until = 0;
+    return true;
+}
 
-        printf("\n[RX] %s:\n%s\n", c->id, buf);
-        handle_msg(c, buf);
+int srv_conn_feed(Conn *c, LineBuf *lb, const char *data, size_t n) {
+    if (linebuf_append(lb, data, n) < 0) {
+        printf("[ERROR] Frame too large from %s\n", c->id);
+        return -1;
     }
 
-    close(c->sock);
+    char *line;
+    size_t len;
+    while ((!c->hold_until || conn_hold(c)) && (line = linebuf_next(lb, &len)) != NULL) {
+        if (len < 5) continue;
+        if (!c->is_peer) {
+            printf("\n[RX] %s:\n%s\n", c->id, line);
+            capture_frame(c->serial, line, len);
+        }
+        handle_msg(c, line);
+    }
+    return 0;
+}
 
-    pthread_mutex_lock(&list.mtx);
-    for (int i = 0; i < list.cnt; i++) {
-        if (strcmp(list.conns[i].id, c->id) == 0) {
-            list.conns[i].online = false;
-            break;
+/* The id c held goes offline (a device) or away (a client). */
+static void list_leave(Conn *c) {
+    if (reg_drop(c->id, c->q)) {
+        cluster_announce(c->id, c->device_type, false);
+        if (c->is_dev) {
+            home_device_down(c->id);
+            notify_device_event(c->id, "down", c->device_type, NULL);
         }
     }
-    pthread_mutex_unlock(&list.mtx);
+}
 
+void srv_conn_close(Conn *c) {
+    c->online = false;
+    outq_close(c->q);
+    shutdown(c->sock, SHUT_RDWR);
+    if (!c->is_peer) capture_end(c->serial);
+
+    list_leave(c);
+    if (c->is_peer) cluster_peer_down(c->id);
+
+    outq_unref(c->q);
     free(c);
-    return NULL;
 }
 
-static void send_error_response(Conn *c, const char *action, const char *error_msg) {
-    Message *r = calloc(1, sizeof(Message));
-    if (!r) return;
+static void send_error_response(Conn *c, Action action, const char *error_msg) {
+    Message r = {0};
+    r.type = MSG_RESPONSE;
+    strncpy(r.from, "server", sizeof(r.from) - 1);
+    strncpy(r.to, c->id, sizeof(r.to) - 1);
+    r.action = action;
+    r.timestamp = time(NULL);
 
-    r->type = MSG_RESPONSE;
-    strncpy(r->from, "server", sizeof(r->from) - 1);
-    r->from[sizeof(r->from) - 1] = '\0';
-    strncpy(r->to, c->id, sizeof(r->to) - 1);
-    r->to[sizeof(r->to) - 1] = '\0';
-    
-    if (strcmp(action, "register") == 0) {
-        r->action = ACT_REGISTER;
-    } else if (strcmp(action, "login") == 0) {
-        r->action = ACT_LOGIN;
-    } else if (strcmp(action, "change_password") == 0) {
-        r->action = ACT_CHANGE_PASSWORD;
-    } else {
-        r->action = ACT_CONTROL;
-    }
-    
-    r->timestamp = time(NULL);
+    StatusResp e = {.has_status = true, .has_message = true};
+    snprintf(e.status, sizeof(e.status), "error");
+    snprintf(e.message, sizeof(e.message), "%s", error_msg);
+    r.data = status_resp_encode(&e);
 
-    struct json_object *d = json_object_new_object();
-    json_object_object_add(d, "status", json_object_new_string("error"));
-    json_object_object_add(d, "message", json_object_new_string(error_msg));
-    r->data = d;
+    char *js = create_msg(&r);
+    if (js) {
+        conn_send(c, js, msg_lane(&r));
+        free(js);
+    }
+    json_object_put(r.data);
+}
 
-    char *js = create_msg(r);
+/* Refused for now ("busy" registration, "throttled" message): the sender
+ * keeps its connection and tries again after retry_after_ms. */
+static void send_retry_later(Conn *c, const char *to, Action action, const char *why,
+                             unsigned wait_ms) {
+    Message r = {0};
+    r.type = MSG_RESPONSE;
+    strncpy(r.from, "server", sizeof(r.from) - 1);
+    strncpy(r.to, to, sizeof(r.to) - 1);
+    r.action = action;
+    r.timestamp = time(NULL);
+
+    StatusResp e = {.has_status = true, .has_message = true, .has_retry_after_ms = true};
+    snprintf(e.status, sizeof(e.status), "error");
+    snprintf(e.message, sizeof(e.message), "%s", why);
+    e.retry_after_ms = (int)wait_ms;
+    r.data = status_resp_encode(&e);
+
+    char *js = create_msg(&r);
     if (js) {
-        send(c->sock, js, strlen(js), 0);
-        send(c->sock, "\n", 1, 0);
+        conn_send(c, js, msg_lane(&r));
         free(js);
     }
-    free_msg(r);
+    json_object_put(r.data);
+}
+
+/* OTA acks are exempt: the server's own window already paces them. */
+static bool conn_admit(Conn *c, Message *m) {
+    if (!quota_enabled() || (m->action == ACT_OTA && m->type == MSG_RESPONSE)) return true;
+
+    /* Before login the peer address is the identity, so reconnecting
+     * does not buy a fresh bucket. */
+    char who[40];
+    if (!c->logged_in) snprintf(who, sizeof(who), "#%s", c->ip);
+    bool notify;
+    unsigned wait_ms = quota_take(c->logged_in ? c->id : who, action_lane(m->action), &notify);
+    if (wait_ms == 0) return true;
+
+    c->hold_until = now_ms() + wait_ms;
+    quota_count_pause(wait_ms);
+    /* A requester waits for one reply per request; anything else only
+     * hears about it once per window. */
+    if (m->type == MSG_REQUEST || notify) {
+        send_retry_later(c, m->from, m->action, "throttled", wait_ms);
+    }
+    if (notify) {
+        printf("[QUOTA] %s throttled on %s, retry in %ums\n",
+               c->logged_in ? c->id : c->ip, action_str(m->action), wait_ms);
+    }
+    return false;
+}
+
+static void emit_rule_action(const char *rule, const char *device,
+                             struct json_object *data, void *arg) {
+    (void)arg;
+    Message r = {0};
+    r.type = MSG_REQUEST;
+    strncpy(r.from, RULES_SENDER, sizeof(r.from) - 1);
+    strncpy(r.to, device, sizeof(r.to) - 1);
+    r.action = ACT_CONTROL;
+    r.timestamp = time(NULL);
+    r.data = data;
+
+    printf("[RULE] %s -> %s\n", rule, device);
+    route_msg(&r);
+}
+
+/* State a device reports, over its TCP connection or a UDP datagram.
+ * data is NULL for a bare heartbeat. */
+void srv_device_report(const char *id, struct json_object *data) {
+    home_touch(id);
+    if (!data) return;
+    rules_eval(id, data, emit_rule_action, NULL);
+
+    struct json_object *power, *state;
+    if (json_object_object_get_ex(data, "power", &power)) {
+        home_set_power(id, json_object_get_double(power));
+    }
+    /* "on"/"off" from a status reply, true/false echoed from a control. */
+    if (json_object_object_get_ex(data, "state", &state)) {
+        const char *s = NULL;
+        if (json_object_is_type(state, json_type_string)) {
+            s = json_object_get_string(state);
+        } else if (json_object_is_type(state, json_type_boolean)) {
+            s = json_object_get_boolean(state) ? "on" : "off";
+        }
+        if (s && home_set_state(id, s)) notify_device_event(id, "state", NULL, s);
+    }
+}
+
+/* {"compress": "deflate"} in login/register data. The reply confirms it
+ * and is itself the last plain frame; see zframe.h. */
+static bool wants_deflate(const char *req, char *reply, size_t n, bool *has) {
+    if (strcmp(req, "deflate") != 0) return false;
+    snprintf(reply, n, "deflate");
+    *has = true;
+    return true;
 }
 
 static void handle_msg(Conn *c, const char *json) {
+    uint64_t now = trace_now();
     Message *m = parse_msg(json);
     if (!m) {
         printf("[ERROR] Parse failed\n");
         return;
     }
+    trace_recv(m, now);
+
+    if (c->is_peer) {
+        if (m->action == ACT_CLUSTER_GOSSIP) {
+            cluster_apply_gossip(m->data);
+        } else if (!route_local(m)) {
+            printf("[CLUSTER] %s forwarded %s, not here any more\n", c->id, m->to);
+        }
+        free_msg(m);
+        return;
+    }
 
     printf("[MSG] %s | %s | %s -> %s\n",
         type_str(m->type), action_str(m->action), m->from, m->to);
 
+    if (!conn_admit(c, m)) {
+        free_msg(m);
+        return;
+    }
+
+    if (c->is_dev && m->action != ACT_OTA) {
+        if (m->type == MSG_RESPONSE) outq_ack(c->q);
+        else outq_kick(c->q);
+        srv_device_report(c->id, (struct json_object*)m->data);
+    }
+
     if (m->action == ACT_REGISTER) {
+        unsigned wait_ms = c->is_dev ? 0 : admit_register(m->from);
+        if (wait_ms > 0) {
+            send_retry_later(c, m->from, ACT_REGISTER, "busy", wait_ms);
+            printf("[ADMIT] %s deferred %ums\n", m->from, wait_ms);
+            free_msg(m);
+            return;
+        }
+
+        RegisterReq req;
+        char err[160];
+        if (register_req_decode((struct json_object*)m->data, &req, err, sizeof(err)) < 0) {
+            printf("[REGISTER] Bad request from %s: %s\n", m->from, err);
+            send_error_response(c, ACT_REGISTER, "invalid_request");
+            free_msg(m);
+            return;
+        }
+
+        if (strcmp(c->id, m->from) != 0) list_leave(c);
         strncpy(c->id, m->from, sizeof(c->id) - 1);
         c->id[sizeof(c->id) - 1] = '\0';
         c->is_dev = true;
         c->logged_in = true;
-
-        struct json_object *data = (struct json_object*)m->data;
-        struct json_object *dev_type;
-        if (json_object_object_get_ex(data, "device_type", &dev_type)) {
-            strncpy(c->device_type, json_object_get_string(dev_type), 
-                    sizeof(c->device_type) - 1);
-            c->device_type[sizeof(c->device_type) - 1] = '\0';
+        snprintf(c->scope, sizeof(c->scope), "device");
+        if (req.has_device_type) {
+            snprintf(c->device_type, sizeof(c->device_type), "%s", req.device_type);
         }
+        c->udp_nonce = udp_nonce();
 
-        pthread_mutex_lock(&list.mtx);
-        bool found = false;
-        for (int i = 0; i < list.cnt; i++) {
-            if (strcmp(list.conns[i].id, c->id) == 0) {
-                list.conns[i] = *c;
-                found = true;
-                break;
-            }
-        }
-        if (!found && list.cnt < MAX_CONN) {
-            list.conns[list.cnt++] = *c;
+        if (!list_join(c, ACT_REGISTER)) {
+            free_msg(m);
+            return;
         }
-        pthread_mutex_unlock(&list.mtx);
+
+        home_device_up(c->id, c->device_type, req.has_home ? req.home : NULL,
+                       req.has_room ? req.room : NULL);
+        notify_device_event(c->id, "up", c->device_type, NULL);
 
         Message *r = calloc(1, sizeof(Message));
         if (r) {
@@ -239,55 +1330,79 @@ static void handle_msg(Conn *c, const char *json) {
             r->action = ACT_REGISTER;
             r->timestamp = time(NULL);
 
-            struct json_object *d = json_object_new_object();
-            json_object_object_add(d, "status", json_object_new_string("success"));
-            json_object_object_add(d, "device_id", json_object_new_string(c->id));
-            r->data = d;
+            RegisterResp resp = {.has_device_id = true};
+            snprintf(resp.status, sizeof(resp.status), "success");
+            snprintf(resp.device_id, sizeof(resp.device_id), "%s", c->id);
+            if (udp_device_key(c->id, c->udp_nonce, resp.udp_key, sizeof(resp.udp_key)) == 0) {
+                resp.udp_port = udp_port();
+                resp.has_udp_port = resp.has_udp_key = true;
+            }
+            bool deflate = wants_deflate(req.compress, resp.compress, sizeof(resp.compress),
+                                         &resp.has_compress);
+            r->data = register_resp_encode(&resp);
 
             char *js = create_msg(r);
             if (js) {
-                send(c->sock, js, strlen(js), 0);
-                send(c->sock, "\n", 1, 0);
+                conn_send(c, js, msg_lane(r));
                 free(js);
             }
             free_msg(r);
+            if (deflate) outq_enable_deflate(c->q);
         }
         printf("[REGISTER] Device: %s (%s)\n", c->id, c->device_type);
+
+        deliver_parked(c->id, c->q);
+        ota_device_up(c->id, c->q);
     }
     else if (m->action == ACT_LOGIN) {
-        struct json_object *data = (struct json_object*)m->data;
-        struct json_object *pass_obj;
-        
-        const char *provided_password = NULL;
-        if (json_object_object_get_ex(data, "password", &pass_obj)) {
-            provided_password = json_object_get_string(pass_obj);
+        LoginReq req;
+        char err[160];
+        if (login_req_decode((struct json_object*)m->data, &req, err, sizeof(err)) < 0) {
+            printf("[LOGIN] FAILED - bad request from %s: %s\n", m->from, err);
+            send_error_response(c, ACT_LOGIN, "invalid_request");
+            free_msg(m);
+            return;
         }
 
-        if (!provided_password || strcmp(provided_password, admin_password) != 0) {
+        unsigned gen = auth_generation();
+        char tok_id[32], scope[16];
+        if (req.has_token) {
+            if (!auth_verify(req.token, tok_id, sizeof(tok_id), scope, sizeof(scope))) {
+                printf("[LOGIN] FAILED - invalid token from %s\n", m->from);
+                send_error_response(c, ACT_LOGIN, "invalid_token");
+                free_msg(m);
+                return;
+            }
+        } else if (!req.has_password || strcmp(req.password, admin_password) != 0) {
             printf("[LOGIN] FAILED - wrong password from %s\n", m->from);
-            send_error_response(c, "login", "wrong_password");
+            send_error_response(c, ACT_LOGIN, "wrong_password");
             free_msg(m);
             return;
+        } else {
+            snprintf(tok_id, sizeof(tok_id), "%s", m->from);
+            snprintf(scope, sizeof(scope), "admin");
         }
 
-        strncpy(c->id, m->from, sizeof(c->id) - 1);
+        LoginResp resp = {.has_token = true, .has_expires_in = true};
+        if (auth_issue(tok_id, scope, AUTH_TOKEN_TTL, resp.token, sizeof(resp.token)) < 0) {
+            send_error_response(c, ACT_LOGIN, "invalid_client_id");
+            free_msg(m);
+            return;
+        }
+
+        if (strcmp(c->id, tok_id) != 0) list_leave(c);
+        strncpy(c->id, tok_id, sizeof(c->id) - 1);
         c->id[sizeof(c->id) - 1] = '\0';
+        strncpy(c->scope, scope, sizeof(c->scope) - 1);
+        c->scope[sizeof(c->scope) - 1] = '\0';
         c->is_dev = false;
         c->logged_in = true;
-        
-        pthread_mutex_lock(&list.mtx);
-        bool found = false;
-        for (int i = 0; i < list.cnt; i++) {
-            if (strcmp(list.conns[i].id, c->id) == 0) {
-                list.conns[i] = *c;
-                found = true;
-                break;
-            }
-        }
-        if (!found && list.cnt < MAX_CONN) {
-            list.conns[list.cnt++] = *c;
+        c->auth_gen = gen;
+
+        if (!list_join(c, ACT_LOGIN)) {
+            free_msg(m);
+            return;
         }
-        pthread_mutex_unlock(&list.mtx);
 
         Message *r = calloc(1, sizeof(Message));
         if (r) {
@@ -299,99 +1414,212 @@ static void handle_msg(Conn *c, const char *json) {
             r->action = ACT_LOGIN;
             r->timestamp = time(NULL);
 
-            struct json_object *d = json_object_new_object();
-            json_object_object_add(d, "status", json_object_new_string("success"));
-            json_object_object_add(d, "token", json_object_new_string("token123"));
-            r->data = d;
+            snprintf(resp.status, sizeof(resp.status), "success");
+            resp.expires_in = AUTH_TOKEN_TTL;
+            bool deflate = wants_deflate(req.compress, resp.compress, sizeof(resp.compress),
+                                         &resp.has_compress);
+            r->data = login_resp_encode(&resp);
 
             char *js = create_msg(r);
             if (js) {
-                send(c->sock, js, strlen(js), 0);
-                send(c->sock, "\n", 1, 0);
+                conn_send(c, js, msg_lane(r));
                 free(js);
             }
             free_msg(r);
+            if (deflate) outq_enable_deflate(c->q);
         }
         printf("[LOGIN] SUCCESS - Client: %s\n", c->id);
     }
     else if (m->action == ACT_CHANGE_PASSWORD) {
-        if (!c->logged_in) {
+        if (!conn_authed(c) || strcmp(c->scope, "admin") != 0) {
             printf("[CHANGE_PASSWORD] Rejected - not authenticated\n");
-            send_error_response(c, "change_password", "not_authenticated");
+            send_error_response(c, ACT_CHANGE_PASSWORD, "not_authenticated");
             free_msg(m);
             return;
         }
 
-        struct json_object *data = (struct json_object*)m->data;
-        struct json_object *oldp, *newp;
-
-        Message *r = calloc(1, sizeof(Message));
-        r->type = MSG_RESPONSE;
-        strcpy(r->from, "server");
-        strcpy(r->to, m->from);
-        r->action = ACT_CHANGE_PASSWORD;
-        r->timestamp = time(NULL);
-
-        struct json_object *res = json_object_new_object();
-
-        if (json_object_object_get_ex(data, "old_password", &oldp) &&
-            json_object_object_get_ex(data, "new_password", &newp)) {
-
-            const char *oldpw = json_object_get_string(oldp);
-            const char *newpw = json_object_get_string(newp);
-
-            if (strcmp(oldpw, admin_password) == 0) {
-                strncpy(admin_password, newpw, sizeof(admin_password) - 1);
-                admin_password[sizeof(admin_password) - 1] = '\0';
-                json_object_object_add(res, "status",
-                    json_object_new_string("success"));
-                printf("[CHANGE_PASSWORD] Password changed by %s\n", c->id);
-                c->logged_in = false;
-            } else {
-                json_object_object_add(res, "status",
-                    json_object_new_string("wrong_password"));
-                printf("[CHANGE_PASSWORD] Wrong old password from %s\n", c->id);
-            }
+        ChangePasswordReq req;
+        StatusResp res = {.has_status = true};
+
+        if (change_password_req_decode((struct json_object*)m->data, &req, NULL, 0) < 0) {
+            snprintf(res.status, sizeof(res.status), "invalid_request");
+        } else if (strcmp(req.old_password, admin_password) != 0) {
+            snprintf(res.status, sizeof(res.status), "wrong_password");
+            printf("[CHANGE_PASSWORD] Wrong old password from %s\n", c->id);
+        } else if (auth_rotate_key() < 0) {
+            /* Sessions under the old key would outlive the old password. */
+            snprintf(res.status, sizeof(res.status), "error");
+            printf("[CHANGE_PASSWORD] Cannot make a new token key\n");
         } else {
-            json_object_object_add(res, "status",
-                json_object_new_string("invalid_request"));
+            snprintf(admin_password, sizeof(admin_password), "%s", req.new_password);
+            snprintf(res.status, sizeof(res.status), "success");
+            printf("[CHANGE_PASSWORD] Password changed by %s\n", c->id);
+            c->logged_in = false;
         }
 
-        r->data = res;
-
-        char *js = create_msg(r);
-        send(c->sock, js, strlen(js), 0);
-        send(c->sock, "\n", 1, 0);
-
-        free(js);
-        free_msg(r);
+        Message r = {0};
+        r.type = MSG_RESPONSE;
+        strcpy(r.from, "server");
+        strcpy(r.to, m->from);
+        r.action = ACT_CHANGE_PASSWORD;
+        r.timestamp = time(NULL);
+        r.data = status_resp_encode(&res);
+
+        char *js = create_msg(&r);
+        if (js) {
+            conn_send(c, js, msg_lane(&r));
+            free(js);
+        }
+        json_object_put(r.data);
     }
     else if (m->action == ACT_LIST_DEVICES) {
-        if (!c->logged_in) {
+        if (!conn_authed(c)) {
             printf("[LIST_DEVICES] Rejected - not authenticated\n");
-            send_error_response(c, "list_devices", "not_authenticated");
+            send_error_response(c, ACT_LIST_DEVICES, "not_authenticated");
+            free_msg(m);
+            return;
+        }
+        if (offload(c, m, handle_list_devices)) return;
+        handle_list_devices(c, m);
+    }
+    else if (m->action == ACT_CLUSTER_HELLO) {
+        handle_cluster_hello(c, m);
+    }
+    else if (m->action == ACT_ASSIGN_ROOM) {
+        if (!conn_authed(c) || strcmp(c->scope, "admin") != 0) {
+            printf("[ASSIGN_ROOM] Rejected - not authenticated\n");
+            send_error_response(c, ACT_ASSIGN_ROOM, "not_authenticated");
+            free_msg(m);
+            return;
+        }
+        handle_assign_room(c, m);
+    }
+    else if (m->action == ACT_HOME_STATUS) {
+        if (!conn_authed(c)) {
+            printf("[HOME_STATUS] Rejected - not authenticated\n");
+            send_error_response(c, ACT_HOME_STATUS, "not_authenticated");
+            free_msg(m);
+            return;
+        }
+        if (offload(c, m, handle_home_status)) return;
+        handle_home_status(c, m);
+    }
+    else if (m->action == ACT_OTA) {
+        if (c->is_dev) {
+            home_touch(c->id);
+            ota_reply(c->id, c->q, (struct json_object*)m->data);
+        } else if (!conn_authed(c) || strcmp(c->scope, "admin") != 0) {
+            send_error_response(c, ACT_OTA, "not_authenticated");
+        } else if (!ota_enabled()) {
+            send_error_response(c, ACT_OTA, "ota_disabled");
+        } else {
+            handle_ota(c, m);
+        }
+    }
+    else if (m->action == ACT_TRACE) {
+        if (!conn_authed(c) || strcmp(c->scope, "admin") != 0) {
+            send_error_response(c, ACT_TRACE, "not_authenticated");
             free_msg(m);
             return;
         }
-        handle_list_devices(c);
+        if (offload(c, m, handle_trace)) return;
+        handle_trace(c, m);
+    }
+    else if (m->action == ACT_QUERY_DEVICES) {
+        if (!conn_authed(c)) {
+            send_error_response(c, ACT_QUERY_DEVICES, "not_authenticated");
+        } else {
+            handle_query_devices(c, m);
+        }
+    }
+    else if (m->action == ACT_STATS) {
+        if (!conn_authed(c) || strcmp(c->scope, "admin") != 0) {
+            send_error_response(c, ACT_STATS, "not_authenticated");
+        } else {
+            send_server_response(c, ACT_STATS, quota_stats());
+        }
     }
     else if (m->action == ACT_HEARTBEAT) {
         printf("[HEARTBEAT] From %s\n", m->from);
     }
     else {
-        if (!c->logged_in && !c->is_dev) {
+        if (!conn_authed(c)) {
             printf("[CONTROL] Rejected - not authenticated\n");
-            send_error_response(c, "control", "not_authenticated");
+            send_error_response(c, m->action, "not_authenticated");
             free_msg(m);
             return;
         }
+        /* Its sender was told "queued" long ago and is not waiting. */
+        if (c->is_dev && m->type == MSG_RESPONSE && offline_late_reply(c->id, m->to)) {
+            m->type = MSG_NOTIFY;
+        }
         route_msg(m);
     }
 
     free_msg(m);
 }
 
-static void handle_list_devices(Conn *c) {
+static void handle_cluster_hello(Conn *c, Message *m) {
+    ClusterHelloReq req;
+    if (cluster_hello_req_decode((struct json_object*)m->data, &req, NULL, 0) < 0 ||
+        !cluster_accept_peer(req.node, req.key)) {
+        printf("[CLUSTER] Rejected peer %s from %s\n", m->from, c->ip);
+        send_error_response(c, ACT_CLUSTER_HELLO, "rejected");
+        return;
+    }
+
+    snprintf(c->id, sizeof(c->id), "%s", req.node);
+    c->is_peer = true;
+    c->logged_in = true;
+    cluster_peer_up(c->id);
+
+    Message r = {0};
+    r.type = MSG_RESPONSE;
+    snprintf(r.from, sizeof(r.from), "%s", cluster_node());
+    snprintf(r.to, sizeof(r.to), "%s", c->id);
+    r.action = ACT_CLUSTER_HELLO;
+    r.timestamp = time(NULL);
+
+    ClusterHelloResp resp = {.has_node = true};
+    snprintf(resp.status, sizeof(resp.status), "success");
+    snprintf(resp.node, sizeof(resp.node), "%s", cluster_node());
+    r.data = cluster_hello_resp_encode(&resp);
+
+    char *js = create_msg(&r);
+    if (js) {
+        conn_send(c, js, msg_lane(&r));
+        free(js);
+    }
+    json_object_put(r.data);
+    printf("[CLUSTER] Peer %s joined from %s:%d\n", c->id, c->ip, c->port);
+}
+
+static void add_remote_device(const char *id, const char *type,
+                              const char *node, void *arg) {
+    if (!type[0]) return;
+    DeviceInfo d = {.has_type = true, .has_node = true};
+    snprintf(d.id, sizeof(d.id), "%s", id);
+    snprintf(d.type, sizeof(d.type), "%s", type);
+    snprintf(d.node, sizeof(d.node), "%s", node);
+    json_object_array_add((struct json_object*)arg, device_info_encode(&d));
+}
+
+static void add_local_device(const Conn *c, void *arg) {
+    if (!c->is_dev) return;
+    DeviceInfo d = {.has_type = true, .has_ip = true, .has_last_seen = true};
+    snprintf(d.id, sizeof(d.id), "%s", c->id);
+    snprintf(d.type, sizeof(d.type), "%s", c->device_type);
+    snprintf(d.ip, sizeof(d.ip), "%s", c->ip);
+    d.last_seen = home_last_seen(c->id);
+    if (home_device_state(c->id, d.state, sizeof(d.state), &d.power) == 0) {
+        d.has_state = d.state[0] != '\0';
+        d.has_power = true;
+    }
+    json_object_array_add((struct json_object*)arg, device_info_encode(&d));
+}
+
+static void handle_list_devices(Conn *c, Message *m) {
+    (void)m;
     Message *r = calloc(1, sizeof(Message));
     if (!r) return;
 
@@ -405,26 +1633,16 @@ static void handle_list_devices(Conn *c) {
 
     struct json_object *devices = json_object_new_array();
 
-    pthread_mutex_lock(&list.mtx);
-    for (int i = 0; i < list.cnt; i++) {
-        if (list.conns[i].is_dev && list.conns[i].online) {
-            struct json_object *dev = json_object_new_object();
-            json_object_object_add(dev, "id", json_object_new_string(list.conns[i].id));
-            json_object_object_add(dev, "type", json_object_new_string(list.conns[i].device_type));
-            json_object_object_add(dev, "ip", json_object_new_string(list.conns[i].ip));
-            json_object_array_add(devices, dev);
-        }
-    }
-    pthread_mutex_unlock(&list.mtx);
+    reg_foreach(add_local_device, devices);
+    cluster_foreach_remote(add_remote_device, devices);
 
-    struct json_object *d = json_object_new_object();
-    json_object_object_add(d, "devices", devices);
-    r->data = d;
+    ListDevicesResp resp = {.devices = devices, .has_devices = true};
+    r->data = list_devices_resp_encode(&resp);
+    json_object_put(devices);
 
     char *js = create_msg(r);
     if (js) {
-        send(c->sock, js, strlen(js), 0);
-        send(c->sock, "\n", 1, 0);
+        conn_send(c, js, msg_lane(r));
         free(js);
     }
 
@@ -433,44 +1651,299 @@ static void handle_list_devices(Conn *c) {
     free_msg(r);
 }
 
-static void route_msg(Message *m) {
-    pthread_mutex_lock(&list.mtx);
+static void send_server_response(Conn *c, Action action, struct json_object *d) {
+    Message r = {0};
+    r.type = MSG_RESPONSE;
+    strncpy(r.from, "server", sizeof(r.from) - 1);
+    strncpy(r.to, c->id, sizeof(r.to) - 1);
+    r.action = action;
+    r.timestamp = time(NULL);
+    r.data = d;
 
-    bool found = false;
-    for (int i = 0; i < list.cnt; i++) {
-        if (strcmp(list.conns[i].id, m->to) == 0 && list.conns[i].online) {
-            char *js = create_msg(m);
-            if (js) {
-                send(list.conns[i].sock, js, strlen(js), 0);
-                send(list.conns[i].sock, "\n", 1, 0);
-                free(js);
+    char *js = create_msg(&r);
+    if (js) {
+        conn_send(c, js, msg_lane(&r));
+        free(js);
+    }
+    json_object_put(d);
+}
+
+static void handle_assign_room(Conn *c, Message *m) {
+    AssignRoomReq req;
+    if (assign_room_req_decode((struct json_object*)m->data, &req, NULL, 0) < 0) {
+        send_error_response(c, ACT_ASSIGN_ROOM, "invalid_request");
+        return;
+    }
+    const char *h = req.has_home ? req.home : HOME_DEFAULT;
+
+    if (home_assign(req.device, h, req.room) < 0) {
+        send_error_response(c, ACT_ASSIGN_ROOM, "unknown_device");
+        return;
+    }
+    printf("[HOME] %s -> %s/%s\n", req.device, h, req.room);
+
+    StatusResp res = {.has_status = true};
+    snprintf(res.status, sizeof(res.status), "success");
+    send_server_response(c, ACT_ASSIGN_ROOM, status_resp_encode(&res));
+}
+
+static void handle_home_status(Conn *c, Message *m) {
+    HomeStatusReq req;
+    if (home_status_req_decode((struct json_object*)m->data, &req, NULL, 0) < 0) {
+        send_error_response(c, ACT_HOME_STATUS, "invalid_request");
+        return;
+    }
+
+    struct json_object *d = home_status(req.has_home ? req.home : HOME_DEFAULT,
+                                        req.has_room ? req.room : NULL);
+    if (!d) {
+        send_error_response(c, ACT_HOME_STATUS, "not_found");
+        return;
+    }
+    json_object_object_add(d, "status", json_object_new_string("success"));
+    send_server_response(c, ACT_HOME_STATUS, d);
+}
+
+static void handle_query_devices(Conn *c, Message *m) {
+    QueryDevicesReq req;
+    if (query_devices_req_decode((struct json_object*)m->data, &req, NULL, 0) < 0) {
+        send_error_response(c, ACT_QUERY_DEVICES, "invalid_request");
+        return;
+    }
+
+    HomeQuery q = {
+        .type = req.has_type ? req.type : NULL,
+        .state = req.has_state ? req.state : NULL,
+        .online = req.has_online ? req.online : -1,
+        .power_min = req.has_power_min ? req.power_min : -INFINITY,
+        .power_max = req.has_power_max ? req.power_max : INFINITY,
+        .limit = req.has_limit ? req.limit : HOME_QUERY_LIMIT,
+    };
+    if (q.limit < 0) q.limit = 0;
+    if (q.limit > HOME_QUERY_MAX) q.limit = HOME_QUERY_MAX;
+
+    int count;
+    struct json_object *d = json_object_new_object();
+    struct json_object *devices = home_query(&q, &count);
+    json_object_object_add(d, "status", json_object_new_string("success"));
+    json_object_object_add(d, "count", json_object_new_int(count));
+    json_object_object_add(d, "devices", devices);
+    send_server_response(c, ACT_QUERY_DEVICES, d);
+}
+
+/* {"image": name, "devices": [ids]} starts a rollout; without an image it
+ * only reports progress. */
+static void handle_ota(Conn *c, Message *m) {
+    OtaReq req;
+    if (ota_req_decode((struct json_object*)m->data, &req, NULL, 0) < 0) {
+        send_error_response(c, ACT_OTA, "invalid_request");
+        return;
+    }
+    if (req.has_image) {
+        if (!req.has_devices || !json_object_is_type(req.devices, json_type_array)) {
+            send_error_response(c, ACT_OTA, "no_devices");
+            return;
+        }
+        for (size_t i = 0; i < json_object_array_length(req.devices); i++) {
+            const char *id = json_object_get_string(json_object_array_get_idx(req.devices, i));
+            if (!id || !reg_is_device(id)) continue;
+            bool is_dev = false;
+            OutQ *q = reg_lookup(id, &is_dev);
+            int rc = ota_offer(id, q, req.image);
+            outq_unref(q);
+            if (rc < 0) {
+                send_error_response(c, ACT_OTA, "bad_image");
+                return;
+            }
+        }
+    }
+
+    struct json_object *d = json_object_new_object();
+    json_object_object_add(d, "status", json_object_new_string("success"));
+    json_object_object_add(d, "rollouts", ota_status());
+    send_server_response(c, ACT_OTA, d);
+}
+
+/* {"limit": n} returns the newest n completed spans, all of them without. */
+static void handle_trace(Conn *c, Message *m) {
+    TraceReq req;
+    if (trace_req_decode((struct json_object*)m->data, &req, NULL, 0) < 0) {
+        send_error_response(c, ACT_TRACE, "invalid_request");
+        return;
+    }
+    struct json_object *d = trace_export(req.limit);
+    json_object_object_add(d, "status", json_object_new_string("success"));
+    send_server_response(c, ACT_TRACE, d);
+}
+
+/* Requests to a device that share a key replace each other while they wait
+ * in the device's queue. Control is keyed per attribute ("state", "speed"),
+ * status and heartbeat requests per action. */
+static bool coalesce_key(Message *m, char *key, size_t n) {
+    if (m->type != MSG_REQUEST) return false;
+
+    if (m->action == ACT_STATUS || m->action == ACT_HEARTBEAT) {
+        snprintf(key, n, "%s", action_str(m->action));
+        return true;
+    }
+    if (m->action != ACT_CONTROL || !m->data) return false;
+
+    struct json_object *data = (struct json_object*)m->data;
+    struct json_object *attr;
+    if (json_object_object_get_ex(data, "attribute", &attr)) {
+        snprintf(key, n, "control:%s", json_object_get_string(attr));
+        return true;
+    }
+    json_object_object_foreach(data, k, v) {
+        (void)v;
+        if (strcmp(k, "device_type") == 0) continue;
+        snprintf(key, n, "control:%s", k);
+        return true;
+    }
+    return false;
+}
+
+/* Tells the sender of m what became of it when it was not delivered. */
+static void send_route_status(const char *to, Message *m, MsgType type, const char *status) {
+    Message r = {0};
+    r.type = type;
+    strncpy(r.from, m->to, sizeof(r.from) - 1);
+    strncpy(r.to, to, sizeof(r.to) - 1);
+    r.action = m->action;
+    r.timestamp = time(NULL);
+
+    struct json_object *d = json_object_new_object();
+    json_object_object_add(d, "status", json_object_new_string(status));
+    r.data = d;
+
+    route_msg(&r);
+    json_object_put(d);
+}
+
+static bool route_local(Message *m) {
+    bool to_dev = false;
+    OutQ *q = reg_lookup(m->to, &to_dev);
+    if (!q) return false;
+
+    char key[OUTQ_KEY_LEN] = "";
+    bool gated = to_dev && m->type == MSG_REQUEST;
+    if (gated) coalesce_key(m, key, sizeof(key));
+
+    trace_route(m);
+    char *js = create_msg(m);
+    if (js) {
+        char prev[32];
+        int rc = outq_push(q, js, msg_lane(m), key, gated, m->from, prev, sizeof(prev));
+        free(js);
+        if (rc == 1) {
+            printf("[COALESCE] %s -> %s (%s)\n", m->from, m->to, key);
+            if (prev[0] && strcmp(prev, m->from) != 0) {
+                send_route_status(prev, m, MSG_RESPONSE, "superseded");
             }
+        } else {
             printf("[ROUTE] %s -> %s\n", m->from, m->to);
-            found = true;
-            break;
         }
     }
+    outq_unref(q);
+    return true;
+}
+
+/* Everything parked while the device was away goes out as one write. */
+static void deliver_parked(const char *id, OutQ *q) {
+    int queued;
+    char *burst = offline_take(id, &queued);
+    if (!burst) return;
+    outq_push(q, burst, action_lane(ACT_CONTROL), NULL, false, NULL, NULL, 0);
+    free(burst);
+    printf("[OFFLINE] Delivered %d queued request(s) to %s\n", queued, id);
+}
+
+/* Requests for a device we know but that is offline are parked until it
+ * registers again. */
+static bool park_offline(Message *m, const char *js) {
+    if (m->type != MSG_REQUEST || !reg_is_device(m->to)) return false;
+
+    char key[OUTQ_KEY_LEN] = "";
+    coalesce_key(m, key, sizeof(key));
+
+    char prev[32];
+    int rc = offline_put(m->to, key, m->from, js, prev, sizeof(prev));
+    if (rc < 0) {
+        printf("[OFFLINE] Queue full for %s, dropped %s\n", m->to, action_str(m->action));
+        send_route_status(m->from, m, MSG_RESPONSE, "offline_queue_full");
+        return true;
+    }
+
+    printf("[OFFLINE] %s -> %s queued%s\n", m->from, m->to, rc == 1 ? " (replaced)" : "");
+    /* The replaced sender already had its "queued" reply. */
+    if (rc == 1 && prev[0] && strcmp(prev, m->from) != 0) {
+        send_route_status(prev, m, MSG_NOTIFY, "superseded");
+    }
+    send_route_status(m->from, m, MSG_RESPONSE, "queued");
+
+    /* A registration between route_local's miss and the put above has
+     * already drained the queue; it is in the registry now, though. */
+    OutQ *q = reg_lookup(m->to, NULL);
+    if (q) {
+        deliver_parked(m->to, q);
+        outq_unref(q);
+    }
+    return true;
+}
+
+static void route_msg(Message *m) {
+    if (strcmp(m->to, RULES_SENDER) == 0) return;
+    if (route_local(m)) return;
 
-    pthread_mutex_unlock(&list.mtx);
+    trace_route(m);
+    char *js = create_msg(m);
+    int rc = js ? cluster_forward(m->to, js, msg_lane(m)) : -1;
 
-    if (!found) {
+    if (rc == 0) {
+        printf("[FORWARD] %s -> %s\n", m->from, m->to);
+    } else if (!js || !park_offline(m, js)) {
         printf("[ERROR] Destination not found: %s\n", m->to);
     }
+    free(js);
+}
+
+typedef struct {
+    cluster_emit_fn fn;
+    void *arg;
+} EmitCtx;
+
+static void emit_local(const Conn *c, void *arg) {
+    EmitCtx *e = arg;
+    e->fn(c->id, c->device_type, e->arg);
+}
+
+void srv_foreach_local(cluster_emit_fn fn, void *arg) {
+    EmitCtx e = {.fn = fn, .arg = arg};
+    reg_foreach(emit_local, &e);
+}
+
+static void shutdown_conn(const Conn *c, void *arg) {
+    (void)arg;
+    shutdown(c->sock, SHUT_RDWR);
 }
 
 void srv_stop(void) {
     running = false;
-    if (srv_sock >= 0) close(srv_sock);
-
-    pthread_mutex_lock(&list.mtx);
-    for (int i = 0; i < list.cnt; i++) {
-        if (list.conns[i].online) {
-            close(list.conns[i].sock);
-            list.conns[i].online = false;
-        }
+    cluster_stop();
+    udp_stop();
+    if (unix_sock >= 0) {
+        close(unix_sock);
+        unlink(unix_path);
+    }
+    if (handoff_sock >= 0) {
+        close(handoff_sock);
+        unlink(handoff_path);
     }
-    pthread_mutex_unlock(&list.mtx);
+    pool_stop();
+    capture_close();
+    if (srv_sock >= 0) close(srv_sock);
 
-    pthread_mutex_destroy(&list.mtx);
+    reg_foreach(shutdown_conn, NULL);
+    tls_server_cleanup();
     printf("Server stopped\n");
 }
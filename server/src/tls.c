@@ -0,0 +1,178 @@
+#include "tls.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_HANDSHAKE_TIMEOUT_MS 5000
+
+struct TlsConn {
+    SSL *ssl;
+    int sock;
+    bool ktls_send;
+    pthread_mutex_t mtx;
+};
+
+static SSL_CTX *ctx = NULL;
+
+int tls_server_init(const char *cert_file, const char *key_file) {
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    /* Reconnecting devices resume with a stateless ticket instead of a
+     * full handshake; the server keeps no per-session state for it. */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"homeserver", 10);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_timeout(ctx, 24 * 3600);
+
+    /* Let the kernel do record encryption when the tls module is loaded. */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return -1;
+    }
+
+    printf("TLS enabled (cert: %s)\n", cert_file);
+    return 0;
+}
+
+bool tls_enabled(void) {
+    return ctx != NULL;
+}
+
+void tls_server_cleanup(void) {
+    if (ctx) {
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+    }
+}
+
+static int wait_sock(int sock, short events, int timeout_ms) {
+    struct pollfd p = {.fd = sock, .events = events};
+    int rc;
+    do {
+        rc = poll(&p, 1, timeout_ms);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+TlsConn* tls_accept(int sock) {
+    if (!ctx) return NULL;
+
+    TlsConn *t = calloc(1, sizeof(TlsConn));
+    if (!t) return NULL;
+    t->sock = sock;
+    pthread_mutex_init(&t->mtx, NULL);
+
+    t->ssl = SSL_new(ctx);
+    if (!t->ssl) {
+        tls_free(t);
+        return NULL;
+    }
+    SSL_set_fd(t->ssl, sock);
+
+    /* Non-blocking so a reader waiting for a record never holds the SSL
+     * object while another thread writes to the same connection. */
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    for (;;) {
+        int rc = SSL_accept(t->ssl);
+        if (rc == 1) break;
+
+        int err = SSL_get_error(t->ssl, rc);
+        short ev = err == SSL_ERROR_WANT_READ ? POLLIN :
+                   err == SSL_ERROR_WANT_WRITE ? POLLOUT : 0;
+        if (!ev || wait_sock(sock, ev, TLS_HANDSHAKE_TIMEOUT_MS) <= 0) {
+            ERR_clear_error();
+            tls_free(t);
+            return NULL;
+        }
+    }
+
+    t->ktls_send = BIO_get_ktls_send(SSL_get_wbio(t->ssl)) > 0;
+    return t;
+}
+
+ssize_t tls_read(TlsConn *t, void *buf, size_t len) {
+    for (;;) {
+        pthread_mutex_lock(&t->mtx);
+        int rc = SSL_read(t->ssl, buf, (int)len);
+        int err = rc > 0 ? SSL_ERROR_NONE : SSL_get_error(t->ssl, rc);
+        pthread_mutex_unlock(&t->mtx);
+
+        if (rc > 0) return rc;
+        if (err == SSL_ERROR_WANT_READ) {
+            if (wait_sock(t->sock, POLLIN, -1) < 0) return -1;
+            continue;
+        }
+        if (err == SSL_ERROR_WANT_WRITE) {
+            if (wait_sock(t->sock, POLLOUT, -1) < 0) return -1;
+            continue;
+        }
+        ERR_clear_error();
+        return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+}
+
+/* WANT_READ on a write means the peer's next record has to come first. */
+static ssize_t write_result(TlsConn *t, ossl_ssize_t rc, short *events) {
+    int err = rc > 0 ? SSL_ERROR_NONE : SSL_get_error(t->ssl, (int)rc);
+    pthread_mutex_unlock(&t->mtx);
+    if (rc > 0) return rc;
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+        *events = err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN;
+        return 0;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+ssize_t tls_write_some(TlsConn *t, const void *buf, size_t len, short *events) {
+    pthread_mutex_lock(&t->mtx);
+    return write_result(t, SSL_write(t->ssl, buf, (int)len), events);
+}
+
+ssize_t tls_sendfile_some(TlsConn *t, int fd, off_t off, size_t len, short *events) {
+    if (!t->ktls_send) return -1;
+    pthread_mutex_lock(&t->mtx);
+    return write_result(t, SSL_sendfile(t->ssl, fd, off, len, 0), events);
+}
+
+bool tls_ktls_send(TlsConn *t) {
+    return t && t->ktls_send;
+}
+
+bool tls_resumed(TlsConn *t) {
+    return t && SSL_session_reused(t->ssl);
+}
+
+void tls_free(TlsConn *t) {
+    if (!t) return;
+    if (t->ssl) {
+        pthread_mutex_lock(&t->mtx);
+        SSL_shutdown(t->ssl);
+        pthread_mutex_unlock(&t->mtx);
+        SSL_free(t->ssl);
+    }
+    pthread_mutex_destroy(&t->mtx);
+    free(t);
+}
@@ -0,0 +1,110 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct {
+    TraceCtx t;
+    Action action;
+    char client[32];
+    char device[32];
+} Span;
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static Span ring[TRACE_RING];
+static uint64_t recorded;
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void trace_recv(Message *m, uint64_t now) {
+    if (!m->trace.id[0]) return;
+    TraceStamp s = m->type == MSG_RESPONSE ? TS_REPLY_RECV : TS_SERVER_RECV;
+    if (!m->trace.ns[s]) m->trace.ns[s] = now;
+}
+
+static void record(const Message *m) {
+    pthread_mutex_lock(&mtx);
+    Span *sp = &ring[recorded++ % TRACE_RING];
+    sp->t = m->trace;
+    sp->action = m->action;
+    snprintf(sp->client, sizeof(sp->client), "%s", m->to);
+    snprintf(sp->device, sizeof(sp->device), "%s", m->from);
+    pthread_mutex_unlock(&mtx);
+}
+
+void trace_route(Message *m) {
+    if (!m->trace.id[0]) return;
+    bool reply = m->type == MSG_RESPONSE;
+    TraceStamp s = reply ? TS_REPLY_ROUTE : TS_SERVER_ROUTE;
+    if (m->trace.ns[s]) return;
+    m->trace.ns[s] = trace_now();
+    if (reply) record(m);
+}
+
+static void add_us(struct json_object *o, const char *key, int64_t ns) {
+    json_object_object_add(o, key, json_object_new_int64(ns / 1000));
+}
+
+static struct json_object* span_obj(const Span *sp) {
+    const uint64_t *ns = sp->t.ns;
+    struct json_object *o = json_object_new_object();
+    json_object_object_add(o, "id", json_object_new_string(sp->t.id));
+    json_object_object_add(o, "action", json_object_new_string(action_str(sp->action)));
+    json_object_object_add(o, "client", json_object_new_string(sp->client));
+    json_object_object_add(o, "device", json_object_new_string(sp->device));
+
+    struct json_object *stamps = json_object_new_object();
+    for (int i = 0; i < TS_COUNT; i++) {
+        if (ns[i]) {
+            json_object_object_add(stamps, stamp_str((TraceStamp)i),
+                                   json_object_new_int64((int64_t)ns[i]));
+        }
+    }
+    json_object_object_add(o, "stamps", stamps);
+
+    bool out = ns[TS_SERVER_RECV] && ns[TS_SERVER_ROUTE];
+    bool back = ns[TS_REPLY_RECV] && ns[TS_REPLY_ROUTE];
+    bool dev = ns[TS_DEVICE_RECV] && ns[TS_DEVICE_REPLY];
+    if (out && back) {
+        add_us(o, "server_us", (int64_t)(ns[TS_SERVER_ROUTE] - ns[TS_SERVER_RECV]) +
+                               (int64_t)(ns[TS_REPLY_ROUTE] - ns[TS_REPLY_RECV]));
+        add_us(o, "path_us", (int64_t)(ns[TS_REPLY_ROUTE] - ns[TS_SERVER_RECV]));
+    }
+    int64_t device = dev ? (int64_t)(ns[TS_DEVICE_REPLY] - ns[TS_DEVICE_RECV]) : 0;
+    if (dev) add_us(o, "device_us", device);
+    if (ns[TS_SERVER_ROUTE] && ns[TS_REPLY_RECV]) {
+        add_us(o, "device_link_us",
+               (int64_t)(ns[TS_REPLY_RECV] - ns[TS_SERVER_ROUTE]) - device);
+    }
+    return o;
+}
+
+struct json_object* trace_export(int limit) {
+    if (limit <= 0 || limit > TRACE_RING) limit = TRACE_RING;
+
+    pthread_mutex_lock(&mtx);
+    uint64_t total = recorded;
+    uint64_t n = total < (uint64_t)limit ? total : (uint64_t)limit;
+    Span *copy = malloc((n ? n : 1) * sizeof(Span));
+    for (uint64_t i = 0; copy && i < n; i++) {
+        copy[i] = ring[(total - n + i) % TRACE_RING];
+    }
+    pthread_mutex_unlock(&mtx);
+
+    struct json_object *d = json_object_new_object();
+    struct json_object *spans = json_object_new_array();
+    for (uint64_t i = 0; copy && i < n; i++) {
+        json_object_array_add(spans, span_obj(&copy[i]));
+    }
+    free(copy);
+    json_object_object_add(d, "recorded", json_object_new_int64((int64_t)total));
+    json_object_object_add(d, "spans", spans);
+    return d;
+}
@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+#include "udp.h"
+#include "server.h"
+#include "registry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <json-c/json.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#define KEY_BUCKETS 1024
+#define UDP_KIND_HEARTBEAT 1
+#define UDP_KIND_TELEMETRY 2
+
+/* One per device whose datagrams verified, under the nonce of its current
+ * registration. An entry is only created or replaced after a MAC check
+ * with the new key passes, and only dropped once the registry no longer
+ * holds that nonce, so a live key never loses its last seq. Only the
+ * receive thread touches the table, so it needs no lock. */
+typedef struct KeyEntry {
+    char id[32];
+    uint64_t nonce;
+    unsigned char key[UDP_KEY_LEN];
+    uint32_t last_seq;
+    struct KeyEntry *next;
+} KeyEntry;
+
+static unsigned char secret[UDP_SECRET_LEN];
+static int sock = -1;
+static int bound_port;
+static atomic_bool running;
+static pthread_t tid;
+static KeyEntry *keys[KEY_BUCKETS];
+
+static void derive_key(const char *id, uint64_t nonce, unsigned char key[UDP_KEY_LEN]) {
+    unsigned char msg[32 + 8], mac[EVP_MAX_MD_SIZE];
+    unsigned int len = sizeof(mac);
+    size_t n = strlen(id);
+    memcpy(msg, id, n);
+    for (int i = 0; i < 8; i++) msg[n + i] = (unsigned char)(nonce >> (56 - 8 * i));
+    HMAC(EVP_sha256(), secret, sizeof(secret), msg, n + 8, mac, &len);
+    memcpy(key, mac, UDP_KEY_LEN);
+}
+
+uint64_t udp_nonce(void) {
+    uint64_t nonce = 0;
+    if (sock < 0) return 0;
+    while (nonce == 0) {
+        if (RAND_bytes((unsigned char*)&nonce, sizeof(nonce)) != 1) return 0;
+    }
+    return nonce;
+}
+
+int udp_device_key(const char *id, uint64_t nonce, char *hex, size_t len) {
+    if (sock < 0 || nonce == 0 || len < UDP_KEY_LEN * 2 + 1) return -1;
+    unsigned char key[UDP_KEY_LEN];
+    derive_key(id, nonce, key);
+    for (int i = 0; i < UDP_KEY_LEN; i++) snprintf(hex + i * 2, 3, "%02x", key[i]);
+    return 0;
+}
+
+int udp_port(void) {
+    return sock >= 0 ? bound_port : 0;
+}
+
+static KeyEntry** key_slot(const char *id) {
+    unsigned h = 2166136261u;
+    for (const char *p = id; *p; p++) h = (h ^ (unsigned char)*p) * 16777619u;
+    KeyEntry **pp = &keys[h % KEY_BUCKETS];
+    while (*pp && strcmp((*pp)->id, id) != 0) pp = &(*pp)->next;
+    return pp;
+}
+
+/* id's entry, now under nonce with no seq seen yet. */
+static KeyEntry* key_put(const char *id, uint64_t nonce, const unsigned char key[UDP_KEY_LEN]) {
+    KeyEntry **pp = key_slot(id);
+    KeyEntry *e = *pp;
+    if (!e) {
+        e = calloc(1, sizeof(KeyEntry));
+        if (!e) return NULL;
+        snprintf(e->id, sizeof(e->id), "%s", id);
+        *pp = e;
+    }
+    e->nonce = nonce;
+    memcpy(e->key, key, UDP_KEY_LEN);
+    e->last_seq = 0;
+    return e;
+}
+
+/* Entries whose registration is gone, checked now and then. */
+static void key_prune(void) {
+    for (int b = 0; b < KEY_BUCKETS; b++) {
+        KeyEntry **pp = &keys[b];
+        while (*pp) {
+            KeyEntry *e = *pp;
+            if (reg_udp_nonce(e->id) == e->nonce) {
+                pp = &e->next;
+                continue;
+            }
+            *pp = e->next;
+            free(e);
+        }
+    }
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Telemetry entries become the same data object a TCP status report
+ * carries. */
+static struct json_object* decode_values(const unsigned char *p, size_t n) {
+    if (n < 1) return NULL;
+    int count = p[0];
+    size_t off = 1;
+    struct json_object *data = json_object_new_object();
+
+    for (int i = 0; i < count; i++) {
+        if (off + 2 > n) goto bad;
+        size_t kl = p[off++];
+        if (kl == 0 || kl > 31 || off + kl + 1 > n) goto bad;
+        char key[32];
+        memcpy(key, p + off, kl);
+        key[kl] = '\0';
+        off += kl;
+
+        char tag = (char)p[off++];
+        if (tag == 'n' && off + 4 <= n) {
+            int32_t v = (int32_t)get_u32(p + off);
+            off += 4;
+            json_object_object_add(data, key, json_object_new_double(v / 1000.0));
+        } else if (tag == 'b' && off + 1 <= n) {
+            json_object_object_add(data, key, json_object_new_boolean(p[off++] != 0));
+        } else if (tag == 's' && off + 1 <= n && off + 1 + p[off] <= n) {
+            size_t sl = p[off++];
+            json_object_object_add(data, key, json_object_new_string_len((const char*)p + off, (int)sl));
+            off += sl;
+        } else {
+            goto bad;
+        }
+    }
+    if (off == n) return data;
+bad:
+    json_object_put(data);
+    return NULL;
+}
+
+/* Returns true if the datagram was authentic and applied. */
+static bool handle_dgram(const unsigned char *p, size_t n) {
+    if (n < 9 + UDP_MAC_LEN || p[0] != 'S' || p[1] != 'H' || p[2] != 1) return false;
+    int kind = p[3];
+    uint32_t seq = get_u32(p + 4);
+    size_t idl = p[8];
+    size_t body = n - UDP_MAC_LEN;
+    if (idl == 0 || idl > 31 || 9 + idl > body) return false;
+
+    char id[32];
+    memcpy(id, p + 9, idl);
+    id[idl] = '\0';
+
+    uint64_t nonce = reg_udp_nonce(id);
+    if (nonce == 0) return false;
+    KeyEntry *e = *key_slot(id);
+    unsigned char fresh[UDP_KEY_LEN];
+    const unsigned char *key = e && e->nonce == nonce ? e->key : fresh;
+    if (key == fresh) derive_key(id, nonce, fresh);
+
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int len = sizeof(mac);
+    HMAC(EVP_sha256(), key, UDP_KEY_LEN, p, body, mac, &len);
+    if (CRYPTO_memcmp(mac, p + body, UDP_MAC_LEN) != 0) return false;
+    if (key == fresh && !(e = key_put(id, nonce, fresh))) return false;
+    if (seq <= e->last_seq) return false;
+    e->last_seq = seq;
+
+    if (kind == UDP_KIND_HEARTBEAT) {
+        srv_device_report(id, NULL);
+        return true;
+    }
+    if (kind != UDP_KIND_TELEMETRY) return false;
+
+    struct json_object *data = decode_values(p + 9 + idl, body - 9 - idl);
+    if (!data) return false;
+    srv_device_report(id, data);
+    json_object_put(data);
+    return true;
+}
+
+static void* udp_thread(void *arg) {
+    (void)arg;
+    static unsigned char bufs[UDP_BATCH][UDP_MAX_DGRAM];
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    unsigned long ok = 0, bad = 0;
+    time_t last_log = time(NULL);
+
+    while (atomic_load(&running)) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = UDP_MAX_DGRAM;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = recvmmsg(sock, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        for (int i = 0; i < n; i++) {
+            if (handle_dgram(bufs[i], msgs[i].msg_len)) ok++;
+            else bad++;
+        }
+
+        time_t now = time(NULL);
+        if (now - last_log >= 10) {
+            if (ok + bad > 0) printf("[UDP] %lu datagram(s) applied, %lu rejected\n", ok, bad);
+            ok = bad = 0;
+            last_log = now;
+            key_prune();
+        }
+    }
+    return NULL;
+}
+
+static int start_thread(void) {
+    atomic_store(&running, true);
+    if (pthread_create(&tid, NULL, udp_thread, NULL) != 0) {
+        perror("pthread_create");
+        close(sock);
+        sock = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int udp_start(int port) {
+    if (RAND_bytes(secret, sizeof(secret)) != 1) {
+        fprintf(stderr, "UDP: no randomness for the device key secret\n");
+        return -1;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("udp socket");
+        return -1;
+    }
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    /* recvmmsg's own timeout is only checked between datagrams. */
+    struct timeval tv = {.tv_sec = 1};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("udp bind");
+        close(sock);
+        sock = -1;
+        return -1;
+    }
+    bound_port = port;
+
+    if (start_thread() < 0) return -1;
+    printf("UDP telemetry on port %d\n", port);
+    return 0;
+}
+
+void udp_stop(void) {
+    int s = udp_detach();
+    if (s >= 0) close(s);
+}
+
+int udp_detach(void) {
+    if (sock < 0) return -1;
+    atomic_store(&running, false);
+    pthread_join(tid, NULL);
+    int s = sock;
+    sock = -1;
+    return s;
+}
+
+void udp_secret(unsigned char out[UDP_SECRET_LEN]) {
+    memcpy(out, secret, sizeof(secret));
+}
+
+void udp_foreach_seq(udp_seq_fn fn, void *arg) {
+    for (int b = 0; b < KEY_BUCKETS; b++) {
+        for (KeyEntry *e = keys[b]; e; e = e->next) fn(e->id, e->nonce, e->last_seq, arg);
+    }
+}
+
+/* The key is derived in udp_adopt, once the secret is known. */
+void udp_restore_seq(const char *id, uint64_t nonce, uint32_t seq) {
+    static const unsigned char none[UDP_KEY_LEN];
+    if (nonce == 0 || strlen(id) >= sizeof(((KeyEntry*)0)->id)) return;
+    KeyEntry *e = key_put(id, nonce, none);
+    if (e) e->last_seq = seq;
+}
+
+int udp_adopt(int fd, const unsigned char key[UDP_SECRET_LEN]) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &len) < 0) return -1;
+
+    memcpy(secret, key, sizeof(secret));
+    for (int b = 0; b < KEY_BUCKETS; b++) {
+        for (KeyEntry *e = keys[b]; e; e = e->next) derive_key(e->id, e->nonce, e->key);
+    }
+    sock = fd;
+    bound_port = ntohs(addr.sin_port);
+    if (start_thread() < 0) return -1;
+    printf("UDP telemetry on port %d (taken over)\n", bound_port);
+    return 0;
+}
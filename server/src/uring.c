@@ -0,0 +1,552 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include "server.h"
+#include "outq.h"
+#include "linebuf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+/* Single-threaded io_uring loop: multishot accept, multishot recv into a
+ * provided buffer ring, and one SEND in flight per connection fed from the
+ * connection's OutQ. Other threads that push to a queue only mark it dirty
+ * and poke an eventfd; the loop turns dirty queues into SENDs. A connection
+ * held back for being over its quota has its recv cancelled and re-armed
+ * by a TIMEOUT when the hold ends, one buffer at a time until a read goes
+ * by without a hold, so the backlog waits in the kernel; lines it had
+ * already read wait in its line buffer and are fed first. */
+
+#define BGID 1
+
+enum { OP_ACCEPT = 1, OP_ACCEPT_UNIX, OP_RECV, OP_SEND, OP_WAKE, OP_CANCEL, OP_HOLD, OP_ACK };
+
+/* The op rides in the low bits of a malloc'd (16-byte aligned) pointer. */
+#define UD(p, op) ((uint64_t)(uintptr_t)(p) | (uint64_t)(op))
+#define UD_PTR(u) ((void*)(uintptr_t)((u) & ~(uint64_t)15))
+#define UD_OP(u) ((int)((u) & 15))
+
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned tail;
+    unsigned submitted;
+} Ring;
+
+typedef struct UConn {
+    Conn *c;
+    OutQ *q;
+    LineBuf lb;
+    OutItem *out;
+    size_t out_off;
+    int ops;
+    bool closed;
+    bool queued;
+    bool receiving;
+    bool held;
+    bool slow;
+    bool ack_wait;
+    struct __kernel_timespec hold_ts;
+    struct __kernel_timespec ack_ts;
+    struct UConn *next_dirty;
+} UConn;
+
+static Ring ring;
+static struct io_uring_buf_ring *br;
+static char *bufs;
+static unsigned short br_tail;
+static int listen_fd = -1;
+static int unix_fd = -1;
+static int wake_fd = -1;
+static uint64_t wake_val;
+static pthread_t loop_tid;
+static pthread_mutex_t dirty_mtx = PTHREAD_MUTEX_INITIALIZER;
+static UConn *dirty_head = NULL;
+
+static int ring_enter(unsigned to_submit, unsigned min_complete) {
+    int rc;
+    do {
+        rc = (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                          min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+static int ring_submit(unsigned wait) {
+    __atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+    unsigned n = ring.tail - ring.submitted;
+    ring.submitted = ring.tail;
+    return ring_enter(n, wait);
+}
+
+static struct io_uring_sqe* get_sqe(void) {
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.tail - head >= ring.sq_entries) {
+        ring_submit(0);
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        if (ring.tail - head >= ring.sq_entries) return NULL;
+    }
+    unsigned idx = ring.tail & ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    ring.tail++;
+    return sqe;
+}
+
+static int ring_setup(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) return -1;
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) sq_sz = cq_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+
+    char *sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    char *cq = sq;
+    if (!single) {
+        cq = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    ring.fd = fd;
+    ring.sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring.sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    ring.sq_entries = p.sq_entries;
+    ring.cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring.cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ring.tail = ring.submitted = *ring.sq_tail;
+    return 0;
+}
+
+static void buf_add(unsigned short bid) {
+    struct io_uring_buf *b = &br->bufs[br_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    br_tail++;
+}
+
+static void buf_commit(void) {
+    __atomic_store_n(&br->tail, br_tail, __ATOMIC_RELEASE);
+}
+
+static int bufring_setup(void) {
+    size_t sz = URING_BUFS * sizeof(struct io_uring_buf);
+    br = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (br == MAP_FAILED) return -1;
+    bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (!bufs) return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = BGID;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < URING_BUFS; i++) buf_add((unsigned short)i);
+    buf_commit();
+    return 0;
+}
+
+/* Multishot recv needs 6.0; older kernels reject the flag with -EINVAL or,
+ * if they ignore it, finish after one read without IORING_CQE_F_MORE. A
+ * byte and an EOF on a socketpair tell which. */
+static int probe_multishot(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+    int rc = -1;
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe || write(sv[1], "x", 1) != 1 || shutdown(sv[1], SHUT_WR) < 0) goto out;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    if (ring_submit(0) < 0) goto out;
+
+    bool first = true, more = true;
+    while (more) {
+        if (ring_enter(0, 1) < 0) goto out;
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && more; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            more = cqe->flags & IORING_CQE_F_MORE;
+            if (first) rc = cqe->res == 1 && more ? 0 : -1;
+            first = false;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                buf_add((unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+                buf_commit();
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+out:
+    close(sv[0]);
+    close(sv[1]);
+    return rc;
+}
+
+static void arm_accept(int op) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = op == OP_ACCEPT_UNIX ? unix_fd : listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UD(NULL, op);
+}
+
+static void arm_wake(void) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&wake_val;
+    sqe->len = sizeof(wake_val);
+    sqe->user_data = UD(NULL, OP_WAKE);
+}
+
+static void arm_recv(UConn *u) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = u->c->sock;
+    sqe->ioprio = u->slow ? 0 : IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    sqe->user_data = UD(u, OP_RECV);
+    u->ops++;
+    u->receiving = true;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Receive again once the connection's hold is over. */
+static void arm_hold(UConn *u) {
+    uint64_t now = now_ms();
+    if (u->c->hold_until <= now) {
+        arm_recv(u);
+        return;
+    }
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    uint64_t ms = u->c->hold_until - now;
+    u->hold_ts.tv_sec = (long long)(ms / 1000);
+    u->hold_ts.tv_nsec = (long long)(ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&u->hold_ts;
+    sqe->len = 1;
+    sqe->user_data = UD(u, OP_HOLD);
+    u->ops++;
+    u->held = true;
+    u->slow = true;
+}
+
+static void hold_recv(UConn *u) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = UD(u, OP_RECV);
+    sqe->user_data = UD(u, OP_CANCEL);
+    u->ops++;
+    arm_hold(u);
+}
+
+static void arm_send(UConn *u) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = u->q->sock;
+    sqe->addr = (uint64_t)(uintptr_t)(u->out->buf + u->out_off);
+    sqe->len = (unsigned)(u->out->len - u->out_off);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = UD(u, OP_SEND);
+    u->ops++;
+}
+
+static void on_wake(OutQ *q) {
+    UConn *u = q->loop;
+    pthread_mutex_lock(&dirty_mtx);
+    if (!u->queued) {
+        u->queued = true;
+        u->next_dirty = dirty_head;
+        dirty_head = u;
+    }
+    pthread_mutex_unlock(&dirty_mtx);
+
+    if (!pthread_equal(pthread_self(), loop_tid)) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {}
+    }
+}
+
+static void maybe_free(UConn *u) {
+    if (!u->closed || u->ops > 0) return;
+    pthread_mutex_lock(&dirty_mtx);
+    bool queued = u->queued;
+    pthread_mutex_unlock(&dirty_mtx);
+    if (queued) return;
+
+    linebuf_free(&u->lb);
+    outq_unref(u->q);
+    free(u);
+}
+
+static void conn_down(UConn *u) {
+    if (u->closed) return;
+    u->closed = true;
+    printf("[DISCONNECT] %s\n", u->c->id);
+    srv_conn_close(u->c);
+    u->c = NULL;
+}
+
+/* Wakes the queue when a request that is never acked times out, so the
+ * frames behind it still go out. */
+static void arm_ack_wait(UConn *u) {
+    if (u->ack_wait || u->closed) return;
+    int ms = outq_ack_wait(u->q);
+    if (ms < 0) return;
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    u->ack_ts.tv_sec = ms / 1000;
+    u->ack_ts.tv_nsec = (long long)(ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&u->ack_ts;
+    sqe->len = 1;
+    sqe->user_data = UD(u, OP_ACK);
+    u->ops++;
+    u->ack_wait = true;
+}
+
+static void start_send(UConn *u) {
+    if (u->closed || u->out) return;
+    u->out = outq_take(u->q);
+    if (!u->out) {
+        arm_ack_wait(u);
+        return;
+    }
+    u->out_off = 0;
+    arm_send(u);
+}
+
+static void on_ack_wait(UConn *u) {
+    u->ops--;
+    u->ack_wait = false;
+    start_send(u);
+    maybe_free(u);
+}
+
+static void process_dirty(void) {
+    pthread_mutex_lock(&dirty_mtx);
+    UConn *list = dirty_head;
+    dirty_head = NULL;
+    for (UConn *u = list; u; u = u->next_dirty) u->queued = false;
+    pthread_mutex_unlock(&dirty_mtx);
+
+    while (list) {
+        UConn *u = list;
+        list = u->next_dirty;
+        start_send(u);
+        maybe_free(u);
+    }
+}
+
+static void on_accept(struct io_uring_cqe *cqe, int op) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) arm_accept(op);
+    if (cqe->res < 0) {
+        if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    int fd = cqe->res;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    if (op == OP_ACCEPT) getpeername(fd, (struct sockaddr*)&addr, &len);
+
+    Conn *c = srv_conn_open(fd, op == OP_ACCEPT ? &addr : NULL);
+    if (!c) return;
+
+    UConn *u = calloc(1, sizeof(UConn));
+    if (!u || linebuf_init(&u->lb, MAX_FRAME) < 0) {
+        free(u);
+        srv_conn_close(c);
+        return;
+    }
+    u->c = c;
+    u->q = outq_ref(c->q);
+    c->q->loop = u;
+    c->q->wake = on_wake;
+    arm_recv(u);
+}
+
+static void on_recv(UConn *u, struct io_uring_cqe *cqe) {
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more) {
+        u->ops--;
+        u->receiving = false;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe->res > 0 && !u->closed &&
+            srv_conn_feed(u->c, &u->lb, bufs + (size_t)bid * URING_BUF_SIZE,
+                          (size_t)cqe->res) < 0) {
+            conn_down(u);
+        }
+        buf_add(bid);
+        buf_commit();
+    }
+
+    if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+        if (!more && !u->closed && !u->held) arm_recv(u);
+    } else if (cqe->res <= 0) {
+        conn_down(u);
+    } else if (!u->closed && !u->held && u->c->hold_until) {
+        if (more) hold_recv(u);
+        else arm_hold(u);
+    } else if (!more && !u->closed && !u->held) {
+        u->slow = false;
+        arm_recv(u);
+    }
+    maybe_free(u);
+}
+
+static void on_hold(UConn *u) {
+    u->ops--;
+    u->held = false;
+    if (!u->closed && srv_conn_feed(u->c, &u->lb, "", 0) < 0) conn_down(u);
+    if (!u->closed && u->c->hold_until) {
+        if (u->receiving) hold_recv(u);
+        else arm_hold(u);
+    } else if (!u->closed && !u->receiving) {
+        arm_recv(u);
+    }
+    maybe_free(u);
+}
+
+static void on_send(UConn *u, struct io_uring_cqe *cqe) {
+    u->ops--;
+    OutItem *it = u->out;
+
+    if (cqe->res < 0) {
+        u->out = NULL;
+        outq_done(u->q, it, false);
+        conn_down(u);
+    } else {
+        u->out_off += (size_t)cqe->res;
+        if (u->out_off < it->len && !u->closed) {
+            arm_send(u);
+        } else {
+            u->out = NULL;
+            outq_done(u->q, it, true);
+            start_send(u);
+        }
+    }
+    maybe_free(u);
+}
+
+int uring_init(void) {
+    if (ring_setup() < 0) return -1;
+    if (bufring_setup() < 0 || probe_multishot() < 0 ||
+        (wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        close(ring.fd);
+        return -1;
+    }
+    return 0;
+}
+
+int uring_run(int listen_sock, int unix_sock) {
+    listen_fd = listen_sock;
+    unix_fd = unix_sock;
+    loop_tid = pthread_self();
+    arm_accept(OP_ACCEPT);
+    if (unix_fd >= 0) arm_accept(OP_ACCEPT_UNIX);
+    arm_wake();
+    printf("[IO] io_uring backend (%d entries, %d x %d B recv buffers)\n",
+           URING_ENTRIES, URING_BUFS, URING_BUF_SIZE);
+
+    for (;;) {
+        process_dirty();
+        if (ring_submit(1) < 0 && errno != EBUSY) {
+            perror("io_uring_enter");
+            return -1;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            uint64_t ud = cqe->user_data;
+            switch (UD_OP(ud)) {
+                case OP_ACCEPT:
+                case OP_ACCEPT_UNIX: on_accept(cqe, UD_OP(ud)); break;
+                case OP_RECV: on_recv(UD_PTR(ud), cqe); break;
+                case OP_SEND: on_send(UD_PTR(ud), cqe); break;
+                case OP_WAKE: arm_wake(); break;
+                case OP_CANCEL: {
+                    UConn *u = UD_PTR(ud);
+                    u->ops--;
+                    maybe_free(u);
+                    break;
+                }
+                case OP_HOLD: on_hold(UD_PTR(ud)); break;
+                case OP_ACK: on_ack_wait(UD_PTR(ud)); break;
+            }
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#include "zframe.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+struct ZFrame {
+    z_stream zs;
+    unsigned char *tmp;
+    size_t cap;
+    bool broken;
+};
+
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+ZFrame* zframe_new(void) {
+    ZFrame *z = calloc(1, sizeof(ZFrame));
+    if (!z) return NULL;
+    if (deflateInit2(&z->zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(z);
+        return NULL;
+    }
+    return z;
+}
+
+void zframe_free(ZFrame *z) {
+    if (!z) return;
+    deflateEnd(&z->zs);
+    free(z->tmp);
+    free(z);
+}
+
+static size_t b64_encode(const unsigned char *in, size_t n, char *out) {
+    size_t o = 0;
+    for (size_t i = 0; i < n; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16;
+        if (i + 1 < n) v |= (uint32_t)in[i + 1] << 8;
+        if (i + 2 < n) v |= in[i + 2];
+        out[o++] = b64[(v >> 18) & 63];
+        out[o++] = b64[(v >> 12) & 63];
+        out[o++] = i + 1 < n ? b64[(v >> 6) & 63] : '=';
+        out[o++] = i + 2 < n ? b64[v & 63] : '=';
+    }
+    return o;
+}
+
+char* zframe_encode(ZFrame *z, const char *frame, size_t len, size_t *out_len) {
+    if (!z || z->broken || len < ZFRAME_MIN) return NULL;
+    size_t body = len - 1;
+
+    size_t need = deflateBound(&z->zs, body) + 16;
+    if (need > z->cap) {
+        unsigned char *t = realloc(z->tmp, need);
+        if (!t) return NULL;
+        z->tmp = t;
+        z->cap = need;
+    }
+
+    z->zs.next_in = (unsigned char*)frame;
+    z->zs.avail_in = (uInt)body;
+    z->zs.next_out = z->tmp;
+    z->zs.avail_out = (uInt)z->cap;
+    /* Once bytes have gone into the stream the peer's inflater has to see
+     * them, so a failure from here on ends compression for good and the
+     * rest of the connection is sent plain. */
+    if (deflate(&z->zs, Z_SYNC_FLUSH) != Z_OK || z->zs.avail_in != 0) {
+        z->broken = true;
+        return NULL;
+    }
+    size_t zlen = z->cap - z->zs.avail_out;
+
+    size_t plen = strlen(ZFRAME_PREFIX);
+    char *out = malloc(plen + (zlen + 2) / 3 * 4 + 1);
+    if (!out) {
+        z->broken = true;
+        return NULL;
+    }
+    memcpy(out, ZFRAME_PREFIX, plen);
+    size_t o = plen + b64_encode(z->tmp, zlen, out + plen);
+    out[o++] = '\n';
+    *out_len = o;
+    return out;
+}
@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* Message throughput: -c devices register at once, each streams -k
+ * heartbeats and then waits for a list_devices reply, which comes back
+ * after every heartbeat before it was read. With -P the server's own CPU
+ * time over the run is read from /proc. Run the server with --msg-rate 0. */
+
+static struct sockaddr_in addr;
+static int beats;
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Waits for a line holding needle; false on EOF. */
+static bool read_until(int fd, const char *needle) {
+    char buf[65536];
+    size_t keep = strlen(needle), len = 0;
+    for (;;) {
+        ssize_t n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (n <= 0) return false;
+        len += (size_t)n;
+        buf[len] = '\0';
+        if (strstr(buf, needle)) return true;
+        if (len > keep) {
+            memmove(buf, buf + len - keep, keep);
+            len = keep;
+        }
+    }
+}
+
+static void* device(void *arg) {
+    long id = (long)arg;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        if (fd >= 0) close(fd);
+        return (void*)0;
+    }
+
+    char msg[256];
+    int n = snprintf(msg, sizeof(msg), "{\"type\":\"request\",\"from\":\"dev%ld\",\"to\":\"server\","
+                     "\"action\":\"register\",\"data\":{\"device_type\":\"light\"}}\n", id);
+    long ok = send_all(fd, msg, (size_t)n) == 0 && read_until(fd, "\"register\"");
+
+    n = snprintf(msg, sizeof(msg), "{\"type\":\"request\",\"from\":\"dev%ld\",\"to\":\"server\","
+                 "\"action\":\"heartbeat\",\"data\":{}}\n", id);
+    for (int i = 0; ok && i < beats; i++) {
+        if (send_all(fd, msg, (size_t)n) < 0) ok = 0;
+    }
+    n = snprintf(msg, sizeof(msg), "{\"type\":\"request\",\"from\":\"dev%ld\",\"to\":\"server\","
+                 "\"action\":\"list_devices\",\"data\":{}}\n", id);
+    if (ok) ok = send_all(fd, msg, (size_t)n) == 0 && read_until(fd, "\"list_devices\"");
+    close(fd);
+    return (void*)ok;
+}
+
+/* utime + stime of pid in seconds, -1 if it cannot be read. */
+static double proc_cpu(int pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')');
+    unsigned long ut, st;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st) != 2) return -1;
+    return (double)(ut + st) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -H, --host ADDR      server address (default 127.0.0.1)\n"
+        "  -p, --port PORT      server port (default 6666)\n"
+        "  -c, --conns N        devices (default 100)\n"
+        "  -k, --beats N        heartbeats per device (default 10000)\n"
+        "  -P, --pid PID        also report this server's CPU time\n",
+        prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    int port = 6666;
+    int conns = 100;
+    int pid = 0;
+    beats = 10000;
+
+    static const struct option opts[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"conns", required_argument, NULL, 'c'},
+        {"beats", required_argument, NULL, 'k'},
+        {"pid", required_argument, NULL, 'P'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:c:k:P:h", opts, NULL)) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': conns = atoi(optarg); break;
+            case 'k': beats = atoi(optarg); break;
+            case 'P': pid = atoi(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (optind != argc || conns < 1 || beats < 0 || inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    pthread_t *tids = calloc((size_t)conns, sizeof(pthread_t));
+    if (!tids) return 1;
+    double cpu = pid ? proc_cpu(pid) : -1;
+    double start = now_s();
+    for (long i = 0; i < conns; i++) pthread_create(&tids[i], NULL, device, (void*)i);
+    long done = 0;
+    for (int i = 0; i < conns; i++) {
+        void *ok;
+        pthread_join(tids[i], &ok);
+        done += (long)ok;
+    }
+    double elapsed = now_s() - start;
+
+    double msgs = (double)conns * beats;
+    printf("%d conns x %d heartbeats in %.2fs: %.0f msg/s (%ld/%d conns finished)\n",
+           conns, beats, elapsed, msgs / elapsed, done, conns);
+    if (cpu >= 0) {
+        double used = proc_cpu(pid) - cpu;
+        printf("Server CPU %.2fs (%.0f msg per CPU-second)\n", used, used > 0 ? msgs / used : 0.0);
+    }
+    free(tids);
+    return 0;
+}
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include "registry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+/* Registry contention: reader threads look random ids up (and drop the
+ * ref) while one writer takes a device offline and back every millisecond.
+ * "mutex" is the routing path from before the snapshots, a lock around a
+ * linear scan, kept here as the baseline. */
+
+static struct {
+    Conn *conns;
+    int cnt;
+    pthread_mutex_t mtx;
+} list = {.mtx = PTHREAD_MUTEX_INITIALIZER};
+
+static Conn *devs;
+static int ndevs;
+static bool use_mutex;
+static atomic_bool stop;
+static atomic_long writes;
+
+static OutQ* mutex_lookup(const char *id, bool *is_dev) {
+    OutQ *q = NULL;
+    pthread_mutex_lock(&list.mtx);
+    for (int i = 0; i < list.cnt; i++) {
+        if (list.conns[i].online && strcmp(list.conns[i].id, id) == 0) {
+            q = outq_ref(list.conns[i].q);
+            *is_dev = list.conns[i].is_dev;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&list.mtx);
+    return q;
+}
+
+static void mutex_set(int i, bool online) {
+    pthread_mutex_lock(&list.mtx);
+    list.conns[i].online = online;
+    pthread_mutex_unlock(&list.mtx);
+}
+
+static void* reader(void *arg) {
+    unsigned r = (unsigned)(uintptr_t)arg;
+    long n = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        for (int k = 0; k < 64; k++, n++) {
+            r = r * 1103515245 + 12345;
+            const char *id = devs[(r >> 16) % (unsigned)ndevs].id;
+            bool is_dev;
+            OutQ *q = use_mutex ? mutex_lookup(id, &is_dev) : reg_lookup(id, &is_dev);
+            if (q) outq_unref(q);
+        }
+    }
+    return (void*)n;
+}
+
+static void* writer(void *arg) {
+    (void)arg;
+    for (int i = 0; !atomic_load(&stop); i = (i + 1) % ndevs) {
+        if (use_mutex) {
+            mutex_set(i, false);
+            mutex_set(i, true);
+        } else {
+            reg_drop(devs[i].id, devs[i].q);
+            reg_upsert(&devs[i]);
+        }
+        atomic_fetch_add(&writes, 1);
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -m, --mode MODE      snapshot (default) or mutex\n"
+        "  -t, --threads N      reader threads (default 1)\n"
+        "  -n, --devices N      registered ids (default 10)\n"
+        "  -d, --duration SEC   run time (default 2)\n",
+        prog);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 1;
+    int secs = 2;
+    ndevs = 10;
+
+    static const struct option opts[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"threads", required_argument, NULL, 't'},
+        {"devices", required_argument, NULL, 'n'},
+        {"duration", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:t:n:d:h", opts, NULL)) != -1) {
+        switch (opt) {
+            case 'm': use_mutex = strcmp(optarg, "mutex") == 0; break;
+            case 't': threads = atoi(optarg); break;
+            case 'n': ndevs = atoi(optarg); break;
+            case 'd': secs = atoi(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc || threads < 1 || ndevs < 1 || secs < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    devs = calloc((size_t)ndevs, sizeof(Conn));
+    list.conns = calloc((size_t)ndevs, sizeof(Conn));
+    pthread_t *tids = calloc((size_t)threads, sizeof(pthread_t));
+    if (!devs || !list.conns || !tids || reg_init() < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < ndevs; i++) {
+        Conn *c = &devs[i];
+        snprintf(c->id, sizeof(c->id), "dev%d", i);
+        c->online = true;
+        c->is_dev = true;
+        c->q = outq_new(-1);
+        if (!c->q || reg_upsert(c) < 0) {
+            fprintf(stderr, "Cannot register %s\n", c->id);
+            return 1;
+        }
+        list.conns[i] = *c;
+    }
+    list.cnt = ndevs;
+
+    pthread_t w;
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, reader, (void*)(uintptr_t)(i + 1));
+    }
+    pthread_create(&w, NULL, writer, NULL);
+    sleep((unsigned)secs);
+    atomic_store(&stop, true);
+
+    long total = 0;
+    for (int i = 0; i < threads; i++) {
+        void *n;
+        pthread_join(tids[i], &n);
+        total += (long)n;
+    }
+    pthread_join(w, NULL);
+
+    printf("%s, %d reader(s), %d ids: %.1f M lookups/s, %ld writes\n",
+           use_mutex ? "mutex" : "snapshot", threads, ndevs, total / 1e6 / secs,
+           atomic_load(&writes));
+    free(tids);
+    free(list.conns);
+    free(devs);
+    return 0;
+}
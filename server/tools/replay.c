@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* Pushes a --capture file back at a server. Each captured connection gets
+ * its own socket; frames go out at their recorded offsets divided by the
+ * speed, or back to back with "max". Replies are read and discarded so the
+ * server never blocks on us. */
+
+typedef struct {
+    int fd;
+    bool open;
+} Sim;
+
+static Sim *sims;
+static size_t nsims;
+static struct pollfd *pfds;
+static size_t npfds;
+static struct sockaddr_in target;
+static unsigned long long rx_bytes;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t get_le(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    for (int i = n - 1; i >= 0; i--) v = v << 8 | p[i];
+    return v;
+}
+
+static void drop_pfd(int fd) {
+    for (size_t i = 0; i < npfds; i++) {
+        if (pfds[i].fd == fd) {
+            pfds[i] = pfds[--npfds];
+            return;
+        }
+    }
+}
+
+/* Reads whatever the server sent, waiting at most timeout_ms. */
+static void pump(int timeout_ms) {
+    if (npfds == 0) {
+        if (timeout_ms > 0) poll(NULL, 0, timeout_ms);
+        return;
+    }
+    if (poll(pfds, npfds, timeout_ms) <= 0) return;
+
+    char buf[16384];
+    for (size_t i = 0; i < npfds; i++) {
+        if (!pfds[i].revents) continue;
+        ssize_t n;
+        while ((n = recv(pfds[i].fd, buf, sizeof(buf), 0)) > 0) rx_bytes += (size_t)n;
+    }
+}
+
+static Sim* sim_get(uint32_t conn) {
+    if (conn >= nsims) {
+        size_t n = nsims ? nsims : 64;
+        while (n <= conn) n *= 2;
+        Sim *s = realloc(sims, n * sizeof(Sim));
+        struct pollfd *p = realloc(pfds, n * sizeof(struct pollfd));
+        if (!s || !p) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        memset(s + nsims, 0, (n - nsims) * sizeof(Sim));
+        sims = s;
+        pfds = p;
+        nsims = n;
+    }
+
+    Sim *s = &sims[conn];
+    if (!s->open) {
+        s->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (s->fd < 0 || connect(s->fd, (struct sockaddr*)&target, sizeof(target)) < 0) {
+            perror("connect");
+            exit(1);
+        }
+        int one = 1;
+        setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+        pfds[npfds++] = (struct pollfd){.fd = s->fd, .events = POLLIN};
+        s->open = true;
+    }
+    return s;
+}
+
+static void sim_close(uint32_t conn) {
+    if (conn >= nsims || !sims[conn].open) return;
+    drop_pfd(sims[conn].fd);
+    close(sims[conn].fd);
+    sims[conn].open = false;
+}
+
+static int send_frame(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            pump(1);
+            continue;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options] CAPTURE\n"
+        "  -H, --host ADDR    server address (default 127.0.0.1)\n"
+        "  -p, --port PORT    server port (default 6666)\n"
+        "  -s, --speed X      1 for recorded timing, N for N times faster, max for no delays\n",
+        prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    int port = 6666;
+    double speed = 1;
+
+    static const struct option opts[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"speed", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:s:h", opts, NULL)) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 's': speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1 || speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[optind], "rb");
+    if (!in) {
+        perror(argv[optind]);
+        return 1;
+    }
+    unsigned char hdr[CAPTURE_HDR_LEN];
+    if (fread(hdr, 1, sizeof(hdr), in) != sizeof(hdr) ||
+        memcmp(hdr, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", argv[optind]);
+        return 1;
+    }
+
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &target.sin_addr) != 1) {
+        fprintf(stderr, "Bad host: %s\n", host);
+        return 1;
+    }
+
+    char *frame = malloc(CAPTURE_BUF + 1);
+    if (!frame) return 1;
+    unsigned long frames = 0, conns = 0;
+    unsigned long long tx_bytes = 0;
+    uint64_t first_t = 0, late_max = 0, late_sum = 0;
+    bool started = false;
+    uint64_t start = now_us();
+    unsigned char rec[CAPTURE_REC_LEN];
+
+    while (fread(rec, 1, sizeof(rec), in) == sizeof(rec)) {
+        uint32_t conn = (uint32_t)get_le(rec, 4);
+        uint64_t t = get_le(rec + 4, 8);
+        uint32_t len = (uint32_t)get_le(rec + 12, 4);
+        if (len > CAPTURE_BUF || fread(frame, 1, len, in) != len) {
+            fprintf(stderr, "Truncated capture\n");
+            break;
+        }
+        if (!started) {
+            first_t = t;
+            started = true;
+        }
+
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)((double)(t - first_t) / speed);
+            uint64_t now;
+            while ((now = now_us()) + 1000 < due) pump((int)((due - now) / 1000));
+            if (now > due) {
+                late_max = now - due > late_max ? now - due : late_max;
+                late_sum += now - due;
+            }
+        }
+
+        if (len == 0) {
+            sim_close(conn);
+            continue;
+        }
+        bool fresh = conn >= nsims || !sims[conn].open;
+        Sim *s = sim_get(conn);
+        if (fresh) conns++;
+
+        frame[len] = '\n';
+        if (send_frame(s->fd, frame, len + 1) < 0) {
+            sim_close(conn);
+            continue;
+        }
+        frames++;
+        tx_bytes += len + 1;
+        pump(0);
+    }
+    fclose(in);
+
+    double elapsed = (double)(now_us() - start) / 1e6;
+    pump(500);
+    for (size_t i = 0; i < nsims; i++) sim_close((uint32_t)i);
+
+    printf("Replayed %lu frames on %lu connections in %.2fs (%.0f frames/s)\n",
+           frames, conns, elapsed, elapsed > 0 ? frames / elapsed : 0.0);
+    printf("Sent %llu bytes, received %llu bytes\n", tx_bytes, rx_bytes);
+    if (speed > 0 && frames > 0) {
+        printf("Lateness vs schedule: avg %.2fms, max %.2fms\n",
+               (double)late_sum / frames / 1000, (double)late_max / 1000);
+    }
+    free(frame);
+    free(sims);
+    free(pfds);
+    return 0;
+}
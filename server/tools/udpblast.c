@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include "udp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+/* UDP channel throughput: registers -i over TCP for its key, then sends -n
+ * heartbeats (or telemetry with -t) in sendmmsg batches. The server's CPU
+ * time comes from /proc with -P; it logs how many it applied. */
+
+static unsigned char key[UDP_KEY_LEN];
+
+/* Finds "name": and returns what follows it, NULL if absent. */
+static const char* field(const char *js, const char *name) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":", name);
+    const char *p = strstr(js, pat);
+    if (!p) return NULL;
+    p += strlen(pat);
+    while (*p == ' ' || *p == '"') p++;
+    return p;
+}
+
+/* Registers id and keeps the connection open so the id stays known;
+ * returns the socket and the server's UDP port, -1 on failure. */
+static int register_dev(const struct sockaddr_in *addr, const char *id, int *udp_port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) < 0) {
+        perror("connect");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    char buf[4096];
+    int n = snprintf(buf, sizeof(buf), "{\"type\":\"request\",\"from\":\"%s\",\"to\":\"server\","
+                     "\"action\":\"register\",\"data\":{\"device_type\":\"light\"}}\n", id);
+    size_t len = 0;
+    if (send(fd, buf, (size_t)n, 0) != n) goto fail;
+    while (!memchr(buf, '\n', len)) {
+        ssize_t r = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (r <= 0) goto fail;
+        len += (size_t)r;
+        buf[len] = '\0';
+    }
+    const char *hex = field(buf, "udp_key");
+    const char *port = field(buf, "udp_port");
+    if (!hex || !port) {
+        fprintf(stderr, "No UDP key in the register reply (server without --udp-port?)\n");
+        goto fail;
+    }
+    for (int i = 0; i < UDP_KEY_LEN; i++) {
+        if (sscanf(hex + 2 * i, "%2hhx", &key[i]) != 1) goto fail;
+    }
+    *udp_port = atoi(port);
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/* One datagram as udp.h lays it out; returns its length. */
+static size_t build(unsigned char *p, const char *id, uint32_t seq, bool telemetry) {
+    size_t n = 0, idlen = strlen(id);
+    p[n++] = 'S';
+    p[n++] = 'H';
+    p[n++] = 1;
+    p[n++] = telemetry ? 2 : 1;
+    uint32_t s = htonl(seq);
+    memcpy(p + n, &s, 4);
+    n += 4;
+    p[n++] = (unsigned char)idlen;
+    memcpy(p + n, id, idlen);
+    n += idlen;
+    if (telemetry) {
+        p[n++] = 2;
+        p[n++] = 5;
+        memcpy(p + n, "power", 5);
+        n += 5;
+        p[n++] = 'n';
+        int32_t mw = (int32_t)htonl(12000 + seq % 100);
+        memcpy(p + n, &mw, 4);
+        n += 4;
+        p[n++] = 5;
+        memcpy(p + n, "state", 5);
+        n += 5;
+        p[n++] = 'b';
+        p[n++] = 1;
+    }
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int maclen;
+    HMAC(EVP_sha256(), key, UDP_KEY_LEN, p, n, mac, &maclen);
+    memcpy(p + n, mac, UDP_MAC_LEN);
+    return n + UDP_MAC_LEN;
+}
+
+static double proc_cpu(int pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')');
+    unsigned long ut, st;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st) != 2) return -1;
+    return (double)(ut + st) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -H, --host ADDR      server address (default 127.0.0.1)\n"
+        "  -p, --port PORT      server TCP port (default 6666)\n"
+        "  -i, --id ID          device id (default lamp)\n"
+        "  -n, --count N        datagrams (default 2000000)\n"
+        "  -t, --telemetry      send power + state instead of heartbeats\n"
+        "  -P, --pid PID        also report this server's CPU time\n",
+        prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    const char *id = "lamp";
+    int port = 6666;
+    long total = 2000000;
+    bool telemetry = false;
+    int pid = 0;
+
+    static const struct option opts[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"id", required_argument, NULL, 'i'},
+        {"count", required_argument, NULL, 'n'},
+        {"telemetry", no_argument, NULL, 't'},
+        {"pid", required_argument, NULL, 'P'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:i:n:tP:h", opts, NULL)) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'i': id = optarg; break;
+            case 'n': total = atol(optarg); break;
+            case 't': telemetry = true; break;
+            case 'P': pid = atoi(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((uint16_t)port)};
+    if (optind != argc || total < 1 || strlen(id) > 255 || inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int udp_port;
+    int tcp = register_dev(&addr, id, &udp_port);
+    if (tcp < 0) return 1;
+    addr.sin_port = htons((uint16_t)udp_port);
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0 || connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("udp");
+        return 1;
+    }
+
+    static unsigned char bufs[UDP_BATCH][UDP_MAX_DGRAM];
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    uint32_t seq = 1;
+    long sent = 0, batches = 0;
+    double cpu = pid ? proc_cpu(pid) : -1;
+    double start = now_s();
+    while (sent < total) {
+        int k = total - sent < UDP_BATCH ? (int)(total - sent) : UDP_BATCH;
+        for (int i = 0; i < k; i++) {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = build(bufs[i], id, seq++, telemetry);
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int r = sendmmsg(s, msgs, (unsigned)k, 0);
+        if (r > 0) sent += r;
+        /* Let the server's socket buffer drain now and then. */
+        if (++batches % 16 == 0) usleep(200);
+    }
+    double elapsed = now_s() - start;
+    /* The last datagrams are still queued; give the server a moment. */
+    sleep(1);
+
+    printf("Sent %ld %s datagrams in %.2fs (%.0f/s)\n", sent,
+           telemetry ? "telemetry" : "heartbeat", elapsed, sent / elapsed);
+    if (cpu >= 0) {
+        double used = proc_cpu(pid) - cpu;
+        printf("Server CPU %.2fs (%.0f datagrams per CPU-second)\n", used, used > 0 ? sent / used : 0.0);
+    }
+    close(s);
+    close(tcp);
+    return 0;
+}